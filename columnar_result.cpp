@@ -0,0 +1,202 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/columnar_result.h"
+
+namespace database
+{
+	columnar_result::columnar_result(void) : column_count_(0), rows_(0) {}
+
+	columnar_result::~columnar_result(void) {}
+
+	void columnar_result::reset(void)
+	{
+		clear_rows();
+		column_count_ = 0;
+	}
+
+	void columnar_result::clear_rows(void)
+	{
+		for (size_t index = 0; index < column_count_; ++index)
+		{
+			column& target = columns_[index];
+			target.nulls.clear();
+			target.booleans.clear();
+			target.integers.clear();
+			target.reals.clear();
+			target.ends.clear();
+			target.text.clear();
+		}
+		rows_ = 0;
+	}
+
+	void columnar_result::add_column(std::string_view name, const column_kind& kind)
+	{
+		// Columns past the count are left over from an earlier result and
+		// are reused with their capacity.
+		if (column_count_ == columns_.size())
+		{
+			columns_.emplace_back();
+		}
+		column& target = columns_[column_count_++];
+		target.name.assign(name);
+		target.kind = kind;
+		target.nulls.clear();
+		target.booleans.clear();
+		target.integers.clear();
+		target.reals.clear();
+		target.ends.clear();
+		target.text.clear();
+	}
+
+	void columnar_result::append_null(const size_t& column)
+	{
+		auto& target = columns_[column];
+		target.nulls.push_back(1);
+		switch (target.kind)
+		{
+		case column_kind::boolean:
+			target.booleans.push_back(0);
+			break;
+		case column_kind::integer:
+		case column_kind::timestamp:
+		case column_kind::date:
+			target.integers.push_back(0);
+			break;
+		case column_kind::real:
+			target.reals.push_back(0.0);
+			break;
+		default:
+			target.ends.push_back(target.text.size());
+			break;
+		}
+	}
+
+	void columnar_result::append_boolean(const size_t& column, const bool& value)
+	{
+		columns_[column].nulls.push_back(0);
+		columns_[column].booleans.push_back(value ? 1 : 0);
+	}
+
+	void columnar_result::append_integer(const size_t& column, const int64_t& value)
+	{
+		columns_[column].nulls.push_back(0);
+		columns_[column].integers.push_back(value);
+	}
+
+	void columnar_result::append_real(const size_t& column, const double& value)
+	{
+		columns_[column].nulls.push_back(0);
+		columns_[column].reals.push_back(value);
+	}
+
+	void columnar_result::append_text(const size_t& column, std::string_view value)
+	{
+		auto& target = columns_[column];
+		target.nulls.push_back(0);
+		target.text.insert(target.text.end(), value.begin(), value.end());
+		target.ends.push_back(target.text.size());
+	}
+
+	std::string_view columnar_result::column_name(const size_t& column) const
+	{
+		return column < column_count_ ? std::string_view(columns_[column].name) : std::string_view();
+	}
+
+	columnar_result::column_kind columnar_result::kind(const size_t& column) const
+	{
+		return column < column_count_ ? columns_[column].kind : column_kind::bytes;
+	}
+
+	bool columnar_result::is_null(const size_t& row, const size_t& column) const
+	{
+		return column >= column_count_ || row >= rows_ || columns_[column].nulls[row] != 0;
+	}
+
+	std::span<const uint8_t> columnar_result::booleans(const size_t& column) const
+	{
+		if (column >= column_count_)
+		{
+			return {};
+		}
+		return columns_[column].booleans;
+	}
+
+	std::span<const int64_t> columnar_result::integers(const size_t& column) const
+	{
+		if (column >= column_count_)
+		{
+			return {};
+		}
+		return columns_[column].integers;
+	}
+
+	std::span<const double> columnar_result::reals(const size_t& column) const
+	{
+		if (column >= column_count_)
+		{
+			return {};
+		}
+		return columns_[column].reals;
+	}
+
+	std::string_view columnar_result::text(const size_t& row, const size_t& column) const
+	{
+		if (column >= column_count_ || row >= rows_ || !stores_text(columns_[column].kind))
+		{
+			return {};
+		}
+
+		const auto& source = columns_[column];
+		const size_t begin = row == 0 ? 0 : source.ends[row - 1];
+		return std::string_view(source.text.data() + begin, source.ends[row] - begin);
+	}
+
+	size_t columnar_result::capacity_bytes(void) const
+	{
+		size_t bytes = columns_.capacity() * sizeof(column);
+		for (const auto& source : columns_)
+		{
+			bytes += source.name.capacity() + source.nulls.capacity() + source.booleans.capacity()
+					 + source.integers.capacity() * sizeof(int64_t)
+					 + source.reals.capacity() * sizeof(double)
+					 + source.ends.capacity() * sizeof(size_t) + source.text.capacity();
+		}
+		return bytes;
+	}
+
+	bool columnar_result::stores_text(const column_kind& kind)
+	{
+		return kind == column_kind::text || kind == column_kind::numeric
+			   || kind == column_kind::bytes;
+	}
+} // namespace database
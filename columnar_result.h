@@ -0,0 +1,150 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace database
+{
+	/**
+	 * @class columnar_result
+	 * @brief Query result stored column by column, each column in one
+	 *        contiguous typed array.
+	 *
+	 * Integers, timestamps and dates are kept as @c int64_t, floating
+	 * point as @c double and booleans as one byte, so a column can be
+	 * scanned as a @c std::span without touching the other columns. Text
+	 * cells are packed into one arena per column with an end offset per
+	 * row. NULL cells hold 0 (or empty text) and are marked separately.
+	 *
+	 * @c reset() and @c clear_rows() keep the allocated capacity, so
+	 * decoding similar results (or batches of one result) into the same
+	 * object stops allocating once it has grown to fit.
+	 */
+	class columnar_result
+	{
+	public:
+		/**
+		 * @enum column_kind
+		 * @brief How the cells of a column are stored.
+		 */
+		enum class column_kind : uint8_t
+		{
+			boolean, ///< @c booleans(), 0 or 1.
+			integer, ///< @c integers().
+			real, ///< @c reals().
+			timestamp, ///< @c integers(), microseconds since 1970-01-01 UTC.
+			date, ///< @c integers(), days since 1970-01-01.
+			text, ///< @c text().
+			numeric, ///< @c text(), the decimal value as PostgreSQL prints it.
+			bytes ///< @c text(), the raw binary form of any other type.
+		};
+
+		columnar_result(void);
+		virtual ~columnar_result(void);
+
+		/**
+		 * @brief Removes all columns and rows, keeping the capacity.
+		 */
+		void reset(void);
+
+		/**
+		 * @brief Removes all rows but keeps the columns.
+		 */
+		void clear_rows(void);
+
+		void add_column(std::string_view name, const column_kind& kind);
+
+		/**
+		 * @brief Appends a cell to @p column. Every column must receive
+		 *        one cell before @c finish_row() is called.
+		 */
+		void append_null(const size_t& column);
+		void append_boolean(const size_t& column, const bool& value);
+		void append_integer(const size_t& column, const int64_t& value);
+		void append_real(const size_t& column, const double& value);
+		void append_text(const size_t& column, std::string_view value);
+
+		void finish_row(void) { ++rows_; }
+
+		size_t rows(void) const { return rows_; }
+		size_t columns(void) const { return column_count_; }
+		std::string_view column_name(const size_t& column) const;
+		column_kind kind(const size_t& column) const;
+
+		bool is_null(const size_t& row, const size_t& column) const;
+
+		/**
+		 * @brief The values of a column; empty when the column is of
+		 *        another kind.
+		 */
+		std::span<const uint8_t> booleans(const size_t& column) const;
+		std::span<const int64_t> integers(const size_t& column) const;
+		std::span<const double> reals(const size_t& column) const;
+
+		/**
+		 * @brief The cell of a @c text, @c numeric or @c bytes column;
+		 *        empty for other kinds and NULL.
+		 */
+		std::string_view text(const size_t& row, const size_t& column) const;
+
+		/**
+		 * @brief Returns the heap bytes currently reserved.
+		 */
+		size_t capacity_bytes(void) const;
+
+	private:
+		struct column
+		{
+			std::string name;
+			column_kind kind = column_kind::text;
+			std::vector<uint8_t> nulls;
+			std::vector<uint8_t> booleans;
+			std::vector<int64_t> integers;
+			std::vector<double> reals;
+			std::vector<size_t> ends; ///< End offset of each row's text.
+			std::vector<char> text;
+		};
+
+		static bool stores_text(const column_kind& kind);
+
+	private:
+		std::vector<column> columns_;
+		size_t column_count_;
+		size_t rows_;
+	};
+} // namespace database
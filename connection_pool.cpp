@@ -0,0 +1,218 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/connection_pool.h"
+
+#include "database/database_metrics.h"
+#include "database/query_timing.h"
+#include "database/query_tracer.h"
+
+namespace database
+{
+	connection_pool::lease::lease(void) : pool_(nullptr), connection_(nullptr) {}
+
+	connection_pool::lease::lease(connection_pool* pool,
+								  std::unique_ptr<postgres_manager> connection)
+		: pool_(pool), connection_(std::move(connection))
+	{
+	}
+
+	connection_pool::lease::lease(lease&& other) noexcept
+		: pool_(other.pool_), connection_(std::move(other.connection_))
+	{
+		other.pool_ = nullptr;
+	}
+
+	connection_pool::lease& connection_pool::lease::operator=(lease&& other) noexcept
+	{
+		if (this != &other)
+		{
+			release();
+			pool_ = other.pool_;
+			connection_ = std::move(other.connection_);
+			other.pool_ = nullptr;
+		}
+
+		return *this;
+	}
+
+	connection_pool::lease::~lease(void) { release(); }
+
+	void connection_pool::lease::release(void)
+	{
+		if (pool_ != nullptr && connection_ != nullptr)
+		{
+			pool_->release(std::move(connection_));
+		}
+
+		pool_ = nullptr;
+		connection_.reset();
+	}
+
+	connection_pool::connection_pool(const std::string& connect_string,
+									 const size_t& max_size, const std::string& name)
+		: connect_string_(connect_string)
+		, max_size_(max_size == 0 ? 1 : max_size)
+		, total_(0)
+		, waiting_(0)
+	{
+		database_metrics::handle().register_pool(name, this);
+	}
+
+	connection_pool::~connection_pool(void)
+	{
+		database_metrics::handle().unregister_pool(this);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		for (auto& connection : idle_)
+		{
+			connection->disconnect();
+		}
+		idle_.clear();
+	}
+
+	connection_pool::lease connection_pool::acquire(const std::chrono::milliseconds& timeout)
+	{
+		scoped_span span(span_kind::acquire);
+
+		const auto start = std::chrono::steady_clock::now();
+		const auto deadline = start + timeout;
+
+		std::unique_ptr<postgres_manager> connection;
+		bool open_new = false;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+
+			while (idle_.empty() && total_ >= max_size_)
+			{
+				++waiting_;
+				const bool ready = available_.wait_until(
+					lock, deadline, [this]() { return !idle_.empty() || total_ < max_size_; });
+				--waiting_;
+
+				if (!ready)
+				{
+					span.set_error("", "timed out waiting for a pooled connection");
+					scoped_query_timing::add_pending_pool_wait(
+						std::chrono::steady_clock::now() - start);
+
+					return lease();
+				}
+			}
+
+			if (!idle_.empty())
+			{
+				connection = std::move(idle_.back());
+				idle_.pop_back();
+			}
+			else
+			{
+				++total_;
+				open_new = true;
+			}
+		}
+
+		if (open_new)
+		{
+			connection = std::make_unique<postgres_manager>();
+			if (!connection->connect(connect_string_))
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					--total_;
+				}
+				available_.notify_one();
+
+				span.set_error("", "could not open a pooled connection");
+				scoped_query_timing::add_pending_pool_wait(
+					std::chrono::steady_clock::now() - start);
+
+				return lease();
+			}
+		}
+
+		const auto waited = std::chrono::steady_clock::now() - start;
+		scoped_query_timing::add_pending_pool_wait(waited);
+		span.set_attribute("db.pool.new_connection", static_cast<int64_t>(open_new));
+
+		return lease(this, std::move(connection));
+	}
+
+	size_t connection_pool::size(void) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		return total_;
+	}
+
+	size_t connection_pool::idle(void) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		return idle_.size();
+	}
+
+	size_t connection_pool::waiting(void) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		return waiting_;
+	}
+
+	void connection_pool::release(std::unique_ptr<postgres_manager> connection)
+	{
+		// A connection left inside a transaction block would leak that
+		// transaction to the next caller.
+		const bool healthy = connection->is_idle();
+		if (!healthy)
+		{
+			connection->disconnect();
+			connection.reset();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			if (healthy)
+			{
+				idle_.push_back(std::move(connection));
+			}
+			else
+			{
+				--total_;
+			}
+		}
+
+		available_.notify_one();
+	}
+} // namespace database
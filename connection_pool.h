@@ -0,0 +1,158 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <condition_variable>
+
+#include "postgres_manager.h"
+
+namespace database
+{
+	/**
+	 * @class connection_pool
+	 * @brief A bounded pool of PostgreSQL connections.
+	 *
+	 * Connections are opened lazily up to @c max_size. @c acquire hands out
+	 * a @c lease that returns the connection to the pool when it goes out
+	 * of scope; a connection that is no longer healthy or was left inside
+	 * a transaction block is discarded instead of being returned. Waiting time is traced as a
+	 * @c span_kind::acquire span and charged to the next query on the
+	 * acquiring thread as @c query_phase::pool_wait.
+	 *
+	 * Session settings made with @c postgres_manager::set_session stay
+	 * with a connection across leases, so the next caller that needs the
+	 * same values sends nothing. A caller that needs the server defaults
+	 * calls @c reset_session, which is free on a connection already at
+	 * them.
+	 *
+	 * Every lease must be released before the pool is destroyed.
+	 */
+	class connection_pool
+	{
+	public:
+		/**
+		 * @class lease
+		 * @brief Exclusive use of one pooled connection.
+		 */
+		class lease
+		{
+		public:
+			lease(void);
+			lease(connection_pool* pool, std::unique_ptr<postgres_manager> connection);
+			lease(lease&& other) noexcept;
+			lease& operator=(lease&& other) noexcept;
+			~lease(void);
+
+			lease(const lease&) = delete;
+			lease& operator=(const lease&) = delete;
+
+			/**
+			 * @brief Returns @c true if this lease holds a connection.
+			 */
+			bool valid(void) const { return connection_ != nullptr; }
+
+			postgres_manager* operator->(void) const { return connection_.get(); }
+			postgres_manager& operator*(void) const { return *connection_; }
+			postgres_manager* get(void) const { return connection_.get(); }
+
+			/**
+			 * @brief Returns the connection to the pool before destruction.
+			 */
+			void release(void);
+
+		private:
+			connection_pool* pool_;
+			std::unique_ptr<postgres_manager> connection_;
+		};
+
+		/**
+		 * @brief Creates an empty pool.
+		 *
+		 * The pool registers itself with @c database_metrics under @p name
+		 * so its gauges are included in the exported metrics.
+		 *
+		 * @param connect_string Connection string used for every connection.
+		 * @param max_size       Maximum number of open connections.
+		 * @param name           Label identifying the pool in metrics.
+		 */
+		connection_pool(const std::string& connect_string, const size_t& max_size,
+						const std::string& name = "default");
+
+		virtual ~connection_pool(void);
+
+		/**
+		 * @brief Takes an idle connection, opening a new one if the pool is
+		 *        below @c max_size, or waits for one to be released.
+		 *
+		 * @param timeout Longest time to wait for a connection.
+		 * @return A valid lease, or an invalid one on timeout or when a new
+		 *         connection could not be opened.
+		 */
+		lease acquire(const std::chrono::milliseconds& timeout = std::chrono::milliseconds(5000));
+
+		/**
+		 * @brief Number of open connections, idle or leased.
+		 */
+		size_t size(void) const;
+
+		/**
+		 * @brief Number of open connections not currently leased.
+		 */
+		size_t idle(void) const;
+
+		/**
+		 * @brief Number of threads blocked in @c acquire.
+		 */
+		size_t waiting(void) const;
+
+		size_t max_size(void) const { return max_size_; }
+
+	private:
+		void release(std::unique_ptr<postgres_manager> connection);
+
+	private:
+		std::string connect_string_;
+		size_t max_size_;
+
+		mutable std::mutex mutex_;
+		std::condition_variable available_;
+		std::vector<std::unique_ptr<postgres_manager>> idle_;
+		size_t total_;
+		size_t waiting_;
+	};
+} // namespace database
@@ -0,0 +1,462 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/csv_import.h"
+
+#include "database/postgres_manager.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CSV_SCAN_SSE2
+#endif
+
+namespace database
+{
+	namespace
+	{
+		constexpr size_t block_bytes = 16;
+
+		/**
+		 * Bit i of each mask is set when byte i of a block is that
+		 * character.
+		 */
+		struct block_masks
+		{
+			uint32_t quote;
+			uint32_t delimiter;
+			uint32_t newline;
+		};
+
+		block_masks scan_block(const char* data, const size_t& size,
+							   const char& delimiter, const char& quote)
+		{
+			block_masks masks{ 0, 0, 0 };
+#ifdef CSV_SCAN_SSE2
+			if (size == block_bytes)
+			{
+				const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+				if (quote != '\0')
+				{
+					masks.quote = static_cast<uint32_t>(
+						_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(quote))));
+				}
+				masks.delimiter = static_cast<uint32_t>(
+					_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(delimiter))));
+				masks.newline = static_cast<uint32_t>(
+					_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'))));
+				return masks;
+			}
+#endif
+			for (size_t index = 0; index < size; ++index)
+			{
+				const uint32_t bit = 1u << index;
+				if (quote != '\0' && data[index] == quote)
+				{
+					masks.quote |= bit;
+				}
+				else if (data[index] == delimiter)
+				{
+					masks.delimiter |= bit;
+				}
+				else if (data[index] == '\n')
+				{
+					masks.newline |= bit;
+				}
+			}
+			return masks;
+		}
+
+		size_t count_quotes(const char* data, const size_t& size, const char& quote)
+		{
+			if (quote == '\0')
+			{
+				return 0;
+			}
+
+			size_t count = 0;
+			size_t index = 0;
+#ifdef CSV_SCAN_SSE2
+			const __m128i pattern = _mm_set1_epi8(quote);
+			for (; index + block_bytes <= size; index += block_bytes)
+			{
+				const __m128i bytes
+					= _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + index));
+				count += static_cast<size_t>(std::popcount(static_cast<uint32_t>(
+					_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, pattern)))));
+			}
+#endif
+			for (; index < size; ++index)
+			{
+				count += data[index] == quote ? 1 : 0;
+			}
+			return count;
+		}
+
+		std::string sql_character(const char& c)
+		{
+			return c == '\'' ? std::string("''''") : std::string("'") + c + '\'';
+		}
+	} // namespace
+
+	mapped_file::mapped_file(void) : data_(nullptr), size_(0), mapped_(false) {}
+
+	mapped_file::~mapped_file(void) { close(); }
+
+	bool mapped_file::open(const std::string& path)
+	{
+		close();
+
+#ifndef _WIN32
+		const int descriptor = ::open(path.c_str(), O_RDONLY);
+		if (descriptor < 0)
+		{
+			return false;
+		}
+
+		struct stat status;
+		if (fstat(descriptor, &status) != 0)
+		{
+			::close(descriptor);
+			return false;
+		}
+		if (status.st_size == 0)
+		{
+			::close(descriptor);
+			return true;
+		}
+
+		void* address = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE,
+							 descriptor, 0);
+		::close(descriptor);
+		if (address != MAP_FAILED)
+		{
+			// The file is read front to back once per chunk.
+			madvise(address, static_cast<size_t>(status.st_size), MADV_SEQUENTIAL);
+			data_ = static_cast<const char*>(address);
+			size_ = static_cast<size_t>(status.st_size);
+			mapped_ = true;
+			return true;
+		}
+#endif
+
+		std::ifstream input(path, std::ios::binary);
+		if (!input)
+		{
+			return false;
+		}
+		buffer_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+		if (input.bad())
+		{
+			buffer_.clear();
+			return false;
+		}
+		data_ = buffer_.data();
+		size_ = buffer_.size();
+
+		return true;
+	}
+
+	void mapped_file::close(void)
+	{
+#ifndef _WIN32
+		if (mapped_)
+		{
+			munmap(const_cast<char*>(data_), size_);
+		}
+#endif
+		data_ = nullptr;
+		size_ = 0;
+		mapped_ = false;
+		buffer_.clear();
+		buffer_.shrink_to_fit();
+	}
+
+	std::string_view mapped_file::data(void) const
+	{
+		return data_ != nullptr ? std::string_view(data_, size_) : std::string_view();
+	}
+
+	csv_scanner::csv_scanner(std::string_view data, const char& delimiter, const char& quote)
+		: data_(data), delimiter_(delimiter), quote_(quote), position_(0), quoted_(false)
+	{
+	}
+
+	bool csv_scanner::next_row(size_t& fields)
+	{
+		if (position_ >= data_.size())
+		{
+			return false;
+		}
+
+		fields = 1;
+		for (size_t block = position_; block < data_.size(); block += block_bytes)
+		{
+			const size_t size = std::min(block_bytes, data_.size() - block);
+			const block_masks masks = scan_block(data_.data() + block, size, delimiter_, quote_);
+
+			// Structural characters in the order they appear.
+			for (uint32_t bits = masks.quote | masks.delimiter | masks.newline; bits != 0;
+				 bits &= bits - 1)
+			{
+				const uint32_t bit = bits & (~bits + 1);
+				if ((masks.quote & bit) != 0)
+				{
+					quoted_ = !quoted_;
+				}
+				else if (quoted_)
+				{
+					continue;
+				}
+				else if ((masks.delimiter & bit) != 0)
+				{
+					++fields;
+				}
+				else
+				{
+					position_ = block + static_cast<size_t>(std::countr_zero(bit)) + 1;
+					return true;
+				}
+			}
+		}
+
+		position_ = data_.size();
+		return true;
+	}
+
+	size_t csv_scanner::offset(void) const { return position_; }
+
+	bool csv_scanner::in_quotes(void) const { return quoted_; }
+
+	std::vector<std::string_view> split_csv_rows(std::string_view data,
+												 const size_t& chunk_bytes,
+												 const char& quote)
+	{
+		std::vector<std::string_view> chunks;
+		const size_t step = std::max<size_t>(chunk_bytes, 1);
+
+		size_t start = 0;
+		while (start < data.size())
+		{
+			if (data.size() - start <= step)
+			{
+				chunks.push_back(data.substr(start));
+				break;
+			}
+
+			// Chunks start outside quotes, so an odd count up to the cut
+			// means the cut is inside a quoted field.
+			size_t end = start + step;
+			bool quoted = count_quotes(data.data() + start, end - start, quote) % 2 == 1;
+			for (; end < data.size(); ++end)
+			{
+				if (quote != '\0' && data[end] == quote)
+				{
+					quoted = !quoted;
+				}
+				else if (data[end] == '\n' && !quoted)
+				{
+					break;
+				}
+			}
+
+			end = std::min(end + 1, data.size());
+			chunks.push_back(data.substr(start, end - start));
+			start = end;
+		}
+
+		return chunks;
+	}
+
+	csv_importer::csv_importer(const csv_import_options& options) : options_(options) {}
+
+	csv_importer::~csv_importer(void) {}
+
+	std::string csv_importer::copy_statement(void) const
+	{
+		std::string statement = "COPY " + options_.table;
+		if (!options_.columns.empty())
+		{
+			statement += " (" + options_.columns + ")";
+		}
+
+		// Without a quote character the rows are in PostgreSQL's text
+		// format, whose fields are never quoted.
+		statement += options_.quote != '\0' ? " FROM STDIN WITH (FORMAT csv, DELIMITER "
+											: " FROM STDIN WITH (FORMAT text, DELIMITER ";
+		statement += sql_character(options_.delimiter);
+		if (options_.quote != '\0')
+		{
+			statement += ", QUOTE " + sql_character(options_.quote);
+		}
+		statement += ")";
+
+		return statement;
+	}
+
+	csv_import_result csv_importer::load(const std::string& connect_string,
+										 std::string_view data) const
+	{
+		csv_import_result outcome;
+
+		// Every row must have as many fields as the first, header or not.
+		size_t expected_fields = 0;
+		std::string_view rows = data;
+		{
+			csv_scanner first(data, options_.delimiter, options_.quote);
+			if (!first.next_row(expected_fields))
+			{
+				outcome.completed = true;
+				return outcome;
+			}
+			if (options_.header)
+			{
+				rows.remove_prefix(first.offset());
+			}
+		}
+
+		const std::vector<std::string_view> chunks
+			= split_csv_rows(rows, options_.chunk_bytes, options_.quote);
+		outcome.chunks = chunks.size();
+		const std::string statement = copy_statement();
+
+		std::mutex mutex;
+		std::atomic<size_t> next{ 0 };
+		auto fail = [&](std::string_view chunk, std::string message) {
+			std::lock_guard<std::mutex> lock(mutex);
+			outcome.failed_chunks.push_back({ static_cast<size_t>(chunk.data() - data.data()),
+											  chunk.size(), std::move(message) });
+		};
+		auto check_rows = [&](std::string_view chunk) -> std::string {
+			csv_scanner scanner(chunk, options_.delimiter, options_.quote);
+			size_t row_start = 0;
+			size_t fields = 0;
+			while (scanner.next_row(fields))
+			{
+				if (fields != expected_fields)
+				{
+					return "row at byte "
+						   + std::to_string(static_cast<size_t>(chunk.data() - data.data())
+											+ row_start)
+						   + " has " + std::to_string(fields) + " fields, expected "
+						   + std::to_string(expected_fields);
+				}
+				row_start = scanner.offset();
+			}
+			return scanner.in_quotes() ? "unterminated quoted field" : "";
+		};
+
+		auto worker = [&]() {
+			postgres_manager connection;
+			if (!connection.connect(connect_string))
+			{
+				return;
+			}
+
+			for (size_t index = next++; index < chunks.size(); index = next++)
+			{
+				const std::string_view chunk = chunks[index];
+				std::string problem = check_rows(chunk);
+				if (!problem.empty())
+				{
+					fail(chunk, std::move(problem));
+					continue;
+				}
+
+				uint64_t copied = 0;
+				if (!connection.copy_in(statement, chunk, copied))
+				{
+					const std::string& state = connection.last_error_state();
+					fail(chunk, state.empty() ? "COPY failed" : "COPY failed with SQLSTATE " + state);
+					continue;
+				}
+
+				std::lock_guard<std::mutex> lock(mutex);
+				outcome.rows += copied;
+				outcome.bytes += chunk.size();
+			}
+		};
+
+		const size_t workers
+			= std::max<size_t>(1, std::min(options_.connections, chunks.size()));
+		std::vector<std::thread> threads;
+		threads.reserve(workers);
+		for (size_t index = 0; index < workers; ++index)
+		{
+			threads.emplace_back(worker);
+		}
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+
+		// Chunks nobody took because no connection could be opened.
+		for (size_t index = next.load(); index < chunks.size(); ++index)
+		{
+			fail(chunks[index], "no connection to the server");
+		}
+
+		std::sort(outcome.failed_chunks.begin(), outcome.failed_chunks.end(),
+				  [](const auto& left, const auto& right) { return left.offset < right.offset; });
+		outcome.completed = outcome.failed_chunks.empty();
+
+		return outcome;
+	}
+
+	csv_import_result csv_importer::load_file(const std::string& connect_string,
+											  const std::string& path) const
+	{
+		mapped_file file;
+		if (!file.open(path))
+		{
+			csv_import_result outcome;
+			outcome.failed_chunks.push_back({ 0, 0, "cannot read " + path });
+			return outcome;
+		}
+
+		return load(connect_string, file.data());
+	}
+} // namespace database
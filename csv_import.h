@@ -0,0 +1,212 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace database
+{
+	/**
+	 * @class mapped_file
+	 * @brief Read-only view of a whole file, memory-mapped where the
+	 *        platform allows it and read into memory otherwise.
+	 */
+	class mapped_file
+	{
+	public:
+		mapped_file(void);
+		~mapped_file(void);
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		/**
+		 * @brief Maps @p path, closing any file mapped before.
+		 *
+		 * @return @c false if the file cannot be opened or mapped.
+		 */
+		bool open(const std::string& path);
+
+		void close(void);
+
+		/**
+		 * @brief The file contents; empty before @c open succeeds.
+		 */
+		std::string_view data(void) const;
+
+	private:
+		const char* data_;
+		size_t size_;
+		bool mapped_;
+		std::string buffer_; ///< Contents when the file could not be mapped.
+	};
+
+	/**
+	 * @class csv_scanner
+	 * @brief Walks the rows of CSV data, counting the fields of each.
+	 *
+	 * Quotes, delimiters and newlines are located sixteen bytes at a time
+	 * with SSE2 compares where available, so the bytes of a field are never
+	 * looked at one by one. A doubled quote inside a quoted field toggles
+	 * the quote state twice and so needs no special case; delimiters and
+	 * newlines inside quotes belong to the field.
+	 */
+	class csv_scanner
+	{
+	public:
+		/**
+		 * @param quote Quote character, or '\0' for data without quoting.
+		 */
+		csv_scanner(std::string_view data, const char& delimiter, const char& quote);
+
+		/**
+		 * @brief Advances past the next row.
+		 *
+		 * A last row without a trailing newline is returned as a row.
+		 *
+		 * @param fields Receives the number of fields of the row.
+		 * @return @c false when no data is left.
+		 */
+		bool next_row(size_t& fields);
+
+		/**
+		 * @brief Byte offset of the row after the last one returned.
+		 */
+		size_t offset(void) const;
+
+		/**
+		 * @brief @c true if the data ended inside a quoted field.
+		 */
+		bool in_quotes(void) const;
+
+	private:
+		std::string_view data_;
+		char delimiter_;
+		char quote_;
+		size_t position_;
+		bool quoted_;
+	};
+
+	/**
+	 * @brief Cuts CSV data into pieces of about @p chunk_bytes that start
+	 *        and end on row boundaries.
+	 *
+	 * Each cut is moved forward to the first newline that is not inside a
+	 * quoted field. Whether a position is quoted follows from the parity
+	 * of the quotes before it, which is counted with SIMD population
+	 * counts rather than by parsing the rows.
+	 */
+	std::vector<std::string_view> split_csv_rows(std::string_view data,
+												 const size_t& chunk_bytes,
+												 const char& quote);
+
+	/**
+	 * @brief What @c csv_importer loads and how the input is written.
+	 */
+	struct csv_import_options
+	{
+		std::string table; ///< Target table, as written in SQL.
+		std::string columns; ///< Column list such as "id, name", or empty for all.
+		char delimiter = ',';
+		char quote = '"';
+		bool header = false; ///< Skip the first row.
+		size_t connections = 4; ///< Parallel COPY streams.
+		size_t chunk_bytes = 16 * 1024 * 1024; ///< Input per COPY statement.
+	};
+
+	/**
+	 * @brief A chunk of input the server did not load.
+	 */
+	struct csv_chunk_error
+	{
+		size_t offset; ///< First byte of the chunk in the input.
+		size_t bytes;
+		std::string message;
+	};
+
+	/**
+	 * @brief Outcome of @c csv_importer::load.
+	 */
+	struct csv_import_result
+	{
+		bool completed = false; ///< Every chunk was loaded.
+		uint64_t rows = 0; ///< Rows the server reported as loaded.
+		uint64_t bytes = 0; ///< Input bytes of the loaded chunks.
+		size_t chunks = 0;
+		std::vector<csv_chunk_error> failed_chunks; ///< In input order.
+	};
+
+	/**
+	 * @class csv_importer
+	 * @brief Loads CSV or TSV input into a table over several connections
+	 *        in parallel with @c COPY.
+	 *
+	 * The input is cut into chunks on row boundaries by @c split_csv_rows
+	 * and each connection takes the next chunk until none are left. Before
+	 * a chunk is sent, @c csv_scanner checks that every row has as many
+	 * fields as the first row, so a malformed row is reported with its
+	 * byte offset instead of aborting a COPY halfway through.
+	 *
+	 * Each chunk is its own @c COPY statement and commits on its own: a
+	 * failed load leaves the other chunks in the table, and
+	 * @c failed_chunks gives the byte ranges to retry.
+	 */
+	class csv_importer
+	{
+	public:
+		explicit csv_importer(const csv_import_options& options);
+		virtual ~csv_importer(void);
+
+		/**
+		 * @brief Loads @p data, which must be in the client encoding.
+		 */
+		csv_import_result load(const std::string& connect_string, std::string_view data) const;
+
+		/**
+		 * @brief Maps @p path and loads its contents.
+		 */
+		csv_import_result load_file(const std::string& connect_string,
+									const std::string& path) const;
+
+		/**
+		 * @brief The @c COPY statement each chunk is sent with.
+		 */
+		std::string copy_statement(void) const;
+
+	private:
+		csv_import_options options_;
+	};
+} // namespace database
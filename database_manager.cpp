@@ -33,10 +33,98 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "database/database_manager.h"
 
 #include "database/postgres_manager.h"
+#include "database/sql_fingerprint.h"
+
+#include <chrono>
+#include <string_view>
 
 namespace database
 {
-	database_manager::database_manager() : connected_(false), database_(nullptr)
+	namespace
+	{
+		uint64_t capture_rows(const bool&) { return 0; }
+		uint64_t capture_rows(const unsigned int& result) { return result; }
+		template <typename T> uint64_t capture_rows(const std::unique_ptr<T>&) { return 0; }
+
+		bool capture_succeeded(const bool& result) { return result; }
+		bool capture_succeeded(const unsigned int&) { return true; }
+		template <typename T> bool capture_succeeded(const std::unique_ptr<T>& result)
+		{
+			return result != nullptr;
+		}
+
+		/**
+		 * Whether the result of @p query_string may be shared: a plain
+		 * SELECT without a locking clause and without calls that change
+		 * state or differ on every call. Other volatile functions are the
+		 * caller's responsibility.
+		 */
+		bool shareable_select(const std::string& query_string)
+		{
+			const std::string normalized = normalize_statement(query_string);
+			if (normalized.rfind("select ", 0) != 0)
+			{
+				return false;
+			}
+
+			static constexpr std::string_view excluded[]
+				= { " for update",	  " for no key update", " for share",	   " for key share",
+					"nextval (",	  "setval (",			"currval (",	   "lastval (",
+					"random (",		  "gen_random_uuid (",	"clock_timestamp (", "txid_current (",
+					"pg_advisory",	  "pg_try_advisory",	"pg_notify (",	   "set_config (" };
+			for (const auto call : excluded)
+			{
+				if (normalized.find(call) != std::string::npos)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		/**
+		 * Runs @p execute and, while a capture is open, records the
+		 * statement with its timing and result. Modification queries
+		 * report only an affected row count, so they are always recorded
+		 * as succeeded.
+		 */
+		template <typename Function>
+		auto captured(query_capture_writer& capture,
+					  const uint32_t& session,
+					  const capture_statement_kind& kind,
+					  const std::string& query_string,
+					  Function&& execute)
+		{
+			if (!capture.is_open())
+			{
+				return execute();
+			}
+
+			const auto start = std::chrono::steady_clock::now();
+			auto result = execute();
+			const auto duration = std::chrono::steady_clock::now() - start;
+
+			capture_record record;
+			record.session = session;
+			record.start_offset_us = capture.offset_us(start);
+			record.duration_us = static_cast<uint64_t>(
+				std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+			record.kind = kind;
+			record.succeeded = capture_succeeded(result);
+			record.rows = capture_rows(result);
+			record.statement = query_string;
+			capture.record(record);
+
+			return result;
+		}
+	}
+
+	database_manager::database_manager()
+		: connected_(false)
+		, database_(nullptr)
+		, session_(0)
+		, auto_parameterize_(false)
+		, shared_cache_ttl_(0)
 	{
 	}
 
@@ -54,8 +142,12 @@ namespace database
 		switch (database_type)
 		{
 		case database_types::postgres:
-			database_ = std::make_unique<postgres_manager>();
+		{
+			auto connection = std::make_unique<postgres_manager>();
+			connection->set_auto_parameterize(auto_parameterize_);
+			database_ = std::move(connection);
 			break;
+		}
 		default:
 			break;
 		}
@@ -85,7 +177,14 @@ namespace database
 			return false;
 		}
 
-		return database_->connect(connect_string);
+		if (!database_->connect(connect_string))
+		{
+			return false;
+		}
+
+		session_.store(capture_.next_session(), std::memory_order_relaxed);
+
+		return true;
 	}
 
 	bool database_manager::create_query(const std::string& query_string)
@@ -95,7 +194,9 @@ namespace database
 			return false;
 		}
 
-		return database_->create_query(query_string);
+		return captured(capture_, session_.load(std::memory_order_relaxed),
+						capture_statement_kind::create_query, query_string,
+						[&]() { return database_->create_query(query_string); });
 	}
 
 	unsigned int database_manager::insert_query(const std::string& query_string)
@@ -105,7 +206,9 @@ namespace database
 			return 0;
 		}
 
-		return database_->insert_query(query_string);
+		return captured(capture_, session_.load(std::memory_order_relaxed),
+						capture_statement_kind::insert_query, query_string,
+						[&]() { return database_->insert_query(query_string); });
 	}
 
 	unsigned int database_manager::update_query(const std::string& query_string)
@@ -115,7 +218,9 @@ namespace database
 			return 0;
 		}
 
-		return database_->update_query(query_string);
+		return captured(capture_, session_.load(std::memory_order_relaxed),
+						capture_statement_kind::update_query, query_string,
+						[&]() { return database_->update_query(query_string); });
 	}
 
 	unsigned int database_manager::delete_query(const std::string& query_string)
@@ -125,7 +230,9 @@ namespace database
 			return 0;
 		}
 
-		return database_->update_query(query_string);
+		return captured(capture_, session_.load(std::memory_order_relaxed),
+						capture_statement_kind::delete_query, query_string,
+						[&]() { return database_->update_query(query_string); });
 	}
 
 	std::unique_ptr<container_module::value_container> database_manager::select_query(
@@ -136,7 +243,55 @@ namespace database
 			return nullptr;
 		}
 
-		return database_->select_query(query_string);
+#ifdef USE_SQLITE
+		if (replica_ != nullptr && replica_->serves(query_string))
+		{
+			auto local = replica_->select_query(query_string);
+			if (local != nullptr)
+			{
+				return local;
+			}
+		}
+#endif
+
+		return captured(capture_, session_.load(std::memory_order_relaxed),
+						capture_statement_kind::select_query, query_string,
+						[&]() { return database_->select_query(query_string); });
+	}
+
+	std::unique_ptr<container_module::value_container> database_manager::select_shared(
+		const std::string& query_string)
+	{
+		// A transaction block may see its own uncommitted rows or a
+		// snapshot older than the entry, so it neither reads nor fills
+		// the cache.
+		auto* connection = dynamic_cast<postgres_manager*>(database_.get());
+		if (!shared_cache_.is_open() || connection == nullptr || !connection->is_idle()
+			|| !shareable_select(query_string))
+		{
+			return select_query(query_string);
+		}
+
+		std::string key = connection->session_identity();
+		if (key.empty())
+		{
+			return select_query(query_string);
+		}
+		key.append(query_string);
+
+		std::string cached;
+		if (shared_cache_.get(key, cached))
+		{
+			return std::make_unique<container_module::value_container>(cached, false);
+		}
+
+		auto result = select_query(query_string);
+		if (result != nullptr)
+		{
+			shared_cache_.put(key, result->serialize(), shared_cache_ttl_);
+		}
+
+		return result;
 	}
 
 	bool database_manager::disconnect(void)
@@ -149,6 +304,46 @@ namespace database
 		return database_->disconnect();
 	}
 
+	bool database_manager::start_capture(const std::string& path)
+	{
+		return capture_.open(path);
+	}
+
+	void database_manager::stop_capture(void) { capture_.close(); }
+
+	bool database_manager::capturing(void) const { return capture_.is_open(); }
+
+	void database_manager::set_auto_parameterize(const bool& enabled)
+	{
+		auto_parameterize_ = enabled;
+		if (auto* connection = dynamic_cast<postgres_manager*>(database_.get()))
+		{
+			connection->set_auto_parameterize(enabled);
+		}
+	}
+
+	bool database_manager::enable_shared_cache(const std::string& name,
+											   const size_t& size_bytes,
+											   const std::chrono::milliseconds& ttl)
+	{
+		shared_cache_ttl_ = ttl;
+		return shared_cache_.open(name, size_bytes);
+	}
+
+	void database_manager::disable_shared_cache(void) { shared_cache_.close(); }
+
+	shared_result_cache::statistics database_manager::shared_cache_stats(void) const
+	{
+		return shared_cache_.stats();
+	}
+
+#ifdef USE_SQLITE
+	void database_manager::set_replica(std::shared_ptr<sqlite_replica> replica)
+	{
+		replica_ = std::move(replica);
+	}
+#endif
+
 #pragma region singleton
 	std::unique_ptr<database_manager> database_manager::handle_;
 	std::once_flag database_manager::once_;
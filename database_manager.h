@@ -34,8 +34,15 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <memory>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 
 #include "database_base.h"
+#include "query_capture.h"
+#include "shared_result_cache.h"
+#ifdef USE_SQLITE
+#include "sqlite_replica.h"
+#endif
 
 namespace database
 {
@@ -152,6 +159,25 @@ namespace database
 		std::unique_ptr<container_module::value_container> select_query(
 			const std::string& query_string);
 
+		/**
+		 * @brief Runs @c select_query through the shared cache opened by
+		 *        @c enable_shared_cache.
+		 *
+		 * Only call this for reads that may be up to the cache's TTL
+		 * stale and that return the same rows for every caller, i.e. do
+		 * not depend on volatile functions such as @c now(). Entries are
+		 * keyed by the statement and @c postgres_manager::session_identity,
+		 * so connections to other databases, as other users or with
+		 * another search_path do not share them. The cache is bypassed
+		 * inside a transaction block and for statements with a locking
+		 * clause (FOR UPDATE / FOR SHARE) or calls such as @c nextval.
+		 *
+		 * @param query_string The SQL SELECT statement.
+		 * @return The rows, as @c select_query returns them.
+		 */
+		std::unique_ptr<container_module::value_container> select_shared(
+			const std::string& query_string);
+
 		/**
 		 * @brief Disconnects from the currently active database.
 		 *
@@ -160,10 +186,94 @@ namespace database
 		 */
 		bool disconnect(void);
 
+		/**
+		 * @brief Starts writing every statement to a binary capture log.
+		 *
+		 * Each statement is recorded with its start time, duration,
+		 * result and the session (connection) it ran on, for replay with
+		 * the @c database_replay tool. See @c query_capture_writer for the
+		 * file format.
+		 *
+		 * @param path The capture file; an existing file is truncated.
+		 * @return @c true if the capture was started, @c false if the file
+		 *         cannot be written or a capture is already running.
+		 */
+		bool start_capture(const std::string& path);
+
+		/**
+		 * @brief Flushes and closes the capture log, if any.
+		 */
+		void stop_capture(void);
+
+		/**
+		 * @brief Returns @c true while statements are being captured.
+		 */
+		bool capturing(void) const;
+
+		/**
+		 * @brief Runs statements sent as text as prepared statements with
+		 *        their literals as parameters; see
+		 *        @c postgres_manager::set_auto_parameterize. Off by default,
+		 *        and kept across @c set_mode.
+		 */
+		void set_auto_parameterize(const bool& enabled);
+
+		/**
+		 * @brief Serves @c select_shared results from a shared memory cache
+		 *        that every process on the host opening @p name shares.
+		 *
+		 * A miss runs the query and stores the serialized result for
+		 * @p ttl. Writes do not invalidate entries, so @p ttl bounds how
+		 * stale a result may be. @c select_query never uses the cache.
+		 * Call before issuing queries.
+		 *
+		 * @param name       Shared memory segment name, e.g. "/orders_db".
+		 * @param size_bytes Size of the segment; entries are evicted
+		 *                   least recently used first to stay within it.
+		 * @param ttl        How long a cached result is served.
+		 * @return @c true if the segment was mapped.
+		 */
+		bool enable_shared_cache(const std::string& name,
+								 const size_t& size_bytes,
+								 const std::chrono::milliseconds& ttl);
+
+		/**
+		 * @brief Stops using the shared cache; the segment stays in place.
+		 */
+		void disable_shared_cache(void);
+
+		/**
+		 * @brief Returns the shared cache counters for all processes.
+		 */
+		shared_result_cache::statistics shared_cache_stats(void) const;
+
+#ifdef USE_SQLITE
+		/**
+		 * @brief Routes @c select_query calls for statements registered
+		 *        with @c sqlite_replica::serve to @p replica instead of
+		 *        the server.
+		 *
+		 * A statement the replica cannot run falls back to the server.
+		 * Replica reads are not captured. The caller keeps the replica
+		 * current, e.g. with @c sqlite_replica::wait_and_refresh on its
+		 * own connection. Call before issuing queries; @c nullptr stops
+		 * routing.
+		 */
+		void set_replica(std::shared_ptr<sqlite_replica> replica);
+#endif
+
 	private:
 		bool connected_; ///< Indicates whether a database connection is active.
 		std::unique_ptr<database_base>
 			database_;	 ///< The underlying database interface.
+		query_capture_writer capture_; ///< Statement capture log.
+		std::atomic<uint32_t> session_; ///< Capture session of the current connection.
+		bool auto_parameterize_; ///< Applied to every connection created by @c set_mode.
+		shared_result_cache shared_cache_; ///< Cross-process select cache.
+		std::chrono::milliseconds shared_cache_ttl_; ///< Lifetime of cached results.
+#ifdef USE_SQLITE
+		std::shared_ptr<sqlite_replica> replica_; ///< Local copy of reference tables.
+#endif
 
 #pragma region singleton
 	public:
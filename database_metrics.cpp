@@ -0,0 +1,217 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/database_metrics.h"
+
+#include "database/connection_pool.h"
+
+#include <algorithm>
+
+namespace database
+{
+	database_metrics::database_metrics(void)
+		: in_flight_(0)
+		, queries_(0)
+		, bytes_sent_(0)
+		, bytes_received_(0)
+		, prepared_hits_(0)
+		, prepared_misses_(0)
+		, reconnects_(0)
+		, reconnect_failures_(0)
+	{
+	}
+
+	database_metrics::~database_metrics(void) {}
+
+	void database_metrics::query_started(void)
+	{
+		in_flight_.fetch_add(1, std::memory_order_relaxed);
+		queries_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void database_metrics::query_finished(void)
+	{
+		in_flight_.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void database_metrics::record_error(std::string_view sqlstate)
+	{
+		const std::string error_class
+			= sqlstate.size() >= 2 ? std::string(sqlstate.substr(0, 2)) : std::string("08");
+
+		std::lock_guard<std::mutex> lock(errors_mutex_);
+
+		++errors_[error_class];
+	}
+
+	void database_metrics::add_bytes_sent(const uint64_t& bytes)
+	{
+		bytes_sent_.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	void database_metrics::add_bytes_received(const uint64_t& bytes)
+	{
+		bytes_received_.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	void database_metrics::record_prepared_lookup(const bool& hit)
+	{
+		if (hit)
+		{
+			prepared_hits_.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		prepared_misses_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void database_metrics::record_reconnect(const bool& succeeded)
+	{
+		if (succeeded)
+		{
+			reconnects_.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		reconnect_failures_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	int64_t database_metrics::in_flight(void) const
+	{
+		return in_flight_.load(std::memory_order_relaxed);
+	}
+
+	uint64_t database_metrics::queries(void) const
+	{
+		return queries_.load(std::memory_order_relaxed);
+	}
+
+	uint64_t database_metrics::bytes_sent(void) const
+	{
+		return bytes_sent_.load(std::memory_order_relaxed);
+	}
+
+	uint64_t database_metrics::bytes_received(void) const
+	{
+		return bytes_received_.load(std::memory_order_relaxed);
+	}
+
+	uint64_t database_metrics::prepared_hits(void) const
+	{
+		return prepared_hits_.load(std::memory_order_relaxed);
+	}
+
+	uint64_t database_metrics::prepared_misses(void) const
+	{
+		return prepared_misses_.load(std::memory_order_relaxed);
+	}
+
+	uint64_t database_metrics::reconnects(void) const
+	{
+		return reconnects_.load(std::memory_order_relaxed);
+	}
+
+	uint64_t database_metrics::reconnect_failures(void) const
+	{
+		return reconnect_failures_.load(std::memory_order_relaxed);
+	}
+
+	std::map<std::string, uint64_t> database_metrics::errors_by_class(void) const
+	{
+		std::lock_guard<std::mutex> lock(errors_mutex_);
+
+		return errors_;
+	}
+
+	void database_metrics::register_pool(const std::string& name, const connection_pool* pool)
+	{
+		std::lock_guard<std::mutex> lock(pools_mutex_);
+
+		pools_.emplace_back(name, pool);
+	}
+
+	void database_metrics::unregister_pool(const connection_pool* pool)
+	{
+		std::lock_guard<std::mutex> lock(pools_mutex_);
+
+		pools_.erase(std::remove_if(pools_.begin(), pools_.end(),
+									[pool](const auto& entry) { return entry.second == pool; }),
+					 pools_.end());
+	}
+
+	std::vector<database_metrics::pool_gauges> database_metrics::pools(void) const
+	{
+		std::lock_guard<std::mutex> lock(pools_mutex_);
+
+		std::vector<pool_gauges> gauges;
+		gauges.reserve(pools_.size());
+		for (const auto& [name, pool] : pools_)
+		{
+			pool_gauges reading;
+			reading.name = name;
+			reading.size = pool->size();
+			reading.idle = pool->idle();
+			reading.waiting = pool->waiting();
+			reading.max_size = pool->max_size();
+			gauges.push_back(std::move(reading));
+		}
+
+		return gauges;
+	}
+
+	void database_metrics::reset(void)
+	{
+		queries_.store(0, std::memory_order_relaxed);
+		bytes_sent_.store(0, std::memory_order_relaxed);
+		bytes_received_.store(0, std::memory_order_relaxed);
+		prepared_hits_.store(0, std::memory_order_relaxed);
+		prepared_misses_.store(0, std::memory_order_relaxed);
+		reconnects_.store(0, std::memory_order_relaxed);
+		reconnect_failures_.store(0, std::memory_order_relaxed);
+
+		std::lock_guard<std::mutex> lock(errors_mutex_);
+
+		errors_.clear();
+	}
+
+#pragma region singleton
+	std::unique_ptr<database_metrics> database_metrics::handle_;
+	std::once_flag database_metrics::once_;
+
+	database_metrics& database_metrics::handle(void)
+	{
+		std::call_once(once_, []() { handle_ = std::make_unique<database_metrics>(); });
+
+		return *handle_;
+	}
+#pragma endregion
+} // namespace database
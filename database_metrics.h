@@ -0,0 +1,168 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+namespace database
+{
+	class connection_pool;
+
+	/**
+	 * @class database_metrics
+	 * @brief Process-wide counters and gauges for database activity.
+	 *
+	 * Counters are relaxed atomics updated by @c postgres_manager on every
+	 * statement. Connection pools register themselves on construction so
+	 * their size, idle and waiter gauges can be read when metrics are
+	 * rendered. Latency histograms are kept by @c query_timing.
+	 */
+	class database_metrics
+	{
+	public:
+		/**
+		 * @struct pool_gauges
+		 * @brief A point-in-time reading of one registered pool.
+		 */
+		struct pool_gauges
+		{
+			std::string name;
+			size_t size = 0;
+			size_t idle = 0;
+			size_t waiting = 0;
+			size_t max_size = 0;
+		};
+
+		database_metrics(void);
+		virtual ~database_metrics(void);
+
+		void query_started(void);
+		void query_finished(void);
+
+		/**
+		 * @brief Counts a failed statement under its SQLSTATE class (the
+		 *        first two characters); an empty state is counted as class
+		 *        "08", connection exception.
+		 */
+		void record_error(std::string_view sqlstate);
+
+		void add_bytes_sent(const uint64_t& bytes);
+		void add_bytes_received(const uint64_t& bytes);
+
+		/**
+		 * @brief Counts a lookup in a prepared statement cache.
+		 */
+		void record_prepared_lookup(const bool& hit);
+
+		/**
+		 * @brief Counts an automatic reconnect after a lost connection.
+		 */
+		void record_reconnect(const bool& succeeded);
+
+		int64_t in_flight(void) const;
+		uint64_t queries(void) const;
+		uint64_t bytes_sent(void) const;
+		uint64_t bytes_received(void) const;
+		uint64_t prepared_hits(void) const;
+		uint64_t prepared_misses(void) const;
+		uint64_t reconnects(void) const;
+		uint64_t reconnect_failures(void) const;
+
+		/**
+		 * @brief Returns error counts keyed by SQLSTATE class.
+		 */
+		std::map<std::string, uint64_t> errors_by_class(void) const;
+
+		void register_pool(const std::string& name, const connection_pool* pool);
+		void unregister_pool(const connection_pool* pool);
+
+		/**
+		 * @brief Reads the gauges of every registered pool.
+		 */
+		std::vector<pool_gauges> pools(void) const;
+
+		/**
+		 * @brief Clears all counters; registered pools are kept.
+		 */
+		void reset(void);
+
+	private:
+		std::atomic<int64_t> in_flight_;
+		std::atomic<uint64_t> queries_;
+		std::atomic<uint64_t> bytes_sent_;
+		std::atomic<uint64_t> bytes_received_;
+		std::atomic<uint64_t> prepared_hits_;
+		std::atomic<uint64_t> prepared_misses_;
+		std::atomic<uint64_t> reconnects_;
+		std::atomic<uint64_t> reconnect_failures_;
+
+		mutable std::mutex errors_mutex_;
+		std::map<std::string, uint64_t> errors_;
+
+		mutable std::mutex pools_mutex_;
+		std::vector<std::pair<std::string, const connection_pool*>> pools_;
+
+#pragma region singleton
+	public:
+		/**
+		 * @brief Provides access to the process-wide metrics.
+		 */
+		static database_metrics& handle(void);
+
+	private:
+		static std::unique_ptr<database_metrics> handle_;
+		static std::once_flag once_;
+#pragma endregion
+	};
+
+	/**
+	 * @class scoped_in_flight
+	 * @brief Counts a statement as in flight for the lifetime of the object.
+	 */
+	class scoped_in_flight
+	{
+	public:
+		scoped_in_flight(void) { database_metrics::handle().query_started(); }
+		~scoped_in_flight(void) { database_metrics::handle().query_finished(); }
+
+		scoped_in_flight(const scoped_in_flight&) = delete;
+		scoped_in_flight& operator=(const scoped_in_flight&) = delete;
+	};
+} // namespace database
@@ -0,0 +1,208 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/id_allocator.h"
+
+#include "database/postgres_manager.h"
+
+#include <algorithm>
+
+namespace database
+{
+	namespace
+	{
+		// One nextval per block when the sequence increments by at least
+		// the block size; each value stands for a range of increment ids.
+		constexpr const char* reserve_statement
+			= "SELECT nextval($1::regclass), s.seqincrement FROM pg_sequence s "
+			  "CROSS JOIN generate_series(1, greatest(1, ceil($2::numeric / abs(s.seqincrement))::int8)) "
+			  "WHERE s.seqrelid = $1::regclass";
+	} // namespace
+
+	id_allocator::id_allocator(const std::string& name, const std::string& sequence, const size_t& block_size)
+		: name_(name)
+		, sequence_(sequence)
+		, block_size_(std::to_string(std::max<size_t>(1, block_size)))
+		, state_(0)
+		, reservations_(0)
+		, generation_(0)
+	{
+		// Generation 0 is an empty range, so the first claim reserves.
+		slots_[0].generation.store(0, std::memory_order_relaxed);
+	}
+
+	id_allocator::~id_allocator(void) {}
+
+	bool id_allocator::next(postgres_manager& connection, int64_t& id)
+	{
+		for (;;)
+		{
+			uint64_t claimed = 0;
+			uint64_t generation = 0;
+			switch (claim(1, id, claimed, generation))
+			{
+			case claim_result::claimed:
+				return true;
+			case claim_result::exhausted:
+				if (!refill(connection, generation))
+				{
+					return false;
+				}
+				break;
+			case claim_result::stale:
+				break;
+			}
+		}
+	}
+
+	bool id_allocator::take(postgres_manager& connection, const size_t& count, std::vector<int64_t>& ids)
+	{
+		ids.reserve(ids.size() + count);
+		size_t remaining = count;
+		while (remaining > 0)
+		{
+			int64_t first = 0;
+			uint64_t claimed = 0;
+			uint64_t generation = 0;
+			switch (claim(remaining, first, claimed, generation))
+			{
+			case claim_result::claimed:
+				for (uint64_t index = 0; index < claimed; ++index)
+				{
+					ids.push_back(first + static_cast<int64_t>(index));
+				}
+				remaining -= static_cast<size_t>(claimed);
+				break;
+			case claim_result::exhausted:
+				if (!refill(connection, generation))
+				{
+					return false;
+				}
+				break;
+			case claim_result::stale:
+				break;
+			}
+		}
+		return true;
+	}
+
+	id_allocator::claim_result id_allocator::claim(const uint64_t& wanted,
+												   int64_t& first,
+												   uint64_t& claimed,
+												   uint64_t& generation)
+	{
+		const uint64_t state = state_.fetch_add(wanted, std::memory_order_acq_rel);
+		generation = state >> offset_bits;
+		const uint64_t offset = state & offset_mask;
+
+		const slot& current = slots_[generation % slot_count];
+		const uint64_t written = current.generation.load(std::memory_order_acquire);
+		const int64_t range_first = current.first.load(std::memory_order_relaxed);
+		const uint64_t range_count = current.count.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (written != current.generation.load(std::memory_order_relaxed)
+			|| (written & (UINT64_MAX >> offset_bits)) != generation)
+		{
+			return claim_result::stale;
+		}
+
+		if (offset >= range_count)
+		{
+			return claim_result::exhausted;
+		}
+		first = range_first + static_cast<int64_t>(offset);
+		claimed = std::min(wanted, range_count - offset);
+
+		return claim_result::claimed;
+	}
+
+	bool id_allocator::refill(postgres_manager& connection, const uint64_t& exhausted)
+	{
+		std::lock_guard<std::mutex> lock(refill_mutex_);
+		if ((state_.load(std::memory_order_acquire) >> offset_bits) != exhausted)
+		{
+			// Another thread published a new range meanwhile.
+			return true;
+		}
+		if (runs_.empty() && !reserve(connection))
+		{
+			return false;
+		}
+
+		const run next = runs_.front();
+		runs_.pop_front();
+		++generation_;
+
+		slot& target = slots_[generation_ % slot_count];
+		target.generation.store(UINT64_MAX, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		target.first.store(next.first, std::memory_order_relaxed);
+		target.count.store(next.count, std::memory_order_relaxed);
+		target.generation.store(generation_, std::memory_order_release);
+
+		state_.store((generation_ & (UINT64_MAX >> offset_bits)) << offset_bits,
+					 std::memory_order_release);
+
+		return true;
+	}
+
+	bool id_allocator::reserve(postgres_manager& connection)
+	{
+		if (!connection.is_prepared(name_) && !connection.prepare(name_, reserve_statement))
+		{
+			return false;
+		}
+
+		const std::array<const char*, 2> parameters = { sequence_.c_str(), block_size_.c_str() };
+		if (!connection.execute_prepared(name_, parameters, reserved_) || reserved_.rows() == 0)
+		{
+			return false;
+		}
+		reservations_.fetch_add(1, std::memory_order_relaxed);
+
+		for (size_t row = 0; row < reserved_.rows(); ++row)
+		{
+			const int64_t value = reserved_.integer(row, 0);
+			const int64_t increment = reserved_.integer(row, 1);
+			// A descending sequence hands out its values one by one.
+			const uint64_t count = increment > 0 ? static_cast<uint64_t>(increment) : 1;
+			if (!runs_.empty() && runs_.back().first + static_cast<int64_t>(runs_.back().count) == value)
+			{
+				runs_.back().count += count;
+				continue;
+			}
+			runs_.push_back({ value, count });
+		}
+
+		return true;
+	}
+} // namespace database
@@ -0,0 +1,154 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "result_buffer.h"
+
+namespace database
+{
+	class postgres_manager;
+
+	/**
+	 * @class id_allocator
+	 * @brief Hands out primary keys from a sequence without a round trip
+	 *        per key (hi-lo allocation).
+	 *
+	 * Each reservation takes a block of about @c block_size ids from the
+	 * sequence with one statement. If the sequence increments by more than
+	 * one, as in
+	 * @code
+	 * CREATE SEQUENCE orders_id_seq INCREMENT BY 1000;
+	 * @endcode
+	 * every @c nextval value @c v owns the ids @c v to @c v + 999, so a
+	 * block is a single @c nextval; a sequence that increments by one is
+	 * called @c block_size times in the same statement. Other writers that
+	 * take plain @c nextval values from the same sequence never collide
+	 * with reserved ids.
+	 *
+	 * Ids are then taken from the current range with one atomic
+	 * increment, so any number of threads can share one allocator. Only
+	 * the thread that finds the range used up reserves the next block,
+	 * and it does so on the connection it passed in. Clients therefore
+	 * know the keys of new rows before inserting them, and parent and
+	 * child rows can go to the server together, e.g. in one COPY.
+	 *
+	 * Ids are unique but not dense: ids of a block that is not used up
+	 * before the allocator is destroyed are never handed out.
+	 */
+	class id_allocator
+	{
+	public:
+		/**
+		 * @param name       Prepared statement name, unique per connection.
+		 * @param sequence   The sequence, as written in SQL.
+		 * @param block_size Ids reserved per round trip.
+		 */
+		id_allocator(const std::string& name, const std::string& sequence, const size_t& block_size = 1000);
+		virtual ~id_allocator(void);
+
+		id_allocator(const id_allocator&) = delete;
+		id_allocator& operator=(const id_allocator&) = delete;
+
+		/**
+		 * @brief Takes one id; @p connection is only used when a block
+		 *        has to be reserved.
+		 *
+		 * @return @c false if a reservation was needed and failed.
+		 */
+		bool next(postgres_manager& connection, int64_t& id);
+
+		/**
+		 * @brief Appends @p count ids to @p ids, reserving as many blocks
+		 *        as needed.
+		 */
+		bool take(postgres_manager& connection, const size_t& count, std::vector<int64_t>& ids);
+
+		/**
+		 * @brief Number of reservations made, i.e. round trips spent.
+		 */
+		uint64_t reservations(void) const { return reservations_.load(std::memory_order_relaxed); }
+
+	private:
+		/**
+		 * One contiguous range of ids. A slot is reused every
+		 * @c slot_count ranges; its generation is written around the
+		 * range, seqlock-style, so a reader that was preempted for that
+		 * long sees the change and takes another id.
+		 */
+		struct slot
+		{
+			std::atomic<uint64_t> generation{ UINT64_MAX };
+			std::atomic<int64_t> first{ 0 };
+			std::atomic<uint64_t> count{ 0 };
+		};
+
+		struct run
+		{
+			int64_t first;
+			uint64_t count;
+		};
+
+		enum class claim_result : uint8_t { claimed, exhausted, stale };
+
+		claim_result claim(const uint64_t& wanted, int64_t& first, uint64_t& claimed, uint64_t& generation);
+		bool refill(postgres_manager& connection, const uint64_t& exhausted);
+		bool reserve(postgres_manager& connection);
+
+		static constexpr size_t slot_count = 16;
+		static constexpr uint64_t offset_bits = 48;
+		static constexpr uint64_t offset_mask = (uint64_t{ 1 } << offset_bits) - 1;
+
+	private:
+		std::string name_;
+		std::string sequence_;
+		std::string block_size_;
+
+		std::array<slot, slot_count> slots_;
+		std::atomic<uint64_t> state_; ///< Low 16 bits of the generation, then the
+									  ///< offset of the next id in its range.
+		std::atomic<uint64_t> reservations_;
+
+		std::mutex refill_mutex_;
+		uint64_t generation_; ///< Guarded by @c refill_mutex_, as are the members below.
+		std::deque<run> runs_; ///< Reserved ranges not yet published.
+		result_buffer reserved_;
+	};
+} // namespace database
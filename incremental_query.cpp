@@ -0,0 +1,242 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/incremental_query.h"
+
+#include "database/postgres_manager.h"
+
+#include <array>
+#include <cctype>
+
+namespace database
+{
+	namespace
+	{
+		size_t find_column(const result_buffer& buffer, std::string_view name, const size_t& columns)
+		{
+			for (size_t column = 0; column < columns; ++column)
+			{
+				if (buffer.column_name(column) == name)
+				{
+					return column;
+				}
+			}
+			return columns;
+		}
+
+		std::string quote_identifier(std::string_view name)
+		{
+			std::string quoted(1, '"');
+			for (const char c : name)
+			{
+				quoted += c;
+				if (c == '"')
+				{
+					quoted += '"';
+				}
+			}
+			quoted += '"';
+			return quoted;
+		}
+
+		// Adds the largest watermark of the result as a last column. The
+		// server takes the max in the column's own type, so numerics,
+		// timestamps with an offset and variable-width values order
+		// correctly, and in the same snapshot as the rows.
+		std::string with_watermark(std::string_view query_string, std::string_view watermark_column)
+		{
+			while (!query_string.empty()
+				   && (query_string.back() == ';' || std::isspace(static_cast<unsigned char>(query_string.back()))))
+			{
+				query_string.remove_suffix(1);
+			}
+
+			return "SELECT incremental.*, max(incremental." + quote_identifier(watermark_column)
+				   + ") OVER ()::text FROM (" + std::string(query_string) + ") AS incremental";
+		}
+	}
+
+	incremental_query::incremental_query(const std::string& name,
+										 const std::string& query_string,
+										 const std::string& key_column,
+										 const std::string& watermark_column,
+										 const std::string& initial_watermark)
+		: name_(name)
+		, query_string_(with_watermark(query_string, watermark_column))
+		, key_column_(key_column)
+		, watermark_column_(watermark_column)
+		, initial_watermark_(initial_watermark)
+		, watermark_(initial_watermark)
+		, loaded_(false)
+		, last_full_(false)
+		, refreshes_(0)
+		, full_refresh_interval_(0)
+	{
+	}
+
+	incremental_query::~incremental_query(void) {}
+
+	void incremental_query::set_full_refresh_interval(const uint64_t& refreshes)
+	{
+		full_refresh_interval_ = refreshes;
+	}
+
+	void incremental_query::invalidate(void) { loaded_ = false; }
+
+	bool incremental_query::refresh(postgres_manager& connection)
+	{
+		if (!connection.is_prepared(name_) && !connection.prepare(name_, query_string_))
+		{
+			return false;
+		}
+
+		const bool full = !loaded_
+						  || (full_refresh_interval_ != 0
+							  && (refreshes_ + 1) % full_refresh_interval_ == 0);
+		const std::string& bound = full ? initial_watermark_ : watermark_;
+		const std::array<const char*, 1> parameters = { bound.c_str() };
+
+		if (!connection.execute_prepared(name_, parameters, delta_))
+		{
+			return false;
+		}
+
+		// The last column is the server's watermark, not part of the result.
+		if (delta_.columns() == 0)
+		{
+			return false;
+		}
+		const size_t columns = delta_.columns() - 1;
+		const size_t key = find_column(delta_, key_column_, columns);
+		if (key == columns || find_column(delta_, watermark_column_, columns) == columns)
+		{
+			return false;
+		}
+
+		if (full)
+		{
+			rows_.reset(0);
+			index_.clear();
+			watermark_ = initial_watermark_;
+		}
+
+		merge(key, columns);
+		advance_watermark(columns);
+
+		loaded_ = true;
+		last_full_ = full;
+		++refreshes_;
+
+		return true;
+	}
+
+	bool incremental_query::advance_watermark(const size_t& column)
+	{
+		// Every row carries the same max; it is past $1 by construction.
+		if (delta_.rows() == 0 || delta_.is_null(0, column))
+		{
+			return false;
+		}
+
+		watermark_.assign(delta_.text(0, column));
+		return true;
+	}
+
+	void incremental_query::merge(const size_t& key_column, const size_t& columns)
+	{
+		if (rows_.columns() != columns)
+		{
+			rows_.reset(columns);
+			index_.clear();
+			for (size_t column = 0; column < columns; ++column)
+			{
+				rows_.set_column_name(column, delta_.column_name(column));
+			}
+		}
+
+		// The last fetched row wins when a key repeats.
+		latest_.clear();
+		bool replaced = false;
+		for (size_t row = 0; row < delta_.rows(); ++row)
+		{
+			std::string key(delta_.text(row, key_column));
+			replaced = replaced || index_.count(key) != 0;
+			latest_[std::move(key)] = row;
+		}
+
+		if (!replaced)
+		{
+			// Only new keys: append them in place.
+			for (size_t row = 0; row < delta_.rows(); ++row)
+			{
+				std::string key(delta_.text(row, key_column));
+				if (latest_[key] == row)
+				{
+					index_.emplace(std::move(key), rows_.rows());
+					rows_.append_row(delta_, row);
+				}
+			}
+			return;
+		}
+
+		// Some keys changed: rebuild without their old rows, then append
+		// the fetched rows.
+		spare_.reset(rows_.columns());
+		for (size_t column = 0; column < rows_.columns(); ++column)
+		{
+			spare_.set_column_name(column, rows_.column_name(column));
+		}
+
+		index_.clear();
+		for (size_t row = 0; row < rows_.rows(); ++row)
+		{
+			std::string key(rows_.text(row, key_column));
+			if (latest_.count(key) != 0)
+			{
+				continue;
+			}
+			index_.emplace(std::move(key), spare_.rows());
+			spare_.append_row(rows_, row);
+		}
+		for (size_t row = 0; row < delta_.rows(); ++row)
+		{
+			std::string key(delta_.text(row, key_column));
+			if (latest_[key] == row)
+			{
+				index_.emplace(std::move(key), spare_.rows());
+				spare_.append_row(delta_, row);
+			}
+		}
+
+		rows_.swap(spare_);
+	}
+} // namespace database
@@ -0,0 +1,154 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+
+#include "result_buffer.h"
+
+namespace database
+{
+	class postgres_manager;
+
+	/**
+	 * @class incremental_query
+	 * @brief Keeps the result of a query over a mostly appended or updated
+	 *        table current by fetching only rows past a high-water mark.
+	 *
+	 * The query selects rows whose watermark column (an @c updated_at
+	 * timestamp or a growing id) is greater than @c $1, for example
+	 * @code
+	 * SELECT id, status, updated_at FROM orders WHERE updated_at > $1
+	 * @endcode
+	 * The first refresh binds the initial watermark and loads everything;
+	 * later refreshes bind the largest watermark seen so far and merge the
+	 * returned rows into the kept result by key, replacing rows whose key
+	 * is already present and appending the rest.
+	 *
+	 * The next watermark is the largest value of the watermark column,
+	 * taken by the server in the column's own type along with the rows,
+	 * so numeric, @c timestamptz and other non-integer columns order as
+	 * they do in the query.
+	 *
+	 * A watermark query cannot see deleted rows, nor rows committed after
+	 * a later watermark value was already read (a long transaction that
+	 * stamped @c updated_at before a shorter one committed). Use
+	 * @c set_full_refresh_interval to reload the whole result every few
+	 * refreshes when either matters.
+	 */
+	class incremental_query
+	{
+	public:
+		/**
+		 * @param name              Prepared statement name, unique per
+		 *                          connection.
+		 * @param query_string      SQL with one @c $1 placeholder compared
+		 *                          against the watermark column.
+		 * @param key_column        Column that identifies a row.
+		 * @param watermark_column  Column whose largest value is the next
+		 *                          @c $1; may equal @p key_column.
+		 * @param initial_watermark Value bound for a full load, e.g.
+		 *                          "-infinity" or "0".
+		 */
+		incremental_query(const std::string& name,
+						  const std::string& query_string,
+						  const std::string& key_column,
+						  const std::string& watermark_column,
+						  const std::string& initial_watermark);
+		virtual ~incremental_query(void);
+
+		/**
+		 * @brief Fetches rows past the watermark on @p connection and merges
+		 *        them into @c rows().
+		 *
+		 * @return @c false if the statement failed or the key or watermark
+		 *         column is missing; the kept result is left unchanged.
+		 */
+		bool refresh(postgres_manager& connection);
+
+		/**
+		 * @brief Reloads the whole result on every @p refreshes-th refresh;
+		 *        0 (the default) only loads it on the first.
+		 */
+		void set_full_refresh_interval(const uint64_t& refreshes);
+
+		/**
+		 * @brief Makes the next refresh a full load.
+		 */
+		void invalidate(void);
+
+		/**
+		 * @brief The merged result. Row order is not meaningful once rows
+		 *        have been replaced.
+		 */
+		const result_buffer& rows(void) const { return rows_; }
+
+		const std::string& watermark(void) const { return watermark_; }
+
+		/**
+		 * @brief Rows returned by the server on the last refresh.
+		 */
+		size_t fetched_rows(void) const { return delta_.rows(); }
+
+		/**
+		 * @brief @c true if the last refresh reloaded the whole result.
+		 */
+		bool last_refresh_was_full(void) const { return last_full_; }
+
+	private:
+		bool advance_watermark(const size_t& column);
+		void merge(const size_t& key_column, const size_t& columns);
+
+	private:
+		std::string name_;
+		std::string query_string_; ///< The query with its max watermark added.
+		std::string key_column_;
+		std::string watermark_column_;
+		std::string initial_watermark_;
+
+		std::string watermark_;
+		bool loaded_;
+		bool last_full_;
+		uint64_t refreshes_;
+		uint64_t full_refresh_interval_;
+
+		result_buffer rows_;  ///< The kept result.
+		result_buffer delta_; ///< Rows from the last statement.
+		result_buffer spare_; ///< Rebuild target when rows are replaced.
+		std::unordered_map<std::string, size_t> index_; ///< Key to row of @c rows_.
+		std::unordered_map<std::string, size_t> latest_; ///< Key to last row of @c delta_.
+	};
+} // namespace database
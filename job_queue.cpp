@@ -0,0 +1,347 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+
+#include "database/job_queue.h"
+
+#include <algorithm>
+#include <array>
+
+namespace database
+{
+	namespace
+	{
+		// Array literal of text elements, each quoted.
+		std::string text_array(std::span<const std::string> values)
+		{
+			std::string literal = "{";
+			for (const std::string& value : values)
+			{
+				literal += literal.size() > 1 ? ",\"" : "\"";
+				for (const char& c : value)
+				{
+					if (c == '"' || c == '\\')
+					{
+						literal.push_back('\\');
+					}
+					literal.push_back(c);
+				}
+				literal.push_back('"');
+			}
+			literal.push_back('}');
+			return literal;
+		}
+
+		// Array literals of the ids and attempts of @p jobs.
+		void lease_arrays(std::span<const job> jobs, std::string& ids, std::string& attempts)
+		{
+			ids = "{";
+			attempts = "{";
+			for (const job& item : jobs)
+			{
+				if (ids.size() > 1)
+				{
+					ids.push_back(',');
+					attempts.push_back(',');
+				}
+				ids += std::to_string(item.id);
+				attempts += std::to_string(item.attempts);
+			}
+			ids.push_back('}');
+			attempts.push_back('}');
+		}
+
+		// One field of COPY text format.
+		void append_copy_field(std::string& output, const std::string& value)
+		{
+			for (const char& c : value)
+			{
+				switch (c)
+				{
+				case '\\':
+					output += "\\\\";
+					break;
+				case '\n':
+					output += "\\n";
+					break;
+				case '\r':
+					output += "\\r";
+					break;
+				case '\t':
+					output += "\\t";
+					break;
+				default:
+					output.push_back(c);
+					break;
+				}
+			}
+		}
+	} // namespace
+
+	job_queue::job_queue(const std::string& name, const job_queue_options& options)
+		: name_(name), options_(options)
+	{
+		// An index name cannot be schema-qualified; it lives in the
+		// table's schema anyway.
+		const size_t dot = options_.table.rfind('.');
+		index_name_ = (dot == std::string::npos ? options_.table : options_.table.substr(dot + 1)) + "_ready";
+	}
+
+	job_queue::~job_queue(void) {}
+
+	bool job_queue::install(postgres_manager& connection)
+	{
+		return connection.create_query("CREATE TABLE IF NOT EXISTS " + options_.table
+									   + " (id bigserial PRIMARY KEY, queue text NOT NULL, payload text NOT NULL, "
+										 "visible_at timestamptz NOT NULL DEFAULT now(), "
+										 "attempts int4 NOT NULL DEFAULT 0)")
+			   && connection.create_query("CREATE INDEX IF NOT EXISTS " + index_name_ + " ON " + options_.table
+										  + " (queue, visible_at, id)");
+	}
+
+	bool job_queue::enqueue(postgres_manager& connection, std::span<const std::string> payloads, uint64_t& enqueued)
+	{
+		enqueued = 0;
+		if (payloads.empty())
+		{
+			return true;
+		}
+
+		result_buffer result;
+		if (payloads.size() <= options_.copy_rows)
+		{
+			// The insert and the notification share one statement, so
+			// consumers cannot wake before the jobs are visible.
+			if (!prepare(connection, "_enqueue",
+						 "WITH added AS (INSERT INTO " + options_.table
+							 + " (queue, payload) SELECT $1::text, unnest($2::text[]) RETURNING 1) "
+							   "SELECT count(*), pg_notify($3::text, $1::text) FROM added"))
+			{
+				return false;
+			}
+
+			const std::string array = text_array(payloads);
+			const std::array<const char*, 3> parameters
+				= { options_.queue.c_str(), array.c_str(), options_.table.c_str() };
+			if (!connection.execute_prepared(name_ + "_enqueue", parameters, result) || result.rows() == 0)
+			{
+				return false;
+			}
+			enqueued = static_cast<uint64_t>(result.integer(0, 0));
+
+			return true;
+		}
+
+		std::string data;
+		for (const std::string& payload : payloads)
+		{
+			append_copy_field(data, options_.queue);
+			data.push_back('\t');
+			append_copy_field(data, payload);
+			data.push_back('\n');
+		}
+		if (!connection.copy_in("COPY " + options_.table + " (queue, payload) FROM STDIN", data, enqueued))
+		{
+			return false;
+		}
+
+		if (!prepare(connection, "_notify", "SELECT pg_notify($1::text, $2::text)"))
+		{
+			return false;
+		}
+		const std::array<const char*, 2> parameters = { options_.table.c_str(), options_.queue.c_str() };
+		return connection.execute_prepared(name_ + "_notify", parameters, result);
+	}
+
+	bool job_queue::dequeue(postgres_manager& connection, const size_t& count, std::vector<job>& jobs)
+	{
+		jobs.clear();
+		if (!prepare(connection, "_dequeue",
+					 "WITH next AS (SELECT id FROM " + options_.table
+						 + " WHERE queue = $1::text AND visible_at <= now() ORDER BY visible_at, id "
+						   "LIMIT $2::int8 FOR UPDATE SKIP LOCKED) "
+						   "UPDATE "
+						 + options_.table
+						 + " AS j SET visible_at = now() + $3::int8 * interval '1 millisecond', "
+						   "attempts = j.attempts + 1 FROM next WHERE j.id = next.id "
+						   "RETURNING j.id, j.attempts, j.payload"))
+		{
+			return false;
+		}
+
+		const std::string limit = std::to_string(count);
+		const std::string timeout = std::to_string(options_.visibility_timeout.count());
+		const std::array<const char*, 3> parameters = { options_.queue.c_str(), limit.c_str(), timeout.c_str() };
+		result_buffer result;
+		if (!connection.execute_prepared(name_ + "_dequeue", parameters, result))
+		{
+			return false;
+		}
+
+		jobs.reserve(result.rows());
+		for (size_t row = 0; row < result.rows(); ++row)
+		{
+			jobs.push_back({ result.integer(row, 0), static_cast<int32_t>(result.integer(row, 1)),
+							 std::string(result.text(row, 2)) });
+		}
+		// RETURNING keeps no order.
+		std::sort(jobs.begin(), jobs.end(), [](const job& left, const job& right) { return left.id < right.id; });
+
+		return true;
+	}
+
+	bool job_queue::wait_dequeue(postgres_manager& connection,
+								 const size_t& count,
+								 const std::chrono::milliseconds& timeout,
+								 std::vector<job>& jobs)
+	{
+		const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+		// Listening before the first look means no enqueue can slip in
+		// between an empty dequeue and the wait.
+		if (!connection.is_listening(channel()) && !connection.listen(channel()))
+		{
+			return false;
+		}
+
+		for (;;)
+		{
+			if (!dequeue(connection, count, jobs))
+			{
+				return false;
+			}
+			if (!jobs.empty())
+			{
+				return true;
+			}
+
+			const auto remaining
+				= std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			if (remaining.count() <= 0)
+			{
+				return false;
+			}
+
+			// Notifications for other channels or queues stay with the
+			// connection for whoever waits for them.
+			const auto ours = [this](std::string_view notified, std::string_view payload) {
+				return notified == channel() && payload == options_.queue;
+			};
+			std::string notified;
+			std::string payload;
+			if (!connection.wait_notification(std::min(remaining, options_.recheck_interval), ours,
+											  notified, payload))
+			{
+				if (remaining <= options_.recheck_interval)
+				{
+					return false;
+				}
+				continue;
+			}
+			// Later notifications are covered by the same look.
+			while (connection.wait_notification(std::chrono::milliseconds(0), ours, notified, payload))
+			{
+			}
+		}
+	}
+
+	bool job_queue::complete(postgres_manager& connection, std::span<const job> jobs, uint64_t& completed)
+	{
+		completed = 0;
+		if (jobs.empty())
+		{
+			return true;
+		}
+
+		if (!prepare(connection, "_complete",
+					 "DELETE FROM " + options_.table
+						 + " AS j USING unnest($1::int8[], $2::int4[]) AS done(id, attempts) "
+						   "WHERE j.id = done.id AND j.attempts = done.attempts"))
+		{
+			return false;
+		}
+
+		std::string ids;
+		std::string attempts;
+		lease_arrays(jobs, ids, attempts);
+		const std::array<const char*, 2> parameters = { ids.c_str(), attempts.c_str() };
+		result_buffer result;
+		if (!connection.execute_prepared(name_ + "_complete", parameters, result))
+		{
+			return false;
+		}
+		completed = result.affected_rows();
+
+		return true;
+	}
+
+	bool job_queue::defer(postgres_manager& connection,
+						  std::span<const job> jobs,
+						  const std::chrono::milliseconds& delay,
+						  uint64_t& deferred)
+	{
+		deferred = 0;
+		if (jobs.empty())
+		{
+			return true;
+		}
+
+		if (!prepare(connection, "_defer",
+					 "UPDATE " + options_.table
+						 + " AS j SET visible_at = now() + $3::int8 * interval '1 millisecond' "
+						   "FROM unnest($1::int8[], $2::int4[]) AS leased(id, attempts) "
+						   "WHERE j.id = leased.id AND j.attempts = leased.attempts"))
+		{
+			return false;
+		}
+
+		std::string ids;
+		std::string attempts;
+		lease_arrays(jobs, ids, attempts);
+		const std::string milliseconds = std::to_string(delay.count());
+		const std::array<const char*, 3> parameters = { ids.c_str(), attempts.c_str(), milliseconds.c_str() };
+		result_buffer result;
+		if (!connection.execute_prepared(name_ + "_defer", parameters, result))
+		{
+			return false;
+		}
+		deferred = result.affected_rows();
+
+		return true;
+	}
+
+	bool job_queue::prepare(postgres_manager& connection, const std::string& suffix, const std::string& statement)
+	{
+		const std::string name = name_ + suffix;
+		return connection.is_prepared(name) || connection.prepare(name, statement);
+	}
+} // namespace database
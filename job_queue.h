@@ -0,0 +1,185 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "postgres_manager.h"
+#include "result_buffer.h"
+
+namespace database
+{
+	/**
+	 * @brief Where a @c job_queue keeps its jobs and how long they stay
+	 *        leased.
+	 */
+	struct job_queue_options
+	{
+		std::string table = "job_queue"; ///< Job table, as written in SQL.
+		std::string queue = "default"; ///< Jobs of other queues in the table are not seen.
+		std::chrono::milliseconds visibility_timeout{ 30000 }; ///< Lease of a dequeued job.
+		std::chrono::milliseconds recheck_interval{ 5000 }; ///< Longest wait without a notification.
+		size_t copy_rows = 1000; ///< Larger enqueues use COPY.
+	};
+
+	/**
+	 * @brief A leased job. @c attempts identifies the lease: acks for an
+	 *        earlier lease of the same job are ignored.
+	 */
+	struct job
+	{
+		int64_t id = 0;
+		int32_t attempts = 0;
+		std::string payload;
+	};
+
+	/**
+	 * @class job_queue
+	 * @brief Durable job queue in a PostgreSQL table, dequeued with
+	 *        @c FOR @c UPDATE @c SKIP @c LOCKED.
+	 *
+	 * @c install creates
+	 * @code
+	 * CREATE TABLE job_queue (id bigserial PRIMARY KEY, queue text NOT NULL,
+	 *     payload text NOT NULL, visible_at timestamptz NOT NULL DEFAULT now(),
+	 *     attempts int4 NOT NULL DEFAULT 0);
+	 * CREATE INDEX job_queue_ready ON job_queue (queue, visible_at, id);
+	 * @endcode
+	 * and every other call is one prepared statement, prepared once per
+	 * connection.
+	 *
+	 * @c enqueue adds a batch of jobs with one statement, or with @c COPY
+	 * for more than @c copy_rows, and notifies the table's channel with
+	 * the queue name. @c dequeue leases up to @c n ready jobs in one
+	 * round trip: concurrent consumers skip each other's locked rows
+	 * instead of waiting, and each taken job becomes invisible for
+	 * @c visibility_timeout and counts an attempt. A job that is not
+	 * acked by then is handed out again, so a consumer that dies loses
+	 * no work. @c complete deletes a batch of finished jobs, and @c defer
+	 * puts jobs back for a retry or extends their lease.
+	 *
+	 * @c wait_dequeue sleeps on @c LISTEN while the queue is empty, so
+	 * idle consumers cost the server nothing. Jobs whose lease ran out or
+	 * that were deferred send no notification; they are picked up within
+	 * @c recheck_interval.
+	 *
+	 * Outside a transaction block every call commits on its own. The
+	 * object holds no connection state, so one queue can be shared by
+	 * threads that each use their own connection.
+	 */
+	class job_queue
+	{
+	public:
+		/**
+		 * @param name Prefix for the prepared statements, unique per
+		 *             connection.
+		 */
+		job_queue(const std::string& name, const job_queue_options& options);
+		virtual ~job_queue(void);
+
+		/**
+		 * @brief Creates the job table and its index if they do not
+		 *        exist.
+		 */
+		bool install(postgres_manager& connection);
+
+		/**
+		 * @brief Adds one job per payload and wakes waiting consumers.
+		 *
+		 * @param payloads Text in the client encoding.
+		 * @param enqueued Receives the number of jobs added.
+		 */
+		bool enqueue(postgres_manager& connection, std::span<const std::string> payloads, uint64_t& enqueued);
+
+		/**
+		 * @brief Leases up to @p count ready jobs, oldest first.
+		 *
+		 * @param jobs Replaced with the leased jobs; empty if none is
+		 *        ready.
+		 * @return @c false if the statement failed.
+		 */
+		bool dequeue(postgres_manager& connection, const size_t& count, std::vector<job>& jobs);
+
+		/**
+		 * @brief Like @c dequeue, but waits up to @p timeout for jobs to
+		 *        become ready.
+		 *
+		 * Only notifications for this queue are taken from the
+		 * connection; others stay for other waiters on it.
+		 *
+		 * @return @c true if at least one job was leased.
+		 */
+		bool wait_dequeue(postgres_manager& connection,
+						  const size_t& count,
+						  const std::chrono::milliseconds& timeout,
+						  std::vector<job>& jobs);
+
+		/**
+		 * @brief Deletes finished jobs with one statement.
+		 *
+		 * @param completed Receives the number of jobs deleted; jobs whose
+		 *        lease has since passed to another consumer are skipped.
+		 */
+		bool complete(postgres_manager& connection, std::span<const job> jobs, uint64_t& completed);
+
+		/**
+		 * @brief Makes leased jobs visible again after @p delay: zero
+		 *        hands them out again at once, a longer delay retries
+		 *        later or extends the lease of jobs still being worked on.
+		 *
+		 * @param deferred Receives the number of jobs changed.
+		 */
+		bool defer(postgres_manager& connection,
+				   std::span<const job> jobs,
+				   const std::chrono::milliseconds& delay,
+				   uint64_t& deferred);
+
+		/**
+		 * @brief Channel notified on enqueue; the table name.
+		 */
+		const std::string& channel(void) const { return options_.table; }
+
+	private:
+		bool prepare(postgres_manager& connection, const std::string& suffix, const std::string& statement);
+
+	private:
+		std::string name_;
+		job_queue_options options_;
+		std::string index_name_;
+	};
+} // namespace database
@@ -0,0 +1,240 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/latency_histogram.h"
+
+namespace database
+{
+	namespace
+	{
+		size_t highest_bit(const uint64_t& value)
+		{
+			size_t bit = 0;
+			uint64_t remaining = value;
+			while (remaining >>= 1)
+			{
+				++bit;
+			}
+
+			return bit;
+		}
+	} // namespace
+
+	latency_histogram::latency_histogram(void)
+		: total_count_(0), sum_(0), max_(0)
+	{
+		for (auto& count : counts_)
+		{
+			count.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	size_t latency_histogram::bucket_index(const uint64_t& value)
+	{
+		if (value < sub_bucket_count)
+		{
+			return static_cast<size_t>(value);
+		}
+
+		const size_t magnitude = highest_bit(value);
+		if (magnitude > max_magnitude)
+		{
+			return bucket_count - 1;
+		}
+
+		const size_t shift = magnitude - sub_bucket_bits;
+		const size_t sub_bucket = static_cast<size_t>(value >> shift) & (sub_bucket_count - 1);
+
+		return (magnitude - sub_bucket_bits + 1) * sub_bucket_count + sub_bucket;
+	}
+
+	uint64_t latency_histogram::bucket_upper_bound(const size_t& index)
+	{
+		if (index < sub_bucket_count)
+		{
+			return index;
+		}
+
+		const size_t magnitude = index / sub_bucket_count + sub_bucket_bits - 1;
+		const size_t sub_bucket = index % sub_bucket_count;
+		const size_t shift = magnitude - sub_bucket_bits;
+		const uint64_t lower = (static_cast<uint64_t>(sub_bucket_count + sub_bucket)) << shift;
+
+		return lower + ((uint64_t{ 1 } << shift) - 1);
+	}
+
+	void latency_histogram::record(const uint64_t& value, const uint64_t& count)
+	{
+		if (count == 0)
+		{
+			return;
+		}
+
+		counts_[bucket_index(value)].fetch_add(count, std::memory_order_relaxed);
+		total_count_.fetch_add(count, std::memory_order_relaxed);
+		sum_.fetch_add(value * count, std::memory_order_relaxed);
+
+		uint64_t current = max_.load(std::memory_order_relaxed);
+		while (value > current
+			   && !max_.compare_exchange_weak(current, value, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	void latency_histogram::record_corrected(const uint64_t& value,
+											 const uint64_t& expected_interval)
+	{
+		record(value);
+
+		if (expected_interval == 0 || value <= expected_interval)
+		{
+			return;
+		}
+
+		for (uint64_t missing = value - expected_interval; missing >= expected_interval;
+			 missing -= expected_interval)
+		{
+			record(missing);
+		}
+	}
+
+	void latency_histogram::reset(void)
+	{
+		for (auto& count : counts_)
+		{
+			count.store(0, std::memory_order_relaxed);
+		}
+		total_count_.store(0, std::memory_order_relaxed);
+		sum_.store(0, std::memory_order_relaxed);
+		max_.store(0, std::memory_order_relaxed);
+	}
+
+	void latency_histogram::merge(const latency_histogram& other)
+	{
+		for (size_t index = 0; index < bucket_count; ++index)
+		{
+			const uint64_t count = other.counts_[index].load(std::memory_order_relaxed);
+			if (count != 0)
+			{
+				counts_[index].fetch_add(count, std::memory_order_relaxed);
+			}
+		}
+		total_count_.fetch_add(other.count(), std::memory_order_relaxed);
+		sum_.fetch_add(other.sum(), std::memory_order_relaxed);
+
+		const uint64_t other_max = other.max();
+		uint64_t current = max_.load(std::memory_order_relaxed);
+		while (other_max > current
+			   && !max_.compare_exchange_weak(current, other_max, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	uint64_t latency_histogram::count(void) const
+	{
+		return total_count_.load(std::memory_order_relaxed);
+	}
+
+	uint64_t latency_histogram::sum(void) const
+	{
+		return sum_.load(std::memory_order_relaxed);
+	}
+
+	uint64_t latency_histogram::max(void) const
+	{
+		return max_.load(std::memory_order_relaxed);
+	}
+
+	uint64_t latency_histogram::value_at_quantile(const double& quantile) const
+	{
+		uint64_t total = 0;
+		for (const auto& count : counts_)
+		{
+			total += count.load(std::memory_order_relaxed);
+		}
+
+		if (total == 0)
+		{
+			return 0;
+		}
+
+		const double clamped = quantile < 0.0 ? 0.0 : (quantile > 1.0 ? 1.0 : quantile);
+		uint64_t rank = static_cast<uint64_t>(clamped * static_cast<double>(total) + 0.5);
+		if (rank == 0)
+		{
+			rank = 1;
+		}
+
+		uint64_t seen = 0;
+		for (size_t index = 0; index < bucket_count; ++index)
+		{
+			seen += counts_[index].load(std::memory_order_relaxed);
+			if (seen >= rank)
+			{
+				const uint64_t bound = bucket_upper_bound(index);
+				const uint64_t observed_max = max();
+
+				return (observed_max != 0 && observed_max < bound) ? observed_max : bound;
+			}
+		}
+
+		return max();
+	}
+
+	uint64_t latency_histogram::count_at_or_below(const uint64_t& value) const
+	{
+		const size_t last = bucket_index(value);
+
+		uint64_t total = 0;
+		for (size_t index = 0; index <= last; ++index)
+		{
+			total += counts_[index].load(std::memory_order_relaxed);
+		}
+
+		return total;
+	}
+
+	latency_histogram::snapshot_data latency_histogram::snapshot(void) const
+	{
+		snapshot_data data;
+		data.counts.resize(bucket_count);
+		for (size_t index = 0; index < bucket_count; ++index)
+		{
+			data.counts[index] = counts_[index].load(std::memory_order_relaxed);
+			data.total_count += data.counts[index];
+		}
+		data.sum = sum();
+		data.max = max();
+
+		return data;
+	}
+} // namespace database
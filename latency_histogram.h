@@ -0,0 +1,133 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+namespace database
+{
+	/**
+	 * @class latency_histogram
+	 * @brief Lock-free, log-linear histogram of durations in nanoseconds.
+	 *
+	 * Every power of two is split into eight linear sub-buckets, which keeps
+	 * the relative error of any reported value under 12.5% across the whole
+	 * range from 1 ns to roughly 39 hours. Recording is a pair of relaxed
+	 * atomic increments, so one histogram can be shared by all threads.
+	 */
+	class latency_histogram
+	{
+	public:
+		static constexpr size_t sub_bucket_bits = 3;
+		static constexpr size_t sub_bucket_count = size_t{ 1 } << sub_bucket_bits;
+		static constexpr size_t max_magnitude = 47;
+		static constexpr size_t bucket_count
+			= (max_magnitude - sub_bucket_bits + 2) * sub_bucket_count;
+
+		/**
+		 * @struct snapshot_data
+		 * @brief A point-in-time copy of the histogram.
+		 */
+		struct snapshot_data
+		{
+			std::vector<uint64_t> counts;
+			uint64_t total_count = 0;
+			uint64_t sum = 0;
+			uint64_t max = 0;
+		};
+
+		latency_histogram(void);
+
+		latency_histogram(const latency_histogram&) = delete;
+		latency_histogram& operator=(const latency_histogram&) = delete;
+
+		/**
+		 * @brief Records @p count occurrences of @p value nanoseconds.
+		 */
+		void record(const uint64_t& value, const uint64_t& count = 1);
+
+		/**
+		 * @brief Records @p value and back-fills the samples a paced load
+		 *        generator would have taken while it was stalled.
+		 *
+		 * When a request that should have been issued every
+		 * @p expected_interval nanoseconds takes longer than that, the
+		 * requests that were never sent are recorded as
+		 * @c value - interval, @c value - 2 * interval and so on. This
+		 * corrects closed-loop measurements for coordinated omission.
+		 */
+		void record_corrected(const uint64_t& value, const uint64_t& expected_interval);
+
+		/**
+		 * @brief Clears every bucket.
+		 */
+		void reset(void);
+
+		/**
+		 * @brief Adds every sample of @p other into this histogram.
+		 */
+		void merge(const latency_histogram& other);
+
+		uint64_t count(void) const;
+		uint64_t sum(void) const;
+		uint64_t max(void) const;
+
+		/**
+		 * @brief Returns the value at quantile @p quantile (0..1).
+		 *
+		 * The returned value is the upper bound of the bucket that holds the
+		 * requested rank, so it never understates the true latency.
+		 */
+		uint64_t value_at_quantile(const double& quantile) const;
+
+		/**
+		 * @brief Returns how many samples are less than or equal to
+		 *        @p value, rounded to bucket granularity.
+		 */
+		uint64_t count_at_or_below(const uint64_t& value) const;
+
+		snapshot_data snapshot(void) const;
+
+		static size_t bucket_index(const uint64_t& value);
+		static uint64_t bucket_upper_bound(const size_t& index);
+
+	private:
+		std::array<std::atomic<uint64_t>, bucket_count> counts_;
+		std::atomic<uint64_t> total_count_;
+		std::atomic<uint64_t> sum_;
+		std::atomic<uint64_t> max_;
+	};
+} // namespace database
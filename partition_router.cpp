@@ -0,0 +1,731 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/partition_router.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace database
+{
+	namespace
+	{
+		constexpr size_t no_partition = SIZE_MAX;
+
+		constexpr const char* key_statement
+			= "SELECT pt.partstrat::text, pt.partnatts, t.typname::text "
+			  "FROM pg_partitioned_table pt "
+			  "LEFT JOIN pg_attribute a ON a.attrelid = pt.partrelid AND a.attnum = pt.partattrs[0] "
+			  "LEFT JOIN pg_type t ON t.oid = a.atttypid "
+			  "WHERE pt.partrelid = $1::regclass";
+
+		constexpr const char* bounds_statement
+			= "SELECT c.oid::regclass::text, pg_get_expr(c.relpartbound, c.oid) "
+			  "FROM pg_inherits i JOIN pg_class c ON c.oid = i.inhrelid "
+			  "WHERE i.inhparent = $1::regclass";
+
+		// Attaching or detaching a partition changes pg_inherits, and
+		// altering one rewrites its pg_class row, which gets a new xmin.
+		constexpr const char* version_statement
+			= "SELECT count(*)::text || ':' || coalesce(sum(c.oid::int8), 0)::text || ':' "
+			  "|| coalesce(sum(c.xmin::text::int8), 0)::text "
+			  "FROM pg_inherits i JOIN pg_class c ON c.oid = i.inhrelid "
+			  "WHERE i.inhparent = $1::regclass";
+
+		/**
+		 * A partition that no longer takes its rows: they fail its
+		 * constraint, or it was dropped.
+		 */
+		bool is_routing_error(const std::string& state)
+		{
+			return state == "23514" || state == "42P01";
+		}
+
+		std::string_view trim(std::string_view text)
+		{
+			while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+			{
+				text.remove_prefix(1);
+			}
+			while (!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+			{
+				text.remove_suffix(1);
+			}
+			return text;
+		}
+
+		bool consume(std::string_view& text, std::string_view prefix)
+		{
+			text = trim(text);
+			if (text.substr(0, prefix.size()) != prefix)
+			{
+				return false;
+			}
+			text.remove_prefix(prefix.size());
+			return true;
+		}
+
+		struct literal
+		{
+			std::string value;
+			bool quoted = false;
+		};
+
+		/**
+		 * Reads a parenthesized list of constants as pg_get_expr prints
+		 * them: quoted strings with doubled quotes, or bare numbers and
+		 * keywords. A cast suffix is skipped.
+		 */
+		bool read_list(std::string_view& text, std::vector<literal>& values)
+		{
+			values.clear();
+			if (!consume(text, "("))
+			{
+				return false;
+			}
+
+			for (;;)
+			{
+				text = trim(text);
+				literal value;
+				if (!text.empty() && text.front() == '\'')
+				{
+					value.quoted = true;
+					size_t index = 1;
+					for (; index < text.size(); ++index)
+					{
+						if (text[index] != '\'')
+						{
+							value.value.push_back(text[index]);
+						}
+						else if (index + 1 < text.size() && text[index + 1] == '\'')
+						{
+							value.value.push_back('\'');
+							++index;
+						}
+						else
+						{
+							break;
+						}
+					}
+					if (index >= text.size())
+					{
+						return false;
+					}
+					text.remove_prefix(index + 1);
+				}
+				const size_t end = text.find_first_of(",)");
+				if (end == std::string_view::npos)
+				{
+					return false;
+				}
+				if (!value.quoted)
+				{
+					value.value.assign(trim(text.substr(0, end)));
+				}
+				values.push_back(std::move(value));
+
+				const char separator = text[end];
+				text.remove_prefix(end + 1);
+				if (separator == ')')
+				{
+					return true;
+				}
+			}
+		}
+
+		int64_t days_from_civil(int64_t year, const int64_t& month, const int64_t& day)
+		{
+			year -= month <= 2 ? 1 : 0;
+			const int64_t era = (year >= 0 ? year : year - 399) / 400;
+			const int64_t year_of_era = year - era * 400;
+			const int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+			const int64_t day_of_era
+				= year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+			return era * 146097 + day_of_era - 719468;
+		}
+
+		bool read_number(std::string_view& text, const size_t& digits, int64_t& value)
+		{
+			if (text.size() < digits)
+			{
+				return false;
+			}
+			const auto [end, error] = std::from_chars(text.data(), text.data() + digits, value);
+			if (error != std::errc() || end != text.data() + digits)
+			{
+				return false;
+			}
+			text.remove_prefix(digits);
+			return true;
+		}
+
+		/**
+		 * Parses "YYYY-MM-DD[( |T)HH:MM[:SS[.ffffff]]][Z|(+|-)HH[:MM]]"
+		 * into microseconds since 1970-01-01 UTC.
+		 */
+		bool parse_time(std::string_view text, int64_t& micros)
+		{
+			text = trim(text);
+			if (text == "infinity")
+			{
+				micros = INT64_MAX;
+				return true;
+			}
+			if (text == "-infinity")
+			{
+				micros = INT64_MIN;
+				return true;
+			}
+
+			int64_t year = 0;
+			int64_t month = 0;
+			int64_t day = 0;
+			if (!read_number(text, 4, year) || !consume(text, "-") || !read_number(text, 2, month)
+				|| !consume(text, "-") || !read_number(text, 2, day) || month < 1 || month > 12
+				|| day < 1 || day > 31)
+			{
+				return false;
+			}
+
+			int64_t hour = 0;
+			int64_t minute = 0;
+			int64_t second = 0;
+			int64_t fraction = 0;
+			if (!text.empty() && (text.front() == ' ' || text.front() == 'T'))
+			{
+				text.remove_prefix(1);
+				if (!read_number(text, 2, hour) || !consume(text, ":") || !read_number(text, 2, minute))
+				{
+					return false;
+				}
+				if (!text.empty() && text.front() == ':'
+					&& (text.remove_prefix(1), !read_number(text, 2, second)))
+				{
+					return false;
+				}
+				if (!text.empty() && text.front() == '.')
+				{
+					text.remove_prefix(1);
+					size_t digits = 0;
+					while (digits < text.size() && text[digits] >= '0' && text[digits] <= '9')
+					{
+						++digits;
+					}
+					if (digits == 0)
+					{
+						return false;
+					}
+					for (size_t index = 0; index < 6; ++index)
+					{
+						fraction = fraction * 10 + (index < digits ? text[index] - '0' : 0);
+					}
+					text.remove_prefix(digits);
+				}
+			}
+
+			int64_t offset_seconds = 0;
+			if (text == "Z")
+			{
+				text.remove_prefix(1);
+			}
+			else if (!text.empty() && (text.front() == '+' || text.front() == '-'))
+			{
+				const int64_t sign = text.front() == '-' ? -1 : 1;
+				text.remove_prefix(1);
+				int64_t offset_hours = 0;
+				int64_t offset_minutes = 0;
+				if (!read_number(text, 2, offset_hours))
+				{
+					return false;
+				}
+				if (!text.empty() && text.front() == ':')
+				{
+					text.remove_prefix(1);
+				}
+				if (!text.empty() && !read_number(text, 2, offset_minutes))
+				{
+					return false;
+				}
+				offset_seconds = sign * (offset_hours * 3600 + offset_minutes * 60);
+			}
+			if (!text.empty())
+			{
+				return false;
+			}
+
+			const int64_t seconds
+				= days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+			micros = (seconds - offset_seconds) * 1000000 + fraction;
+			return true;
+		}
+	} // namespace
+
+	partition_router::partition_router(const std::string& name, const std::string& table)
+		: name_(name)
+		, table_(table)
+		, stale_(true)
+		, kind_(key_kind::unsupported)
+		, default_partition_(no_partition)
+	{
+	}
+
+	partition_router::~partition_router(void) {}
+
+	void partition_router::invalidate(void) { stale_ = true; }
+
+	bool partition_router::prepare(postgres_manager& connection)
+	{
+		const std::pair<std::string, const char*> statements[]
+			= { { name_ + "_key", key_statement },
+				{ name_ + "_bounds", bounds_statement },
+				{ name_ + "_version", version_statement } };
+		for (const auto& [name, statement] : statements)
+		{
+			if (!connection.is_prepared(name) && !connection.prepare(name, statement))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool partition_router::catalog_version(postgres_manager& connection, std::string& version)
+	{
+		const std::array<const char*, 1> parameters = { table_.c_str() };
+		if (!connection.execute_prepared(name_ + "_version", parameters, catalog_)
+			|| catalog_.rows() != 1)
+		{
+			return false;
+		}
+		version.assign(catalog_.text(0, 0));
+		return true;
+	}
+
+	bool partition_router::load(postgres_manager& connection)
+	{
+		std::string version;
+		if (!prepare(connection) || !catalog_version(connection, version))
+		{
+			return false;
+		}
+
+		const std::array<const char*, 1> parameters = { table_.c_str() };
+		if (!connection.execute_prepared(name_ + "_key", parameters, catalog_))
+		{
+			return false;
+		}
+		if (catalog_.rows() != 1)
+		{
+			// Not partitioned: everything goes to the table itself.
+			set_bounds("", "", {});
+			version_ = version;
+			stale_ = false;
+			return false;
+		}
+
+		const std::string strategy(catalog_.text(0, 0));
+		// Only single-column keys on a plain column are routed.
+		const std::string key_type = catalog_.text(0, 1) == "1" && !catalog_.is_null(0, 2)
+										 ? std::string(catalog_.text(0, 2))
+										 : std::string();
+
+		if (!connection.execute_prepared(name_ + "_bounds", parameters, catalog_))
+		{
+			return false;
+		}
+		std::vector<std::pair<std::string, std::string>> partitions;
+		partitions.reserve(catalog_.rows());
+		for (size_t row = 0; row < catalog_.rows(); ++row)
+		{
+			partitions.emplace_back(catalog_.text(row, 0), catalog_.text(row, 1));
+		}
+
+		const bool parsed = set_bounds(strategy, key_type, partitions);
+		version_ = version;
+		stale_ = false;
+
+		return parsed;
+	}
+
+	bool partition_router::refresh_if_changed(postgres_manager& connection)
+	{
+		if (!stale_)
+		{
+			std::string version;
+			if (!prepare(connection) || !catalog_version(connection, version))
+			{
+				return false;
+			}
+			if (version == version_)
+			{
+				return true;
+			}
+		}
+
+		return load(connection);
+	}
+
+	bool partition_router::set_bounds(const std::string& strategy,
+									  const std::string& key_type,
+									  const std::vector<std::pair<std::string, std::string>>& partitions)
+	{
+		names_.clear();
+		ranges_.clear();
+		list_.clear();
+		default_partition_ = no_partition;
+
+		if (key_type == "int2" || key_type == "int4" || key_type == "int8")
+		{
+			kind_ = key_kind::integer;
+		}
+		else if (key_type == "date" || key_type == "timestamp" || key_type == "timestamptz")
+		{
+			kind_ = key_kind::datetime;
+		}
+		else if (key_type == "text" || key_type == "varchar")
+		{
+			kind_ = key_kind::text;
+		}
+		else
+		{
+			kind_ = key_kind::unsupported;
+		}
+		if (kind_ == key_kind::unsupported || (strategy != "r" && strategy != "l"))
+		{
+			kind_ = key_kind::unsupported;
+			return true;
+		}
+
+		std::vector<literal> values;
+		std::vector<literal> upper;
+		for (const auto& [name, bound] : partitions)
+		{
+			const size_t partition = names_.size();
+			names_.push_back(name);
+
+			std::string_view text = trim(bound);
+			bool parsed = false;
+			if (text == "DEFAULT")
+			{
+				default_partition_ = partition;
+				parsed = true;
+			}
+			else if (consume(text, "FOR VALUES FROM") && read_list(text, values)
+					 && consume(text, "TO") && read_list(text, upper) && values.size() == 1
+					 && upper.size() == 1)
+			{
+				auto bound_value = [&](const literal& source, key_value& value) {
+					if (!source.quoted && source.value == "MINVALUE")
+					{
+						value.kind = key_value::bound::minimum;
+						return true;
+					}
+					if (!source.quoted && source.value == "MAXVALUE")
+					{
+						value.kind = key_value::bound::maximum;
+						return true;
+					}
+					return parse_key(source.value, value);
+				};
+				range entry;
+				entry.partition = partition;
+				parsed = bound_value(values[0], entry.lower) && bound_value(upper[0], entry.upper);
+				ranges_.push_back(std::move(entry));
+			}
+			else if (consume(text, "FOR VALUES IN") && read_list(text, values))
+			{
+				parsed = true;
+				for (const literal& source : values)
+				{
+					key_value value;
+					if (!source.quoted && source.value == "NULL")
+					{
+						continue;
+					}
+					if (!parse_key(source.value, value))
+					{
+						parsed = false;
+						break;
+					}
+					list_[kind_ == key_kind::text ? value.text : std::to_string(value.number)]
+						= partition;
+				}
+			}
+
+			if (!parsed)
+			{
+				set_bounds("", "", {});
+				return false;
+			}
+		}
+
+		std::sort(ranges_.begin(), ranges_.end(), [this](const range& left, const range& right) {
+			return less(left.lower, right.lower);
+		});
+
+		return true;
+	}
+
+	bool partition_router::parse_key(std::string_view text, key_value& value) const
+	{
+		value.kind = key_value::bound::value;
+		switch (kind_)
+		{
+		case key_kind::integer:
+		{
+			text = trim(text);
+			const auto [end, error]
+				= std::from_chars(text.data(), text.data() + text.size(), value.number);
+			return !text.empty() && error == std::errc() && end == text.data() + text.size();
+		}
+		case key_kind::datetime:
+			return parse_time(text, value.number);
+		case key_kind::text:
+			value.text.assign(text);
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool partition_router::less(const key_value& left, const key_value& right) const
+	{
+		if (left.kind != key_value::bound::value || right.kind != key_value::bound::value)
+		{
+			return left.kind == key_value::bound::minimum
+					   ? right.kind != key_value::bound::minimum
+					   : left.kind == key_value::bound::value && right.kind == key_value::bound::maximum;
+		}
+		return kind_ == key_kind::text ? left.text < right.text : left.number < right.number;
+	}
+
+	const std::string& partition_router::route(std::string_view key) const
+	{
+		key_value value;
+		if (kind_ == key_kind::unsupported || names_.empty() || !parse_key(key, value))
+		{
+			return table_;
+		}
+
+		if (!ranges_.empty())
+		{
+			// The last range starting at or below the key is the only one
+			// that can hold it; partition ranges do not overlap.
+			auto next = std::upper_bound(ranges_.begin(), ranges_.end(), value,
+										 [this](const key_value& probe, const range& entry) {
+											 return less(probe, entry.lower);
+										 });
+			if (next != ranges_.begin() && less(value, std::prev(next)->upper))
+			{
+				return names_[std::prev(next)->partition];
+			}
+		}
+		if (!list_.empty())
+		{
+			const auto found
+				= list_.find(kind_ == key_kind::text ? value.text : std::to_string(value.number));
+			if (found != list_.end())
+			{
+				return names_[found->second];
+			}
+		}
+
+		return default_partition_ != no_partition ? names_[default_partition_] : table_;
+	}
+
+	std::vector<partition_batch> partition_router::group(std::span<const std::string> keys) const
+	{
+		std::vector<partition_batch> batches;
+		std::unordered_map<const std::string*, size_t> index;
+		for (size_t row = 0; row < keys.size(); ++row)
+		{
+			const std::string& partition = route(keys[row]);
+			auto [found, inserted] = index.try_emplace(&partition, batches.size());
+			if (inserted)
+			{
+				batches.push_back({ partition, {} });
+			}
+			batches[found->second].rows.push_back(row);
+		}
+		return batches;
+	}
+
+	partition_write_result partition_router::insert(postgres_manager& connection,
+													 const std::string& columns,
+													 std::span<const std::string> keys,
+													 std::span<const std::string> tuples)
+	{
+		partition_write_result result;
+		std::vector<std::string> rows;
+		for (const partition_batch& batch : group(keys.first(std::min(keys.size(), tuples.size()))))
+		{
+			++result.partitions;
+			rows.clear();
+			std::string statement = "INSERT INTO " + batch.partition + " (" + columns + ") VALUES ";
+			for (size_t position = 0; position < batch.rows.size(); ++position)
+			{
+				statement += position == 0 ? "" : ", ";
+				statement += tuples[batch.rows[position]];
+				rows.push_back(tuples[batch.rows[position]]);
+			}
+
+			// The whole batch in one statement first; only a batch that
+			// fails is sent again to isolate its bad rows.
+			const unsigned int inserted = connection.insert_query(statement);
+			if (inserted > 0)
+			{
+				result.rows += inserted;
+				continue;
+			}
+
+			std::string target = batch.partition;
+			if (target != table_ && is_routing_error(connection.last_error_state()))
+			{
+				stale_ = true;
+				target = table_;
+				++result.rerouted;
+			}
+
+			const bulk_write_result written
+				= connection.bulk_write("INSERT INTO " + target + " (" + columns + ") VALUES ", rows);
+			if (!written.completed)
+			{
+				result.failed_partitions.push_back(
+					{ target, connection.last_error_state(), rows.size() });
+				continue;
+			}
+			result.rows += written.rows_written;
+			for (const bulk_write_error& failed : written.failed_rows)
+			{
+				result.failed_rows.push_back({ batch.rows[failed.row], failed.state, failed.message });
+			}
+		}
+
+		std::sort(result.failed_rows.begin(), result.failed_rows.end(),
+				  [](const auto& left, const auto& right) { return left.row < right.row; });
+		result.completed = result.failed_partitions.empty() && result.failed_rows.empty();
+
+		return result;
+	}
+
+	partition_write_result partition_router::copy(const std::string& connect_string,
+												  const std::string& columns,
+												  std::span<const std::string> keys,
+												  std::span<const std::string> lines,
+												  const size_t& connections,
+												  const std::string& copy_options)
+	{
+		partition_write_result result;
+		const std::vector<partition_batch> batches
+			= group(keys.first(std::min(keys.size(), lines.size())));
+		result.partitions = batches.size();
+
+		auto statement = [&](const std::string& target) {
+			return "COPY " + target + (columns.empty() ? "" : " (" + columns + ")")
+				   + " FROM STDIN WITH (" + copy_options + ")";
+		};
+
+		std::mutex mutex;
+		std::atomic<size_t> next{ 0 };
+		bool rerouted = false;
+		auto worker = [&]() {
+			postgres_manager connection;
+			if (!connection.connect(connect_string))
+			{
+				return;
+			}
+
+			std::string data;
+			for (size_t index = next++; index < batches.size(); index = next++)
+			{
+				const partition_batch& batch = batches[index];
+				data.clear();
+				for (const size_t row : batch.rows)
+				{
+					data += lines[row];
+					data.push_back('\n');
+				}
+
+				uint64_t copied = 0;
+				bool loaded = connection.copy_in(statement(batch.partition), data, copied);
+				bool sent_to_parent = false;
+				if (!loaded && batch.partition != table_
+					&& is_routing_error(connection.last_error_state()))
+				{
+					sent_to_parent = true;
+					loaded = connection.copy_in(statement(table_), data, copied);
+				}
+
+				std::lock_guard<std::mutex> lock(mutex);
+				rerouted = rerouted || sent_to_parent;
+				result.rerouted += sent_to_parent ? 1 : 0;
+				if (!loaded)
+				{
+					result.failed_partitions.push_back(
+						{ sent_to_parent ? table_ : batch.partition, connection.last_error_state(),
+						  batch.rows.size() });
+					continue;
+				}
+				result.rows += copied;
+			}
+		};
+
+		const size_t workers = std::max<size_t>(1, std::min(connections, batches.size()));
+		std::vector<std::thread> threads;
+		threads.reserve(workers);
+		for (size_t index = 0; index < workers; ++index)
+		{
+			threads.emplace_back(worker);
+		}
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+
+		// Batches nobody took because no connection could be opened.
+		for (size_t index = next.load(); index < batches.size(); ++index)
+		{
+			result.failed_partitions.push_back({ batches[index].partition, "", batches[index].rows.size() });
+		}
+
+		stale_ = stale_ || rerouted;
+		result.completed = result.failed_partitions.empty();
+
+		return result;
+	}
+} // namespace database
@@ -0,0 +1,241 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "postgres_manager.h"
+
+namespace database
+{
+	/**
+	 * @brief Rows of one write that go to the same partition.
+	 */
+	struct partition_batch
+	{
+		std::string partition; ///< Child table, or the parent when not routed.
+		std::vector<size_t> rows; ///< Indexes into the caller's rows, ascending.
+	};
+
+	/**
+	 * @brief A partition whose rows were not written.
+	 */
+	struct partition_write_error
+	{
+		std::string partition;
+		std::string state; ///< SQLSTATE, empty if the server did not answer.
+		size_t rows;
+	};
+
+	/**
+	 * @brief Outcome of @c partition_router::insert and
+	 *        @c partition_router::copy.
+	 */
+	struct partition_write_result
+	{
+		bool completed = false; ///< Every row was written.
+		uint64_t rows = 0; ///< Rows the server reported as written.
+		size_t partitions = 0; ///< Batches sent, one per partition.
+		size_t rerouted = 0; ///< Batches sent through the parent after their
+							 ///< partition rejected them.
+		std::vector<partition_write_error> failed_partitions;
+		std::vector<bulk_write_error> failed_rows; ///< @c insert only; rows index
+												   ///< the caller's rows.
+	};
+
+	/**
+	 * @class partition_router
+	 * @brief Sends writes for a declaratively partitioned table straight
+	 *        to its partitions.
+	 *
+	 * The partition key and every partition's bound are read from
+	 * @c pg_partitioned_table and @c pg_inherits and kept. Rows are then
+	 * grouped by partition on the client, and each group is written to its
+	 * child table. This skips tuple routing on the server, and with
+	 * @c copy the groups load in parallel.
+	 *
+	 * Range and list partitioning on one integer, date, timestamp,
+	 * timestamptz or text column are routed. Text is compared bytewise,
+	 * which matches the "C" collation. A timestamptz key without an offset
+	 * is taken as UTC. Hash partitions, expression keys and keys that do
+	 * not parse are sent to the parent table, which routes them as before.
+	 * Rows that fit no partition go to the default partition if there is
+	 * one.
+	 *
+	 * @c refresh_if_changed reloads the bounds after partitions were
+	 * attached, detached or altered; call it before each batch of writes.
+	 * If a partition rejects its rows anyway (its constraint no longer
+	 * matches or it was dropped), they are resent through the parent and
+	 * the bounds are reloaded on the next refresh.
+	 *
+	 * Not synchronized: use one router per thread, or load it once and
+	 * only call the const members concurrently.
+	 */
+	class partition_router
+	{
+	public:
+		/**
+		 * @param name  Prefix for the prepared statements that read the
+		 *              catalog, unique per connection.
+		 * @param table The partitioned table, as written in SQL.
+		 */
+		partition_router(const std::string& name, const std::string& table);
+		virtual ~partition_router(void);
+
+		/**
+		 * @brief Reads the partition key and bounds.
+		 *
+		 * @return @c false if the statements failed or @p table is not
+		 *         partitioned; writes then all go to the parent.
+		 */
+		bool load(postgres_manager& connection);
+
+		/**
+		 * @brief Reloads the bounds if the set of partitions or any of
+		 *        their catalog rows changed since the last load; one
+		 *        round trip when nothing changed.
+		 */
+		bool refresh_if_changed(postgres_manager& connection);
+
+		/**
+		 * @brief Builds the routing table from catalog text, as @c load
+		 *        does with what it reads.
+		 *
+		 * @param strategy   @c pg_partitioned_table.partstrat: "r", "l" or "h".
+		 * @param key_type   Type name of the key column, e.g. "int8".
+		 * @param partitions Child table and @c pg_get_expr of its bound,
+		 *                   e.g. "FOR VALUES FROM (1) TO (100)".
+		 * @return @c false if a bound could not be parsed; nothing is
+		 *         routed then.
+		 */
+		bool set_bounds(const std::string& strategy,
+						const std::string& key_type,
+						const std::vector<std::pair<std::string, std::string>>& partitions);
+
+		/**
+		 * @brief Makes the next @c refresh_if_changed reload the bounds.
+		 */
+		void invalidate(void);
+
+		const std::string& table(void) const { return table_; }
+
+		/**
+		 * @brief Partitions rows can be routed to; zero when everything
+		 *        goes to the parent.
+		 */
+		size_t partitions(void) const { return names_.size(); }
+
+		/**
+		 * @brief The child table for a row whose key column is @p key, in
+		 *        its text form, or the parent table.
+		 */
+		const std::string& route(std::string_view key) const;
+
+		/**
+		 * @brief Groups rows by the partition of their key.
+		 */
+		std::vector<partition_batch> group(std::span<const std::string> keys) const;
+
+		/**
+		 * @brief Inserts rows with @c postgres_manager::bulk_write, one
+		 *        batch per partition, on @p connection.
+		 *
+		 * @param columns Column list such as "id, created_at, payload".
+		 * @param keys    Key column text of each row.
+		 * @param tuples  Value tuple of each row, e.g. "(1, '2024-05-01', 'x')".
+		 */
+		partition_write_result insert(postgres_manager& connection,
+									  const std::string& columns,
+									  std::span<const std::string> keys,
+									  std::span<const std::string> tuples);
+
+		/**
+		 * @brief Loads rows with @c COPY, one statement per partition,
+		 *        over up to @p connections parallel connections.
+		 *
+		 * @param lines         One line of COPY input per row, without
+		 *                      the newline.
+		 * @param copy_options  Options of the COPY statement.
+		 */
+		partition_write_result copy(const std::string& connect_string,
+									const std::string& columns,
+									std::span<const std::string> keys,
+									std::span<const std::string> lines,
+									const size_t& connections,
+									const std::string& copy_options = "FORMAT csv");
+
+	private:
+		enum class key_kind : uint8_t { unsupported, integer, datetime, text };
+
+		/**
+		 * A key in comparable form: integers and times as @c number, text
+		 * as @c text. Range bounds may also be MINVALUE or MAXVALUE.
+		 */
+		struct key_value
+		{
+			enum class bound : uint8_t { value, minimum, maximum } kind = bound::value;
+			int64_t number = 0;
+			std::string text;
+		};
+
+		struct range
+		{
+			key_value lower;
+			key_value upper;
+			size_t partition;
+		};
+
+		bool parse_key(std::string_view text, key_value& value) const;
+		bool less(const key_value& left, const key_value& right) const;
+		bool prepare(postgres_manager& connection);
+		bool catalog_version(postgres_manager& connection, std::string& version);
+
+	private:
+		std::string name_;
+		std::string table_;
+		bool stale_;
+		std::string version_;
+
+		key_kind kind_;
+		std::vector<std::string> names_;
+		std::vector<range> ranges_; ///< Sorted by lower bound.
+		std::unordered_map<std::string, size_t> list_; ///< Normalized value to partition.
+		size_t default_partition_;
+		result_buffer catalog_;
+	};
+} // namespace database
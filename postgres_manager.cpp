@@ -32,15 +32,949 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "database/postgres_manager.h"
 
+#include "database/database_metrics.h"
+#include "database/query_timing.h"
+#include "database/query_tracer.h"
+#include "database/result_buffer.h"
+#include "database/sql_fingerprint.h"
+
 #include "libpq-fe.h"
 
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <cerrno>
+#include <poll.h>
+#endif
+
 #include "utilities/conversion/convert_string.h"
+#include "container/values/bool_value.h"
+#include "container/values/numeric_value.h"
+#include "container/values/string_value.h"
+#include "container/values/container_value.h"
 
 namespace database
 {
 	using namespace utility_module;
 
-	postgres_manager::postgres_manager(void) : connection_(nullptr) {}
+	namespace
+	{
+		// Type OIDs from pg_type.h, which is a server header.
+		constexpr Oid bool_oid = 16;
+		constexpr Oid int8_oid = 20;
+		constexpr Oid int2_oid = 21;
+		constexpr Oid int4_oid = 23;
+		constexpr Oid float4_oid = 700;
+		constexpr Oid float8_oid = 701;
+		constexpr Oid name_oid = 19;
+		constexpr Oid text_oid = 25;
+		constexpr Oid oid_oid = 26;
+		constexpr Oid json_oid = 114;
+		constexpr Oid bpchar_oid = 1042;
+		constexpr Oid varchar_oid = 1043;
+		constexpr Oid date_oid = 1082;
+		constexpr Oid timestamp_oid = 1114;
+		constexpr Oid timestamptz_oid = 1184;
+		constexpr Oid numeric_oid = 1700;
+		constexpr Oid jsonb_oid = 3802;
+
+		bool succeeded(PGresult* result)
+		{
+			const ExecStatusType status = PQresultStatus(result);
+
+			return status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK;
+		}
+
+		/**
+		 * ASCII is the same in UTF-8 and every client encoding, so such
+		 * text can be sent without the allocating conversion.
+		 */
+		bool is_ascii(const char* text, const size_t& length)
+		{
+			for (size_t index = 0; index < length; ++index)
+			{
+				if (static_cast<unsigned char>(text[index]) >= 0x80)
+				{
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		uint64_t affected_rows(PGresult* result)
+		{
+			const char* tuples = PQcmdTuples(result);
+			uint64_t rows = 0;
+			std::from_chars(tuples, tuples + std::strlen(tuples), rows);
+
+			return rows;
+		}
+
+		int64_t result_bytes(const PGresult* result)
+		{
+			int64_t bytes = 0;
+			const int rows = PQntuples(result);
+			const int columns = PQnfields(result);
+			for (int row = 0; row < rows; ++row)
+			{
+				for (int column = 0; column < columns; ++column)
+				{
+					bytes += PQgetlength(result, row, column);
+				}
+			}
+
+			return bytes;
+		}
+
+		/**
+		 * Records a failed statement and returns its SQLSTATE, or
+		 * @p fallback when the server sent no result, e.g. because the
+		 * statement was refused before it was sent.
+		 */
+		std::string record_error(scoped_span& span, PGconn* connection, PGresult* result,
+								 const std::string& fallback = std::string())
+		{
+			const char* sqlstate
+				= (result != nullptr) ? PQresultErrorField(result, PG_DIAG_SQLSTATE) : nullptr;
+			database_metrics::handle().record_error(sqlstate != nullptr ? sqlstate : "");
+
+			if (span.recording())
+			{
+				if (result == nullptr)
+				{
+					span.set_error("", connection != nullptr ? PQerrorMessage(connection)
+															 : "no connection");
+				}
+				else
+				{
+					span.set_error(sqlstate != nullptr ? sqlstate : "",
+								   PQresultErrorMessage(result));
+				}
+			}
+
+			if (result == nullptr)
+			{
+				return fallback;
+			}
+			return sqlstate != nullptr ? sqlstate : "";
+		}
+
+		/**
+		 * A result cell converted to its native type. Text still points into
+		 * the PGresult, so cells must be used before the result is cleared.
+		 */
+		struct decoded_cell
+		{
+			enum class kinds { null, boolean, integer, big_integer, real, text } kind;
+			int64_t integer = 0;
+			double real = 0.0;
+			const char* text = nullptr;
+		};
+
+		decoded_cell decode_cell(PGresult* result, const int& row, const int& column)
+		{
+			decoded_cell cell{ decoded_cell::kinds::text };
+			if (PQgetisnull(result, row, column))
+			{
+				cell.kind = decoded_cell::kinds::null;
+				return cell;
+			}
+
+			cell.text = PQgetvalue(result, row, column);
+			const char* end = cell.text + PQgetlength(result, row, column);
+
+			// from_chars neither allocates nor throws; a value that does not
+			// parse completely (e.g. "NaN" for a float4) stays text.
+			switch (PQftype(result, column))
+			{
+			case bool_oid:
+				cell.kind = decoded_cell::kinds::boolean;
+				cell.integer = (cell.text[0] == 't') ? 1 : 0;
+				break;
+			case int2_oid:
+			case int4_oid:
+			case int8_oid:
+			{
+				auto [parsed, error] = std::from_chars(cell.text, end, cell.integer);
+				if (error == std::errc() && parsed == end)
+				{
+					cell.kind = PQftype(result, column) == int8_oid
+									? decoded_cell::kinds::big_integer
+									: decoded_cell::kinds::integer;
+				}
+				break;
+			}
+			case float4_oid:
+			case float8_oid:
+			{
+				auto [parsed, error] = std::from_chars(cell.text, end, cell.real);
+				if (error == std::errc() && parsed == end)
+				{
+					cell.kind = decoded_cell::kinds::real;
+				}
+				break;
+			}
+			default:
+				break;
+			}
+
+			return cell;
+		}
+
+		std::shared_ptr<container_module::value> build_value(const char* name,
+															 const decoded_cell& cell)
+		{
+			switch (cell.kind)
+			{
+			case decoded_cell::kinds::null:
+				return std::make_shared<container_module::value>(name);
+			case decoded_cell::kinds::boolean:
+				return std::make_shared<container_module::bool_value>(name, cell.integer != 0);
+			case decoded_cell::kinds::integer:
+				return std::make_shared<container_module::int_value>(
+					name, static_cast<int>(cell.integer));
+			case decoded_cell::kinds::big_integer:
+				return std::make_shared<container_module::llong_value>(
+					name, static_cast<long long>(cell.integer));
+			case decoded_cell::kinds::real:
+				return std::make_shared<container_module::double_value>(name, cell.real);
+			case decoded_cell::kinds::text:
+				break;
+			}
+
+			return std::make_shared<container_module::string_value>(name, cell.text);
+		}
+
+		/**
+		 * Blocks until the connection's socket has data to read, so the time
+		 * until the first response byte can be told apart from the time
+		 * spent receiving the rest of the result. Returns false only if
+		 * @p timeout_ms (-1 waits forever) passed first.
+		 */
+		bool wait_readable(PGconn* connection, const int& timeout_ms = -1)
+		{
+			const int socket = PQsocket(connection);
+			if (socket < 0)
+			{
+				return true;
+			}
+
+#ifdef _WIN32
+			WSAPOLLFD descriptor{};
+			descriptor.fd = static_cast<SOCKET>(socket);
+			descriptor.events = POLLRDNORM;
+			return WSAPoll(&descriptor, 1, timeout_ms) != 0;
+#else
+			pollfd descriptor{};
+			descriptor.fd = socket;
+			descriptor.events = POLLIN;
+			int ready = 0;
+			while ((ready = poll(&descriptor, 1, timeout_ms)) < 0 && errno == EINTR)
+			{
+			}
+			return ready != 0;
+#endif
+		}
+
+		/**
+		 * Reads input until the next result can be taken without blocking.
+		 * Returns false if the server sent nothing for @p timeout; a broken
+		 * connection returns true and is reported by @c PQgetResult.
+		 */
+		bool wait_for_result(PGconn* connection, const std::chrono::milliseconds& timeout)
+		{
+			const auto deadline = std::chrono::steady_clock::now() + timeout;
+			while (PQisBusy(connection))
+			{
+				const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now());
+				if (remaining.count() <= 0
+					|| !wait_readable(connection, static_cast<int>(remaining.count())))
+				{
+					return false;
+				}
+				if (PQconsumeInput(connection) == 0)
+				{
+					return true;
+				}
+			}
+
+			return true;
+		}
+
+		/**
+		 * Takes every result of the statement just sent and keeps the last,
+		 * which also carries any error that stopped a multi-statement
+		 * string. Earlier results are released as they are replaced.
+		 * Returns false if @p timeout (zero waits forever) passed first.
+		 */
+		bool take_results(PGconn* connection, const std::chrono::milliseconds& timeout,
+						  pg_result_handle& result)
+		{
+			for (;;)
+			{
+				if (timeout.count() > 0 && !wait_for_result(connection, timeout))
+				{
+					return false;
+				}
+
+				PGresult* next = PQgetResult(connection);
+				if (next == nullptr)
+				{
+					return true;
+				}
+				result.reset(next);
+			}
+		}
+
+		/**
+		 * Opens a connection, giving up after @p timeout (zero waits as
+		 * long as libpq does). Returns @c nullptr when the time ran out.
+		 */
+		PGconn* connect_within(const std::string& connect_string, const std::chrono::milliseconds& timeout)
+		{
+			if (timeout.count() <= 0)
+			{
+				return PQconnectdb(connect_string.c_str());
+			}
+
+			PGconn* connection = PQconnectStart(connect_string.c_str());
+			if (connection == nullptr || PQstatus(connection) == CONNECTION_BAD)
+			{
+				return connection;
+			}
+
+			const auto deadline = std::chrono::steady_clock::now() + timeout;
+			PostgresPollingStatusType polling = PGRES_POLLING_WRITING;
+			while (polling != PGRES_POLLING_OK && polling != PGRES_POLLING_FAILED)
+			{
+				const auto remaining
+					= std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+				const int socket = PQsocket(connection);
+				int ready = 0;
+				if (remaining.count() > 0 && socket >= 0)
+				{
+#ifdef _WIN32
+					WSAPOLLFD descriptor{};
+					descriptor.fd = static_cast<SOCKET>(socket);
+					descriptor.events = polling == PGRES_POLLING_READING ? POLLRDNORM : POLLWRNORM;
+					ready = WSAPoll(&descriptor, 1, static_cast<int>(remaining.count()));
+#else
+					pollfd descriptor{};
+					descriptor.fd = socket;
+					descriptor.events = polling == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+					while ((ready = poll(&descriptor, 1, static_cast<int>(remaining.count()))) < 0
+						   && errno == EINTR)
+					{
+					}
+#endif
+				}
+				if (ready <= 0)
+				{
+					PQfinish(connection);
+					return nullptr;
+				}
+				polling = PQconnectPoll(connection);
+			}
+
+			return connection;
+		}
+
+		/**
+		 * Whether @p query_string ends a transaction block by rolling it
+		 * back; ROLLBACK TO SAVEPOINT does not.
+		 */
+		bool is_rollback(std::string_view query_string)
+		{
+			auto word = [&query_string]() {
+				while (!query_string.empty() && std::isspace(static_cast<unsigned char>(query_string.front())))
+				{
+					query_string.remove_prefix(1);
+				}
+				size_t length = 0;
+				while (length < query_string.size() && std::isalpha(static_cast<unsigned char>(query_string[length])))
+				{
+					++length;
+				}
+				std::string result(query_string.substr(0, length));
+				query_string.remove_prefix(length);
+				for (char& c : result)
+				{
+					c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+				}
+				return result;
+			};
+
+			const std::string first = word();
+			if (first == "ABORT")
+			{
+				return true;
+			}
+			if (first != "ROLLBACK")
+			{
+				return false;
+			}
+			std::string next = word();
+			if (next == "WORK" || next == "TRANSACTION")
+			{
+				next = word();
+			}
+			return next != "TO" && next != "PREPARED";
+		}
+
+		/**
+		 * Whether @p text contains the lowercase @p word in any case.
+		 */
+		bool contains_ignoring_case(std::string_view text, std::string_view word)
+		{
+			return std::search(text.begin(), text.end(), word.begin(), word.end(),
+							   [](const char& left, const char& right) {
+								   return std::tolower(static_cast<unsigned char>(left)) == right;
+							   })
+				   != text.end();
+		}
+
+		/**
+		 * Whether a SQLSTATE is caused by the values of a row, so that
+		 * retrying fewer rows may succeed: data exceptions, integrity
+		 * constraint violations, WITH CHECK OPTION violations and
+		 * exceptions raised by a trigger. Anything else, such as a
+		 * syntax error, a lost connection or a deadlock, fails every
+		 * subset of the rows alike.
+		 */
+		bool is_row_error(const std::string& state)
+		{
+			static constexpr std::string_view classes[] = { "22", "23", "44" };
+
+			if (state.size() != 5)
+			{
+				return false;
+			}
+			if (state == "P0001")
+			{
+				return true;
+			}
+			for (const std::string_view error_class : classes)
+			{
+				if (state.compare(0, 2, error_class) == 0)
+				{
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		columnar_result::column_kind columnar_kind(const Oid& type)
+		{
+			using kind = columnar_result::column_kind;
+
+			switch (type)
+			{
+			case bool_oid:
+				return kind::boolean;
+			case int2_oid:
+			case int4_oid:
+			case int8_oid:
+			case oid_oid:
+				return kind::integer;
+			case float4_oid:
+			case float8_oid:
+				return kind::real;
+			case timestamp_oid:
+			case timestamptz_oid:
+				return kind::timestamp;
+			case date_oid:
+				return kind::date;
+			case numeric_oid:
+				return kind::numeric;
+			case name_oid:
+			case text_oid:
+			case json_oid:
+			case bpchar_oid:
+			case varchar_oid:
+			case jsonb_oid:
+				return kind::text;
+			default:
+				return kind::bytes;
+			}
+		}
+
+		uint64_t read_big_endian(const char* data, const size_t& bytes)
+		{
+			uint64_t value = 0;
+			for (size_t index = 0; index < bytes; ++index)
+			{
+				value = (value << 8) | static_cast<unsigned char>(data[index]);
+			}
+			return value;
+		}
+
+		/**
+		 * Formats the binary numeric representation (digit count, weight of
+		 * the first digit, sign and display scale, then base-10000 digits)
+		 * the way numeric_out prints it.
+		 */
+		bool format_numeric(const char* data, const size_t& length, std::string& output)
+		{
+			if (length < 8)
+			{
+				return false;
+			}
+			const auto digits = static_cast<int16_t>(read_big_endian(data, 2));
+			const auto weight = static_cast<int16_t>(read_big_endian(data + 2, 2));
+			const auto sign = static_cast<uint16_t>(read_big_endian(data + 4, 2));
+			const auto scale = static_cast<int16_t>(read_big_endian(data + 6, 2));
+			if (digits < 0 || length != 8 + 2 * static_cast<size_t>(digits))
+			{
+				return false;
+			}
+
+			output.clear();
+			switch (sign)
+			{
+			case 0xC000:
+				output = "NaN";
+				return true;
+			case 0xD000:
+				output = "Infinity";
+				return true;
+			case 0xF000:
+				output = "-Infinity";
+				return true;
+			case 0x4000:
+				output.push_back('-');
+				break;
+			default:
+				break;
+			}
+
+			auto digit = [&](const int& index) -> int {
+				return index >= 0 && index < digits
+						   ? static_cast<int16_t>(read_big_endian(data + 8 + 2 * index, 2))
+						   : 0;
+			};
+			char group[5];
+
+			if (weight < 0)
+			{
+				output.push_back('0');
+			}
+			for (int index = 0; index <= weight; ++index)
+			{
+				std::snprintf(group, sizeof(group), index == 0 ? "%d" : "%04d", digit(index));
+				output += group;
+			}
+			if (scale > 0)
+			{
+				output.push_back('.');
+				const size_t end = output.size() + static_cast<size_t>(scale);
+				for (int index = weight + 1; output.size() < end; ++index)
+				{
+					std::snprintf(group, sizeof(group), "%04d", digit(index));
+					output += group;
+				}
+				output.resize(end);
+			}
+
+			return true;
+		}
+
+		/**
+		 * Decodes the binary COPY stream (a signature header, then per row
+		 * a field count and a length-prefixed value per field, then a -1
+		 * trailer) into a columnar_result. Data may be split anywhere: a
+		 * row cut short is kept until the rest arrives.
+		 */
+		class binary_copy_decoder
+		{
+		public:
+			binary_copy_decoder(columnar_result& output,
+								std::vector<Oid> types,
+								const size_t& batch_rows,
+								const std::function<bool(const columnar_result&)>& on_batch)
+				: output_(output)
+				, types_(std::move(types))
+				, batch_rows_(batch_rows)
+				, on_batch_(on_batch)
+				, rows_(0)
+				, header_seen_(false)
+				, trailer_seen_(false)
+				, failed_(false)
+			{
+			}
+
+			bool feed(std::string_view data)
+			{
+				if (failed_ || trailer_seen_)
+				{
+					return !failed_;
+				}
+
+				if (carry_.empty())
+				{
+					const size_t consumed = parse(data);
+					carry_.assign(data.substr(consumed));
+				}
+				else
+				{
+					carry_.append(data);
+					carry_.erase(0, parse(carry_));
+				}
+
+				return !failed_;
+			}
+
+			bool finish(void)
+			{
+				if (failed_ || !trailer_seen_)
+				{
+					return false;
+				}
+				if (batch_rows_ > 0 && output_.rows() > 0 && !hand_over())
+				{
+					return false;
+				}
+				return true;
+			}
+
+			uint64_t rows(void) const { return rows_; }
+
+		private:
+			/**
+			 * Decodes the complete rows at the front of @p data and returns
+			 * the bytes consumed.
+			 */
+			size_t parse(std::string_view data)
+			{
+				static constexpr char signature[] = "PGCOPY\n\377\r\n";
+				constexpr size_t header_bytes = 19;
+
+				size_t offset = 0;
+				if (!header_seen_)
+				{
+					if (data.size() < header_bytes)
+					{
+						return 0;
+					}
+					if (std::memcmp(data.data(), signature, 11) != 0)
+					{
+						failed_ = true;
+						return 0;
+					}
+					const size_t extension = read_big_endian(data.data() + 15, 4);
+					if (data.size() < header_bytes + extension)
+					{
+						return 0;
+					}
+					offset = header_bytes + extension;
+					header_seen_ = true;
+				}
+
+				const size_t columns = types_.size();
+				while (offset + 2 <= data.size())
+				{
+					const auto fields = static_cast<int16_t>(read_big_endian(data.data() + offset, 2));
+					if (fields == -1)
+					{
+						trailer_seen_ = true;
+						return data.size();
+					}
+					if (fields < 0 || static_cast<size_t>(fields) != columns)
+					{
+						failed_ = true;
+						return offset;
+					}
+
+					// Check the whole row is here before any cell is added.
+					size_t end = offset + 2;
+					for (size_t column = 0; column < columns && end <= data.size(); ++column)
+					{
+						if (end + 4 > data.size())
+						{
+							end = data.size() + 1;
+							break;
+						}
+						const auto length = static_cast<int32_t>(read_big_endian(data.data() + end, 4));
+						end += 4 + (length > 0 ? static_cast<size_t>(length) : 0);
+					}
+					if (end > data.size())
+					{
+						return offset;
+					}
+
+					size_t cursor = offset + 2;
+					for (size_t column = 0; column < columns; ++column)
+					{
+						const auto length = static_cast<int32_t>(read_big_endian(data.data() + cursor, 4));
+						cursor += 4;
+						if (!decode(column, data.data() + cursor, length))
+						{
+							failed_ = true;
+							return offset;
+						}
+						cursor += length > 0 ? static_cast<size_t>(length) : 0;
+					}
+					output_.finish_row();
+					++rows_;
+					offset = end;
+
+					if (batch_rows_ > 0 && output_.rows() >= batch_rows_ && !hand_over())
+					{
+						failed_ = true;
+						return offset;
+					}
+				}
+
+				return offset;
+			}
+
+			bool decode(const size_t& column, const char* data, const int32_t& length)
+			{
+				if (length < 0)
+				{
+					output_.append_null(column);
+					return true;
+				}
+
+				const auto size = static_cast<size_t>(length);
+				switch (types_[column])
+				{
+				case bool_oid:
+					if (size != 1)
+					{
+						return false;
+					}
+					output_.append_boolean(column, data[0] != 0);
+					return true;
+				case int2_oid:
+					if (size != 2)
+					{
+						return false;
+					}
+					output_.append_integer(column, static_cast<int16_t>(read_big_endian(data, 2)));
+					return true;
+				case int4_oid:
+					if (size != 4)
+					{
+						return false;
+					}
+					output_.append_integer(column, static_cast<int32_t>(read_big_endian(data, 4)));
+					return true;
+				case oid_oid:
+					if (size != 4)
+					{
+						return false;
+					}
+					output_.append_integer(column, static_cast<int64_t>(read_big_endian(data, 4)));
+					return true;
+				case int8_oid:
+					if (size != 8)
+					{
+						return false;
+					}
+					output_.append_integer(column, static_cast<int64_t>(read_big_endian(data, 8)));
+					return true;
+				case float4_oid:
+				{
+					if (size != 4)
+					{
+						return false;
+					}
+					const auto bits = static_cast<uint32_t>(read_big_endian(data, 4));
+					float value;
+					std::memcpy(&value, &bits, sizeof(value));
+					output_.append_real(column, value);
+					return true;
+				}
+				case float8_oid:
+				{
+					if (size != 8)
+					{
+						return false;
+					}
+					const uint64_t bits = read_big_endian(data, 8);
+					double value;
+					std::memcpy(&value, &bits, sizeof(value));
+					output_.append_real(column, value);
+					return true;
+				}
+				case timestamp_oid:
+				case timestamptz_oid:
+				{
+					// Microseconds since 2000-01-01; +-infinity are kept.
+					if (size != 8)
+					{
+						return false;
+					}
+					const auto value = static_cast<int64_t>(read_big_endian(data, 8));
+					const bool finite = value != INT64_MAX && value != INT64_MIN;
+					output_.append_integer(column, finite ? value + 946684800000000LL : value);
+					return true;
+				}
+				case date_oid:
+				{
+					// Days since 2000-01-01; +-infinity are kept.
+					if (size != 4)
+					{
+						return false;
+					}
+					const auto value = static_cast<int32_t>(read_big_endian(data, 4));
+					const bool finite = value != INT32_MAX && value != INT32_MIN;
+					output_.append_integer(column, finite ? int64_t{ value } + 10957 : value);
+					return true;
+				}
+				case numeric_oid:
+					if (!format_numeric(data, size, scratch_))
+					{
+						return false;
+					}
+					output_.append_text(column, scratch_);
+					return true;
+				case jsonb_oid:
+					// A version byte, 1, precedes the JSON text.
+					if (size == 0 || data[0] != 1)
+					{
+						return false;
+					}
+					output_.append_text(column, std::string_view(data + 1, size - 1));
+					return true;
+				default:
+					output_.append_text(column, std::string_view(data, size));
+					return true;
+				}
+			}
+
+			bool hand_over(void)
+			{
+				const bool accepted = on_batch_ == nullptr || on_batch_(output_);
+				output_.clear_rows();
+				return accepted;
+			}
+
+		private:
+			columnar_result& output_;
+			std::vector<Oid> types_;
+			size_t batch_rows_;
+			const std::function<bool(const columnar_result&)>& on_batch_;
+			uint64_t rows_;
+			bool header_seen_;
+			bool trailer_seen_;
+			bool failed_;
+			std::string carry_;
+			std::string scratch_;
+		};
+
+		std::string quote_identifier(PGconn* connection, const std::string& name)
+		{
+			char* quoted = PQescapeIdentifier(connection, name.c_str(), name.size());
+			if (quoted == nullptr)
+			{
+				return "\"\"";
+			}
+			std::string result(quoted);
+			PQfreemem(quoted);
+			return result;
+		}
+
+		void put_big_endian(std::string& output, const uint64_t& value, const size_t& bytes)
+		{
+			for (size_t index = bytes; index-- > 0;)
+			{
+				output.push_back(static_cast<char>((value >> (index * 8)) & 0xff));
+			}
+		}
+
+		/**
+		 * Encodes @p count elements as a one-dimensional array in the
+		 * binary COPY/parameter format: int8 elements when @p integer is
+		 * set, text elements otherwise. @p element returns the text of
+		 * element @c i, or @c nullptr for NULL.
+		 */
+		template <typename Element>
+		bool encode_array(std::string& output, const size_t& count, const bool& integer, Element element)
+		{
+			bool has_null = false;
+			for (size_t index = 0; index < count && !has_null; ++index)
+			{
+				has_null = element(index) == nullptr;
+			}
+
+			output.clear();
+			put_big_endian(output, 1, 4);
+			put_big_endian(output, has_null ? 1 : 0, 4);
+			put_big_endian(output, integer ? int8_oid : text_oid, 4);
+			put_big_endian(output, count, 4);
+			put_big_endian(output, 1, 4);
+
+			for (size_t index = 0; index < count; ++index)
+			{
+				const std::string* value = element(index);
+				if (value == nullptr)
+				{
+					put_big_endian(output, UINT32_MAX, 4);
+					continue;
+				}
+
+				if (integer)
+				{
+					int64_t number = 0;
+					const auto [end, error]
+						= std::from_chars(value->data(), value->data() + value->size(), number);
+					if (error != std::errc() || end != value->data() + value->size())
+					{
+						return false;
+					}
+					put_big_endian(output, 8, 4);
+					put_big_endian(output, static_cast<uint64_t>(number), 8);
+					continue;
+				}
+
+				if (is_ascii(value->data(), value->size()))
+				{
+					put_big_endian(output, value->size(), 4);
+					output.append(*value);
+					continue;
+				}
+				auto [converted_string, error_message] = convert_string::utf8_to_system(*value);
+				if (error_message.has_value())
+				{
+					return false;
+				}
+				put_big_endian(output, converted_string.value().size(), 4);
+				output.append(converted_string.value());
+			}
+
+			return true;
+		}
+	} // namespace
+
+	void pg_connection_deleter::operator()(pg_conn* connection) const
+	{
+		PQfinish(connection);
+	}
+
+	void pg_result_deleter::operator()(pg_result* result) const
+	{
+		PQclear(result);
+	}
+
+	postgres_manager::postgres_manager(void)
+		: in_transaction_(false)
+		, transaction_lost_(false)
+		, auto_reconnect_(true)
+		, response_timeout_(std::chrono::milliseconds(0))
+		, auto_parameterize_(false)
+	{
+	}
 
 	postgres_manager::~postgres_manager(void) {}
 
@@ -51,70 +985,85 @@ namespace database
 
 	bool postgres_manager::connect(const std::string& connect_string)
 	{
+		scoped_span span(span_kind::connect);
+		span.set_attribute("db.system", "postgresql");
+
 		auto [converted_string, error_message]
 			= convert_string::utf8_to_system(connect_string);
 		if (error_message.has_value())
 		{
+			span.set_error("", error_message.value());
 			return false;
 		}
 
 		auto converted_connect_string = converted_string.value();
 
-		connection_ = PQconnectdb(converted_connect_string.c_str());
-		if (PQstatus((PGconn*)connection_) != CONNECTION_OK)
+		connection_.reset(PQconnectdb(converted_connect_string.c_str()));
+		if (PQstatus(connection_.get()) != CONNECTION_OK)
 		{
-			PQfinish((PGconn*)connection_);
-			connection_ = nullptr;
+			span.set_error("", PQerrorMessage(connection_.get()));
+
+			connection_.reset();
 
 			return false;
 		}
 
+		connect_string_ = std::move(converted_connect_string);
+		in_transaction_ = false;
+		transaction_lost_ = false;
+		search_path_.clear();
+		prepared_statements_.clear();
+		listen_channels_.clear();
+		notifications_.clear();
+		auto_statements_.clear();
+		auto_rejected_.clear();
+		session_ = session_state();
+		bulk_statements_.clear();
+
 		return true;
 	}
 
 	bool postgres_manager::create_query(const std::string& query_string)
 	{
-		PGresult* result = (PGresult*)query_result(query_string);
-		if (PQresultStatus(result) != PGRES_TUPLES_OK)
-		{
-			PQclear(result);
-			result = nullptr;
+		scoped_in_flight in_flight;
+		scoped_query_timing timing(query_string);
+		scoped_span span(span_kind::query);
+		span.set_attribute("db.system", "postgresql");
+		span.set_statement(query_string);
 
-			PQfinish((PGconn*)connection_);
-			connection_ = nullptr;
+		pg_result_handle result = query_result(query_string);
+		if (!succeeded(result.get()))
+		{
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+			timing.set_failed();
 
 			return false;
 		}
 
-		PQclear(result);
-		result = nullptr;
-
 		return true;
 	}
 
 	unsigned int postgres_manager::execute_modification_query(const std::string& query_string)
 	{
-		PGresult* result = (PGresult*)query_result(query_string);
-		if (PQresultStatus(result) != PGRES_TUPLES_OK)
-		{
-			PQclear(result);
-			result = nullptr;
+		scoped_in_flight in_flight;
+		scoped_query_timing timing(query_string);
+		scoped_span span(span_kind::query);
+		span.set_attribute("db.system", "postgresql");
+		span.set_statement(query_string);
 
-			PQfinish((PGconn*)connection_);
-			connection_ = nullptr;
+		pg_result_handle result = query_result(query_string);
+		if (!succeeded(result.get()))
+		{
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+			timing.set_failed();
 
 			return 0;
 		}
 
-		unsigned int result_count;
-		try {
-			result_count = static_cast<unsigned int>(std::stoi(PQcmdTuples(result)));
-		} catch (const std::exception&) {
-			result_count = 0;
-		}
-
-		PQclear(result);
-		result = nullptr;
+		const auto result_count = static_cast<unsigned int>(affected_rows(result.get()));
+		timing.lap(query_phase::decode);
+		timing.set_rows(result_count);
+		span.set_attribute("db.rows", static_cast<int64_t>(result_count));
 
 		return result_count;
 	}
@@ -137,50 +1086,1497 @@ namespace database
 	std::unique_ptr<container_module::value_container> postgres_manager::select_query(
 		const std::string& query_string)
 	{
-		std::unique_ptr<container_module::value_container> container
-			= std::make_unique<container_module::value_container>(
-				"query", std::vector<std::shared_ptr<container_module::value>>{});
+		scoped_in_flight in_flight;
+		scoped_query_timing timing(query_string);
+		scoped_span span(span_kind::query);
+		span.set_attribute("db.system", "postgresql");
+		span.set_statement(query_string);
+
+		pg_result_handle result = query_result(query_string);
+		if (!succeeded(result.get()))
+		{
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+			timing.set_failed();
+
+			return nullptr;
+		}
+
+		scoped_span decode(span_kind::decode);
+
+		const int rows = PQntuples(result.get());
+		const int columns = PQnfields(result.get());
+
+		std::vector<decoded_cell> cells;
+		cells.reserve(static_cast<size_t>(rows) * static_cast<size_t>(columns));
+		for (int row = 0; row < rows; ++row)
+		{
+			for (int column = 0; column < columns; ++column)
+			{
+				cells.push_back(decode_cell(result.get(), row, column));
+			}
+		}
+		timing.lap(query_phase::decode);
+
+		std::vector<std::shared_ptr<container_module::value>> units;
+		units.reserve(rows);
+		for (int row = 0; row < rows; ++row)
+		{
+			std::vector<std::shared_ptr<container_module::value>> values;
+			values.reserve(columns);
+			for (int column = 0; column < columns; ++column)
+			{
+				values.push_back(build_value(
+					PQfname(result.get(), column),
+					cells[static_cast<size_t>(row) * static_cast<size_t>(columns) + column]));
+			}
+
+			units.push_back(std::make_shared<container_module::container_value>(
+				"row", std::move(values)));
+		}
+
+		decode.set_attribute("db.rows", static_cast<int64_t>(rows));
+		span.set_attribute("db.rows", static_cast<int64_t>(rows));
+		timing.set_rows(rows);
+
+		auto container = std::make_unique<container_module::value_container>("query", units);
+		timing.lap(query_phase::container_build);
 
 		return container;
 	}
 
-	bool postgres_manager::disconnect(void)
+	bool postgres_manager::prepare(const std::string& name, const std::string& query_string)
 	{
-		if (connection_ == nullptr)
+		last_error_state_.clear();
+		if (!ensure_connected())
+		{
+			return false;
+		}
+
+		scoped_span span(span_kind::query);
+		span.set_attribute("db.system", "postgresql");
+		span.set_attribute("db.statement.name", name);
+		span.set_statement(query_string);
+
+		// Names in the statement are resolved with the search_path in
+		// effect when it is prepared.
+		if (!apply_session(span))
+		{
+			return false;
+		}
+
+		std::string converted_query_string = query_string;
+		if (!is_ascii(query_string.c_str(), query_string.size()))
+		{
+			auto [converted_string, error_message]
+				= convert_string::utf8_to_system(query_string);
+			if (error_message.has_value())
+			{
+				span.set_error("", error_message.value());
+				return false;
+			}
+			converted_query_string = std::move(converted_string.value());
+		}
+
+		pg_result_handle result(PQprepare(connection_.get(), name.c_str(),
+										  converted_query_string.c_str(), 0, nullptr));
+		if (!succeeded(result.get()))
 		{
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+
 			return false;
 		}
 
-		PQfinish((PGconn*)connection_);
-		connection_ = nullptr;
+		prepared_statements_[name] = std::move(converted_query_string);
 
 		return true;
 	}
 
-	void* postgres_manager::query_result(const std::string& query_string)
+	bool postgres_manager::is_prepared(const std::string& name) const
 	{
-		if (connection_ == nullptr)
+		return prepared_statements_.count(name) != 0;
+	}
+
+	bool postgres_manager::execute_prepared(const std::string& name,
+											std::span<const char* const> parameters,
+											result_buffer& output)
+	{
+		scoped_in_flight in_flight;
+		scoped_query_timing timing(name);
+		scoped_span span(span_kind::query);
+		span.set_attribute("db.system", "postgresql");
+		span.set_attribute("db.statement.name", name);
+		database_metrics::handle().record_prepared_lookup(prepared_statements_.count(name) != 0);
+
+		output.reset(0);
+		last_error_state_.clear();
+		if (!ensure_connected())
 		{
-			return nullptr;
+			record_error(span, connection_.get(), nullptr);
+			timing.set_failed();
+
+			return false;
+		}
+		if (!apply_session(span))
+		{
+			timing.set_failed();
+
+			return false;
 		}
 
-		if (PQstatus((PGconn*)connection_) != CONNECTION_OK)
 		{
-			PQfinish((PGconn*)connection_);
-			connection_ = nullptr;
+			scoped_span execute(span_kind::execute);
 
-			return nullptr;
+			// Parameters are sent as they are unless one of them needs an
+			// encoding conversion; only that case allocates.
+			size_t bytes = name.size();
+			bool ascii = true;
+			for (const char* parameter : parameters)
+			{
+				if (parameter == nullptr)
+				{
+					continue;
+				}
+
+				const size_t length = std::strlen(parameter);
+				bytes += length;
+				ascii = ascii && is_ascii(parameter, length);
+			}
+
+			std::vector<std::string> converted;
+			std::vector<const char*> converted_values;
+			const char* const* values = parameters.data();
+			if (!ascii)
+			{
+				converted.reserve(parameters.size());
+				for (const char* parameter : parameters)
+				{
+					if (parameter == nullptr)
+					{
+						converted.emplace_back();
+						converted_values.push_back(nullptr);
+						continue;
+					}
+
+					auto [converted_string, error_message]
+						= convert_string::utf8_to_system(parameter);
+					if (error_message.has_value())
+					{
+						execute.set_error("", error_message.value());
+						timing.set_failed();
+						return false;
+					}
+					converted.push_back(std::move(converted_string.value()));
+					converted_values.push_back(converted.back().c_str());
+				}
+				values = converted_values.data();
+			}
+			timing.lap(query_phase::encode);
+
+			if (PQsendQueryPrepared(connection_.get(), name.c_str(),
+									static_cast<int>(parameters.size()), values, nullptr,
+									nullptr, 0)
+				== 0)
+			{
+				execute.set_error("", PQerrorMessage(connection_.get()));
+				record_error(span, connection_.get(), nullptr);
+				timing.set_failed();
+
+				return false;
+			}
+
+			database_metrics::handle().add_bytes_sent(bytes);
+			execute.set_attribute("db.bytes_sent", static_cast<int64_t>(bytes));
 		}
 
-		auto [converted_string, error_message]
-			= convert_string::utf8_to_system(query_string);
-		if (error_message.has_value())
+		pg_result_handle result = collect_result();
+		if (!succeeded(result.get()))
+		{
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+			timing.set_failed();
+
+			return false;
+		}
+
+		scoped_span decode(span_kind::decode);
+
+		const int rows = PQntuples(result.get());
+		const int columns = PQnfields(result.get());
+
+		output.reset(static_cast<size_t>(columns));
+		for (int column = 0; column < columns; ++column)
+		{
+			output.set_column_name(static_cast<size_t>(column), PQfname(result.get(), column));
+		}
+
+		for (int row = 0; row < rows; ++row)
+		{
+			for (int column = 0; column < columns; ++column)
+			{
+				const decoded_cell cell = decode_cell(result.get(), row, column);
+				const std::string_view text(
+					cell.text == nullptr ? "" : cell.text,
+					cell.text == nullptr ? 0
+										 : static_cast<size_t>(PQgetlength(result.get(), row, column)));
+
+				switch (cell.kind)
+				{
+				case decoded_cell::kinds::null:
+					output.append_null();
+					break;
+				case decoded_cell::kinds::boolean:
+					output.append_boolean(cell.integer != 0, text);
+					break;
+				case decoded_cell::kinds::integer:
+				case decoded_cell::kinds::big_integer:
+					output.append_integer(cell.integer, text);
+					break;
+				case decoded_cell::kinds::real:
+					output.append_real(cell.real, text);
+					break;
+				case decoded_cell::kinds::text:
+					output.append_text(text);
+					break;
+				}
+			}
+		}
+		output.set_affected_rows(affected_rows(result.get()));
+		timing.lap(query_phase::decode);
+		timing.set_rows(rows != 0 ? rows : static_cast<int64_t>(output.affected_rows()));
+
+		decode.set_attribute("db.rows", static_cast<int64_t>(rows));
+		span.set_attribute("db.rows", static_cast<int64_t>(rows));
+
+		return true;
+	}
+
+	bulk_write_result postgres_manager::bulk_write(const std::string& statement_prefix,
+												   std::span<const std::string> rows,
+												   const std::string& statement_suffix)
+	{
+		scoped_in_flight in_flight;
+		scoped_query_timing timing(statement_prefix);
+		scoped_span span(span_kind::query);
+		span.set_attribute("db.system", "postgresql");
+		span.set_statement(statement_prefix);
+
+		bulk_write_result outcome;
+		last_error_state_.clear();
+		if (rows.empty())
+		{
+			outcome.completed = true;
+			return outcome;
+		}
+		if (!ensure_connected())
+		{
+			record_error(span, connection_.get(), nullptr);
+			timing.set_failed();
+
+			return outcome;
+		}
+
+		const PGTransactionStatusType status = PQtransactionStatus(connection_.get());
+		if (status != PQTRANS_IDLE && status != PQTRANS_INTRANS)
+		{
+			span.set_error("", "not in a usable transaction state");
+			timing.set_failed();
+
+			return outcome;
+		}
+		const bool own_transaction = status == PQTRANS_IDLE;
+
+		// The commands that restore or move the savepoint are sent in
+		// front of the next attempt rather than on their own.
+		std::string lead = own_transaction ? "BEGIN; SAVEPOINT bulk_write; "
+										   : "SAVEPOINT bulk_write; ";
+		bool last_failed = false;
+		std::string statement;
+
+		// Row ranges still to try, the next one last. A range that fails
+		// is replaced by its two halves.
+		std::vector<std::pair<size_t, size_t>> pending{ { 0, rows.size() } };
+		while (!pending.empty())
+		{
+			const auto [first, last] = pending.back();
+			pending.pop_back();
+
+			statement.assign(lead);
+			statement += statement_prefix;
+			for (size_t row = first; row < last; ++row)
+			{
+				if (row != first)
+				{
+					statement += ", ";
+				}
+				statement += rows[row];
+			}
+			statement += statement_suffix;
+
+			pg_result_handle result = query_result(statement);
+			++outcome.round_trips;
+			if (succeeded(result.get()))
+			{
+				outcome.rows_written += affected_rows(result.get());
+				lead = "RELEASE SAVEPOINT bulk_write; SAVEPOINT bulk_write; ";
+				last_failed = false;
+				continue;
+			}
+
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+			if (result == nullptr || !is_row_error(last_error_state_)
+				|| PQtransactionStatus(connection_.get()) != PQTRANS_INERROR)
+			{
+				const std::string state = last_error_state_;
+				if (own_transaction && is_connected())
+				{
+					query_result("ROLLBACK");
+				}
+				last_error_state_ = state;
+				outcome.rows_written = 0;
+				outcome.failed_rows.clear();
+				timing.set_failed();
+
+				return outcome;
+			}
+
+			lead = "ROLLBACK TO SAVEPOINT bulk_write; ";
+			last_failed = true;
+			if (last - first == 1)
+			{
+				outcome.failed_rows.push_back(
+					{ first, last_error_state_, PQresultErrorMessage(result.get()) });
+				continue;
+			}
+
+			const size_t middle = first + (last - first) / 2;
+			pending.emplace_back(middle, last);
+			pending.emplace_back(first, middle);
+		}
+
+		statement = last_failed ? lead : std::string();
+		statement += own_transaction ? "COMMIT" : "RELEASE SAVEPOINT bulk_write";
+		pg_result_handle result = query_result(statement);
+		++outcome.round_trips;
+		if (!succeeded(result.get()))
+		{
+			// A deferred constraint can still reject the whole batch here.
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+			if (own_transaction && is_connected()
+				&& PQtransactionStatus(connection_.get()) != PQTRANS_IDLE)
+			{
+				const std::string state = last_error_state_;
+				query_result("ROLLBACK");
+				last_error_state_ = state;
+			}
+			outcome.rows_written = 0;
+			outcome.failed_rows.clear();
+			timing.set_failed();
+
+			return outcome;
+		}
+
+		outcome.completed = true;
+		timing.set_rows(static_cast<int64_t>(outcome.rows_written));
+		span.set_attribute("db.rows", static_cast<int64_t>(outcome.rows_written));
+		span.set_attribute("db.bulk.failed_rows", static_cast<int64_t>(outcome.failed_rows.size()));
+		span.set_attribute("db.bulk.round_trips", static_cast<int64_t>(outcome.round_trips));
+
+		return outcome;
+	}
+
+	bool postgres_manager::bulk_update(const std::string& table,
+									   const std::string& key_column,
+									   const std::vector<std::string>& columns,
+									   std::span<const bulk_update_row> rows,
+									   uint64_t& updated,
+									   const size_t& chunk_rows)
+	{
+		scoped_in_flight in_flight;
+		scoped_query_timing timing("UPDATE " + table);
+		scoped_span span(span_kind::query);
+		span.set_attribute("db.system", "postgresql");
+		span.set_attribute("db.operation", "bulk_update");
+
+		updated = 0;
+		last_error_state_.clear();
+		if (rows.empty())
+		{
+			return true;
+		}
+		for (const bulk_update_row& row : rows)
+		{
+			if (row.values.size() != columns.size())
+			{
+				span.set_error("", "a row does not have one value per column");
+				timing.set_failed();
+				return false;
+			}
+		}
+		if (!ensure_connected())
+		{
+			record_error(span, connection_.get(), nullptr);
+			timing.set_failed();
+			return false;
+		}
+
+		const bulk_statement* statement = prepare_bulk(table, key_column, columns, true, span);
+		if (statement == nullptr)
+		{
+			timing.set_failed();
+			return false;
+		}
+
+		const size_t chunk = std::max<size_t>(1, chunk_rows);
+		std::vector<std::string> parameters(columns.size() + 1);
+		for (size_t start = 0; start < rows.size(); start += chunk)
+		{
+			const auto part = rows.subspan(start, std::min(chunk, rows.size() - start));
+			bool encoded = encode_array(parameters[0], part.size(), statement->integer_parameters[0],
+										[&](const size_t& index) { return &part[index].key; });
+			for (size_t column = 0; encoded && column < columns.size(); ++column)
+			{
+				encoded = encode_array(parameters[column + 1], part.size(),
+									   statement->integer_parameters[column + 1],
+									   [&](const size_t& index) -> const std::string* {
+										   const auto& value = part[index].values[column];
+										   return value.has_value() ? &value.value() : nullptr;
+									   });
+			}
+			if (!encoded)
+			{
+				span.set_error("", "a value could not be encoded for its column");
+				timing.set_failed();
+				return false;
+			}
+			if (!execute_bulk(*statement, parameters, span, updated))
+			{
+				timing.set_failed();
+				return false;
+			}
+		}
+
+		timing.set_rows(static_cast<int64_t>(updated));
+		span.set_attribute("db.rows", static_cast<int64_t>(updated));
+
+		return true;
+	}
+
+	bool postgres_manager::bulk_delete(const std::string& table,
+									   const std::string& key_column,
+									   std::span<const std::string> keys,
+									   uint64_t& deleted,
+									   const size_t& chunk_rows)
+	{
+		scoped_in_flight in_flight;
+		scoped_query_timing timing("DELETE FROM " + table);
+		scoped_span span(span_kind::query);
+		span.set_attribute("db.system", "postgresql");
+		span.set_attribute("db.operation", "bulk_delete");
+
+		deleted = 0;
+		last_error_state_.clear();
+		if (keys.empty())
+		{
+			return true;
+		}
+		if (!ensure_connected())
+		{
+			record_error(span, connection_.get(), nullptr);
+			timing.set_failed();
+			return false;
+		}
+
+		const bulk_statement* statement = prepare_bulk(table, key_column, {}, false, span);
+		if (statement == nullptr)
+		{
+			timing.set_failed();
+			return false;
+		}
+
+		const size_t chunk = std::max<size_t>(1, chunk_rows);
+		std::vector<std::string> parameters(1);
+		for (size_t start = 0; start < keys.size(); start += chunk)
+		{
+			const auto part = keys.subspan(start, std::min(chunk, keys.size() - start));
+			if (!encode_array(parameters[0], part.size(), statement->integer_parameters[0],
+							  [&](const size_t& index) { return &part[index]; }))
+			{
+				span.set_error("", "a key could not be encoded for its column");
+				timing.set_failed();
+				return false;
+			}
+			if (!execute_bulk(*statement, parameters, span, deleted))
+			{
+				timing.set_failed();
+				return false;
+			}
+		}
+
+		timing.set_rows(static_cast<int64_t>(deleted));
+		span.set_attribute("db.rows", static_cast<int64_t>(deleted));
+
+		return true;
+	}
+
+	const postgres_manager::bulk_statement* postgres_manager::prepare_bulk(
+		const std::string& table,
+		const std::string& key_column,
+		const std::vector<std::string>& columns,
+		const bool& update,
+		scoped_span& span)
+	{
+		std::string shape = (update ? "update\n" : "delete\n") + table + '\n' + key_column;
+		for (const std::string& column : columns)
+		{
+			shape += '\n';
+			shape += column;
+		}
+		const auto found = bulk_statements_.find(shape);
+		if (found != bulk_statements_.end())
+		{
+			return &found->second;
+		}
+
+		// Column types are read once; arrays of text are cast to them on
+		// the server, and integers travel as int8.
+		const char* const table_name[] = { table.c_str() };
+		pg_result_handle types;
+		if (PQsendQueryParams(connection_.get(),
+							  "SELECT a.attname::text, t.typname::text, "
+							  "format_type(a.atttypid, a.atttypmod) "
+							  "FROM pg_attribute a JOIN pg_type t ON t.oid = a.atttypid "
+							  "WHERE a.attrelid = $1::regclass AND a.attnum > 0 AND NOT a.attisdropped",
+							  1, nullptr, table_name, nullptr, nullptr, 0)
+			!= 0)
+		{
+			types = collect_result();
+		}
+		if (!succeeded(types.get()))
+		{
+			last_error_state_ = record_error(span, connection_.get(), types.get(), last_error_state_);
+			return nullptr;
+		}
+
+		bulk_statement statement;
+		std::vector<std::string> parameters;
+		std::vector<std::string> names = { key_column };
+		names.insert(names.end(), columns.begin(), columns.end());
+		for (const std::string& column : names)
+		{
+			int row = 0;
+			while (row < PQntuples(types.get()) && column != PQgetvalue(types.get(), row, 0))
+			{
+				++row;
+			}
+			if (row == PQntuples(types.get()))
+			{
+				span.set_error("", "no column " + column + " in " + table);
+				return nullptr;
+			}
+
+			const std::string type_name = PQgetvalue(types.get(), row, 1);
+			const bool integer = type_name == "int2" || type_name == "int4" || type_name == "int8";
+			const std::string placeholder = "$" + std::to_string(parameters.size() + 1);
+			statement.integer_parameters.push_back(integer);
+			parameters.push_back(integer ? placeholder + "::int8[]"
+										 : placeholder + "::text[]::"
+											   + PQgetvalue(types.get(), row, 2) + "[]");
+		}
+
+		const std::string key = quote_identifier(connection_.get(), key_column);
+		std::string query_string;
+		if (update)
+		{
+			query_string = "UPDATE " + table + " AS target SET ";
+			std::string unnested = "unnest(" + parameters[0];
+			std::string aliases = "(" + key;
+			for (size_t column = 0; column < columns.size(); ++column)
+			{
+				const std::string name = quote_identifier(connection_.get(), columns[column]);
+				query_string += (column == 0 ? "" : ", ") + name + " = source." + name;
+				unnested += ", " + parameters[column + 1];
+				aliases += ", " + name;
+			}
+			query_string += " FROM " + unnested + ") AS source" + aliases + ") WHERE target." + key
+							+ " = source." + key;
+		}
+		else
+		{
+			query_string = "DELETE FROM " + table + " WHERE " + key + " = ANY(" + parameters[0] + ")";
+		}
+
+		statement.name = "bulk_change_" + std::to_string(bulk_statements_.size() + 1);
+		if (!prepare(statement.name, query_string))
+		{
+			span.set_error(last_error_state_, "could not prepare " + query_string);
+			return nullptr;
+		}
+
+		return &bulk_statements_.emplace(std::move(shape), std::move(statement)).first->second;
+	}
+
+	bool postgres_manager::execute_bulk(const bulk_statement& statement,
+										const std::vector<std::string>& parameters,
+										scoped_span& span,
+										uint64_t& affected)
+	{
+		std::vector<const char*> values;
+		std::vector<int> lengths;
+		const std::vector<int> formats(parameters.size(), 1);
+		size_t bytes = statement.name.size();
+		for (const std::string& parameter : parameters)
+		{
+			values.push_back(parameter.data());
+			lengths.push_back(static_cast<int>(parameter.size()));
+			bytes += parameter.size();
+		}
+
+		pg_result_handle result;
+		if (PQsendQueryPrepared(connection_.get(), statement.name.c_str(),
+								static_cast<int>(parameters.size()), values.data(), lengths.data(),
+								formats.data(), 0)
+			!= 0)
+		{
+			database_metrics::handle().add_bytes_sent(bytes);
+			result = collect_result();
+		}
+		if (!succeeded(result.get()))
+		{
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+			return false;
+		}
+
+		affected += affected_rows(result.get());
+		return true;
+	}
+
+	bool postgres_manager::select_columnar(const std::string& query_string,
+										   columnar_result& output,
+										   const size_t& batch_rows,
+										   const std::function<bool(const columnar_result&)>& on_batch)
+	{
+		scoped_in_flight in_flight;
+		scoped_query_timing timing(query_string);
+		scoped_span span(span_kind::query);
+		span.set_attribute("db.system", "postgresql");
+		span.set_statement(query_string);
+
+		output.reset();
+		last_error_state_.clear();
+		if (!ensure_connected())
+		{
+			record_error(span, connection_.get(), nullptr);
+			timing.set_failed();
+			return false;
+		}
+		if (!apply_session(span))
+		{
+			timing.set_failed();
+			return false;
+		}
+
+		std::string query = query_string;
+		while (!query.empty()
+			   && (query.back() == ';' || std::isspace(static_cast<unsigned char>(query.back()))))
+		{
+			query.pop_back();
+		}
+
+		// Binary rows carry no types, so the unnamed statement is prepared
+		// and described to learn them.
+		pg_result_handle described;
+		if (PQsendPrepare(connection_.get(), "", query.c_str(), 0, nullptr) == 1)
+		{
+			described = collect_result();
+		}
+		if (succeeded(described.get()))
+		{
+			described.reset();
+			if (PQsendDescribePrepared(connection_.get(), "") == 1)
+			{
+				described = collect_result();
+			}
+		}
+		if (!succeeded(described.get()))
+		{
+			last_error_state_ = record_error(span, connection_.get(), described.get(), last_error_state_);
+			timing.set_failed();
+			return false;
+		}
+
+		const int fields = PQnfields(described.get());
+		std::vector<Oid> types(static_cast<size_t>(fields));
+		for (int field = 0; field < fields; ++field)
+		{
+			const Oid type = PQftype(described.get(), field);
+			types[static_cast<size_t>(field)] = type;
+			output.add_column(PQfname(described.get(), field), columnar_kind(type));
+		}
+		described.reset();
+
+		binary_copy_decoder decoder(output, std::move(types), batch_rows, on_batch);
+		bool accepted = copy_to(
+			"COPY (" + query + "\n) TO STDOUT (FORMAT binary)",
+			[&](std::string_view data) { return decoder.feed(data); }, span, timing);
+		accepted = accepted && decoder.finish();
+		timing.lap(query_phase::decode);
+
+		const auto rows = static_cast<int64_t>(decoder.rows());
+		timing.set_rows(rows);
+		span.set_attribute("db.rows", rows);
+		if (!accepted)
+		{
+			timing.set_failed();
+		}
+
+		return accepted;
+	}
+
+	bool postgres_manager::copy_out(const std::string& query_string,
+									const std::function<bool(std::string_view)>& on_row)
+	{
+		scoped_in_flight in_flight;
+		scoped_query_timing timing(query_string);
+		scoped_span span(span_kind::query);
+		span.set_attribute("db.system", "postgresql");
+		span.set_statement(query_string);
+
+		int64_t rows = 0;
+		const bool accepted = copy_to(
+			query_string,
+			[&](std::string_view row) {
+				if (!row.empty() && row.back() == '\n')
+				{
+					row.remove_suffix(1);
+				}
+				++rows;
+				return on_row(row);
+			},
+			span, timing);
+
+		timing.set_rows(rows);
+		span.set_attribute("db.rows", rows);
+
+		return accepted;
+	}
+
+	bool postgres_manager::copy_to(const std::string& query_string,
+								   const std::function<bool(std::string_view)>& on_data,
+								   scoped_span& span,
+								   scoped_query_timing& timing)
+	{
+		last_error_state_.clear();
+		if (!ensure_connected() || !apply_session(span))
+		{
+			timing.set_failed();
+			return false;
+		}
+
+		if (PQsendQuery(connection_.get(), query_string.c_str()) == 0)
+		{
+			span.set_error("", PQerrorMessage(connection_.get()));
+			timing.set_failed();
+			return false;
+		}
+		database_metrics::handle().add_bytes_sent(query_string.size());
+		timing.lap(query_phase::send);
+
+		const bool bounded = response_timeout_.count() > 0;
+		auto timed_out = [&]() {
+			span.set_error("", "timed out waiting for the server");
+			timing.set_failed();
+			connection_.reset();
+			return false;
+		};
+
+		if (bounded && !wait_for_result(connection_.get(), response_timeout_))
+		{
+			return timed_out();
+		}
+		pg_result_handle result(PQgetResult(connection_.get()));
+		if (PQresultStatus(result.get()) != PGRES_COPY_OUT)
+		{
+			// Not a COPY TO: collect whatever else the statement returned.
+			if (result != nullptr && !take_results(connection_.get(), response_timeout_, result))
+			{
+				return timed_out();
+			}
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+			timing.set_failed();
+			return false;
+		}
+		timing.lap(query_phase::server_first_byte);
+
+		// Each message is released as soon as it is handed over, so at
+		// most one is held however large the output.
+		bool accepted = true;
+		uint64_t bytes = 0;
+		for (;;)
+		{
+			char* buffer = nullptr;
+			const int length = PQgetCopyData(connection_.get(), &buffer, 1);
+			if (length > 0)
+			{
+				accepted = accepted && on_data(std::string_view(buffer, static_cast<size_t>(length)));
+				PQfreemem(buffer);
+				bytes += static_cast<uint64_t>(length);
+				continue;
+			}
+			if (length < 0)
+			{
+				break;
+			}
+
+			// Nothing buffered yet.
+			if (!wait_readable(connection_.get(),
+							   bounded ? static_cast<int>(response_timeout_.count()) : -1))
+			{
+				return timed_out();
+			}
+			if (PQconsumeInput(connection_.get()) == 0)
+			{
+				break;
+			}
+		}
+		timing.lap(query_phase::transfer);
+		database_metrics::handle().add_bytes_received(bytes);
+
+		if (!take_results(connection_.get(), response_timeout_, result))
+		{
+			return timed_out();
+		}
+		if (!succeeded(result.get()))
+		{
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+			timing.set_failed();
+			return false;
+		}
+
+		if (!accepted)
+		{
+			span.set_error("", "copy rows were rejected");
+			timing.set_failed();
+		}
+
+		return accepted;
+	}
+
+	bool postgres_manager::copy_in(const std::string& query_string,
+								   std::string_view data,
+								   uint64_t& rows)
+	{
+		scoped_in_flight in_flight;
+		scoped_query_timing timing(query_string);
+		scoped_span span(span_kind::query);
+		span.set_attribute("db.system", "postgresql");
+		span.set_statement(query_string);
+
+		rows = 0;
+		last_error_state_.clear();
+		if (!ensure_connected() || !apply_session(span))
+		{
+			timing.set_failed();
+			return false;
+		}
+
+		if (PQsendQuery(connection_.get(), query_string.c_str()) == 0)
+		{
+			span.set_error("", PQerrorMessage(connection_.get()));
+			timing.set_failed();
+			return false;
+		}
+		database_metrics::handle().add_bytes_sent(query_string.size());
+		timing.lap(query_phase::send);
+
+		auto timed_out = [&]() {
+			span.set_error("", "timed out waiting for the server");
+			timing.set_failed();
+			connection_.reset();
+			return false;
+		};
+
+		if (response_timeout_.count() > 0 && !wait_for_result(connection_.get(), response_timeout_))
+		{
+			return timed_out();
+		}
+		pg_result_handle result(PQgetResult(connection_.get()));
+		if (PQresultStatus(result.get()) != PGRES_COPY_IN)
+		{
+			// Not a COPY FROM: collect whatever else the statement returned.
+			if (result != nullptr && !take_results(connection_.get(), response_timeout_, result))
+			{
+				return timed_out();
+			}
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+			timing.set_failed();
+			return false;
+		}
+		result.reset();
+		timing.lap(query_phase::server_first_byte);
+
+		// Pieces keep libpq's output buffer small however large the input
+		// is; the server does not care where they are cut.
+		constexpr size_t piece_bytes = 256 * 1024;
+		bool sent = true;
+		for (size_t offset = 0; sent && offset < data.size(); offset += piece_bytes)
+		{
+			const size_t size = std::min(piece_bytes, data.size() - offset);
+			sent = PQputCopyData(connection_.get(), data.data() + offset, static_cast<int>(size)) == 1;
+		}
+		if (PQputCopyEnd(connection_.get(), sent ? nullptr : "client could not send the data") != 1)
+		{
+			span.set_error("", PQerrorMessage(connection_.get()));
+			timing.set_failed();
+			connection_.reset();
+			return false;
+		}
+		database_metrics::handle().add_bytes_sent(data.size());
+		span.set_attribute("db.bytes_sent", static_cast<int64_t>(data.size()));
+		timing.lap(query_phase::transfer);
+
+		if (!take_results(connection_.get(), response_timeout_, result))
+		{
+			return timed_out();
+		}
+		if (!succeeded(result.get()))
+		{
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+			timing.set_failed();
+			return false;
+		}
+
+		rows = affected_rows(result.get());
+		timing.set_rows(static_cast<int64_t>(rows));
+		span.set_attribute("db.rows", static_cast<int64_t>(rows));
+
+		return true;
+	}
+
+	bool postgres_manager::listen(const std::string& channel)
+	{
+		if (!ensure_connected())
+		{
+			return false;
+		}
+
+		if (!create_query("LISTEN " + quote_identifier(connection_.get(), channel)))
+		{
+			return false;
+		}
+
+		listen_channels_.insert(channel);
+		return true;
+	}
+
+	bool postgres_manager::is_listening(const std::string& channel) const
+	{
+		return listen_channels_.count(channel) != 0;
+	}
+
+	bool postgres_manager::wait_notification(const std::chrono::milliseconds& timeout,
+											 std::string& channel,
+											 std::string& payload)
+	{
+		return wait_notification(timeout, nullptr, channel, payload);
+	}
+
+	bool postgres_manager::wait_notification(
+		const std::chrono::milliseconds& timeout,
+		const std::function<bool(std::string_view, std::string_view)>& wanted,
+		std::string& channel,
+		std::string& payload)
+	{
+		constexpr size_t max_kept_notifications = 4096;
+
+		for (auto kept = notifications_.begin(); kept != notifications_.end(); ++kept)
+		{
+			if (wanted == nullptr || wanted(kept->first, kept->second))
+			{
+				channel = std::move(kept->first);
+				payload = std::move(kept->second);
+				notifications_.erase(kept);
+				return true;
+			}
+		}
+
+		if (!ensure_connected())
+		{
+			return false;
+		}
+
+		const auto deadline = std::chrono::steady_clock::now() + timeout;
+		for (;;)
+		{
+			PQconsumeInput(connection_.get());
+			for (;;)
+			{
+				std::unique_ptr<PGnotify, void (*)(void*)> notification(PQnotifies(connection_.get()),
+																		PQfreemem);
+				if (notification == nullptr)
+				{
+					break;
+				}
+				if (wanted == nullptr || wanted(notification->relname, notification->extra))
+				{
+					channel = notification->relname;
+					payload = notification->extra;
+					return true;
+				}
+				if (notifications_.size() == max_kept_notifications)
+				{
+					notifications_.pop_front();
+				}
+				notifications_.emplace_back(notification->relname, notification->extra);
+			}
+
+			const auto remaining
+				= std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			if (remaining.count() <= 0
+				|| !wait_readable(connection_.get(), static_cast<int>(remaining.count()))
+				|| !is_connected())
+			{
+				return false;
+			}
+		}
+	}
+
+	bool postgres_manager::disconnect(void)
+	{
+		if (connection_ == nullptr)
+		{
+			return false;
+		}
+
+		connection_.reset();
+		connect_string_.clear();
+		in_transaction_ = false;
+		transaction_lost_ = false;
+		search_path_.clear();
+		prepared_statements_.clear();
+		listen_channels_.clear();
+		notifications_.clear();
+		auto_statements_.clear();
+		auto_rejected_.clear();
+		session_ = session_state();
+		bulk_statements_.clear();
+
+		return true;
+	}
+
+	bool postgres_manager::is_connected(void)
+	{
+		return connection_ != nullptr && PQstatus(connection_.get()) == CONNECTION_OK;
+	}
+
+	bool postgres_manager::is_idle(void)
+	{
+		return is_connected() && PQtransactionStatus(connection_.get()) == PQTRANS_IDLE;
+	}
+
+	std::string postgres_manager::session_identity(void)
+	{
+		if (search_path_.empty())
+		{
+			pg_result_handle result = query_result("SELECT current_setting('search_path')");
+			if (PQresultStatus(result.get()) != PGRES_TUPLES_OK || PQntuples(result.get()) != 1)
+			{
+				return std::string();
+			}
+			search_path_ = PQgetvalue(result.get(), 0, 0);
+		}
+
+		pg_conn* connection = connection_.get();
+		const char* parts[] = { PQhost(connection), PQport(connection), PQdb(connection),
+								PQuser(connection), search_path_.c_str() };
+		std::string identity;
+		for (const char* part : parts)
+		{
+			identity.append(part != nullptr ? part : "");
+			identity.push_back('\0');
+		}
+		return identity;
+	}
+
+	void postgres_manager::set_auto_reconnect(const bool& enabled) { auto_reconnect_ = enabled; }
+
+	void postgres_manager::set_response_timeout(const std::chrono::milliseconds& timeout)
+	{
+		response_timeout_ = timeout;
+	}
+
+	bool postgres_manager::ensure_connected(void)
+	{
+		if (is_connected())
+		{
+			// Remembered for the case that this statement loses the
+			// connection.
+			in_transaction_ = PQtransactionStatus(connection_.get()) != PQTRANS_IDLE;
+			return true;
+		}
+
+		// A new session would run the rest of the caller's transaction in
+		// autocommit and turn its COMMIT into a no-op, so nothing is sent
+		// until the caller rolls back or connects again.
+		transaction_lost_ = transaction_lost_ || in_transaction_;
+		in_transaction_ = false;
+		if (transaction_lost_)
+		{
+			last_error_state_ = "08003";
+			return false;
+		}
+
+		if (!auto_reconnect_ || connect_string_.empty())
+		{
+			return false;
+		}
+
+		scoped_span span(span_kind::connect);
+		span.set_attribute("db.system", "postgresql");
+		span.set_attribute("db.connect.reason", "reconnect");
+
+		connection_.reset(connect_within(connect_string_, response_timeout_));
+		search_path_.clear();
+		if (PQstatus(connection_.get()) != CONNECTION_OK)
+		{
+			span.set_error("", connection_ == nullptr ? "timed out connecting"
+													  : PQerrorMessage(connection_.get()));
+			connection_.reset();
+			database_metrics::handle().record_reconnect(false);
+
+			return false;
+		}
+
+		// Prepared statements live in the server session, so they are
+		// recreated; one that no longer prepares fails when executed.
+		for (const auto& [name, query_string] : prepared_statements_)
+		{
+			pg_result_handle result;
+			if (PQsendPrepare(connection_.get(), name.c_str(), query_string.c_str(), 0, nullptr)
+					== 0
+				|| !take_results(connection_.get(), response_timeout_, result))
+			{
+				span.set_error("", "could not prepare statements again");
+				connection_.reset();
+				database_metrics::handle().record_reconnect(false);
+
+				return false;
+			}
+			if (!succeeded(result.get()))
+			{
+				record_error(span, connection_.get(), result.get());
+			}
+		}
+		for (const auto& channel : listen_channels_)
+		{
+			pg_result_handle result;
+			const std::string statement = "LISTEN " + quote_identifier(connection_.get(), channel);
+			if (PQsendQuery(connection_.get(), statement.c_str()) == 0
+				|| !take_results(connection_.get(), response_timeout_, result))
+			{
+				span.set_error("", "could not listen again");
+				connection_.reset();
+				database_metrics::handle().record_reconnect(false);
+
+				return false;
+			}
+		}
+		// Settings are applied again with the next statement.
+		session_.reconnected();
+		database_metrics::handle().record_reconnect(true);
+
+		return true;
+	}
+
+	void postgres_manager::set_auto_parameterize(const bool& enabled)
+	{
+		auto_parameterize_ = enabled;
+	}
+
+	bool postgres_manager::send_parameterized(const std::string& query_string)
+	{
+		constexpr size_t max_auto_statements = 1024;
+		constexpr size_t max_parameters = 32767;
+
+		std::string text;
+		std::vector<std::string> values;
+		if (!parameterize_statement(query_string, text, values) || values.size() > max_parameters
+			|| auto_rejected_.count(text) != 0)
+		{
+			return false;
+		}
+
+		auto found = auto_statements_.find(text);
+		database_metrics::handle().record_prepared_lookup(found != auto_statements_.end());
+		if (found == auto_statements_.end())
+		{
+			// A failed Parse inside a transaction block would abort it.
+			if (auto_statements_.size() >= max_auto_statements
+				|| PQtransactionStatus(connection_.get()) != PQTRANS_IDLE)
+			{
+				return false;
+			}
+
+			const std::string name = "auto_param_" + std::to_string(auto_statements_.size() + 1);
+			pg_result_handle prepared;
+			if (PQsendPrepare(connection_.get(), name.c_str(), text.c_str(), 0, nullptr) == 0)
+			{
+				return false;
+			}
+			if (!take_results(connection_.get(), response_timeout_, prepared))
+			{
+				connection_.reset();
+				return false;
+			}
+			if (!succeeded(prepared.get()))
+			{
+				// A missing table may be created later; anything else,
+				// such as a parameter whose type cannot be inferred, will
+				// not prepare next time either.
+				const char* sqlstate = PQresultErrorField(prepared.get(), PG_DIAG_SQLSTATE);
+				if ((sqlstate == nullptr || std::strcmp(sqlstate, "42P01") != 0)
+					&& auto_rejected_.size() < max_auto_statements)
+				{
+					auto_rejected_.insert(std::move(text));
+				}
+				return false;
+			}
+
+			prepared_statements_[name] = text;
+			found = auto_statements_.emplace(std::move(text), name).first;
+		}
+
+		std::vector<const char*> parameters;
+		parameters.reserve(values.size());
+		for (const auto& value : values)
+		{
+			parameters.push_back(value.c_str());
+		}
+
+		return PQsendQueryPrepared(connection_.get(), found->second.c_str(),
+								   static_cast<int>(parameters.size()), parameters.data(), nullptr,
+								   nullptr, 0)
+			   != 0;
+	}
+
+	const std::string& postgres_manager::last_error_state(void) const
+	{
+		return last_error_state_;
+	}
+
+	pg_result_handle postgres_manager::query_result(const std::string& query_string)
+	{
+		last_error_state_.clear();
+
+		// Rolling back the lost transaction is what the caller owes; the
+		// server already did it, so the ROLLBACK runs on the new session.
+		if (transaction_lost_ && is_rollback(query_string))
+		{
+			transaction_lost_ = false;
+		}
+
+		if (!ensure_connected())
+		{
+			return nullptr;
+		}
+
+		if (session_.pending() || session_state::changes_settings(query_string)
+			|| contains_ignoring_case(query_string, "search_path"))
+		{
+			search_path_.clear();
+		}
+
+		scoped_query_timing* timing = scoped_query_timing::current();
+
+		// Pending session settings travel in front of the statement, in
+		// the same message and the same implicit transaction. Statements
+		// that must not run in a transaction block get them separately.
+		const bool in_transaction = PQtransactionStatus(connection_.get()) != PQTRANS_IDLE;
+		session_.begin(in_transaction);
+		if (session_.pending() && !session_state::can_carry(query_string))
+		{
+			pg_result_handle applied = send_session();
+			if (!succeeded(applied.get()))
+			{
+				return applied;
+			}
+		}
+		const bool with_settings = session_.pending();
+		const std::string prefixed
+			= with_settings ? session_.statement() + ";\n" + query_string : std::string();
+		const std::string& text = with_settings ? prefixed : query_string;
+
+		{
+			scoped_span execute(span_kind::execute);
+
+			std::string converted_query_string;
+			const char* statement = text.c_str();
+			size_t statement_size = text.size();
+			if (!is_ascii(statement, statement_size))
+			{
+				auto [converted_string, error_message]
+					= convert_string::utf8_to_system(text);
+				if (error_message.has_value())
+				{
+					execute.set_error("", error_message.value());
+					return nullptr;
+				}
+
+				converted_query_string = std::move(converted_string.value());
+				statement = converted_query_string.c_str();
+				statement_size = converted_query_string.size();
+			}
+			if (timing != nullptr)
+			{
+				timing->lap(query_phase::encode);
+			}
+
+			const bool parameterized = auto_parameterize_ && statement == query_string.c_str()
+									   && send_parameterized(query_string);
+			if (!parameterized && PQsendQuery(connection_.get(), statement) == 0)
+			{
+				execute.set_error("", PQerrorMessage(connection_.get()));
+				return nullptr;
+			}
+			execute.set_attribute("db.auto_parameterized", parameterized ? "true" : "false");
+
+			database_metrics::handle().add_bytes_sent(statement_size);
+			execute.set_attribute("db.bytes_sent", static_cast<int64_t>(statement_size));
+		}
+
+		pg_result_handle result = collect_result();
+		if (with_settings && result != nullptr)
+		{
+			session_.applied(succeeded(result.get()),
+							 in_transaction || PQtransactionStatus(connection_.get()) != PQTRANS_IDLE);
+		}
+		if (session_state::changes_settings(query_string))
+		{
+			session_.forget();
+		}
+
+		return result;
+	}
+
+	bool postgres_manager::set_session(const std::string& name, const std::string& value)
+	{
+		if (is_connected())
+		{
+			session_.begin(PQtransactionStatus(connection_.get()) != PQTRANS_IDLE);
+		}
+		return session_.set(name, value);
+	}
+
+	bool postgres_manager::reset_session(void)
+	{
+		if (is_connected())
+		{
+			session_.begin(PQtransactionStatus(connection_.get()) != PQTRANS_IDLE);
+		}
+		if (session_.at_baseline())
+		{
+			session_.reset();
+			return true;
+		}
+
+		session_.reset();
+		if (!create_query("RESET ALL"))
+		{
+			session_.forget();
+			return false;
+		}
+		session_.reset();
+		if (PQtransactionStatus(connection_.get()) != PQTRANS_IDLE)
+		{
+			// Undone if the transaction block rolls back.
+			session_.forget();
+		}
+
+		return true;
+	}
+
+	bool postgres_manager::apply_session(scoped_span& span)
+	{
+		session_.begin(PQtransactionStatus(connection_.get()) != PQTRANS_IDLE);
+		if (!session_.pending())
+		{
+			return true;
+		}
+
+		pg_result_handle result = send_session();
+		if (!succeeded(result.get()))
+		{
+			last_error_state_ = record_error(span, connection_.get(), result.get(), last_error_state_);
+			return false;
+		}
+
+		return true;
+	}
+
+	pg_result_handle postgres_manager::send_session(void)
+	{
+		const bool in_transaction = PQtransactionStatus(connection_.get()) != PQTRANS_IDLE;
+		const std::string statement = session_.statement();
+		search_path_.clear();
+		if (PQsendQuery(connection_.get(), statement.c_str()) == 0)
+		{
+			return nullptr;
+		}
+
+		pg_result_handle result = collect_result();
+		if (result != nullptr)
+		{
+			session_.applied(succeeded(result.get()),
+							 in_transaction || PQtransactionStatus(connection_.get()) != PQTRANS_IDLE);
+		}
+
+		return result;
+	}
+
+	pg_result_handle postgres_manager::collect_result(void)
+	{
+		scoped_query_timing* timing = scoped_query_timing::current();
+
+		scoped_span fetch(span_kind::fetch);
+
+		const bool bounded = response_timeout_.count() > 0;
+		bool answered = true;
+		if (timing != nullptr && timing->active())
+		{
+			timing->lap(query_phase::send);
+			answered = wait_readable(connection_.get(),
+									 bounded ? static_cast<int>(response_timeout_.count()) : -1);
+			timing->lap(query_phase::server_first_byte);
+		}
+
+		pg_result_handle result;
+		answered = answered && take_results(connection_.get(), response_timeout_, result);
+
+		// A server that stops answering costs at most the response
+		// timeout; the connection is then dropped, because its protocol
+		// state is unknown, and reopened by the next call.
+		if (!answered)
+		{
+			fetch.set_error("", "timed out waiting for the server");
+			connection_.reset();
+
+			return nullptr;
+		}
+
+		if (timing != nullptr)
+		{
+			timing->lap(query_phase::transfer);
+		}
+
+		if (result == nullptr)
 		{
+			fetch.set_error("", PQerrorMessage(connection_.get()));
 			return nullptr;
 		}
 
-		auto converted_query_string = converted_string.value();
+		const int64_t received = result_bytes(result.get());
+		database_metrics::handle().add_bytes_received(static_cast<uint64_t>(received));
+		fetch.set_attribute("db.rows", static_cast<int64_t>(PQntuples(result.get())));
+		fetch.set_attribute("db.bytes_received", received);
 
-		return PQexec((PGconn*)connection_, converted_query_string.c_str());
+		return result;
 	}
 }; // namespace database
\ No newline at end of file
@@ -30,10 +30,94 @@ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *****************************************************************************/
 
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "columnar_result.h"
 #include "database_base.h"
+#include "result_buffer.h"
+#include "session_state.h"
+
+// libpq's PGconn and PGresult are typedefs of these; declaring them here
+// keeps libpq-fe.h out of this header.
+struct pg_conn;
+struct pg_result;
 
 namespace database
 {
+	class scoped_query_timing;
+	class scoped_span;
+
+	/**
+	 * @brief Closes a libpq connection with @c PQfinish.
+	 */
+	struct pg_connection_deleter
+	{
+		void operator()(pg_conn* connection) const;
+	};
+
+	/**
+	 * @brief Frees a libpq result with @c PQclear.
+	 */
+	struct pg_result_deleter
+	{
+		void operator()(pg_result* result) const;
+	};
+
+	/**
+	 * @brief Owning libpq connection; closed when reset or destroyed.
+	 */
+	using pg_connection_handle = std::unique_ptr<pg_conn, pg_connection_deleter>;
+
+	/**
+	 * @brief Owning libpq result; cleared when reset or destroyed, so
+	 *        every early return releases it.
+	 */
+	using pg_result_handle = std::unique_ptr<pg_result, pg_result_deleter>;
+
+	/**
+	 * @brief A row of a bulk write that the server rejected.
+	 */
+	struct bulk_write_error
+	{
+		size_t row; ///< Index into the rows passed to @c bulk_write.
+		std::string state; ///< SQLSTATE, e.g. "23505".
+		std::string message; ///< Server error message.
+	};
+
+	/**
+	 * @brief Outcome of @c postgres_manager::bulk_write.
+	 */
+	struct bulk_write_result
+	{
+		bool completed = false; ///< @c false if the batch was abandoned and nothing written.
+		uint64_t rows_written = 0; ///< Rows reported by the statements that succeeded.
+		size_t round_trips = 0; ///< Statements sent, including the first attempt.
+		std::vector<bulk_write_error> failed_rows; ///< Rejected rows in ascending order.
+	};
+
+	/**
+	 * @brief One row for @c postgres_manager::bulk_update: its key and the
+	 *        new value of each updated column, @c std::nullopt for NULL.
+	 */
+	struct bulk_update_row
+	{
+		std::string key;
+		std::vector<std::optional<std::string>> values;
+	};
+
 	/**
 	 * @class postgres_manager
 	 * @brief Manages PostgreSQL database operations.
@@ -41,6 +125,11 @@ namespace database
 	 * This class provides an implementation of the @c database_base interface
 	 * for PostgreSQL databases. It defines methods for connecting, querying,
 	 * and disconnecting from a PostgreSQL database.
+	 *
+	 * A failed statement leaves the connection open. If the connection
+	 * itself is lost, the next call reconnects with the string given to
+	 * @c connect and prepares the statements created with @c prepare
+	 * again; the call that saw the failure is not retried.
 	 */
 	class postgres_manager : public database_base
 	{
@@ -51,7 +140,7 @@ namespace database
 		postgres_manager(void);
 
 		/**
-		 * @brief Destructor.
+		 * @brief Destructor. Closes the connection if it is still open.
 		 */
 		virtual ~postgres_manager(void);
 
@@ -135,16 +224,355 @@ namespace database
 		 */
 		bool disconnect(void) override;
 
+		/**
+		 * @brief Checks whether a healthy server connection is open.
+		 *
+		 * @return @c true if connected and the connection status is OK,
+		 *         @c false otherwise.
+		 */
+		bool is_connected(void);
+
+		/**
+		 * @brief Checks whether the connection is healthy and outside a
+		 *        transaction block, i.e. safe to hand to another caller.
+		 */
+		bool is_idle(void);
+
+		/**
+		 * @brief Identifies what unqualified names resolve to on this
+		 *        connection: host, port, database, user and search_path.
+		 *
+		 * Results cached under this identity are valid for any connection
+		 * that returns the same one. The search_path is read from the
+		 * server once and again after a reconnect or a statement that
+		 * may have changed it.
+		 *
+		 * @return An empty string if not connected or the search_path
+		 *         could not be read.
+		 */
+		std::string session_identity(void);
+
+		/**
+		 * @brief Enables or disables reconnecting on the next call after
+		 *        the connection was lost. Enabled by default.
+		 *
+		 * A connection lost inside a transaction block is not replaced:
+		 * every call fails with SQLSTATE 08003 until the caller sends
+		 * @c ROLLBACK (which then runs on a new session) or calls
+		 * @c connect. The reconnect is bounded by the response timeout.
+		 */
+		void set_auto_reconnect(const bool& enabled);
+
+		/**
+		 * @brief Sets the longest time to wait for the server to answer a
+		 *        statement.
+		 *
+		 * When it passes, the statement fails and the connection is
+		 * closed, so a stalled server cannot block callers indefinitely.
+		 * Zero, the default, waits forever.
+		 */
+		void set_response_timeout(const std::chrono::milliseconds& timeout);
+
+		/**
+		 * @brief Runs plain-text statements as prepared statements with
+		 *        their literals as parameters. Off by default.
+		 *
+		 * A SELECT, INSERT, UPDATE or DELETE sent as text is rewritten by
+		 * @c parameterize_statement and executed as a prepared statement
+		 * named after its normalized text, so statements that differ only
+		 * in literal values share one server-side plan. New statements are
+		 * only prepared outside a transaction block, where a statement
+		 * that does not prepare cannot abort the transaction; such
+		 * statements, and any beyond the first 1024, run as plain text.
+		 * Statement names start with "auto_param_".
+		 */
+		void set_auto_parameterize(const bool& enabled);
+
+		/**
+		 * @brief Requests a run-time setting, such as search_path,
+		 *        statement_timeout or work_mem, for the statements that
+		 *        follow.
+		 *
+		 * The connection tracks what its session is set to and sends only
+		 * settings that differ, so calling this before every statement
+		 * costs nothing when the value is already in place. A setting
+		 * that must be sent travels in the same message as the next
+		 * plain-text statement, so it adds no round trip; before a
+		 * prepared statement or COPY it is sent on its own. If that
+		 * statement fails, the setting is sent again with the next one,
+		 * so an invalid value fails every statement until it is replaced
+		 * with @c set_session or dropped by @c reset_session.
+		 *
+		 * Settings last for the session like SET; after a reconnect they
+		 * are applied again. Settings changed with a plain SET, RESET or
+		 * DISCARD statement are no longer tracked until
+		 * @c reset_session, and settings changed in other ways, such as
+		 * by a function calling @c set_config, are not seen at all.
+		 *
+		 * @return @c false if @p name is not a setting name.
+		 */
+		bool set_session(const std::string& name, const std::string& value);
+
+		/**
+		 * @brief Returns the session to the server defaults with RESET
+		 *        ALL, unless it is known to be there already.
+		 */
+		bool reset_session(void);
+
+		/**
+		 * @brief The tracked session settings.
+		 */
+		const session_state& session(void) const { return session_; }
+
+		/**
+		 * @brief Returns the SQLSTATE of the last failed statement.
+		 *
+		 * Cleared when a statement is sent, so it is empty after a
+		 * success. Also empty when the failure happened before the server
+		 * answered, e.g. because the connection was lost.
+		 *
+		 * @return Five-character SQLSTATE such as "40001", or an empty
+		 *         string.
+		 */
+		const std::string& last_error_state(void) const;
+
+		/**
+		 * @brief Creates a server-side prepared statement.
+		 *
+		 * @param name The statement name used by @c execute_prepared.
+		 * @param query_string SQL with @c $1, @c $2, ... placeholders;
+		 *        parameter types are inferred by the server.
+		 * @return @c true if the statement was prepared.
+		 */
+		bool prepare(const std::string& name, const std::string& query_string);
+
+		/**
+		 * @brief Returns @c true if a statement named @p name was created
+		 *        with @c prepare on this connection.
+		 */
+		bool is_prepared(const std::string& name) const;
+
+		/**
+		 * @brief Executes a prepared statement and decodes its rows into
+		 *        @p output.
+		 *
+		 * Parameters are sent as text; @c nullptr is SQL NULL. When the
+		 * parameters are ASCII and @p output has already grown to fit the
+		 * result, this path makes no C++ heap allocation (libpq still
+		 * allocates the raw result internally), so it can be called in a
+		 * hot loop with a reused buffer.
+		 *
+		 * @param name A statement created with @c prepare.
+		 * @param parameters One null-terminated string per placeholder.
+		 * @param output Receives rows and the affected row count; it is
+		 *        reset first, also on failure.
+		 * @return @c true on success.
+		 */
+		bool execute_prepared(const std::string& name,
+							  std::span<const char* const> parameters,
+							  result_buffer& output);
+
+		/**
+		 * @brief Writes @p rows with one multi-row statement and, if it
+		 *        fails, isolates the rows that caused the failure.
+		 *
+		 * The statement is @p statement_prefix, the rows joined by commas,
+		 * then @p statement_suffix, e.g. "INSERT INTO t (a, b) VALUES ",
+		 * "(1, 'x')", ... and " ON CONFLICT (a) DO NOTHING". It runs under
+		 * a savepoint; when it fails, the savepoint is rolled back and
+		 * each half of the rows is tried again, down to single rows,
+		 * which are reported with their errors. With @c k bad rows among
+		 * @c n this takes about @c 2k*log2(n) statements instead of @c n,
+		 * and each one travels together with the savepoint commands, so
+		 * every attempt is a single round trip.
+		 *
+		 * Outside a transaction block the good rows are committed at the
+		 * end; inside one they are left to the caller's transaction.
+		 * Only data exceptions (class 22), constraint violations (23),
+		 * WITH CHECK OPTION violations (44) and RAISE EXCEPTION (P0001)
+		 * are blamed on rows. Any other error, such as a syntax error, a
+		 * lost connection or a deadlock, abandons the batch, also when a
+		 * single row hits it: a transaction begun here is rolled back, a
+		 * caller's is left for the caller to roll back, and
+		 * @c last_error_state tells why.
+		 *
+		 * @param rows One value tuple per row, e.g. "(1, 'x')"; values
+		 *        must already be quoted.
+		 */
+		bulk_write_result bulk_write(const std::string& statement_prefix,
+									 std::span<const std::string> rows,
+									 const std::string& statement_suffix = "");
+
+		/**
+		 * @brief Updates many rows by key with one set-based statement per
+		 *        chunk instead of one UPDATE per row.
+		 *
+		 * Keys and new values go to the server as binary array
+		 * parameters, one array per column, and are joined to the table
+		 * with
+		 * @c UPDATE @c table @c SET @c ... @c FROM @c unnest($1, $2, ...).
+		 * Values are text, as in a literal, and are cast to the column
+		 * types read from the catalog; integer columns are sent as
+		 * binary int8. The statement is prepared once per table and
+		 * column list. Every @p chunk_rows rows form one statement.
+		 * Outside a transaction block each chunk commits on its own, so
+		 * a failure leaves the earlier chunks applied. A key listed
+		 * twice in one chunk updates its row once, with either value.
+		 *
+		 * @param columns Columns to set, in the order of each row's values.
+		 * @param updated Receives the number of rows updated.
+		 * @return @c true if every chunk succeeded.
+		 */
+		bool bulk_update(const std::string& table,
+						 const std::string& key_column,
+						 const std::vector<std::string>& columns,
+						 std::span<const bulk_update_row> rows,
+						 uint64_t& updated,
+						 const size_t& chunk_rows = 10000);
+
+		/**
+		 * @brief Deletes many rows by key with
+		 *        @c DELETE @c ... @c WHERE @c key @c = @c ANY($1), one
+		 *        statement per @p chunk_rows keys.
+		 *
+		 * Keys are sent as a binary array as in @c bulk_update, and
+		 * chunks commit the same way.
+		 *
+		 * @param deleted Receives the number of rows deleted.
+		 * @return @c true if every chunk succeeded.
+		 */
+		bool bulk_delete(const std::string& table,
+						 const std::string& key_column,
+						 std::span<const std::string> keys,
+						 uint64_t& deleted,
+						 const size_t& chunk_rows = 10000);
+
+		/**
+		 * @brief Runs a @c COPY ... @c TO @c STDOUT statement and passes
+		 *        each data row, as sent by the server, to @p on_row.
+		 *
+		 * Rows arrive in the COPY text (or CSV) format without the
+		 * trailing newline. When @p on_row returns @c false the remaining
+		 * rows are read and discarded and the call fails.
+		 *
+		 * @return @c true if the statement succeeded and every row was
+		 *         accepted.
+		 */
+		bool copy_out(const std::string& query_string,
+					  const std::function<bool(std::string_view)>& on_row);
+
+		/**
+		 * @brief Runs a query through binary @c COPY and decodes its rows
+		 *        straight into @p output, column by column.
+		 *
+		 * The query is sent as @c COPY (query) @c TO @c STDOUT
+		 * @c (FORMAT @c binary), and each row is decoded from the stream
+		 * and released as it arrives. No @c PGresult holding every row is
+		 * built, and numbers are not formatted as text and parsed back.
+		 * Binary rows carry no types, so the statement is described
+		 * first. That costs two more round trips, which large results
+		 * pay back many times over.
+		 *
+		 * bool maps to @c boolean; int2, int4, int8 and oid map to
+		 * @c integer; float4 and float8 map to @c real. timestamp and
+		 * timestamptz map to @c timestamp, and date to @c date. numeric
+		 * maps to @c numeric. Text types, json and jsonb map to @c text.
+		 * Any other type is kept as @c bytes in its binary form.
+		 *
+		 * @param query_string One SELECT, VALUES or TABLE statement
+		 *        without parameters.
+		 * @param output Reset first, also on failure.
+		 * @param batch_rows When not zero, @p output is handed to
+		 *        @p on_batch every @p batch_rows rows (and once more for
+		 *        the rest) and then emptied, so memory stays bounded by
+		 *        one batch. Returning @c false from @p on_batch stops the
+		 *        read and fails the call.
+		 * @return @c true if every row was read and decoded.
+		 */
+		bool select_columnar(const std::string& query_string,
+							 columnar_result& output,
+							 const size_t& batch_rows = 0,
+							 const std::function<bool(const columnar_result&)>& on_batch = nullptr);
+
+		/**
+		 * @brief Runs a @c COPY ... @c FROM @c STDIN statement with
+		 *        @p data as its input.
+		 *
+		 * @p data is sent as it is, in pieces, so it must already be in
+		 * the format named by the statement (text or CSV) and in the
+		 * client encoding. It may end without a trailing newline.
+		 *
+		 * @param rows Receives the number of rows the server loaded.
+		 * @return @c true if the server accepted every row.
+		 */
+		bool copy_in(const std::string& query_string, std::string_view data, uint64_t& rows);
+
+		/**
+		 * @brief Subscribes the session to @c NOTIFY messages on
+		 *        @p channel. The subscription is renewed after a
+		 *        reconnect; notifications sent while disconnected are lost.
+		 */
+		bool listen(const std::string& channel);
+
+		/**
+		 * @brief Returns @c true if @p channel was passed to @c listen on
+		 *        this connection.
+		 */
+		bool is_listening(const std::string& channel) const;
+
+		/**
+		 * @brief Waits up to @p timeout for a notification on a channel
+		 *        passed to @c listen.
+		 *
+		 * Notifications that arrived while other statements ran are
+		 * returned first, without waiting.
+		 *
+		 * @return @c true if one was received.
+		 */
+		bool wait_notification(const std::chrono::milliseconds& timeout,
+							   std::string& channel,
+							   std::string& payload);
+
+		/**
+		 * @brief Waits up to @p timeout for a notification that @p wanted
+		 *        accepts, given its channel and payload.
+		 *
+		 * Notifications it does not accept are kept, in order, for later
+		 * calls, so callers waiting for different channels can share the
+		 * connection. Up to 4096 are kept; older ones are dropped first.
+		 *
+		 * @return @c true if one was received.
+		 */
+		bool wait_notification(
+			const std::chrono::milliseconds& timeout,
+			const std::function<bool(std::string_view, std::string_view)>& wanted,
+			std::string& channel,
+			std::string& payload);
+
 	private:
 		/**
-		 * @brief Executes a generic PostgreSQL query and returns a pointer
-		 *        to the raw result.
+		 * @brief Executes a generic PostgreSQL query and returns the raw
+		 *        result.
+		 *
+		 * The statement is sent with @c PQsendQuery and its result
+		 * collected with @c PQgetResult, so that sending and waiting can
+		 * be traced as separate @c execute and @c fetch spans.
 		 *
 		 * @param query_string The SQL query to be executed.
-		 * @return A pointer to the underlying query result structure,
-		 *         or @c nullptr if an error occurs.
+		 * @return The owned query result, or an empty handle if an error
+		 *         occurs.
+		 */
+		pg_result_handle query_result(const std::string& query_string);
+
+		/**
+		 * @brief Runs a @c COPY ... @c TO @c STDOUT statement and passes
+		 *        each data message to @p on_data, recording failures on
+		 *        @p span and @p timing.
 		 */
-		void* query_result(const std::string& query_string);
+		bool copy_to(const std::string& query_string,
+					 const std::function<bool(std::string_view)>& on_data,
+					 scoped_span& span,
+					 scoped_query_timing& timing);
 
 		/**
 		 * @brief Common implementation for INSERT, UPDATE, and DELETE queries.
@@ -154,8 +582,90 @@ namespace database
 		 */
 		unsigned int execute_modification_query(const std::string& query_string);
 
+		/**
+		 * @brief Waits for the result of the statement just sent and
+		 *        returns the last one, or an empty handle.
+		 */
+		pg_result_handle collect_result(void);
+
+		/**
+		 * @brief Sends @p query_string as an auto-parameterized prepared
+		 *        statement, preparing it first if needed.
+		 *
+		 * @return @c false if it was not sent; the caller then sends the
+		 *         text as it is.
+		 */
+		bool send_parameterized(const std::string& query_string);
+
+		/**
+		 * @brief Returns @c true if the connection is healthy, reconnecting
+		 *        first if it was lost and auto-reconnect is enabled.
+		 */
+		bool ensure_connected(void);
+
+		/**
+		 * @brief Sends pending session settings as a statement of their
+		 *        own, for the paths that cannot carry them in front of
+		 *        their statement.
+		 */
+		bool apply_session(scoped_span& span);
+
+		/**
+		 * @brief Sends the pending session settings and returns their
+		 *        result.
+		 */
+		pg_result_handle send_session(void);
+
+		/**
+		 * @brief A statement prepared for @c bulk_update or
+		 *        @c bulk_delete, and which of its array parameters are
+		 *        int8 rather than text.
+		 */
+		struct bulk_statement
+		{
+			std::string name;
+			std::vector<bool> integer_parameters;
+		};
+
+		/**
+		 * @brief Finds or prepares the bulk statement for a table, key
+		 *        and column list, reading the column types once.
+		 */
+		const bulk_statement* prepare_bulk(const std::string& table,
+										   const std::string& key_column,
+										   const std::vector<std::string>& columns,
+										   const bool& update,
+										   scoped_span& span);
+
+		/**
+		 * @brief Executes a bulk statement with binary array parameters
+		 *        and adds the rows it changed to @p affected.
+		 */
+		bool execute_bulk(const bulk_statement& statement,
+						  const std::vector<std::string>& parameters,
+						  scoped_span& span,
+						  uint64_t& affected);
+
 	private:
-		void* connection_; ///< Pointer to the underlying PostgreSQL connection
-						   ///< object.
+		pg_connection_handle connection_; ///< The underlying PostgreSQL connection.
+		std::string last_error_state_; ///< SQLSTATE of the last failed statement.
+		std::string connect_string_; ///< Converted string of the last successful connect.
+		std::map<std::string, std::string> prepared_statements_; ///< Name to SQL, re-prepared
+																 ///< after a reconnect.
+		std::set<std::string> listen_channels_; ///< Channels listened to again after a reconnect.
+		std::deque<std::pair<std::string, std::string>> notifications_; ///< Channel and payload
+																		///< received, not yet taken.
+		bool in_transaction_; ///< A transaction block was open before the last statement.
+		bool transaction_lost_; ///< The connection was lost inside a transaction block.
+		std::string search_path_; ///< Read by @c session_identity; empty if unknown.
+		bool auto_reconnect_;
+		std::chrono::milliseconds response_timeout_;
+		bool auto_parameterize_;
+		std::unordered_map<std::string, std::string> auto_statements_; ///< Parameterized text to
+																		///< statement name.
+		std::unordered_set<std::string> auto_rejected_; ///< Parameterized text that did not prepare.
+		session_state session_;
+		std::unordered_map<std::string, bulk_statement> bulk_statements_; ///< Table, key and
+																		   ///< columns to statement.
 	};
 } // namespace database
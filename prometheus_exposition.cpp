@@ -0,0 +1,463 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/prometheus_exposition.h"
+
+#include "database/database_metrics.h"
+#include "database/query_timing.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#endif
+
+namespace database
+{
+	namespace
+	{
+		constexpr intptr_t invalid_socket = -1;
+
+#ifdef MSG_NOSIGNAL
+		constexpr int send_flags = MSG_NOSIGNAL;
+#else
+		constexpr int send_flags = 0;
+#endif
+
+		// Upper bounds, in seconds, of the exported latency buckets.
+		constexpr double latency_buckets[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+											   0.005,  0.01,	0.025,	0.05,  0.1,
+											   0.25,   0.5,		1.0,	2.5,   5.0,
+											   10.0 };
+
+		// How long one scrape may take to send its request and receive
+		// the response; a slower client is dropped so it cannot hold the
+		// single serving thread.
+		constexpr std::chrono::milliseconds client_timeout(2000);
+
+		void set_client_timeouts(const intptr_t& socket)
+		{
+#ifdef _WIN32
+			const DWORD timeout = static_cast<DWORD>(client_timeout.count());
+			setsockopt(static_cast<SOCKET>(socket), SOL_SOCKET, SO_RCVTIMEO,
+					   reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+			setsockopt(static_cast<SOCKET>(socket), SOL_SOCKET, SO_SNDTIMEO,
+					   reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+#else
+			timeval timeout{};
+			timeout.tv_sec = static_cast<time_t>(client_timeout.count() / 1000);
+			timeout.tv_usec = static_cast<suseconds_t>((client_timeout.count() % 1000) * 1000);
+			setsockopt(static_cast<int>(socket), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			setsockopt(static_cast<int>(socket), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#endif
+		}
+
+		void close_socket(const intptr_t& socket)
+		{
+#ifdef _WIN32
+			closesocket(static_cast<SOCKET>(socket));
+#else
+			close(static_cast<int>(socket));
+#endif
+		}
+
+		std::string format_double(const double& value)
+		{
+			char buffer[32];
+			std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+
+			return buffer;
+		}
+
+		void append_header(std::string& output, const char* name, const char* type,
+						   const char* help)
+		{
+			output += "# HELP ";
+			output += name;
+			output += " ";
+			output += help;
+			output += "\n# TYPE ";
+			output += name;
+			output += " ";
+			output += type;
+			output += "\n";
+		}
+
+		void append_sample(std::string& output, const char* name,
+						   const std::string& labels, const std::string& value)
+		{
+			output += name;
+			if (!labels.empty())
+			{
+				output += "{" + labels + "}";
+			}
+			output += " " + value + "\n";
+		}
+
+		void append_histogram(std::string& output, const char* name,
+							  const std::string& labels, const latency_histogram& histogram)
+		{
+			const std::string prefix = labels.empty() ? std::string() : labels + ",";
+			const std::string bucket = std::string(name) + "_bucket";
+
+			for (const double& bound : latency_buckets)
+			{
+				const uint64_t count = histogram.count_at_or_below(
+					static_cast<uint64_t>(bound * 1000000000.0));
+				append_sample(output, bucket.c_str(),
+							  prefix + "le=\"" + format_double(bound) + "\"",
+							  std::to_string(count));
+			}
+
+			const uint64_t total = histogram.count();
+			append_sample(output, bucket.c_str(), prefix + "le=\"+Inf\"", std::to_string(total));
+			append_sample(output, (std::string(name) + "_sum").c_str(), labels,
+						  format_double(static_cast<double>(histogram.sum()) / 1000000000.0));
+			append_sample(output, (std::string(name) + "_count").c_str(), labels,
+						  std::to_string(total));
+		}
+
+		std::string escape_label(const std::string& value)
+		{
+			std::string escaped;
+			escaped.reserve(value.size());
+			for (const char& c : value)
+			{
+				if (c == '\\' || c == '"')
+				{
+					escaped.push_back('\\');
+					escaped.push_back(c);
+				}
+				else if (c == '\n')
+				{
+					escaped += "\\n";
+				}
+				else
+				{
+					escaped.push_back(c);
+				}
+			}
+
+			return escaped;
+		}
+	} // namespace
+
+	std::string render_prometheus_metrics(void)
+	{
+		database_metrics& metrics = database_metrics::handle();
+		query_timing& timing = query_timing::handle();
+
+		std::string output;
+		output.reserve(8192);
+
+		const auto pools = metrics.pools();
+		append_header(output, "database_pool_size", "gauge",
+					  "Open connections in the pool, idle or leased.");
+		for (const auto& pool : pools)
+		{
+			append_sample(output, "database_pool_size",
+						  "pool=\"" + escape_label(pool.name) + "\"", std::to_string(pool.size));
+		}
+		append_header(output, "database_pool_max_size", "gauge",
+					  "Maximum number of connections the pool may open.");
+		for (const auto& pool : pools)
+		{
+			append_sample(output, "database_pool_max_size",
+						  "pool=\"" + escape_label(pool.name) + "\"",
+						  std::to_string(pool.max_size));
+		}
+		append_header(output, "database_pool_idle_connections", "gauge",
+					  "Open connections not currently leased.");
+		for (const auto& pool : pools)
+		{
+			append_sample(output, "database_pool_idle_connections",
+						  "pool=\"" + escape_label(pool.name) + "\"", std::to_string(pool.idle));
+		}
+		append_header(output, "database_pool_waiters", "gauge",
+					  "Threads blocked waiting for a connection.");
+		for (const auto& pool : pools)
+		{
+			append_sample(output, "database_pool_waiters",
+						  "pool=\"" + escape_label(pool.name) + "\"",
+						  std::to_string(pool.waiting));
+		}
+
+		append_header(output, "database_queries_in_flight", "gauge",
+					  "Statements currently executing.");
+		append_sample(output, "database_queries_in_flight", "",
+					  std::to_string(metrics.in_flight()));
+
+		append_header(output, "database_queries_total", "counter", "Statements executed.");
+		append_sample(output, "database_queries_total", "", std::to_string(metrics.queries()));
+
+		append_header(output, "database_query_errors_total", "counter",
+					  "Failed statements by SQLSTATE class.");
+		for (const auto& [error_class, count] : metrics.errors_by_class())
+		{
+			append_sample(output, "database_query_errors_total",
+						  "sqlstate_class=\"" + escape_label(error_class) + "\"",
+						  std::to_string(count));
+		}
+
+		append_header(output, "database_bytes_sent_total", "counter",
+					  "Statement bytes sent to the server.");
+		append_sample(output, "database_bytes_sent_total", "",
+					  std::to_string(metrics.bytes_sent()));
+
+		append_header(output, "database_bytes_received_total", "counter",
+					  "Result value bytes received from the server.");
+		append_sample(output, "database_bytes_received_total", "",
+					  std::to_string(metrics.bytes_received()));
+
+		const uint64_t hits = metrics.prepared_hits();
+		const uint64_t misses = metrics.prepared_misses();
+		append_header(output, "database_prepared_cache_hits_total", "counter",
+					  "Prepared statement cache hits.");
+		append_sample(output, "database_prepared_cache_hits_total", "", std::to_string(hits));
+		append_header(output, "database_prepared_cache_misses_total", "counter",
+					  "Prepared statement cache misses.");
+		append_sample(output, "database_prepared_cache_misses_total", "",
+					  std::to_string(misses));
+		append_header(output, "database_prepared_cache_hit_ratio", "gauge",
+					  "Fraction of prepared statement lookups that hit the cache.");
+		append_sample(output, "database_prepared_cache_hit_ratio", "",
+					  format_double(hits + misses == 0
+										? 0.0
+										: static_cast<double>(hits)
+											  / static_cast<double>(hits + misses)));
+
+		append_header(output, "database_reconnects_total", "counter",
+					  "Automatic reconnects after a lost connection.");
+		append_sample(output, "database_reconnects_total", "result=\"ok\"",
+					  std::to_string(metrics.reconnects()));
+		append_sample(output, "database_reconnects_total", "result=\"failed\"",
+					  std::to_string(metrics.reconnect_failures()));
+
+		append_header(output, "database_query_duration_seconds", "histogram",
+					  "Wall time of statements, including pool wait.");
+		append_histogram(output, "database_query_duration_seconds", "",
+						 timing.total_histogram());
+
+		append_header(output, "database_query_phase_duration_seconds", "histogram",
+					  "Time spent in each phase of a statement.");
+		for (size_t index = 0; index < query_phase_count; ++index)
+		{
+			const query_phase phase = static_cast<query_phase>(index);
+			append_histogram(output, "database_query_phase_duration_seconds",
+							 std::string("phase=\"") + query_phase_name(phase) + "\"",
+							 timing.phase_histogram(phase));
+		}
+
+		return output;
+	}
+
+	metrics_http_listener::metrics_http_listener(void)
+		: socket_(invalid_socket), port_(0), running_(false)
+	{
+	}
+
+	metrics_http_listener::~metrics_http_listener(void) { stop(); }
+
+	bool metrics_http_listener::start(const uint16_t& port)
+	{
+		if (running_.load())
+		{
+			return false;
+		}
+
+#ifdef _WIN32
+		WSADATA data;
+		if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+		{
+			return false;
+		}
+#endif
+
+		const auto listener = static_cast<intptr_t>(socket(AF_INET, SOCK_STREAM, 0));
+		if (listener < 0)
+		{
+			return false;
+		}
+
+		int reuse = 1;
+		setsockopt(static_cast<int>(listener), SOL_SOCKET, SO_REUSEADDR,
+				   reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+		sockaddr_in address{};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(port);
+
+		if (bind(static_cast<int>(listener), reinterpret_cast<sockaddr*>(&address),
+				 sizeof(address))
+				!= 0
+			|| listen(static_cast<int>(listener), 16) != 0)
+		{
+			close_socket(listener);
+			return false;
+		}
+
+		socklen_t length = sizeof(address);
+		getsockname(static_cast<int>(listener), reinterpret_cast<sockaddr*>(&address), &length);
+
+		socket_ = listener;
+		port_ = ntohs(address.sin_port);
+		running_.store(true);
+		thread_ = std::thread(&metrics_http_listener::serve, this);
+
+		return true;
+	}
+
+	void metrics_http_listener::stop(void)
+	{
+		if (!running_.exchange(false))
+		{
+			return;
+		}
+
+		if (thread_.joinable())
+		{
+			thread_.join();
+		}
+
+		close_socket(socket_);
+		socket_ = invalid_socket;
+		port_ = 0;
+
+#ifdef _WIN32
+		WSACleanup();
+#endif
+	}
+
+	void metrics_http_listener::serve(void)
+	{
+		while (running_.load())
+		{
+#ifdef _WIN32
+			WSAPOLLFD descriptor{};
+			descriptor.fd = static_cast<SOCKET>(socket_);
+			descriptor.events = POLLRDNORM;
+			const int ready = WSAPoll(&descriptor, 1, 200);
+#else
+			pollfd descriptor{};
+			descriptor.fd = static_cast<int>(socket_);
+			descriptor.events = POLLIN;
+			const int ready = poll(&descriptor, 1, 200);
+#endif
+			if (ready <= 0)
+			{
+				continue;
+			}
+
+			const auto client = static_cast<intptr_t>(
+				accept(static_cast<int>(socket_), nullptr, nullptr));
+			if (client < 0)
+			{
+				continue;
+			}
+
+			set_client_timeouts(client);
+			handle_client(client);
+			close_socket(client);
+		}
+	}
+
+	void metrics_http_listener::handle_client(const intptr_t& client)
+	{
+		// Only the request line matters; read until the end of the headers
+		// or until the buffer is full. A client trickling bytes is cut off
+		// at the deadline, not just after an idle timeout.
+		const auto deadline = std::chrono::steady_clock::now() + client_timeout;
+		char request[2048];
+		size_t received = 0;
+		while (received < sizeof(request) - 1)
+		{
+			if (std::chrono::steady_clock::now() >= deadline)
+			{
+				return;
+			}
+			const auto count = recv(static_cast<int>(client), request + received,
+									static_cast<int>(sizeof(request) - 1 - received), 0);
+			if (count < 0)
+			{
+				// Timed out or failed: no response.
+				return;
+			}
+			if (count == 0)
+			{
+				break;
+			}
+			received += static_cast<size_t>(count);
+			request[received] = '\0';
+			if (std::strstr(request, "\r\n\r\n") != nullptr)
+			{
+				break;
+			}
+		}
+		request[received] = '\0';
+
+		const bool is_metrics = std::strncmp(request, "GET /metrics ", 13) == 0
+								|| std::strncmp(request, "GET /metrics?", 13) == 0;
+
+		std::string body = is_metrics ? render_prometheus_metrics() : "not found\n";
+		std::string response = is_metrics ? "HTTP/1.1 200 OK\r\n"
+											"Content-Type: text/plain; version=0.0.4; "
+											"charset=utf-8\r\n"
+										  : "HTTP/1.1 404 Not Found\r\n"
+											"Content-Type: text/plain\r\n";
+		response += "Content-Length: " + std::to_string(body.size())
+					+ "\r\nConnection: close\r\n\r\n";
+		response += body;
+
+		size_t sent = 0;
+		while (sent < response.size())
+		{
+			const auto count = send(static_cast<int>(client), response.data() + sent,
+									static_cast<int>(response.size() - sent), send_flags);
+			if (count <= 0)
+			{
+				break;
+			}
+			sent += static_cast<size_t>(count);
+		}
+	}
+} // namespace database
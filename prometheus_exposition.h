@@ -0,0 +1,103 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <cstdint>
+
+namespace database
+{
+	/**
+	 * @brief Renders all database metrics in the Prometheus text
+	 *        exposition format (version 0.0.4).
+	 *
+	 * The output covers the counters and pool gauges of
+	 * @c database_metrics and the latency histograms of @c query_timing,
+	 * and can be appended to an application's own /metrics response.
+	 * Histogram buckets are rounded to the resolution of
+	 * @c latency_histogram, so a bucket may include a few samples slightly
+	 * above its @c le bound.
+	 *
+	 * @return The metrics text, terminated by a newline.
+	 */
+	std::string render_prometheus_metrics(void);
+
+	/**
+	 * @class metrics_http_listener
+	 * @brief Minimal HTTP server that answers GET /metrics on loopback.
+	 *
+	 * Only meant for scraping: it binds to 127.0.0.1, serves one request
+	 * per connection from a single background thread and answers every
+	 * other path with 404. A client that takes longer than two seconds
+	 * to send its request or receive the response is disconnected.
+	 */
+	class metrics_http_listener
+	{
+	public:
+		metrics_http_listener(void);
+		virtual ~metrics_http_listener(void);
+
+		metrics_http_listener(const metrics_http_listener&) = delete;
+		metrics_http_listener& operator=(const metrics_http_listener&) = delete;
+
+		/**
+		 * @brief Starts listening on 127.0.0.1.
+		 *
+		 * @param port TCP port; 0 picks a free ephemeral port.
+		 * @return @c true if the listener is running.
+		 */
+		bool start(const uint16_t& port);
+
+		/**
+		 * @brief Stops the listener and joins its thread.
+		 */
+		void stop(void);
+
+		/**
+		 * @brief Returns the bound port, or 0 if not running.
+		 */
+		uint16_t port(void) const { return port_; }
+
+	private:
+		void serve(void);
+		void handle_client(const intptr_t& client);
+
+	private:
+		intptr_t socket_;
+		uint16_t port_;
+		std::atomic<bool> running_;
+		std::thread thread_;
+	};
+} // namespace database
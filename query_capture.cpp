@@ -0,0 +1,413 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/query_capture.h"
+
+#include <cstring>
+
+namespace database
+{
+	namespace
+	{
+		constexpr char capture_magic[8] = { 'D', 'B', 'C', 'A', 'P', 0, 0, 1 };
+
+		constexpr uint8_t define_statement_tag = 0x01;
+		constexpr uint8_t statement_tag = 0x02;
+
+		constexpr uint8_t failed_flag = 0x80;
+
+		// Statements beyond these limits are written inline instead of
+		// interned, so captures of unparameterized traffic stay bounded
+		// in memory.
+		constexpr size_t max_interned_statements = 16384;
+		constexpr size_t max_interned_length = 4096;
+
+		constexpr size_t flush_threshold = 64 * 1024;
+
+		void put_varint(std::string& output, uint64_t value)
+		{
+			while (value >= 0x80)
+			{
+				output.push_back(static_cast<char>((value & 0x7F) | 0x80));
+				value >>= 7;
+			}
+			output.push_back(static_cast<char>(value));
+		}
+
+		void put_bytes(std::string& output, const std::string& value)
+		{
+			put_varint(output, value.size());
+			output.append(value);
+		}
+
+		uint64_t zigzag(const int64_t& value)
+		{
+			return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+		}
+
+		int64_t unzigzag(const uint64_t& value)
+		{
+			return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+		}
+
+		bool get_varint(std::istream& input, uint64_t& value)
+		{
+			value = 0;
+			for (int shift = 0; shift < 64; shift += 7)
+			{
+				const int byte = input.get();
+				if (byte == std::char_traits<char>::eof())
+				{
+					return false;
+				}
+
+				value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+				if ((byte & 0x80) == 0)
+				{
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		bool get_bytes(std::istream& input, const uint64_t& length, std::string& value)
+		{
+			// Guards against allocating for a corrupted length.
+			if (length > (1ULL << 30))
+			{
+				return false;
+			}
+
+			value.resize(static_cast<size_t>(length));
+			return length == 0
+				   || input.read(value.data(), static_cast<std::streamsize>(length)).good();
+		}
+	}
+
+	query_capture_writer::query_capture_writer(void)
+		: open_(false)
+		, next_session_(0)
+		, previous_offset_us_(0)
+		, records_written_(0)
+	{
+	}
+
+	query_capture_writer::~query_capture_writer(void) { close(); }
+
+	bool query_capture_writer::open(const std::string& path)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (open_.load(std::memory_order_relaxed))
+		{
+			return false;
+		}
+
+		stream_.open(path, std::ios::binary | std::ios::trunc);
+		if (!stream_.is_open())
+		{
+			return false;
+		}
+
+		started_ = std::chrono::steady_clock::now();
+		statements_.clear();
+		previous_offset_us_ = 0;
+		records_written_ = 0;
+
+		buffer_.assign(capture_magic, sizeof(capture_magic));
+		put_varint(buffer_, static_cast<uint64_t>(
+								std::chrono::duration_cast<std::chrono::microseconds>(
+									std::chrono::system_clock::now().time_since_epoch())
+									.count()));
+
+		open_.store(true, std::memory_order_release);
+
+		return true;
+	}
+
+	void query_capture_writer::close(void)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!open_.load(std::memory_order_relaxed))
+		{
+			return;
+		}
+
+		flush_locked();
+		stream_.close();
+		statements_.clear();
+		open_.store(false, std::memory_order_release);
+	}
+
+	uint32_t query_capture_writer::next_session(void)
+	{
+		return next_session_.fetch_add(1, std::memory_order_relaxed) + 1;
+	}
+
+	uint64_t query_capture_writer::offset_us(
+		const std::chrono::steady_clock::time_point& time) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (time <= started_)
+		{
+			return 0;
+		}
+
+		return static_cast<uint64_t>(
+			std::chrono::duration_cast<std::chrono::microseconds>(time - started_).count());
+	}
+
+	void query_capture_writer::record(const capture_record& record)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!open_.load(std::memory_order_relaxed))
+		{
+			return;
+		}
+
+		uint32_t statement_id = 0;
+		auto found = statements_.find(record.statement);
+		if (found != statements_.end())
+		{
+			statement_id = found->second;
+		}
+		else if (statements_.size() < max_interned_statements
+				 && record.statement.size() <= max_interned_length)
+		{
+			statement_id = static_cast<uint32_t>(statements_.size() + 1);
+			statements_.emplace(record.statement, statement_id);
+
+			buffer_.push_back(static_cast<char>(define_statement_tag));
+			put_varint(buffer_, statement_id);
+			put_bytes(buffer_, record.statement);
+		}
+
+		buffer_.push_back(static_cast<char>(statement_tag));
+		put_varint(buffer_, record.session);
+		put_varint(buffer_, zigzag(static_cast<int64_t>(record.start_offset_us)
+								   - static_cast<int64_t>(previous_offset_us_)));
+		put_varint(buffer_, record.duration_us);
+		buffer_.push_back(static_cast<char>(static_cast<uint8_t>(record.kind)
+											| (record.succeeded ? 0 : failed_flag)));
+		put_varint(buffer_, record.rows);
+		put_varint(buffer_, statement_id);
+		if (statement_id == 0)
+		{
+			put_bytes(buffer_, record.statement);
+		}
+
+		put_varint(buffer_, record.parameters.size());
+		for (const auto& parameter : record.parameters)
+		{
+			if (!parameter.has_value())
+			{
+				put_varint(buffer_, 0);
+				continue;
+			}
+
+			put_varint(buffer_, parameter->size() + 1);
+			buffer_.append(parameter.value());
+		}
+
+		previous_offset_us_ = record.start_offset_us;
+		++records_written_;
+
+		if (buffer_.size() >= flush_threshold)
+		{
+			flush_locked();
+		}
+	}
+
+	uint64_t query_capture_writer::records_written(void) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		return records_written_;
+	}
+
+	void query_capture_writer::flush_locked(void)
+	{
+		if (buffer_.empty())
+		{
+			return;
+		}
+
+		stream_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+		stream_.flush();
+		buffer_.clear();
+
+		if (!stream_.good())
+		{
+			stream_.close();
+			statements_.clear();
+			open_.store(false, std::memory_order_release);
+		}
+	}
+
+	query_capture_reader::query_capture_reader(void)
+		: capture_start_unix_us_(0), previous_offset_us_(0), failed_(false)
+	{
+	}
+
+	query_capture_reader::~query_capture_reader(void) {}
+
+	bool query_capture_reader::open(const std::string& path)
+	{
+		stream_.open(path, std::ios::binary);
+		if (!stream_.is_open())
+		{
+			return false;
+		}
+
+		char magic[sizeof(capture_magic)];
+		if (!stream_.read(magic, sizeof(magic)).good()
+			|| std::memcmp(magic, capture_magic, sizeof(magic)) != 0
+			|| !get_varint(stream_, capture_start_unix_us_))
+		{
+			stream_.close();
+			return false;
+		}
+
+		statements_.clear();
+		previous_offset_us_ = 0;
+		failed_ = false;
+
+		return true;
+	}
+
+	bool query_capture_reader::next(capture_record& record)
+	{
+		if (!stream_.is_open() || failed_)
+		{
+			return false;
+		}
+
+		for (;;)
+		{
+			const int tag = stream_.get();
+			if (tag == std::char_traits<char>::eof())
+			{
+				return false;
+			}
+
+			uint64_t value = 0;
+			if (tag == define_statement_tag)
+			{
+				std::string statement;
+				if (!get_varint(stream_, value) || value != statements_.size() + 1
+					|| !get_varint(stream_, value) || !get_bytes(stream_, value, statement))
+				{
+					failed_ = true;
+					return false;
+				}
+
+				statements_.push_back(std::move(statement));
+				continue;
+			}
+
+			if (tag != statement_tag)
+			{
+				failed_ = true;
+				return false;
+			}
+
+			uint64_t session = 0;
+			uint64_t delta = 0;
+			if (!get_varint(stream_, session) || !get_varint(stream_, delta)
+				|| !get_varint(stream_, record.duration_us))
+			{
+				failed_ = true;
+				return false;
+			}
+
+			const int flags = stream_.get();
+			uint64_t statement_id = 0;
+			if (flags == std::char_traits<char>::eof() || !get_varint(stream_, record.rows)
+				|| !get_varint(stream_, statement_id) || statement_id > statements_.size())
+			{
+				failed_ = true;
+				return false;
+			}
+
+			record.session = static_cast<uint32_t>(session);
+			record.start_offset_us = static_cast<uint64_t>(
+				static_cast<int64_t>(previous_offset_us_) + unzigzag(delta));
+			previous_offset_us_ = record.start_offset_us;
+			record.kind = static_cast<capture_statement_kind>(flags & ~failed_flag);
+			record.succeeded = (flags & failed_flag) == 0;
+
+			if (statement_id != 0)
+			{
+				record.statement = statements_[statement_id - 1];
+			}
+			else if (!get_varint(stream_, value) || !get_bytes(stream_, value, record.statement))
+			{
+				failed_ = true;
+				return false;
+			}
+
+			uint64_t count = 0;
+			if (!get_varint(stream_, count) || count > 65535)
+			{
+				failed_ = true;
+				return false;
+			}
+
+			record.parameters.clear();
+			record.parameters.reserve(static_cast<size_t>(count));
+			for (uint64_t index = 0; index < count; ++index)
+			{
+				if (!get_varint(stream_, value))
+				{
+					failed_ = true;
+					return false;
+				}
+
+				if (value == 0)
+				{
+					record.parameters.emplace_back(std::nullopt);
+					continue;
+				}
+
+				std::string parameter;
+				if (!get_bytes(stream_, value - 1, parameter))
+				{
+					failed_ = true;
+					return false;
+				}
+				record.parameters.emplace_back(std::move(parameter));
+			}
+
+			return true;
+		}
+	}
+} // namespace database
@@ -0,0 +1,186 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <unordered_map>
+
+namespace database
+{
+	/**
+	 * @enum capture_statement_kind
+	 * @brief Which @c database_manager entry point issued a captured
+	 *        statement, so that a replay can call the same one.
+	 */
+	enum class capture_statement_kind : uint8_t {
+		create_query = 0,
+		insert_query = 1,
+		update_query = 2,
+		delete_query = 3,
+		select_query = 4
+	};
+
+	/**
+	 * @struct capture_record
+	 * @brief One executed statement as stored in a capture log.
+	 */
+	struct capture_record
+	{
+		uint32_t session = 0;		 ///< Connection the statement ran on.
+		uint64_t start_offset_us = 0; ///< Start, relative to the capture start.
+		uint64_t duration_us = 0;
+		capture_statement_kind kind = capture_statement_kind::create_query;
+		bool succeeded = true;
+		uint64_t rows = 0; ///< Affected rows for insert/update/delete.
+		std::string statement;
+		std::vector<std::optional<std::string>> parameters; ///< Bound values, NULL as nullopt.
+	};
+
+	/**
+	 * @class query_capture_writer
+	 * @brief Appends executed statements to a compact binary capture log.
+	 *
+	 * The log starts with an 8-byte magic and the capture start as Unix
+	 * microseconds. Each record is a tag byte followed by LEB128 varints:
+	 * statement texts are interned on first use and later records refer to
+	 * them by id, and start offsets are stored as zigzag deltas from the
+	 * previous record. Records are buffered and written in blocks; all
+	 * members are thread-safe.
+	 */
+	class query_capture_writer
+	{
+	public:
+		query_capture_writer(void);
+		virtual ~query_capture_writer(void);
+
+		query_capture_writer(const query_capture_writer&) = delete;
+		query_capture_writer& operator=(const query_capture_writer&) = delete;
+
+		/**
+		 * @brief Creates (or truncates) @p path and starts a capture.
+		 *
+		 * @return @c false if the file cannot be written or a capture is
+		 *         already open.
+		 */
+		bool open(const std::string& path);
+
+		/**
+		 * @brief Flushes buffered records and closes the log.
+		 */
+		void close(void);
+
+		bool is_open(void) const { return open_.load(std::memory_order_acquire); }
+
+		/**
+		 * @brief Returns a new session id for a connection.
+		 */
+		uint32_t next_session(void);
+
+		/**
+		 * @brief Converts a start time to an offset from the capture start.
+		 */
+		uint64_t offset_us(const std::chrono::steady_clock::time_point& time) const;
+
+		/**
+		 * @brief Appends @p record. Ignored when no capture is open; a
+		 *        write error closes the capture.
+		 */
+		void record(const capture_record& record);
+
+		uint64_t records_written(void) const;
+
+	private:
+		void flush_locked(void);
+
+	private:
+		std::atomic<bool> open_;
+		std::atomic<uint32_t> next_session_;
+
+		mutable std::mutex mutex_;
+		std::ofstream stream_;
+		std::string buffer_;
+		std::chrono::steady_clock::time_point started_;
+		std::unordered_map<std::string, uint32_t> statements_;
+		uint64_t previous_offset_us_;
+		uint64_t records_written_;
+	};
+
+	/**
+	 * @class query_capture_reader
+	 * @brief Reads the records of a capture log in file order.
+	 *
+	 * Records are written when statements finish, so start offsets are
+	 * only ordered within a session.
+	 */
+	class query_capture_reader
+	{
+	public:
+		query_capture_reader(void);
+		virtual ~query_capture_reader(void);
+
+		/**
+		 * @brief Opens @p path and validates its header.
+		 */
+		bool open(const std::string& path);
+
+		/**
+		 * @brief Reads the next statement record.
+		 *
+		 * @return @c false at the end of the log or on a truncated or
+		 *         malformed record; @c failed() tells the two apart.
+		 */
+		bool next(capture_record& record);
+
+		bool failed(void) const { return failed_; }
+
+		/**
+		 * @brief Returns the wall-clock start of the capture in Unix
+		 *        microseconds.
+		 */
+		uint64_t capture_start_unix_us(void) const { return capture_start_unix_us_; }
+
+	private:
+		std::ifstream stream_;
+		std::vector<std::string> statements_;
+		uint64_t capture_start_unix_us_;
+		uint64_t previous_offset_us_;
+		bool failed_;
+	};
+} // namespace database
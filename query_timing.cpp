@@ -0,0 +1,281 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/query_timing.h"
+
+#include "database/sql_fingerprint.h"
+
+namespace database
+{
+	namespace
+	{
+		thread_local scoped_query_timing* current_timing_ = nullptr;
+		thread_local uint64_t pending_pool_wait_ns_ = 0;
+		thread_local uint32_t queries_since_sample_ = 0;
+
+		uint64_t elapsed_ns(const std::chrono::steady_clock::time_point& from,
+							const std::chrono::steady_clock::time_point& to)
+		{
+			return static_cast<uint64_t>(
+				std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+		}
+	} // namespace
+
+	const char* query_phase_name(const query_phase& phase)
+	{
+		switch (phase)
+		{
+		case query_phase::encode:
+			return "encode";
+		case query_phase::pool_wait:
+			return "pool_wait";
+		case query_phase::send:
+			return "send";
+		case query_phase::server_first_byte:
+			return "server_first_byte";
+		case query_phase::transfer:
+			return "transfer";
+		case query_phase::decode:
+			return "decode";
+		case query_phase::container_build:
+			return "container_build";
+		}
+
+		return "unknown";
+	}
+
+	query_timing::query_timing(void)
+		: enabled_(true)
+		, sample_interval_(100)
+		, record_capacity_(1024)
+		, next_record_(0)
+	{
+	}
+
+	query_timing::~query_timing(void) {}
+
+	void query_timing::set_enabled(const bool& enabled)
+	{
+		enabled_.store(enabled, std::memory_order_relaxed);
+	}
+
+	void query_timing::set_sample_interval(const uint32_t& interval)
+	{
+		sample_interval_.store(interval, std::memory_order_relaxed);
+	}
+
+	uint32_t query_timing::sample_interval(void) const
+	{
+		return sample_interval_.load(std::memory_order_relaxed);
+	}
+
+	void query_timing::set_record_capacity(const size_t& capacity)
+	{
+		std::lock_guard<std::mutex> lock(records_mutex_);
+
+		record_capacity_ = capacity;
+		records_.clear();
+		next_record_ = 0;
+	}
+
+	const latency_histogram& query_timing::phase_histogram(const query_phase& phase) const
+	{
+		return phases_[static_cast<size_t>(phase)];
+	}
+
+	const latency_histogram& query_timing::total_histogram(void) const { return total_; }
+
+	std::vector<query_timing_record> query_timing::sampled_records(void) const
+	{
+		std::lock_guard<std::mutex> lock(records_mutex_);
+
+		if (records_.size() < record_capacity_)
+		{
+			return records_;
+		}
+
+		std::vector<query_timing_record> ordered;
+		ordered.reserve(records_.size());
+		ordered.insert(ordered.end(), records_.begin() + next_record_, records_.end());
+		ordered.insert(ordered.end(), records_.begin(), records_.begin() + next_record_);
+
+		return ordered;
+	}
+
+	void query_timing::record(const query_timing_record& record, const bool& sampled)
+	{
+		for (size_t index = 0; index < query_phase_count; ++index)
+		{
+			if (record.phase_ns[index] != 0)
+			{
+				phases_[index].record(record.phase_ns[index]);
+			}
+		}
+		total_.record(record.total_ns);
+
+		if (!sampled)
+		{
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(records_mutex_);
+
+		if (record_capacity_ == 0)
+		{
+			return;
+		}
+
+		if (records_.size() < record_capacity_)
+		{
+			// Reserve the whole ring up front so that filling it does not
+			// reallocate on the query path.
+			if (records_.capacity() < record_capacity_)
+			{
+				records_.reserve(record_capacity_);
+			}
+			records_.push_back(record);
+			return;
+		}
+
+		records_[next_record_] = record;
+		next_record_ = (next_record_ + 1) % record_capacity_;
+	}
+
+	void query_timing::reset(void)
+	{
+		for (auto& phase : phases_)
+		{
+			phase.reset();
+		}
+		total_.reset();
+
+		std::lock_guard<std::mutex> lock(records_mutex_);
+
+		records_.clear();
+		next_record_ = 0;
+	}
+
+#pragma region singleton
+	std::unique_ptr<query_timing> query_timing::handle_;
+	std::once_flag query_timing::once_;
+
+	query_timing& query_timing::handle(void)
+	{
+		std::call_once(once_, []() { handle_ = std::make_unique<query_timing>(); });
+
+		return *handle_;
+	}
+#pragma endregion
+
+	scoped_query_timing::scoped_query_timing(std::string_view query_string)
+		: active_(false), sampled_(false), previous_(nullptr)
+	{
+		query_timing& timing = query_timing::handle();
+		if (!timing.enabled())
+		{
+			return;
+		}
+
+		active_ = true;
+		start_ = std::chrono::steady_clock::now();
+		last_ = start_;
+		record_.phase_ns[static_cast<size_t>(query_phase::pool_wait)]
+			= pending_pool_wait_ns_;
+		pending_pool_wait_ns_ = 0;
+
+		const uint32_t interval = timing.sample_interval();
+		if (interval != 0 && ++queries_since_sample_ >= interval)
+		{
+			queries_since_sample_ = 0;
+			sampled_ = true;
+			record_.fingerprint = statement_fingerprint(query_string);
+			record_.start_unix_nano = static_cast<uint64_t>(
+				std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::system_clock::now().time_since_epoch())
+					.count());
+		}
+
+		previous_ = current_timing_;
+		current_timing_ = this;
+	}
+
+	scoped_query_timing::~scoped_query_timing(void)
+	{
+		if (!active_)
+		{
+			return;
+		}
+
+		current_timing_ = previous_;
+
+		record_.total_ns = elapsed_ns(start_, std::chrono::steady_clock::now())
+						   + record_.phase_ns[static_cast<size_t>(query_phase::pool_wait)];
+
+		query_timing::handle().record(record_, sampled_);
+	}
+
+	void scoped_query_timing::lap(const query_phase& phase)
+	{
+		if (!active_)
+		{
+			return;
+		}
+
+		const auto now = std::chrono::steady_clock::now();
+		record_.phase_ns[static_cast<size_t>(phase)] += elapsed_ns(last_, now);
+		last_ = now;
+	}
+
+	void scoped_query_timing::skip(void)
+	{
+		if (!active_)
+		{
+			return;
+		}
+
+		last_ = std::chrono::steady_clock::now();
+	}
+
+	void scoped_query_timing::set_rows(const int64_t& rows) { record_.rows = rows; }
+
+	void scoped_query_timing::set_failed(void) { record_.succeeded = false; }
+
+	scoped_query_timing* scoped_query_timing::current(void) { return current_timing_; }
+
+	void scoped_query_timing::add_pending_pool_wait(const std::chrono::nanoseconds& wait)
+	{
+		if (wait.count() > 0)
+		{
+			pending_pool_wait_ns_ += static_cast<uint64_t>(wait.count());
+		}
+	}
+} // namespace database
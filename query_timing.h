@@ -0,0 +1,251 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+#include "latency_histogram.h"
+
+namespace database
+{
+	/**
+	 * @enum query_phase
+	 * @brief The consecutive phases a query's wall time is split into.
+	 */
+	enum class query_phase {
+		/**
+		 * @brief Converting the statement to the client encoding
+		 *        (@c convert_string::utf8_to_system).
+		 */
+		encode = 0,
+
+		/**
+		 * @brief Waiting for a connection from a @c connection_pool.
+		 */
+		pool_wait = 1,
+
+		/**
+		 * @brief Handing the statement to libpq and flushing it to the socket.
+		 */
+		send = 2,
+
+		/**
+		 * @brief From the end of the send until the first response byte is
+		 *        readable; this is server execution time plus one network
+		 *        round trip.
+		 */
+		server_first_byte = 3,
+
+		/**
+		 * @brief From the first response byte until the complete result has
+		 *        been received and parsed by libpq.
+		 */
+		transfer = 4,
+
+		/**
+		 * @brief Converting result cells into typed values.
+		 */
+		decode = 5,
+
+		/**
+		 * @brief Building the @c value_container handed to the caller.
+		 */
+		container_build = 6
+	};
+
+	constexpr size_t query_phase_count = 7;
+
+	/**
+	 * @brief Returns the lower-case name of a phase (e.g. "pool_wait").
+	 */
+	const char* query_phase_name(const query_phase& phase);
+
+	/**
+	 * @struct query_timing_record
+	 * @brief The phase breakdown of one sampled query.
+	 */
+	struct query_timing_record
+	{
+		uint64_t fingerprint = 0;
+		uint64_t start_unix_nano = 0;
+		uint64_t total_ns = 0;
+		int64_t rows = -1;
+		bool succeeded = true;
+		std::array<uint64_t, query_phase_count> phase_ns{};
+	};
+
+	/**
+	 * @class query_timing
+	 * @brief Process-wide per-phase latency histograms and sampled
+	 *        per-query records.
+	 *
+	 * Every timed query adds its phase durations to one histogram per
+	 * phase plus one for the total. Every @c sample_interval-th query on
+	 * each thread is additionally kept as a @c query_timing_record in a
+	 * bounded ring, so individual slow queries can be inspected.
+	 */
+	class query_timing
+	{
+	public:
+		query_timing(void);
+		virtual ~query_timing(void);
+
+		/**
+		 * @brief Turns phase timing on or off. It is on by default; when
+		 *        off, queries skip the extra readiness wait used to split
+		 *        server time from transfer time.
+		 */
+		void set_enabled(const bool& enabled);
+		bool enabled(void) const { return enabled_.load(std::memory_order_relaxed); }
+
+		/**
+		 * @brief Keeps one record for every @p interval queries per thread;
+		 *        0 disables per-query records.
+		 */
+		void set_sample_interval(const uint32_t& interval);
+		uint32_t sample_interval(void) const;
+
+		/**
+		 * @brief Sets how many sampled records are retained.
+		 */
+		void set_record_capacity(const size_t& capacity);
+
+		const latency_histogram& phase_histogram(const query_phase& phase) const;
+		const latency_histogram& total_histogram(void) const;
+
+		/**
+		 * @brief Returns the retained records, oldest first.
+		 */
+		std::vector<query_timing_record> sampled_records(void) const;
+
+		/**
+		 * @brief Adds a finished query to the histograms and, when
+		 *        @p sampled, to the record ring.
+		 */
+		void record(const query_timing_record& record, const bool& sampled);
+
+		/**
+		 * @brief Clears all histograms and records.
+		 */
+		void reset(void);
+
+	private:
+		std::atomic<bool> enabled_;
+		std::atomic<uint32_t> sample_interval_;
+		std::array<latency_histogram, query_phase_count> phases_;
+		latency_histogram total_;
+
+		mutable std::mutex records_mutex_;
+		std::vector<query_timing_record> records_;
+		size_t record_capacity_;
+		size_t next_record_;
+
+#pragma region singleton
+	public:
+		/**
+		 * @brief Provides access to the process-wide timing registry.
+		 */
+		static query_timing& handle(void);
+
+	private:
+		static std::unique_ptr<query_timing> handle_;
+		static std::once_flag once_;
+#pragma endregion
+	};
+
+	/**
+	 * @class scoped_query_timing
+	 * @brief Measures the phases of one query on the current thread.
+	 *
+	 * Phases are measured as laps: @c lap(phase) charges the time since
+	 * the previous lap (or construction) to @p phase. The innermost
+	 * instance is reachable through @c current(), so helpers deeper in the
+	 * call chain can add laps without extra parameters. Time spent in a
+	 * @c connection_pool just before the query is picked up automatically
+	 * as @c query_phase::pool_wait.
+	 */
+	class scoped_query_timing
+	{
+	public:
+		explicit scoped_query_timing(std::string_view query_string);
+		~scoped_query_timing(void);
+
+		scoped_query_timing(const scoped_query_timing&) = delete;
+		scoped_query_timing& operator=(const scoped_query_timing&) = delete;
+
+		/**
+		 * @brief Returns @c true if timing is enabled for this query.
+		 */
+		bool active(void) const { return active_; }
+
+		/**
+		 * @brief Charges the time since the last lap to @p phase.
+		 */
+		void lap(const query_phase& phase);
+
+		/**
+		 * @brief Restarts the lap clock without charging any phase.
+		 */
+		void skip(void);
+
+		void set_rows(const int64_t& rows);
+		void set_failed(void);
+
+		/**
+		 * @brief Returns the innermost active timing on this thread, or
+		 *        @c nullptr.
+		 */
+		static scoped_query_timing* current(void);
+
+		/**
+		 * @brief Stores a pool wait to be charged to the next query timed
+		 *        on this thread.
+		 */
+		static void add_pending_pool_wait(const std::chrono::nanoseconds& wait);
+
+	private:
+		bool active_;
+		bool sampled_;
+		std::chrono::steady_clock::time_point start_;
+		std::chrono::steady_clock::time_point last_;
+		query_timing_record record_;
+		scoped_query_timing* previous_;
+	};
+} // namespace database
@@ -0,0 +1,608 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/query_tracer.h"
+
+#include "database/sql_fingerprint.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+
+namespace database
+{
+	namespace
+	{
+		thread_local span_frame* current_frame_ = nullptr;
+
+		uint64_t next_random(void)
+		{
+			// splitmix64 over a per-thread state; only used for ids and
+			// sampling, never for anything security relevant.
+			thread_local uint64_t state
+				= std::random_device{}()
+				  ^ (static_cast<uint64_t>(std::hash<std::thread::id>{}(
+						 std::this_thread::get_id()))
+					 << 1)
+				  ^ static_cast<uint64_t>(
+					  std::chrono::steady_clock::now().time_since_epoch().count());
+
+			uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+			return z ^ (z >> 31);
+		}
+
+		template <size_t N> void fill_random(std::array<uint8_t, N>& id)
+		{
+			for (size_t index = 0; index < N; index += 8)
+			{
+				uint64_t value = next_random();
+				for (size_t byte = 0; byte < 8 && index + byte < N; ++byte)
+				{
+					id[index + byte] = static_cast<uint8_t>(value >> (byte * 8));
+				}
+			}
+		}
+
+		uint64_t now_unix_nano(void)
+		{
+			return static_cast<uint64_t>(
+				std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::system_clock::now().time_since_epoch())
+					.count());
+		}
+
+		bool parse_hex(std::string_view text, uint8_t* output, const size_t& size)
+		{
+			if (text.size() != size * 2)
+			{
+				return false;
+			}
+
+			auto nibble = [](const char& c) -> int
+			{
+				if (c >= '0' && c <= '9')
+				{
+					return c - '0';
+				}
+				if (c >= 'a' && c <= 'f')
+				{
+					return c - 'a' + 10;
+				}
+				return -1;
+			};
+
+			bool non_zero = false;
+			for (size_t index = 0; index < size; ++index)
+			{
+				const int high = nibble(text[index * 2]);
+				const int low = nibble(text[index * 2 + 1]);
+				if (high < 0 || low < 0)
+				{
+					return false;
+				}
+				output[index] = static_cast<uint8_t>((high << 4) | low);
+				non_zero = non_zero || output[index] != 0;
+			}
+
+			return non_zero;
+		}
+
+		void append_json_string(std::string& output, std::string_view value)
+		{
+			output.push_back('"');
+			for (const char& c : value)
+			{
+				switch (c)
+				{
+				case '"':
+					output += "\\\"";
+					break;
+				case '\\':
+					output += "\\\\";
+					break;
+				case '\n':
+					output += "\\n";
+					break;
+				case '\r':
+					output += "\\r";
+					break;
+				case '\t':
+					output += "\\t";
+					break;
+				default:
+					if (static_cast<unsigned char>(c) < 0x20)
+					{
+						char buffer[7];
+						std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+						output += buffer;
+					}
+					else
+					{
+						output.push_back(c);
+					}
+					break;
+				}
+			}
+			output.push_back('"');
+		}
+
+		void append_attribute(std::string& output, const span_attribute& attribute)
+		{
+			output += "{\"key\":";
+			append_json_string(output, attribute.key);
+			output += ",\"value\":{";
+
+			if (const auto* text = std::get_if<std::string>(&attribute.value))
+			{
+				output += "\"stringValue\":";
+				append_json_string(output, *text);
+			}
+			else if (const auto* integer = std::get_if<int64_t>(&attribute.value))
+			{
+				// OTLP/JSON encodes 64-bit integers as strings.
+				output += "\"intValue\":\"" + std::to_string(*integer) + "\"";
+			}
+			else if (const auto* real = std::get_if<double>(&attribute.value))
+			{
+				output += "\"doubleValue\":" + std::to_string(*real);
+			}
+			else
+			{
+				output += std::get<bool>(attribute.value) ? "\"boolValue\":true"
+														  : "\"boolValue\":false";
+			}
+
+			output += "}}";
+		}
+
+		bool is_zero(const std::array<uint8_t, 8>& id)
+		{
+			for (const auto& byte : id)
+			{
+				if (byte != 0)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+	} // namespace
+
+	const char* span_name(const span_kind& kind)
+	{
+		switch (kind)
+		{
+		case span_kind::query:
+			return "db.query";
+		case span_kind::connect:
+			return "db.connect";
+		case span_kind::acquire:
+			return "db.acquire";
+		case span_kind::execute:
+			return "db.execute";
+		case span_kind::fetch:
+			return "db.fetch";
+		case span_kind::decode:
+			return "db.decode";
+		}
+
+		return "db.unknown";
+	}
+
+	std::string trace_id_to_string(const uint8_t* id, const size_t& size)
+	{
+		static const char digits[] = "0123456789abcdef";
+
+		std::string text(size * 2, '0');
+		for (size_t index = 0; index < size; ++index)
+		{
+			text[index * 2] = digits[id[index] >> 4];
+			text[index * 2 + 1] = digits[id[index] & 0x0F];
+		}
+
+		return text;
+	}
+
+	otlp_json_file_exporter::otlp_json_file_exporter(const std::string& file_path,
+													 const std::string& service_name,
+													 const size_t& batch_size)
+		: stream_(file_path, std::ios::out | std::ios::app)
+		, service_name_(service_name)
+		, batch_size_(batch_size == 0 ? 1 : batch_size)
+	{
+		pending_.reserve(batch_size_);
+	}
+
+	otlp_json_file_exporter::~otlp_json_file_exporter(void) { flush(); }
+
+	bool otlp_json_file_exporter::is_open(void) const { return stream_.is_open(); }
+
+	void otlp_json_file_exporter::export_span(const trace_span& span)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		pending_.push_back(span);
+		if (pending_.size() >= batch_size_)
+		{
+			write_batch();
+		}
+	}
+
+	void otlp_json_file_exporter::flush(void)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		write_batch();
+		stream_.flush();
+	}
+
+	void otlp_json_file_exporter::write_batch(void)
+	{
+		if (pending_.empty() || !stream_.is_open())
+		{
+			pending_.clear();
+			return;
+		}
+
+		std::string line;
+		line.reserve(512 * pending_.size());
+
+		line += "{\"resourceSpans\":[{\"resource\":{\"attributes\":[";
+		append_attribute(line, span_attribute{ "service.name", service_name_ });
+		line += "]},\"scopeSpans\":[{\"scope\":{\"name\":\"database_system\"},\"spans\":[";
+
+		for (size_t index = 0; index < pending_.size(); ++index)
+		{
+			const trace_span& span = pending_[index];
+			if (index > 0)
+			{
+				line.push_back(',');
+			}
+
+			line += "{\"traceId\":\"";
+			line += trace_id_to_string(span.trace_id.data(), span.trace_id.size());
+			line += "\",\"spanId\":\"";
+			line += trace_id_to_string(span.span_id.data(), span.span_id.size());
+			line += "\"";
+			if (!is_zero(span.parent_span_id))
+			{
+				line += ",\"parentSpanId\":\"";
+				line += trace_id_to_string(span.parent_span_id.data(),
+										   span.parent_span_id.size());
+				line += "\"";
+			}
+
+			// kind 3 is SPAN_KIND_CLIENT.
+			line += ",\"name\":\"";
+			line += span_name(span.kind);
+			line += "\",\"kind\":3,\"startTimeUnixNano\":\"";
+			line += std::to_string(span.start_time_unix_nano);
+			line += "\",\"endTimeUnixNano\":\"";
+			line += std::to_string(span.end_time_unix_nano);
+			line += "\",\"attributes\":[";
+			for (size_t attribute = 0; attribute < span.attributes.size(); ++attribute)
+			{
+				if (attribute > 0)
+				{
+					line.push_back(',');
+				}
+				append_attribute(line, span.attributes[attribute]);
+			}
+			line += "]";
+
+			// status code 2 is STATUS_CODE_ERROR; unset otherwise.
+			if (span.error)
+			{
+				line += ",\"status\":{\"code\":2,\"message\":";
+				append_json_string(line, span.status_message);
+				line += "}";
+			}
+			line += "}";
+		}
+
+		line += "]}]}]}\n";
+
+		stream_ << line;
+		pending_.clear();
+	}
+
+	callback_exporter::callback_exporter(std::function<void(const trace_span&)> callback)
+		: callback_(std::move(callback))
+	{
+	}
+
+	void callback_exporter::export_span(const trace_span& span)
+	{
+		if (callback_)
+		{
+			callback_(span);
+		}
+	}
+
+	query_tracer::query_tracer(void)
+		: enabled_(false), sample_threshold_(UINT64_MAX), exporter_(nullptr)
+	{
+	}
+
+	query_tracer::~query_tracer(void) {}
+
+	void query_tracer::set_exporter(std::shared_ptr<span_exporter> exporter)
+	{
+		std::lock_guard<std::mutex> lock(exporter_mutex_);
+
+		exporter_ = std::move(exporter);
+		enabled_.store(exporter_ != nullptr, std::memory_order_relaxed);
+	}
+
+	void query_tracer::set_sample_ratio(const double& ratio)
+	{
+		if (ratio >= 1.0)
+		{
+			sample_threshold_.store(UINT64_MAX, std::memory_order_relaxed);
+			return;
+		}
+
+		if (ratio <= 0.0)
+		{
+			sample_threshold_.store(0, std::memory_order_relaxed);
+			return;
+		}
+
+		sample_threshold_.store(static_cast<uint64_t>(ratio * 18446744073709551615.0),
+								std::memory_order_relaxed);
+	}
+
+	void query_tracer::flush(void)
+	{
+		std::shared_ptr<span_exporter> exporter;
+		{
+			std::lock_guard<std::mutex> lock(exporter_mutex_);
+			exporter = exporter_;
+		}
+
+		if (exporter != nullptr)
+		{
+			exporter->flush();
+		}
+	}
+
+	bool query_tracer::should_sample(void) const
+	{
+		const uint64_t threshold = sample_threshold_.load(std::memory_order_relaxed);
+		if (threshold == UINT64_MAX)
+		{
+			return true;
+		}
+
+		if (threshold == 0)
+		{
+			return false;
+		}
+
+		return next_random() < threshold;
+	}
+
+	void query_tracer::export_span(const trace_span& span)
+	{
+		std::shared_ptr<span_exporter> exporter;
+		{
+			std::lock_guard<std::mutex> lock(exporter_mutex_);
+			exporter = exporter_;
+		}
+
+		if (exporter != nullptr)
+		{
+			exporter->export_span(span);
+		}
+	}
+
+	span_frame* query_tracer::current_frame(void) { return current_frame_; }
+
+	void query_tracer::set_current_frame(span_frame* frame) { current_frame_ = frame; }
+
+#pragma region singleton
+	std::unique_ptr<query_tracer> query_tracer::handle_;
+	std::once_flag query_tracer::once_;
+
+	query_tracer& query_tracer::handle(void)
+	{
+		std::call_once(once_, []() { handle_ = std::make_unique<query_tracer>(); });
+
+		return *handle_;
+	}
+#pragma endregion
+
+	scoped_trace_context::scoped_trace_context(std::string_view traceparent)
+		: valid_(false)
+	{
+		// version "-" trace-id "-" parent-id "-" trace-flags
+		if (traceparent.size() < 55 || traceparent[2] != '-' || traceparent[35] != '-'
+			|| traceparent[52] != '-' || traceparent.substr(0, 2) == "ff")
+		{
+			return;
+		}
+
+		uint8_t flags = 0;
+		if (!parse_hex(traceparent.substr(3, 32), frame_.trace_id.data(), 16)
+			|| !parse_hex(traceparent.substr(36, 16), frame_.span_id.data(), 8))
+		{
+			return;
+		}
+		parse_hex(traceparent.substr(53, 2), &flags, 1);
+
+		frame_.sampled = (flags & 0x01) != 0;
+		frame_.previous = query_tracer::current_frame();
+		query_tracer::set_current_frame(&frame_);
+		valid_ = true;
+	}
+
+	scoped_trace_context::~scoped_trace_context(void)
+	{
+		if (valid_)
+		{
+			query_tracer::set_current_frame(frame_.previous);
+		}
+	}
+
+	scoped_span::scoped_span(const span_kind& kind) : active_(false), span_(nullptr)
+	{
+		query_tracer& tracer = query_tracer::handle();
+		if (!tracer.enabled())
+		{
+			return;
+		}
+
+		span_frame* parent = query_tracer::current_frame();
+		frame_.previous = parent;
+		frame_.sampled = (parent != nullptr) ? parent->sampled : tracer.should_sample();
+		query_tracer::set_current_frame(&frame_);
+		active_ = true;
+
+		if (!frame_.sampled)
+		{
+			return;
+		}
+
+		if (parent != nullptr)
+		{
+			frame_.trace_id = parent->trace_id;
+		}
+		else
+		{
+			fill_random(frame_.trace_id);
+		}
+		fill_random(frame_.span_id);
+
+		span_ = std::make_unique<trace_span>();
+		span_->trace_id = frame_.trace_id;
+		span_->span_id = frame_.span_id;
+		if (parent != nullptr)
+		{
+			span_->parent_span_id = parent->span_id;
+		}
+		span_->kind = kind;
+		span_->start_time_unix_nano = now_unix_nano();
+	}
+
+	scoped_span::~scoped_span(void)
+	{
+		if (!active_)
+		{
+			return;
+		}
+
+		query_tracer::set_current_frame(frame_.previous);
+
+		if (span_ == nullptr)
+		{
+			return;
+		}
+
+		span_->end_time_unix_nano = now_unix_nano();
+		query_tracer::handle().export_span(*span_);
+	}
+
+	void scoped_span::set_attribute(const char* key, std::string_view value)
+	{
+		if (span_ == nullptr)
+		{
+			return;
+		}
+
+		span_->attributes.push_back(span_attribute{ key, std::string(value) });
+	}
+
+	void scoped_span::set_attribute(const char* key, const int64_t& value)
+	{
+		if (span_ == nullptr)
+		{
+			return;
+		}
+
+		span_->attributes.push_back(span_attribute{ key, value });
+	}
+
+	void scoped_span::set_statement(std::string_view query_string)
+	{
+		if (span_ == nullptr)
+		{
+			return;
+		}
+
+		set_attribute("db.statement.fingerprint",
+					  fingerprint_to_string(statement_fingerprint(query_string)));
+
+		size_t start = 0;
+		while (start < query_string.size()
+			   && (query_string[start] == ' ' || query_string[start] == '\t'
+				   || query_string[start] == '\n' || query_string[start] == '\r'
+				   || query_string[start] == '('))
+		{
+			++start;
+		}
+
+		std::string operation;
+		for (size_t index = start; index < query_string.size(); ++index)
+		{
+			const char c = query_string[index];
+			if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+			{
+				break;
+			}
+			operation.push_back((c >= 'a') ? static_cast<char>(c - 'a' + 'A') : c);
+		}
+
+		if (!operation.empty())
+		{
+			set_attribute("db.operation", operation);
+		}
+	}
+
+	void scoped_span::set_error(std::string_view sqlstate, std::string_view message)
+	{
+		if (span_ == nullptr)
+		{
+			return;
+		}
+
+		span_->error = true;
+		span_->status_message = std::string(message);
+		if (!sqlstate.empty())
+		{
+			set_attribute("error.type", sqlstate);
+		}
+	}
+} // namespace database
@@ -0,0 +1,375 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <variant>
+#include <optional>
+#include <functional>
+#include <string_view>
+
+namespace database
+{
+	/**
+	 * @enum span_kind
+	 * @brief Identifies which part of a database operation a span covers.
+	 */
+	enum class span_kind {
+		/**
+		 * @brief Envelope span for one statement; parent of the spans below.
+		 */
+		query = 0,
+
+		/**
+		 * @brief Establishing a server connection.
+		 */
+		connect = 1,
+
+		/**
+		 * @brief Waiting for a connection to become available.
+		 */
+		acquire = 2,
+
+		/**
+		 * @brief Encoding and sending a statement to the server.
+		 */
+		execute = 3,
+
+		/**
+		 * @brief Waiting for and receiving the result from the server.
+		 */
+		fetch = 4,
+
+		/**
+		 * @brief Converting the received result into caller-facing values.
+		 */
+		decode = 5
+	};
+
+	/**
+	 * @brief Returns the span name used for a @c span_kind (e.g. "db.execute").
+	 */
+	const char* span_name(const span_kind& kind);
+
+	/**
+	 * @struct span_attribute
+	 * @brief A single key/value attribute attached to a span.
+	 */
+	struct span_attribute
+	{
+		std::string key;
+		std::variant<std::string, int64_t, double, bool> value;
+	};
+
+	/**
+	 * @struct trace_span
+	 * @brief A finished span as handed to a @c span_exporter.
+	 *
+	 * Identifiers follow the W3C Trace Context sizes (16 byte trace id,
+	 * 8 byte span id); a zero parent id marks a root span. Times are
+	 * nanoseconds since the Unix epoch.
+	 */
+	struct trace_span
+	{
+		std::array<uint8_t, 16> trace_id{};
+		std::array<uint8_t, 8> span_id{};
+		std::array<uint8_t, 8> parent_span_id{};
+		span_kind kind = span_kind::query;
+		uint64_t start_time_unix_nano = 0;
+		uint64_t end_time_unix_nano = 0;
+		std::vector<span_attribute> attributes;
+		bool error = false;
+		std::string status_message;
+	};
+
+	/**
+	 * @class span_exporter
+	 * @brief Receives finished spans.
+	 *
+	 * Implementations must be thread-safe; @c export_span may be called
+	 * concurrently from every thread that runs queries.
+	 */
+	class span_exporter
+	{
+	public:
+		virtual ~span_exporter(void) {}
+
+		/**
+		 * @brief Called once for every finished, sampled span.
+		 */
+		virtual void export_span(const trace_span& span) = 0;
+
+		/**
+		 * @brief Pushes any buffered spans to their destination.
+		 */
+		virtual void flush(void) {}
+	};
+
+	/**
+	 * @class otlp_json_file_exporter
+	 * @brief Appends spans to a file in the OTLP/JSON encoding.
+	 *
+	 * Each line of the file is one complete @c ExportTraceServiceRequest
+	 * object, the same layout the OpenTelemetry Collector file exporter
+	 * writes, so the output can be replayed into a collector or loaded by
+	 * tools that understand OTLP. Spans are buffered and written in
+	 * batches of @c batch_size or on @c flush.
+	 */
+	class otlp_json_file_exporter : public span_exporter
+	{
+	public:
+		otlp_json_file_exporter(const std::string& file_path,
+								const std::string& service_name = "database_system",
+								const size_t& batch_size = 64);
+		virtual ~otlp_json_file_exporter(void);
+
+		/**
+		 * @brief Returns @c true if the output file could be opened.
+		 */
+		bool is_open(void) const;
+
+		void export_span(const trace_span& span) override;
+		void flush(void) override;
+
+	private:
+		void write_batch(void);
+
+	private:
+		std::mutex mutex_;
+		std::ofstream stream_;
+		std::string service_name_;
+		size_t batch_size_;
+		std::vector<trace_span> pending_;
+	};
+
+	/**
+	 * @class callback_exporter
+	 * @brief Forwards every span to a user-supplied function.
+	 *
+	 * Useful for bridging into an existing OpenTelemetry SDK or any other
+	 * tracing system in the host process.
+	 */
+	class callback_exporter : public span_exporter
+	{
+	public:
+		explicit callback_exporter(std::function<void(const trace_span&)> callback);
+
+		void export_span(const trace_span& span) override;
+
+	private:
+		std::function<void(const trace_span&)> callback_;
+	};
+
+	/**
+	 * @struct span_frame
+	 * @brief Identity of the innermost active span on the current thread.
+	 *
+	 * Frames form an intrusive stack through @c previous; they live inside
+	 * @c scoped_span and @c scoped_trace_context objects, so tracking the
+	 * stack never allocates.
+	 */
+	struct span_frame
+	{
+		std::array<uint8_t, 16> trace_id{};
+		std::array<uint8_t, 8> span_id{};
+		bool sampled = false;
+		span_frame* previous = nullptr;
+	};
+
+	/**
+	 * @class query_tracer
+	 * @brief Process-wide tracing configuration for database operations.
+	 *
+	 * Tracing is off until an exporter is installed. With no exporter a
+	 * span costs one relaxed atomic load; with an exporter but an unsampled
+	 * trace it costs a handful of thread-local stores and allocates
+	 * nothing. Sampling is decided once per root span and inherited by all
+	 * of its children, including spans under a remote parent installed with
+	 * @c scoped_trace_context.
+	 */
+	class query_tracer
+	{
+	public:
+		query_tracer(void);
+		virtual ~query_tracer(void);
+
+		/**
+		 * @brief Installs the exporter; passing @c nullptr disables tracing.
+		 */
+		void set_exporter(std::shared_ptr<span_exporter> exporter);
+
+		/**
+		 * @brief Sets the fraction of root spans that are recorded.
+		 *
+		 * @param ratio A value in [0, 1]; values outside are clamped.
+		 */
+		void set_sample_ratio(const double& ratio);
+
+		/**
+		 * @brief Returns @c true when an exporter is installed.
+		 */
+		bool enabled(void) const { return enabled_.load(std::memory_order_relaxed); }
+
+		/**
+		 * @brief Flushes the installed exporter, if any.
+		 */
+		void flush(void);
+
+		/**
+		 * @brief Makes a sampling decision for a new root span.
+		 */
+		bool should_sample(void) const;
+
+		/**
+		 * @brief Hands a finished span to the installed exporter.
+		 */
+		void export_span(const trace_span& span);
+
+		/**
+		 * @brief Returns the innermost active frame on this thread, or
+		 *        @c nullptr.
+		 */
+		static span_frame* current_frame(void);
+
+		/**
+		 * @brief Replaces the innermost active frame on this thread.
+		 */
+		static void set_current_frame(span_frame* frame);
+
+	private:
+		std::atomic<bool> enabled_;
+		std::atomic<uint64_t> sample_threshold_;
+		std::mutex exporter_mutex_;
+		std::shared_ptr<span_exporter> exporter_;
+
+#pragma region singleton
+	public:
+		/**
+		 * @brief Provides access to the process-wide tracer.
+		 */
+		static query_tracer& handle(void);
+
+	private:
+		static std::unique_ptr<query_tracer> handle_;
+		static std::once_flag once_;
+#pragma endregion
+	};
+
+	/**
+	 * @class scoped_trace_context
+	 * @brief Makes a caller's trace the parent of database spans on this
+	 *        thread for the lifetime of the object.
+	 *
+	 * Construct one around database calls with the incoming W3C
+	 * @c traceparent header so that query spans join the end-to-end
+	 * request trace instead of starting traces of their own.
+	 */
+	class scoped_trace_context
+	{
+	public:
+		explicit scoped_trace_context(std::string_view traceparent);
+		~scoped_trace_context(void);
+
+		scoped_trace_context(const scoped_trace_context&) = delete;
+		scoped_trace_context& operator=(const scoped_trace_context&) = delete;
+
+		/**
+		 * @brief Returns @c true if @c traceparent was well-formed.
+		 */
+		bool valid(void) const { return valid_; }
+
+	private:
+		span_frame frame_;
+		bool valid_;
+	};
+
+	/**
+	 * @class scoped_span
+	 * @brief RAII span around one phase of a database operation.
+	 *
+	 * The span starts on construction and is exported on destruction. All
+	 * setters are no-ops, and take only views, when the span is not being
+	 * recorded, so call sites do not need to guard them.
+	 */
+	class scoped_span
+	{
+	public:
+		explicit scoped_span(const span_kind& kind);
+		~scoped_span(void);
+
+		scoped_span(const scoped_span&) = delete;
+		scoped_span& operator=(const scoped_span&) = delete;
+
+		/**
+		 * @brief Returns @c true if this span will be exported.
+		 */
+		bool recording(void) const { return span_ != nullptr; }
+
+		void set_attribute(const char* key, std::string_view value);
+		void set_attribute(const char* key, const int64_t& value);
+
+		/**
+		 * @brief Attaches the statement fingerprint and operation name.
+		 *
+		 * The statement text itself is never exported, only its
+		 * normalized fingerprint, so literal values do not leak into
+		 * traces.
+		 */
+		void set_statement(std::string_view query_string);
+
+		/**
+		 * @brief Marks the span as failed.
+		 *
+		 * @param sqlstate The five character SQLSTATE, or empty if none.
+		 * @param message  The error message reported by the server.
+		 */
+		void set_error(std::string_view sqlstate, std::string_view message);
+
+	private:
+		span_frame frame_;
+		bool active_;
+		std::unique_ptr<trace_span> span_;
+	};
+
+	/**
+	 * @brief Formats a trace or span id as lower-case hex.
+	 */
+	std::string trace_id_to_string(const uint8_t* id, const size_t& size);
+} // namespace database
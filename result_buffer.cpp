@@ -0,0 +1,209 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/result_buffer.h"
+
+namespace database
+{
+	result_buffer::result_buffer(void) : columns_(0), affected_rows_(0) {}
+
+	result_buffer::~result_buffer(void) {}
+
+	void result_buffer::reset(const size_t& columns)
+	{
+		columns_ = columns;
+		affected_rows_ = 0;
+		cells_.clear();
+		text_.clear();
+		column_names_.assign(columns, { 0, 0 });
+	}
+
+	void result_buffer::reserve(const size_t& rows, const size_t& text_bytes)
+	{
+		cells_.reserve(rows * (columns_ == 0 ? 1 : columns_));
+		text_.reserve(text_bytes);
+	}
+
+	void result_buffer::set_column_name(const size_t& column, std::string_view name)
+	{
+		if (column >= column_names_.size())
+		{
+			return;
+		}
+
+		column_names_[column] = { text_.size(), name.size() };
+		text_.insert(text_.end(), name.begin(), name.end());
+	}
+
+	void result_buffer::append_null(void)
+	{
+		cell value{};
+		value.integer = 0;
+		cells_.push_back(value);
+	}
+
+	void result_buffer::append_boolean(const bool& value, std::string_view text)
+	{
+		cell entry{};
+		entry.integer = value ? 1 : 0;
+		append(cell_kind::boolean, text, entry);
+	}
+
+	void result_buffer::append_integer(const int64_t& value, std::string_view text)
+	{
+		cell entry{};
+		entry.integer = value;
+		append(cell_kind::integer, text, entry);
+	}
+
+	void result_buffer::append_real(const double& value, std::string_view text)
+	{
+		cell entry{};
+		entry.real = value;
+		append(cell_kind::real, text, entry);
+	}
+
+	void result_buffer::append_text(std::string_view text)
+	{
+		cell entry{};
+		entry.integer = 0;
+		append(cell_kind::text, text, entry);
+	}
+
+	void result_buffer::append_row(const result_buffer& source, const size_t& row)
+	{
+		for (size_t column = 0; column < columns_; ++column)
+		{
+			const cell* value = source.find(row, column);
+			if (value == nullptr || value->kind == cell_kind::null)
+			{
+				append_null();
+				continue;
+			}
+
+			cell entry = *value;
+			append(value->kind, source.text(row, column), entry);
+		}
+	}
+
+	void result_buffer::swap(result_buffer& other)
+	{
+		std::swap(columns_, other.columns_);
+		std::swap(affected_rows_, other.affected_rows_);
+		cells_.swap(other.cells_);
+		text_.swap(other.text_);
+		column_names_.swap(other.column_names_);
+	}
+
+	size_t result_buffer::rows(void) const
+	{
+		return columns_ == 0 ? 0 : cells_.size() / columns_;
+	}
+
+	std::string_view result_buffer::column_name(const size_t& column) const
+	{
+		if (column >= column_names_.size())
+		{
+			return {};
+		}
+
+		const auto& [offset, length] = column_names_[column];
+		return std::string_view(text_.data() + offset, length);
+	}
+
+	result_buffer::cell_kind result_buffer::kind(const size_t& row, const size_t& column) const
+	{
+		const cell* value = find(row, column);
+		return value == nullptr ? cell_kind::null : value->kind;
+	}
+
+	bool result_buffer::is_null(const size_t& row, const size_t& column) const
+	{
+		return kind(row, column) == cell_kind::null;
+	}
+
+	bool result_buffer::boolean(const size_t& row, const size_t& column) const
+	{
+		const cell* value = find(row, column);
+		return value != nullptr && value->kind == cell_kind::boolean && value->integer != 0;
+	}
+
+	int64_t result_buffer::integer(const size_t& row, const size_t& column) const
+	{
+		const cell* value = find(row, column);
+		return (value != nullptr && value->kind == cell_kind::integer) ? value->integer : 0;
+	}
+
+	double result_buffer::real(const size_t& row, const size_t& column) const
+	{
+		const cell* value = find(row, column);
+		return (value != nullptr && value->kind == cell_kind::real) ? value->real : 0.0;
+	}
+
+	std::string_view result_buffer::text(const size_t& row, const size_t& column) const
+	{
+		const cell* value = find(row, column);
+		if (value == nullptr || value->kind == cell_kind::null)
+		{
+			return {};
+		}
+
+		return std::string_view(text_.data() + value->offset, value->length);
+	}
+
+	size_t result_buffer::capacity_bytes(void) const
+	{
+		return cells_.capacity() * sizeof(cell) + text_.capacity()
+			   + column_names_.capacity() * sizeof(column_names_[0]);
+	}
+
+	void result_buffer::append(const cell_kind& kind, std::string_view text, cell& value)
+	{
+		value.kind = kind;
+		value.offset = text_.size();
+		value.length = static_cast<uint32_t>(text.size());
+		text_.insert(text_.end(), text.begin(), text.end());
+		cells_.push_back(value);
+	}
+
+	const result_buffer::cell* result_buffer::find(const size_t& row,
+												   const size_t& column) const
+	{
+		if (column >= columns_)
+		{
+			return nullptr;
+		}
+
+		const size_t index = row * columns_ + column;
+		return index < cells_.size() ? &cells_[index] : nullptr;
+	}
+} // namespace database
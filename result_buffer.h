@@ -0,0 +1,156 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+namespace database
+{
+	/**
+	 * @class result_buffer
+	 * @brief A reusable, flat store for the rows of one query result.
+	 *
+	 * Cells are kept in a single vector and their text in a single
+	 * character arena. @c reset() empties both without releasing their
+	 * capacity, so decoding results of a similar size into the same buffer
+	 * repeatedly does not touch the heap once it has grown to fit. Views
+	 * returned by @c text() and @c column_name() stay valid until the next
+	 * @c reset().
+	 */
+	class result_buffer
+	{
+	public:
+		/**
+		 * @enum cell_kind
+		 * @brief The native type a cell was decoded to.
+		 */
+		enum class cell_kind : uint8_t { null, boolean, integer, real, text };
+
+		result_buffer(void);
+		virtual ~result_buffer(void);
+
+		/**
+		 * @brief Removes all rows and sets the column count, keeping the
+		 *        allocated capacity.
+		 */
+		void reset(const size_t& columns);
+
+		/**
+		 * @brief Pre-allocates room for @p rows rows and @p text_bytes
+		 *        bytes of cell and column-name text.
+		 */
+		void reserve(const size_t& rows, const size_t& text_bytes);
+
+		void set_column_name(const size_t& column, std::string_view name);
+
+		/**
+		 * @brief Appends one cell to the current row; a row is complete
+		 *        after @c columns() cells. @p text is the value as sent by
+		 *        the server and is kept for every non-null cell.
+		 */
+		void append_null(void);
+		void append_boolean(const bool& value, std::string_view text);
+		void append_integer(const int64_t& value, std::string_view text);
+		void append_real(const double& value, std::string_view text);
+		void append_text(std::string_view text);
+
+		/**
+		 * @brief Appends a copy of row @p row of @p source, which must
+		 *        have at least as many columns; extra trailing columns
+		 *        are not copied.
+		 */
+		void append_row(const result_buffer& source, const size_t& row);
+
+		/**
+		 * @brief Exchanges contents and capacity with @p other.
+		 */
+		void swap(result_buffer& other);
+
+		void set_affected_rows(const uint64_t& rows) { affected_rows_ = rows; }
+
+		/**
+		 * @brief Returns the number of rows changed by an INSERT, UPDATE
+		 *        or DELETE, or 0.
+		 */
+		uint64_t affected_rows(void) const { return affected_rows_; }
+
+		size_t rows(void) const;
+		size_t columns(void) const { return columns_; }
+
+		std::string_view column_name(const size_t& column) const;
+
+		cell_kind kind(const size_t& row, const size_t& column) const;
+		bool is_null(const size_t& row, const size_t& column) const;
+
+		/**
+		 * @brief Typed accessors. They return 0 / @c false when the cell is
+		 *        of a different kind; @c text() works for every kind and is
+		 *        empty for NULL.
+		 */
+		bool boolean(const size_t& row, const size_t& column) const;
+		int64_t integer(const size_t& row, const size_t& column) const;
+		double real(const size_t& row, const size_t& column) const;
+		std::string_view text(const size_t& row, const size_t& column) const;
+
+		/**
+		 * @brief Returns the heap bytes currently reserved by the buffer.
+		 */
+		size_t capacity_bytes(void) const;
+
+	private:
+		struct cell
+		{
+			cell_kind kind = cell_kind::null;
+			uint32_t length = 0;
+			size_t offset = 0;
+			union
+			{
+				int64_t integer;
+				double real;
+			};
+		};
+
+		void append(const cell_kind& kind, std::string_view text, cell& value);
+		const cell* find(const size_t& row, const size_t& column) const;
+
+	private:
+		size_t columns_;
+		uint64_t affected_rows_;
+		std::vector<cell> cells_;
+		std::vector<char> text_;
+		std::vector<std::pair<size_t, size_t>> column_names_;
+	};
+} // namespace database
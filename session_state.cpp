@@ -0,0 +1,231 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/session_state.h"
+
+#include <cctype>
+
+namespace database
+{
+	namespace
+	{
+		/**
+		 * Quotes @p value as a string literal that reads the same whether
+		 * standard_conforming_strings is on or off.
+		 */
+		void append_literal(std::string& output, const std::string& value)
+		{
+			const bool escaped = value.find('\\') != std::string::npos;
+			output += escaped ? "E'" : "'";
+			for (const char c : value)
+			{
+				if (c == '\'' || (escaped && c == '\\'))
+				{
+					output.push_back(c);
+				}
+				output.push_back(c);
+			}
+			output.push_back('\'');
+		}
+
+		std::string_view skip_space(std::string_view text)
+		{
+			while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front())))
+			{
+				text.remove_prefix(1);
+			}
+			return text;
+		}
+
+		bool starts_with_word(std::string_view text, std::string_view word)
+		{
+			if (text.size() < word.size())
+			{
+				return false;
+			}
+			for (size_t index = 0; index < word.size(); ++index)
+			{
+				if (std::toupper(static_cast<unsigned char>(text[index])) != word[index])
+				{
+					return false;
+				}
+			}
+			return text.size() == word.size() || !std::isalnum(static_cast<unsigned char>(text[word.size()]));
+		}
+	} // namespace
+
+	session_state::session_state(void) : unknown_(false), skipped_(0), sent_(0) {}
+
+	bool session_state::set(const std::string& name, const std::string& value)
+	{
+		std::string key;
+		key.reserve(name.size());
+		for (const char c : name)
+		{
+			const auto byte = static_cast<unsigned char>(c);
+			if (!std::isalnum(byte) && c != '_' && c != '.')
+			{
+				return false;
+			}
+			key.push_back(static_cast<char>(std::tolower(byte)));
+		}
+		if (key.empty())
+		{
+			return false;
+		}
+
+		const auto found = known_.find(key);
+		if (found != known_.end() && found->second == value)
+		{
+			if (pending_.erase(key) == 0)
+			{
+				++skipped_;
+			}
+			return true;
+		}
+
+		pending_[key] = value;
+		return true;
+	}
+
+	const std::string* session_state::value(const std::string& name) const
+	{
+		std::string key;
+		for (const char c : name)
+		{
+			key.push_back(static_cast<char>(std::tolower(static_cast<unsigned char>(c))));
+		}
+
+		auto found = pending_.find(key);
+		if (found != pending_.end())
+		{
+			return &found->second;
+		}
+		found = known_.find(key);
+		return found != known_.end() ? &found->second : nullptr;
+	}
+
+	std::string session_state::statement(void) const
+	{
+		std::string statement = "SELECT ";
+		for (const auto& [name, value] : pending_)
+		{
+			statement += statement.size() > 7 ? ", set_config('" : "set_config('";
+			statement += name;
+			statement += "', ";
+			append_literal(statement, value);
+			statement += ", false)";
+		}
+		return statement;
+	}
+
+	void session_state::begin(const bool& in_transaction)
+	{
+		if (in_transaction || tentative_.empty())
+		{
+			return;
+		}
+
+		for (const std::string& name : tentative_)
+		{
+			known_.erase(name);
+		}
+		tentative_.clear();
+		unknown_ = true;
+	}
+
+	void session_state::applied(const bool& succeeded, const bool& in_transaction)
+	{
+		if (succeeded)
+		{
+			for (auto& [name, value] : pending_)
+			{
+				known_[name] = std::move(value);
+				if (in_transaction)
+				{
+					tentative_.insert(name);
+				}
+			}
+			sent_ += pending_.size();
+			pending_.clear();
+		}
+	}
+
+	void session_state::forget(void)
+	{
+		known_.clear();
+		tentative_.clear();
+		unknown_ = true;
+	}
+
+	void session_state::reconnected(void)
+	{
+		for (auto& [name, value] : known_)
+		{
+			pending_.try_emplace(name, std::move(value));
+		}
+		known_.clear();
+		tentative_.clear();
+		unknown_ = false;
+	}
+
+	void session_state::reset(void)
+	{
+		known_.clear();
+		pending_.clear();
+		tentative_.clear();
+		unknown_ = false;
+	}
+
+	bool session_state::at_baseline(void) const { return known_.empty() && !unknown_; }
+
+	bool session_state::changes_settings(std::string_view query_string)
+	{
+		query_string = skip_space(query_string);
+		return starts_with_word(query_string, "SET") || starts_with_word(query_string, "RESET")
+			   || starts_with_word(query_string, "DISCARD");
+	}
+
+	bool session_state::can_carry(std::string_view query_string)
+	{
+		query_string = skip_space(query_string);
+		for (const std::string_view word :
+			 { "SELECT", "INSERT", "UPDATE", "DELETE", "MERGE", "WITH", "VALUES", "TABLE" })
+		{
+			if (starts_with_word(query_string, word))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+} // namespace database
@@ -0,0 +1,164 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+
+namespace database
+{
+	/**
+	 * @class session_state
+	 * @brief Tracks the run-time settings (GUCs) of one server session, so
+	 *        that only settings that differ are sent.
+	 *
+	 * @c set records the value a caller needs. If the session is already
+	 * known to have it, nothing is sent; otherwise it is pending, and
+	 * @c statement builds one @c set_config call per pending setting,
+	 * which the connection sends together with its next statement.
+	 *
+	 * A setting changed inside a transaction block is undone if the block
+	 * rolls back, and which way it ended is not visible from the client.
+	 * Such settings are trusted until the block ends and then forgotten,
+	 * so the next @c set sends them again. @c forget drops everything
+	 * known after a statement changed settings behind the tracker's back,
+	 * e.g. a plain SET, RESET or DISCARD.
+	 */
+	class session_state
+	{
+	public:
+		session_state(void);
+
+		/**
+		 * @brief Requests @p value for setting @p name, e.g.
+		 *        "statement_timeout" and "5s".
+		 *
+		 * @return @c false if @p name is not a setting name.
+		 */
+		bool set(const std::string& name, const std::string& value);
+
+		/**
+		 * @brief The value requested for @p name, sent or not, or
+		 *        @c nullptr if the session has the server default.
+		 */
+		const std::string* value(const std::string& name) const;
+
+		/**
+		 * @brief Returns @c true if settings are waiting to be sent.
+		 */
+		bool pending(void) const { return !pending_.empty(); }
+
+		/**
+		 * @brief A SELECT that applies every pending setting, e.g.
+		 *        "SELECT set_config('work_mem', '64MB', false)".
+		 */
+		std::string statement(void) const;
+
+		/**
+		 * @brief Called before a statement is sent; settings changed in a
+		 *        transaction block that has since ended are forgotten.
+		 */
+		void begin(const bool& in_transaction);
+
+		/**
+		 * @brief Records the outcome of the statement that carried the
+		 *        pending settings.
+		 *
+		 * On success they are known. On failure the statement's implicit
+		 * transaction rolled them back, so they stay pending and travel
+		 * with the next statement, and the previous values stay known.
+		 *
+		 * @param in_transaction The statement started or ended inside a
+		 *        transaction block.
+		 */
+		void applied(const bool& succeeded, const bool& in_transaction);
+
+		/**
+		 * @brief The session's settings are unknown; pending settings are
+		 *        kept.
+		 */
+		void forget(void);
+
+		/**
+		 * @brief The session was replaced by a new one; everything that
+		 *        was known is pending again.
+		 */
+		void reconnected(void);
+
+		/**
+		 * @brief Settings were reset to the server defaults.
+		 */
+		void reset(void);
+
+		/**
+		 * @brief Returns @c true if the session is known to have only
+		 *        server defaults, apart from pending settings.
+		 */
+		bool at_baseline(void) const;
+
+		/**
+		 * @brief Number of @c set calls that needed nothing sent.
+		 */
+		uint64_t skipped(void) const { return skipped_; }
+
+		/**
+		 * @brief Number of settings sent.
+		 */
+		uint64_t sent(void) const { return sent_; }
+
+		/**
+		 * @brief Returns @c true if @p query_string starts with SET,
+		 *        RESET or DISCARD and may change settings directly.
+		 */
+		static bool changes_settings(std::string_view query_string);
+
+		/**
+		 * @brief Returns @c true if settings can be sent in the same
+		 *        message as @p query_string: it is a SELECT, INSERT,
+		 *        UPDATE, DELETE, MERGE, WITH, VALUES or TABLE statement,
+		 *        which may run in an implicit transaction block.
+		 */
+		static bool can_carry(std::string_view query_string);
+
+	private:
+		std::map<std::string, std::string> known_;
+		std::map<std::string, std::string> pending_;
+		std::set<std::string> tentative_; ///< Known, but set inside a transaction block.
+		bool unknown_; ///< Settings may differ from the defaults in ways not tracked.
+		uint64_t skipped_;
+		uint64_t sent_;
+	};
+} // namespace database
@@ -0,0 +1,480 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/shared_result_cache.h"
+
+#include <atomic>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace database
+{
+	namespace
+	{
+		constexpr uint64_t segment_magic = 0x3148435253444244ULL; // "DBDSRCH1"
+		constexpr uint64_t set_ways = 8;
+		constexpr int read_attempts = 4;
+
+		static_assert(std::atomic<uint64_t>::is_always_lock_free,
+					  "shared_result_cache needs address-free 64-bit atomics");
+
+		uint64_t hash_key(std::string_view key)
+		{
+			uint64_t hash = 14695981039346656037ULL;
+			for (const unsigned char c : key)
+			{
+				hash ^= c;
+				hash *= 1099511628211ULL;
+			}
+			return hash;
+		}
+
+		uint64_t monotonic_ns(void)
+		{
+			return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+		}
+	}
+
+	struct shared_result_cache::segment_header
+	{
+		std::atomic<uint64_t> ready;
+		uint64_t magic;
+		uint64_t slot_bytes;
+		uint64_t slot_count;
+		std::atomic<uint64_t> clock;
+		std::atomic<uint64_t> hits;
+		std::atomic<uint64_t> misses;
+		std::atomic<uint64_t> stores;
+		std::atomic<uint64_t> evictions;
+		std::atomic<uint64_t> rejected;
+		uint64_t reserved[6];
+	};
+
+	struct shared_result_cache::slot_header
+	{
+		std::atomic<uint64_t> sequence; ///< Odd while a writer owns the slot.
+		std::atomic<uint64_t> last_used;
+		uint64_t hash;
+		uint64_t expires_ns;			///< 0 marks an empty slot.
+		uint32_t key_bytes;
+		uint32_t value_bytes;
+		uint64_t reserved;
+	};
+
+	static_assert(sizeof(shared_result_cache::statistics) == 5 * sizeof(uint64_t));
+
+	shared_result_cache::shared_result_cache(void)
+		: segment_(nullptr), mapped_bytes_(0), header_(nullptr)
+	{
+	}
+
+	shared_result_cache::~shared_result_cache(void) { close(); }
+
+	bool shared_result_cache::open(const std::string& name,
+								   const size_t& size_bytes,
+								   const size_t& slot_bytes)
+	{
+#ifdef _WIN32
+		(void)name;
+		(void)size_bytes;
+		(void)slot_bytes;
+		return false;
+#else
+		close();
+
+		if (slot_bytes <= sizeof(slot_header) || slot_bytes % alignof(slot_header) != 0)
+		{
+			return false;
+		}
+
+		const uint64_t slot_count = (size_bytes / slot_bytes) / set_ways * set_ways;
+		if (slot_count == 0)
+		{
+			return false;
+		}
+		const size_t total = sizeof(segment_header) + slot_count * slot_bytes;
+
+		bool created = true;
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0 && errno == EEXIST)
+		{
+			created = false;
+			fd = shm_open(name.c_str(), O_RDWR, 0600);
+		}
+		if (fd < 0)
+		{
+			return false;
+		}
+
+		if (created && ftruncate(fd, static_cast<off_t>(total)) != 0)
+		{
+			::close(fd);
+			shm_unlink(name.c_str());
+			return false;
+		}
+
+		if (!created)
+		{
+			// The creator may not have sized the segment yet.
+			struct stat info{};
+			for (int attempt = 0; attempt < 1000; ++attempt)
+			{
+				if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) >= total)
+				{
+					break;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			if (static_cast<size_t>(info.st_size) != total)
+			{
+				::close(fd);
+				return false;
+			}
+		}
+
+		void* mapped = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (mapped == MAP_FAILED)
+		{
+			if (created)
+			{
+				shm_unlink(name.c_str());
+			}
+			return false;
+		}
+
+		auto* header = static_cast<segment_header*>(mapped);
+		if (created)
+		{
+			// ftruncate zero-fills, which is a valid state for every atomic and
+			// marks every slot empty; only the geometry has to be written.
+			header->magic = segment_magic;
+			header->slot_bytes = slot_bytes;
+			header->slot_count = slot_count;
+			header->ready.store(1, std::memory_order_release);
+		}
+		else
+		{
+			for (int attempt = 0; attempt < 1000 && header->ready.load(std::memory_order_acquire) == 0;
+				 ++attempt)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			if (header->ready.load(std::memory_order_acquire) == 0 || header->magic != segment_magic
+				|| header->slot_bytes != slot_bytes || header->slot_count != slot_count)
+			{
+				munmap(mapped, total);
+				return false;
+			}
+		}
+
+		segment_ = mapped;
+		mapped_bytes_ = total;
+		header_ = header;
+		return true;
+#endif
+	}
+
+	void shared_result_cache::close(void)
+	{
+#ifndef _WIN32
+		if (segment_ != nullptr)
+		{
+			munmap(segment_, mapped_bytes_);
+		}
+#endif
+		segment_ = nullptr;
+		mapped_bytes_ = 0;
+		header_ = nullptr;
+	}
+
+	bool shared_result_cache::remove(const std::string& name)
+	{
+#ifdef _WIN32
+		(void)name;
+		return false;
+#else
+		return shm_unlink(name.c_str()) == 0;
+#endif
+	}
+
+	shared_result_cache::slot_header* shared_result_cache::slot(const uint64_t& index) const
+	{
+		auto* base = reinterpret_cast<char*>(header_ + 1);
+		return reinterpret_cast<slot_header*>(base + index * header_->slot_bytes);
+	}
+
+	bool shared_result_cache::lock(slot_header* entry, uint64_t& sequence)
+	{
+		sequence = entry->sequence.load(std::memory_order_relaxed);
+		if ((sequence & 1) != 0
+			|| !entry->sequence.compare_exchange_strong(sequence, sequence + 1,
+														std::memory_order_acquire,
+														std::memory_order_relaxed))
+		{
+			return false;
+		}
+		// Keep the data stores below from becoming visible before the odd
+		// sequence does.
+		std::atomic_thread_fence(std::memory_order_release);
+		return true;
+	}
+
+	void shared_result_cache::unlock(slot_header* entry, const uint64_t& sequence)
+	{
+		entry->sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+	size_t shared_result_cache::max_entry_bytes(void) const
+	{
+		return header_ == nullptr ? 0 : header_->slot_bytes - sizeof(slot_header);
+	}
+
+	bool shared_result_cache::get(std::string_view key, std::string& value)
+	{
+		if (header_ == nullptr)
+		{
+			return false;
+		}
+
+		const uint64_t hash = hash_key(key);
+		const uint64_t first = (hash % (header_->slot_count / set_ways)) * set_ways;
+		const size_t capacity = max_entry_bytes();
+		const uint64_t now = monotonic_ns();
+
+		for (uint64_t way = 0; way < set_ways; ++way)
+		{
+			slot_header* entry = slot(first + way);
+			const char* data = reinterpret_cast<const char*>(entry + 1);
+
+			for (int attempt = 0; attempt < read_attempts; ++attempt)
+			{
+				const uint64_t before = entry->sequence.load(std::memory_order_acquire);
+				if ((before & 1) != 0)
+				{
+					continue;
+				}
+
+				const uint64_t entry_hash = entry->hash;
+				const uint64_t expires = entry->expires_ns;
+				const size_t key_bytes = entry->key_bytes;
+				const size_t value_bytes = entry->value_bytes;
+
+				// Fields read mid-write may be garbage; check them before use
+				// and let the sequence check below discard the result.
+				bool match = entry_hash == hash && expires > now && key_bytes == key.size()
+							 && key_bytes + value_bytes <= capacity
+							 && std::memcmp(data, key.data(), key_bytes) == 0;
+				if (match)
+				{
+					value.assign(data + key_bytes, value_bytes);
+				}
+
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (entry->sequence.load(std::memory_order_relaxed) != before)
+				{
+					continue;
+				}
+
+				if (!match)
+				{
+					break;
+				}
+
+				entry->last_used.store(header_->clock.fetch_add(1, std::memory_order_relaxed),
+									   std::memory_order_relaxed);
+				header_->hits.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+		}
+
+		header_->misses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	bool shared_result_cache::put(std::string_view key,
+								  std::string_view value,
+								  const std::chrono::milliseconds& ttl)
+	{
+		if (header_ == nullptr)
+		{
+			return false;
+		}
+		if (key.size() + value.size() > max_entry_bytes() || ttl.count() <= 0)
+		{
+			header_->rejected.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		const uint64_t hash = hash_key(key);
+		const uint64_t first = (hash % (header_->slot_count / set_ways)) * set_ways;
+		const uint64_t now = monotonic_ns();
+
+		// Choose the victim from an unlocked scan; a slot that changes before
+		// it is locked is simply overwritten, which is harmless for a cache.
+		uint64_t victim = first;
+		int victim_rank = 4;
+		uint64_t oldest = UINT64_MAX;
+		for (uint64_t way = 0; way < set_ways; ++way)
+		{
+			slot_header* entry = slot(first + way);
+			const char* data = reinterpret_cast<const char*>(entry + 1);
+			const uint64_t expires = entry->expires_ns;
+
+			int rank = 3;
+			if (entry->hash == hash && entry->key_bytes == key.size() && expires != 0
+				&& std::memcmp(data, key.data(), key.size()) == 0)
+			{
+				rank = 0;
+			}
+			else if (expires == 0)
+			{
+				rank = 1;
+			}
+			else if (expires <= now)
+			{
+				rank = 2;
+			}
+
+			const uint64_t used = entry->last_used.load(std::memory_order_relaxed);
+			if (rank < victim_rank || (rank == 3 && victim_rank == 3 && used < oldest))
+			{
+				victim = first + way;
+				victim_rank = rank;
+				oldest = used;
+			}
+			if (rank == 0)
+			{
+				break;
+			}
+		}
+
+		slot_header* entry = slot(victim);
+		uint64_t sequence = 0;
+		if (!lock(entry, sequence))
+		{
+			header_->rejected.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		if (victim_rank == 3 && entry->expires_ns > now)
+		{
+			header_->evictions.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		char* data = reinterpret_cast<char*>(entry + 1);
+		std::memcpy(data, key.data(), key.size());
+		std::memcpy(data + key.size(), value.data(), value.size());
+		entry->hash = hash;
+		entry->key_bytes = static_cast<uint32_t>(key.size());
+		entry->value_bytes = static_cast<uint32_t>(value.size());
+		entry->expires_ns = now + static_cast<uint64_t>(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(ttl).count());
+		entry->last_used.store(header_->clock.fetch_add(1, std::memory_order_relaxed),
+							   std::memory_order_relaxed);
+
+		unlock(entry, sequence);
+		header_->stores.fetch_add(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	void shared_result_cache::invalidate(std::string_view key)
+	{
+		if (header_ == nullptr)
+		{
+			return;
+		}
+
+		const uint64_t hash = hash_key(key);
+		const uint64_t first = (hash % (header_->slot_count / set_ways)) * set_ways;
+		for (uint64_t way = 0; way < set_ways; ++way)
+		{
+			slot_header* entry = slot(first + way);
+			uint64_t sequence = 0;
+			if (entry->hash != hash || !lock(entry, sequence))
+			{
+				continue;
+			}
+
+			const char* data = reinterpret_cast<const char*>(entry + 1);
+			if (entry->key_bytes == key.size() && std::memcmp(data, key.data(), key.size()) == 0)
+			{
+				entry->expires_ns = 0;
+			}
+			unlock(entry, sequence);
+		}
+	}
+
+	void shared_result_cache::clear(void)
+	{
+		if (header_ == nullptr)
+		{
+			return;
+		}
+
+		for (uint64_t index = 0; index < header_->slot_count; ++index)
+		{
+			slot_header* entry = slot(index);
+			uint64_t sequence = 0;
+			if (lock(entry, sequence))
+			{
+				entry->expires_ns = 0;
+				unlock(entry, sequence);
+			}
+		}
+	}
+
+	shared_result_cache::statistics shared_result_cache::stats(void) const
+	{
+		statistics result;
+		if (header_ == nullptr)
+		{
+			return result;
+		}
+
+		result.hits = header_->hits.load(std::memory_order_relaxed);
+		result.misses = header_->misses.load(std::memory_order_relaxed);
+		result.stores = header_->stores.load(std::memory_order_relaxed);
+		result.evictions = header_->evictions.load(std::memory_order_relaxed);
+		result.rejected = header_->rejected.load(std::memory_order_relaxed);
+		return result;
+	}
+} // namespace database
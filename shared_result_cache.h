@@ -0,0 +1,157 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <string_view>
+
+namespace database
+{
+	/**
+	 * @class shared_result_cache
+	 * @brief A fixed-size key/value cache in a named shared memory segment,
+	 *        shared by every process on the host that opens the same name.
+	 *
+	 * The segment is divided into equal slots grouped into sets of eight; a
+	 * key hashes to one set and may occupy any slot in it. Each slot is
+	 * guarded by a seqlock: readers never write to the segment except to
+	 * refresh a slot's LRU stamp, and retry or report a miss if a writer
+	 * changed the slot while it was copied. Writers take a slot by moving
+	 * its sequence to an odd value with compare-and-swap, so a put that
+	 * races another writer on the same slot is dropped rather than
+	 * waiting. A put replaces the same key, else an empty or expired slot,
+	 * else the least recently used slot of the set, so the segment never
+	 * grows beyond the size it was created with.
+	 *
+	 * Expiry uses the monotonic clock, which all processes on a host share.
+	 * A process killed while writing leaves that one slot unusable until
+	 * the segment is removed. POSIX only; @c open fails elsewhere.
+	 */
+	class shared_result_cache
+	{
+	public:
+		/**
+		 * @struct statistics
+		 * @brief Counters kept in the segment, so they cover all processes.
+		 */
+		struct statistics
+		{
+			uint64_t hits = 0;
+			uint64_t misses = 0;
+			uint64_t stores = 0;
+			uint64_t evictions = 0;
+			uint64_t rejected = 0; ///< Puts too large for a slot or lost to a racing writer.
+		};
+
+		shared_result_cache(void);
+		virtual ~shared_result_cache(void);
+
+		shared_result_cache(const shared_result_cache&) = delete;
+		shared_result_cache& operator=(const shared_result_cache&) = delete;
+
+		/**
+		 * @brief Maps the segment @p name, creating it if it does not exist.
+		 *
+		 * @param name       Segment name, e.g. "/app_results"; processes
+		 *                   that use the same name share entries.
+		 * @param size_bytes Total size of the slots.
+		 * @param slot_bytes Size of one slot, including a 48-byte header;
+		 *                   an entry whose key and value do not fit is
+		 *                   not cached.
+		 * @return @c false if the segment cannot be mapped, or exists with
+		 *         a different layout.
+		 */
+		bool open(const std::string& name,
+				  const size_t& size_bytes,
+				  const size_t& slot_bytes = 4096);
+
+		/**
+		 * @brief Unmaps the segment; it stays in place for other processes.
+		 */
+		void close(void);
+
+		bool is_open(void) const { return segment_ != nullptr; }
+
+		/**
+		 * @brief Copies the live value of @p key into @p value.
+		 *
+		 * @return @c true on a hit.
+		 */
+		bool get(std::string_view key, std::string& value);
+
+		/**
+		 * @brief Stores @p value under @p key for @p ttl.
+		 *
+		 * @return @c false if the entry was not stored.
+		 */
+		bool put(std::string_view key, std::string_view value, const std::chrono::milliseconds& ttl);
+
+		/**
+		 * @brief Removes @p key if it is cached.
+		 */
+		void invalidate(std::string_view key);
+
+		/**
+		 * @brief Removes every entry.
+		 */
+		void clear(void);
+
+		/**
+		 * @brief Largest key plus value size that fits in a slot.
+		 */
+		size_t max_entry_bytes(void) const;
+
+		statistics stats(void) const;
+
+		/**
+		 * @brief Deletes the segment @p name. Processes that have it mapped
+		 *        keep using their mapping until they close it.
+		 */
+		static bool remove(const std::string& name);
+
+	private:
+		struct segment_header;
+		struct slot_header;
+
+		slot_header* slot(const uint64_t& index) const;
+		bool lock(slot_header* entry, uint64_t& sequence);
+		void unlock(slot_header* entry, const uint64_t& sequence);
+
+	private:
+		void* segment_;
+		size_t mapped_bytes_;
+		segment_header* header_;
+	};
+} // namespace database
@@ -0,0 +1,646 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/sql_fingerprint.h"
+
+#include <cstdio>
+#include <string>
+
+namespace database
+{
+	namespace
+	{
+		enum class token_class { none, word, symbol, punctuation };
+
+		/**
+		 * Kinds of literal handed to the literal callback of
+		 * @c walk_statement: a plain '...' string, a number, or a literal
+		 * that is not rewritten (E'...', B'...', X'...', N'...' and
+		 * dollar-quoted strings).
+		 */
+		enum class literal_kind { string, number, other };
+
+		bool is_identifier_start(const unsigned char& c)
+		{
+			return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'
+				   || c >= 0x80;
+		}
+
+		bool is_identifier_char(const unsigned char& c)
+		{
+			return is_identifier_start(c) || (c >= '0' && c <= '9') || c == '$';
+		}
+
+		bool is_digit(const unsigned char& c) { return c >= '0' && c <= '9'; }
+
+		bool is_space(const unsigned char& c)
+		{
+			return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f'
+				   || c == '\v';
+		}
+
+		bool is_punctuation(const unsigned char& c)
+		{
+			return c == '(' || c == ')' || c == '[' || c == ']' || c == ','
+				   || c == ';' || c == '.';
+		}
+
+		char to_lower(const unsigned char& c)
+		{
+			return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a')
+										  : static_cast<char>(c);
+		}
+
+		/**
+		 * Skips a quoted literal starting at @p pos (which points at the
+		 * opening quote) and returns the position just past its end.
+		 */
+		size_t skip_quoted(std::string_view sql, size_t pos, const char& quote,
+						   const bool& backslash_escapes)
+		{
+			++pos;
+			while (pos < sql.size())
+			{
+				if (backslash_escapes && sql[pos] == '\\' && pos + 1 < sql.size())
+				{
+					pos += 2;
+					continue;
+				}
+
+				if (sql[pos] == quote)
+				{
+					if (pos + 1 < sql.size() && sql[pos + 1] == quote)
+					{
+						pos += 2;
+						continue;
+					}
+
+					return pos + 1;
+				}
+
+				++pos;
+			}
+
+			return pos;
+		}
+
+		/**
+		 * Walks the statement token by token and hands every character of
+		 * the normalized form to @p emit. Each literal is written by
+		 * @p literal, called with its kind, its source text, the word token
+		 * before it (empty if the previous token was not a word) and a
+		 * function that emits one character.
+		 */
+		template <typename Emit, typename Literal>
+		void walk_statement(std::string_view sql, Emit&& emit, Literal&& literal)
+		{
+			token_class previous = token_class::none;
+			char previous_char = '\0';
+			bool pending_space = false;
+			std::string_view previous_word;
+			std::string_view word;
+
+			// Tokens are separated by exactly one space, except that no space
+			// is placed before ",", ")", "]", "." or ";" or after "(", "[" or
+			// ".", and adjacent operator characters stay joined unless the
+			// source separated them.
+			auto begin_token = [&](const token_class& current, const char& first)
+			{
+				const bool joined_symbol = previous == token_class::symbol
+										   && current == token_class::symbol
+										   && !pending_space;
+				const bool tight_after = previous_char == '(' || previous_char == '['
+										 || previous_char == '.';
+				const bool tight_before = first == ',' || first == ')' || first == ']'
+										  || first == '.' || first == ';';
+				if (previous != token_class::none && !joined_symbol && !tight_after
+					&& !tight_before)
+				{
+					emit(' ');
+				}
+				pending_space = false;
+				previous = current;
+				previous_word = word;
+				word = {};
+			};
+			auto put = [&](const char& c)
+			{
+				emit(c);
+				previous_char = c;
+			};
+			auto put_literal = [&](const literal_kind& kind, const size_t& start, const size_t& end)
+			{
+				begin_token(token_class::word, '?');
+				literal(kind, sql.substr(start, end - start), previous_word, put);
+			};
+
+			size_t pos = 0;
+			while (pos < sql.size())
+			{
+				const unsigned char c = static_cast<unsigned char>(sql[pos]);
+
+				if (is_space(c))
+				{
+					pending_space = true;
+					++pos;
+					continue;
+				}
+
+				if (c == '-' && pos + 1 < sql.size() && sql[pos + 1] == '-')
+				{
+					while (pos < sql.size() && sql[pos] != '\n')
+					{
+						++pos;
+					}
+					pending_space = true;
+					continue;
+				}
+
+				if (c == '/' && pos + 1 < sql.size() && sql[pos + 1] == '*')
+				{
+					int depth = 0;
+					while (pos < sql.size())
+					{
+						if (sql[pos] == '/' && pos + 1 < sql.size() && sql[pos + 1] == '*')
+						{
+							++depth;
+							pos += 2;
+							continue;
+						}
+						if (sql[pos] == '*' && pos + 1 < sql.size() && sql[pos + 1] == '/')
+						{
+							pos += 2;
+							if (--depth == 0)
+							{
+								break;
+							}
+							continue;
+						}
+						++pos;
+					}
+					pending_space = true;
+					continue;
+				}
+
+				if (c == '\'')
+				{
+					const size_t end = skip_quoted(sql, pos, '\'', false);
+					put_literal(literal_kind::string, pos, end);
+					pos = end;
+					continue;
+				}
+
+				if (c == '"')
+				{
+					begin_token(token_class::word, '"');
+					const size_t end = skip_quoted(sql, pos, '"', false);
+					for (size_t index = pos; index < end; ++index)
+					{
+						put(sql[index]);
+					}
+					pos = end;
+					continue;
+				}
+
+				if (c == '$')
+				{
+					size_t end = pos + 1;
+					if (end < sql.size() && is_digit(static_cast<unsigned char>(sql[end])))
+					{
+						// Positional parameter: kept verbatim.
+						begin_token(token_class::word, '$');
+						put('$');
+						while (end < sql.size() && is_digit(static_cast<unsigned char>(sql[end])))
+						{
+							put(sql[end++]);
+						}
+						pos = end;
+						continue;
+					}
+
+					while (end < sql.size() && sql[end] != '$'
+						   && is_identifier_char(static_cast<unsigned char>(sql[end])))
+					{
+						++end;
+					}
+					if (end < sql.size() && sql[end] == '$')
+					{
+						// Dollar-quoted literal: $tag$ ... $tag$
+						const std::string_view tag = sql.substr(pos, end - pos + 1);
+						const size_t close = sql.find(tag, end + 1);
+						const size_t last = (close == std::string_view::npos) ? sql.size()
+																			  : close + tag.size();
+						put_literal(literal_kind::other, pos, last);
+						pos = last;
+						continue;
+					}
+				}
+
+				if (is_digit(c)
+					|| (c == '.' && pos + 1 < sql.size()
+						&& is_digit(static_cast<unsigned char>(sql[pos + 1]))))
+				{
+					const size_t start = pos;
+					while (pos < sql.size())
+					{
+						const unsigned char d = static_cast<unsigned char>(sql[pos]);
+						if (is_digit(d) || d == '.')
+						{
+							++pos;
+						}
+						else if ((d == 'e' || d == 'E') && pos + 1 < sql.size()
+								 && (is_digit(static_cast<unsigned char>(sql[pos + 1]))
+									 || sql[pos + 1] == '+' || sql[pos + 1] == '-'))
+						{
+							pos += 2;
+						}
+						else
+						{
+							break;
+						}
+					}
+					put_literal(literal_kind::number, start, pos);
+					continue;
+				}
+
+				if (is_identifier_start(c))
+				{
+					size_t end = pos + 1;
+					while (end < sql.size()
+						   && is_identifier_char(static_cast<unsigned char>(sql[end])))
+					{
+						++end;
+					}
+
+					// E'...', B'...', X'...' and N'...' are literals with a prefix.
+					if (end == pos + 1 && end < sql.size() && sql[end] == '\'')
+					{
+						const char prefix = to_lower(c);
+						if (prefix == 'e' || prefix == 'b' || prefix == 'x' || prefix == 'n')
+						{
+							const size_t last = skip_quoted(sql, end, '\'', prefix == 'e');
+							put_literal(literal_kind::other, pos, last);
+							pos = last;
+							continue;
+						}
+					}
+
+					begin_token(token_class::word, static_cast<char>(c));
+					word = sql.substr(pos, end - pos);
+					for (size_t index = pos; index < end; ++index)
+					{
+						put(to_lower(static_cast<unsigned char>(sql[index])));
+					}
+					pos = end;
+					continue;
+				}
+
+				begin_token(is_punctuation(c) ? token_class::punctuation
+											  : token_class::symbol,
+							static_cast<char>(c));
+				put(static_cast<char>(c));
+				++pos;
+			}
+		}
+		template <typename Put>
+		void mask_literal(const literal_kind&, std::string_view, std::string_view, Put&& put)
+		{
+			put('?');
+		}
+
+		bool equals_ignoring_case(std::string_view text, std::string_view lower)
+		{
+			if (text.size() != lower.size())
+			{
+				return false;
+			}
+			for (size_t index = 0; index < text.size(); ++index)
+			{
+				if (to_lower(static_cast<unsigned char>(text[index])) != lower[index])
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		/**
+		 * Words after which a string literal is an operand that a parameter
+		 * can replace. After any other word it is most likely a typed
+		 * literal such as DATE '2024-01-01', which has no parameter form.
+		 */
+		bool operand_keyword(std::string_view word)
+		{
+			static constexpr std::string_view keywords[]
+				= { "and",	 "or",	   "not",  "like",	 "ilike",  "similar", "to",
+					"escape", "between", "when", "then",	 "else",   "select",  "where",
+					"having", "on",	   "limit", "offset", "return", "distinct", "all" };
+			for (const auto keyword : keywords)
+			{
+				if (equals_ignoring_case(word, keyword))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		/**
+		 * Words that end an ORDER BY, GROUP BY or DISTINCT ON list, or start
+		 * a clause in which a number is an ordinary value.
+		 */
+		bool clause_keyword(std::string_view word)
+		{
+			static constexpr std::string_view keywords[]
+				= { "select", "from",	  "where",	"having", "window",	   "limit",
+					"offset", "fetch",	  "for",	"values", "set",	   "returning",
+					"union",  "intersect", "except", "on",	   "using",	   "into" };
+			for (const auto keyword : keywords)
+			{
+				if (equals_ignoring_case(word, keyword))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		/**
+		 * Whether the end of the normalized text @p statement lies inside an
+		 * ORDER BY, GROUP BY or DISTINCT ON list, where a number names an
+		 * output column rather than a value. Scans back to the keyword that
+		 * opened the current clause, skipping parenthesized expressions and
+		 * quoted literals.
+		 */
+		bool in_ordinal_list(std::string_view statement)
+		{
+			// Moves end back over the word before it; empty at a symbol.
+			const auto previous_word = [&statement](size_t& end)
+			{
+				while (end > 0 && is_space(static_cast<unsigned char>(statement[end - 1])))
+				{
+					--end;
+				}
+				size_t start = end;
+				while (start > 0 && is_identifier_char(static_cast<unsigned char>(statement[start - 1])))
+				{
+					--start;
+				}
+				const std::string_view word = statement.substr(start, end - start);
+				end = start;
+				return word;
+			};
+
+			std::string_view later_word;
+			size_t depth = 0;
+			size_t end = statement.size();
+			while (end > 0)
+			{
+				const auto c = static_cast<unsigned char>(statement[end - 1]);
+				if (c == '\'' || c == '"')
+				{
+					const size_t open
+						= end < 2 ? std::string_view::npos
+								  : statement.find_last_of(static_cast<char>(c), end - 2);
+					if (open == std::string_view::npos)
+					{
+						return false;
+					}
+					end = open;
+					continue;
+				}
+				if (!is_identifier_char(c))
+				{
+					--end;
+					if (c == ';')
+					{
+						return false;
+					}
+					if (c == ')')
+					{
+						++depth;
+					}
+					else if (c == '(' && depth > 0)
+					{
+						--depth;
+					}
+					else if (c == '(')
+					{
+						// Leaving an enclosing parenthesis: DISTINCT ON (...)
+						// is a list, anything else an expression in the clause.
+						size_t before = end;
+						if (equals_ignoring_case(previous_word(before), "on")
+							&& equals_ignoring_case(previous_word(before), "distinct"))
+						{
+							return true;
+						}
+					}
+					continue;
+				}
+
+				const std::string_view word = previous_word(end);
+				if (depth > 0)
+				{
+					continue;
+				}
+				if (equals_ignoring_case(word, "order") || equals_ignoring_case(word, "group"))
+				{
+					return equals_ignoring_case(later_word, "by");
+				}
+				if (clause_keyword(word))
+				{
+					return false;
+				}
+				later_word = word;
+			}
+			return false;
+		}
+
+		/**
+		 * The type PostgreSQL gives a numeric literal: integer if it fits,
+		 * then bigint, and numeric for anything else.
+		 */
+		std::string_view numeric_literal_type(std::string_view text)
+		{
+			if (text.find_first_of(".eE") != std::string_view::npos)
+			{
+				return "numeric";
+			}
+
+			std::string_view digits = text;
+			while (digits.size() > 1 && digits.front() == '0')
+			{
+				digits.remove_prefix(1);
+			}
+			if (digits.size() < 10 || (digits.size() == 10 && digits <= "2147483647"))
+			{
+				return "int4";
+			}
+			if (digits.size() < 19 || (digits.size() == 19 && digits <= "9223372036854775807"))
+			{
+				return "int8";
+			}
+			return "numeric";
+		}
+	} // namespace
+
+	std::string normalize_statement(std::string_view query_string)
+	{
+		std::string normalized;
+		normalized.reserve(query_string.size());
+
+		walk_statement(
+			query_string, [&normalized](const char& c) { normalized.push_back(c); },
+			[](auto&&... arguments) { mask_literal(arguments...); });
+
+		return normalized;
+	}
+
+	uint64_t statement_fingerprint(std::string_view query_string)
+	{
+		uint64_t hash = 14695981039346656037ULL;
+
+		walk_statement(
+			query_string,
+			[&hash](const char& c)
+			{
+				hash ^= static_cast<unsigned char>(c);
+				hash *= 1099511628211ULL;
+			},
+			[](auto&&... arguments) { mask_literal(arguments...); });
+
+		return hash;
+	}
+
+	bool parameterize_statement(std::string_view query_string,
+								std::string& statement,
+								std::vector<std::string>& parameters)
+	{
+		statement.clear();
+		parameters.clear();
+
+		bool usable = true;
+		auto write_literal = [&](const literal_kind& kind, std::string_view text,
+								 std::string_view previous_word, auto&& put)
+		{
+			const bool inline_literal
+				= kind == literal_kind::other
+				  || (kind == literal_kind::string && !previous_word.empty()
+					  && !operand_keyword(previous_word))
+				  // ORDER BY 1, 2 and GROUP BY 1 name output columns.
+				  || (kind == literal_kind::number && in_ordinal_list(statement));
+			if (inline_literal)
+			{
+				for (const char c : text)
+				{
+					put(c);
+				}
+				return;
+			}
+
+			std::string value;
+			if (kind == literal_kind::string)
+			{
+				// standard_conforming_strings: only '' is an escape.
+				usable = usable && text.size() >= 2 && text.back() == '\'';
+				for (size_t index = 1; index + 1 < text.size(); ++index)
+				{
+					value.push_back(text[index]);
+					if (text[index] == '\'')
+					{
+						++index;
+					}
+				}
+			}
+			else
+			{
+				value.assign(text);
+			}
+			parameters.push_back(std::move(value));
+
+			const std::string placeholder = "$" + std::to_string(parameters.size());
+			for (const char c : placeholder)
+			{
+				put(c);
+			}
+			if (kind == literal_kind::number)
+			{
+				// Keeps the type the literal had.
+				put(':');
+				put(':');
+				for (const char c : numeric_literal_type(text))
+				{
+					put(c);
+				}
+			}
+		};
+
+		bool ended = false;
+		bool in_literal = false;
+		walk_statement(
+			query_string,
+			[&](const char& c)
+			{
+				// Only a single statement, and none that already carries
+				// positional parameters.
+				usable = usable && !(ended && c != ';') && !(c == '$' && !in_literal);
+				ended = ended || c == ';';
+				statement.push_back(c);
+			},
+			[&](const literal_kind& kind, std::string_view text, std::string_view previous_word,
+				auto&& put)
+			{
+				in_literal = true;
+				write_literal(kind, text, previous_word, put);
+				in_literal = false;
+			});
+
+		static constexpr std::string_view commands[]
+			= { "select ", "insert ", "update ", "delete ", "with ", "values " };
+		bool command = false;
+		for (const auto prefix : commands)
+		{
+			command = command || statement.compare(0, prefix.size(), prefix) == 0;
+		}
+
+		return usable && command && !parameters.empty();
+	}
+
+	std::string fingerprint_to_string(const uint64_t& fingerprint)
+	{
+		char buffer[17];
+		std::snprintf(buffer, sizeof(buffer), "%016llx",
+					  static_cast<unsigned long long>(fingerprint));
+
+		return std::string(buffer, 16);
+	}
+} // namespace database
@@ -0,0 +1,99 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+namespace database
+{
+	/**
+	 * @brief Produces the normalized form of an SQL statement.
+	 *
+	 * Comments are removed, tokens are re-spaced in one canonical way,
+	 * unquoted identifiers and keywords are lower-cased, and every string,
+	 * numeric or dollar-quoted literal is replaced by @c ?. Two statements
+	 * that differ only in their literal values therefore normalize to the
+	 * same text.
+	 *
+	 * @param query_string The SQL statement to normalize.
+	 * @return The normalized statement text.
+	 */
+	std::string normalize_statement(std::string_view query_string);
+
+	/**
+	 * @brief Computes a 64-bit fingerprint of the normalized statement.
+	 *
+	 * The fingerprint is the FNV-1a hash of the text that
+	 * @c normalize_statement would return, computed in a single pass
+	 * without building that text, so it is cheap enough to call on every
+	 * traced query.
+	 *
+	 * @param query_string The SQL statement to fingerprint.
+	 * @return The fingerprint value.
+	 */
+	uint64_t statement_fingerprint(std::string_view query_string);
+
+	/**
+	 * @brief Rewrites the literals of a statement as positional parameters.
+	 *
+	 * Produces the normalized statement with each string and numeric
+	 * literal replaced by @c $1, @c $2, ... and collects the literal values
+	 * in order, so statements that differ only in their literals share one
+	 * prepared statement. Numbers keep their literal type through a cast
+	 * (@c $1::int4). Literals that have no parameter form stay inline:
+	 * typed literals such as @c DATE '...', @c E'...' and dollar-quoted
+	 * strings, and every number in an @c ORDER @c BY, @c GROUP @c BY or
+	 * @c DISTINCT @c ON list, where it may name an output column.
+	 *
+	 * @param query_string The SQL statement to rewrite.
+	 * @param statement    Receives the parameterized statement.
+	 * @param parameters   Receives the literal values as text.
+	 * @return @c false if the statement is not a single SELECT, INSERT,
+	 *         UPDATE, DELETE, WITH or VALUES statement, already uses
+	 *         positional parameters, or has no literal to replace.
+	 */
+	bool parameterize_statement(std::string_view query_string,
+								std::string& statement,
+								std::vector<std::string>& parameters);
+
+	/**
+	 * @brief Formats a fingerprint as a fixed-width, 16 digit hex string.
+	 *
+	 * @param fingerprint The value returned by @c statement_fingerprint.
+	 * @return The lower-case hexadecimal representation.
+	 */
+	std::string fingerprint_to_string(const uint64_t& fingerprint);
+} // namespace database
@@ -0,0 +1,859 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/sqlite_replica.h"
+
+#include "database/postgres_manager.h"
+#include "database/query_tracer.h"
+#include "database/sql_fingerprint.h"
+
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <cctype>
+
+#include "container/values/bool_value.h"
+#include "container/values/numeric_value.h"
+#include "container/values/string_value.h"
+#include "container/values/container_value.h"
+
+namespace database
+{
+	namespace
+	{
+		// Statements kept prepared on the read connection; the cache is
+		// emptied when it grows past this.
+		constexpr size_t max_cached_statements = 256;
+
+		std::string quote_identifier(std::string_view name)
+		{
+			std::string quoted = "\"";
+			for (const char c : name)
+			{
+				quoted += c;
+				if (c == '"')
+				{
+					quoted += '"';
+				}
+			}
+			return quoted + "\"";
+		}
+
+		// COPY statements take no parameters, so values are inlined. With
+		// standard_conforming_strings on (the default since 9.1) doubling
+		// quotes is sufficient.
+		std::string quote_literal(std::string_view value)
+		{
+			std::string quoted = "'";
+			for (const char c : value)
+			{
+				quoted += c;
+				if (c == '\'')
+				{
+					quoted += '\'';
+				}
+			}
+			return quoted + "'";
+		}
+
+		std::string unqualified_name(const std::string& table)
+		{
+			std::string name = table.substr(table.find_last_of('.') + 1);
+			if (name.size() >= 2 && name.front() == '"' && name.back() == '"')
+			{
+				name = name.substr(1, name.size() - 2);
+			}
+			return name;
+		}
+
+		/**
+		 * The SQLite declared type for a PostgreSQL type. The names are
+		 * chosen so SQLite picks the matching affinity and so results can
+		 * be decoded to the same value types @c postgres_manager returns.
+		 */
+		std::string declared_type(std::string_view postgres_type)
+		{
+			if (postgres_type == "boolean")
+			{
+				return "BOOLEAN";
+			}
+			if (postgres_type == "smallint" || postgres_type == "integer")
+			{
+				return "INTEGER";
+			}
+			if (postgres_type == "bigint")
+			{
+				return "BIGINT";
+			}
+			if (postgres_type == "real" || postgres_type == "double precision")
+			{
+				return "DOUBLE";
+			}
+			if (postgres_type.substr(0, 7) == "numeric")
+			{
+				return "NUMERIC";
+			}
+			return "TEXT";
+		}
+
+		/**
+		 * Splits one row of the COPY text format into @p fields, undoing
+		 * its backslash escapes. @p nulls marks @c \N fields.
+		 */
+		void parse_copy_row(std::string_view row,
+							std::vector<std::string>& fields,
+							std::vector<bool>& nulls)
+		{
+			fields.clear();
+			nulls.clear();
+
+			size_t start = 0;
+			for (;;)
+			{
+				const size_t end = std::min(row.find('\t', start), row.size());
+				const std::string_view raw = row.substr(start, end - start);
+				fields.emplace_back();
+				nulls.push_back(raw == "\\N");
+
+				std::string& field = fields.back();
+				for (size_t index = 0; index < raw.size() && !nulls.back(); ++index)
+				{
+					if (raw[index] != '\\' || index + 1 == raw.size())
+					{
+						field += raw[index];
+						continue;
+					}
+
+					const char escaped = raw[++index];
+					switch (escaped)
+					{
+					case 'b': field += '\b'; break;
+					case 'f': field += '\f'; break;
+					case 'n': field += '\n'; break;
+					case 'r': field += '\r'; break;
+					case 't': field += '\t'; break;
+					case 'v': field += '\v'; break;
+					case 'x':
+					{
+						int value = 0;
+						int digits = 0;
+						while (digits < 2 && index + 1 < raw.size()
+							   && std::isxdigit(static_cast<unsigned char>(raw[index + 1])))
+						{
+							const char digit = raw[++index];
+							value = value * 16
+									+ (std::isdigit(static_cast<unsigned char>(digit))
+										   ? digit - '0'
+										   : (std::tolower(static_cast<unsigned char>(digit)) - 'a' + 10));
+							++digits;
+						}
+						field += digits == 0 ? 'x' : static_cast<char>(value);
+						break;
+					}
+					default:
+						if (escaped >= '0' && escaped <= '7')
+						{
+							int value = escaped - '0';
+							for (int digits = 1; digits < 3 && index + 1 < raw.size()
+												 && raw[index + 1] >= '0' && raw[index + 1] <= '7';
+								 ++digits)
+							{
+								value = value * 8 + (raw[++index] - '0');
+							}
+							field += static_cast<char>(value);
+						}
+						else
+						{
+							field += escaped;
+						}
+						break;
+					}
+				}
+
+				if (end == row.size())
+				{
+					return;
+				}
+				start = end + 1;
+			}
+		}
+
+		/**
+		 * A result cell of the read connection, typed the way
+		 * @c postgres_manager would type the same column.
+		 */
+		struct replica_cell
+		{
+			enum class kinds { null, boolean, integer, big_integer, real, text } kind;
+			int64_t integer = 0;
+			double real = 0.0;
+			std::string_view text{};
+		};
+
+		replica_cell read_cell(sqlite3_stmt* statement, const int& column)
+		{
+			replica_cell cell{ replica_cell::kinds::text };
+			const int storage = sqlite3_column_type(statement, column);
+			if (storage == SQLITE_NULL)
+			{
+				cell.kind = replica_cell::kinds::null;
+				return cell;
+			}
+
+			const char* declared = sqlite3_column_decltype(statement, column);
+			const std::string_view type = declared != nullptr ? declared : "";
+
+			if (storage == SQLITE_INTEGER)
+			{
+				cell.integer = sqlite3_column_int64(statement, column);
+				if (type == "BOOLEAN")
+				{
+					cell.kind = replica_cell::kinds::boolean;
+				}
+				else if (type == "INTEGER")
+				{
+					cell.kind = replica_cell::kinds::integer;
+				}
+				else if (type != "NUMERIC")
+				{
+					cell.kind = replica_cell::kinds::big_integer;
+				}
+			}
+			else if (storage == SQLITE_FLOAT && type != "NUMERIC")
+			{
+				cell.real = sqlite3_column_double(statement, column);
+				cell.kind = replica_cell::kinds::real;
+			}
+
+			// Text is also kept for typed cells, as the server sent it.
+			const auto* text = reinterpret_cast<const char*>(sqlite3_column_text(statement, column));
+			cell.text = std::string_view(text != nullptr ? text : "",
+										 static_cast<size_t>(sqlite3_column_bytes(statement, column)));
+			if (cell.kind == replica_cell::kinds::boolean)
+			{
+				cell.text = cell.integer != 0 ? "t" : "f";
+			}
+
+			return cell;
+		}
+
+		std::shared_ptr<container_module::value> build_value(const char* name,
+															 const replica_cell& cell)
+		{
+			switch (cell.kind)
+			{
+			case replica_cell::kinds::null:
+				return std::make_shared<container_module::value>(name);
+			case replica_cell::kinds::boolean:
+				return std::make_shared<container_module::bool_value>(name, cell.integer != 0);
+			case replica_cell::kinds::integer:
+				return std::make_shared<container_module::int_value>(
+					name, static_cast<int>(cell.integer));
+			case replica_cell::kinds::big_integer:
+				return std::make_shared<container_module::llong_value>(
+					name, static_cast<long long>(cell.integer));
+			case replica_cell::kinds::real:
+				return std::make_shared<container_module::double_value>(name, cell.real);
+			case replica_cell::kinds::text:
+				break;
+			}
+
+			return std::make_shared<container_module::string_value>(name, std::string(cell.text));
+		}
+
+		bool is_table_list_end(std::string_view token)
+		{
+			static constexpr std::string_view keywords[]
+				= { "where", "group", "order", "limit", "having", "union", "on",	"using",
+					"inner", "left",  "right", "full",	"cross",  "natural", "join", "offset" };
+			for (const auto keyword : keywords)
+			{
+				if (token == keyword)
+				{
+					return true;
+				}
+			}
+			return !token.empty() && token.back() == ')';
+		}
+	} // namespace
+
+	sqlite_replica::sqlite_replica(void) : writer_(nullptr), reader_(nullptr) {}
+
+	sqlite_replica::~sqlite_replica(void) { close(); }
+
+	bool sqlite_replica::open(const std::string& path)
+	{
+		close();
+
+		if (sqlite3_open_v2(path.c_str(), &writer_,
+							SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, nullptr)
+			!= SQLITE_OK)
+		{
+			set_error(sqlite3_errmsg(writer_));
+			close();
+			return false;
+		}
+
+		// WAL lets the read connection run while the writer holds a
+		// transaction open for a snapshot.
+		if (!execute("PRAGMA journal_mode=WAL") || !execute("PRAGMA synchronous=NORMAL"))
+		{
+			close();
+			return false;
+		}
+
+		if (sqlite3_open_v2(path.c_str(), &reader_, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+							nullptr)
+			!= SQLITE_OK)
+		{
+			set_error(sqlite3_errmsg(reader_));
+			close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void sqlite_replica::close(void)
+	{
+		std::lock_guard<std::mutex> lock(reader_mutex_);
+		for (auto& [query_string, statement] : statements_)
+		{
+			sqlite3_finalize(statement);
+		}
+		statements_.clear();
+
+		sqlite3_close(reader_);
+		sqlite3_close(writer_);
+		reader_ = nullptr;
+		writer_ = nullptr;
+	}
+
+	bool sqlite_replica::mirror(const std::string& table_name,
+								const std::string& key_column,
+								const std::string& watermark_column)
+	{
+		const std::string local = unqualified_name(table_name);
+		if (local.empty() || key_column.empty() || local_names_.count(local) != 0)
+		{
+			return false;
+		}
+
+		table target;
+		target.source = table_name;
+		target.local = local;
+		target.key_column = key_column;
+		target.watermark_column = watermark_column;
+		tables_.push_back(std::move(target));
+
+		std::string lowered = local;
+		for (char& c : lowered)
+		{
+			c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+		}
+		local_names_.insert(lowered);
+
+		return true;
+	}
+
+	bool sqlite_replica::snapshot(postgres_manager& source)
+	{
+		for (auto& target : tables_)
+		{
+			if (!describe(source, target) || !load(source, target, true))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool sqlite_replica::refresh(postgres_manager& source)
+	{
+		for (auto& target : tables_)
+		{
+			if (target.watermark_column.empty())
+			{
+				continue;
+			}
+			if (!(target.columns.empty() ? describe(source, target) && load(source, target, true)
+										  : load(source, target, false)))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool sqlite_replica::wait_and_refresh(postgres_manager& source,
+										  const std::chrono::milliseconds& interval)
+	{
+		std::string channel;
+		std::string payload;
+		if (source.wait_notification(interval, channel, payload))
+		{
+			// Fold a burst of notifications into one refresh.
+			while (source.wait_notification(std::chrono::milliseconds(0), channel, payload))
+			{
+			}
+		}
+
+		return refresh(source);
+	}
+
+	bool sqlite_replica::serve(const std::string& query_string)
+	{
+		if (!covers(query_string))
+		{
+			return false;
+		}
+		served_.insert(normalize_statement(query_string));
+		return true;
+	}
+
+	bool sqlite_replica::serves(const std::string& query_string) const
+	{
+		return !served_.empty() && served_.count(normalize_statement(query_string)) != 0;
+	}
+
+	bool sqlite_replica::covers(const std::string& query_string) const
+	{
+		const std::string normalized = normalize_statement(query_string);
+		if (normalized.compare(0, 7, "select ") != 0 || normalized.find("::") != std::string::npos)
+		{
+			return false;
+		}
+
+		bool found = false;
+		bool expect_table = false;
+		bool in_from_list = false;
+		std::string_view previous;
+		size_t start = 0;
+		while (start < normalized.size())
+		{
+			const size_t end = std::min(normalized.find(' ', start), normalized.size());
+			std::string_view token(normalized.data() + start, end - start);
+			start = end + 1;
+
+			// Locking reads and PostgreSQL-only operators go to the server.
+			if ((previous == "for"
+				 && (token == "update" || token == "share" || token == "no" || token == "key"))
+				|| token == "ilike")
+			{
+				return false;
+			}
+			previous = token;
+
+			if (token == "from" || token == "join")
+			{
+				expect_table = true;
+				in_from_list = token == "from";
+				continue;
+			}
+
+			if (expect_table)
+			{
+				expect_table = false;
+				if (token.empty() || token.front() == '(')
+				{
+					// Derived table; its own FROM is checked as it comes.
+					in_from_list = false;
+					continue;
+				}
+
+				const bool more = token.back() == ',';
+				while (!token.empty() && (token.back() == ',' || token.back() == ')'))
+				{
+					token.remove_suffix(1);
+				}
+				if (token.find_first_of(".\"(") != std::string_view::npos
+					|| local_names_.count(std::string(token)) == 0)
+				{
+					return false;
+				}
+				found = true;
+				expect_table = more && in_from_list;
+				continue;
+			}
+
+			if (is_table_list_end(token))
+			{
+				in_from_list = false;
+			}
+			else if (in_from_list && !token.empty() && token.back() == ',')
+			{
+				expect_table = true;
+			}
+		}
+
+		return found;
+	}
+
+	std::unique_ptr<container_module::value_container> sqlite_replica::select_query(
+		const std::string& query_string)
+	{
+		scoped_span span(span_kind::query);
+		span.set_attribute("db.system", "sqlite");
+		span.set_statement(query_string);
+
+		std::lock_guard<std::mutex> lock(reader_mutex_);
+		sqlite3_stmt* statement = prepared(query_string);
+		if (statement == nullptr)
+		{
+			span.set_error("", last_error());
+			return nullptr;
+		}
+
+		const int columns = sqlite3_column_count(statement);
+		std::vector<std::shared_ptr<container_module::value>> units;
+		int result = SQLITE_OK;
+		while ((result = sqlite3_step(statement)) == SQLITE_ROW)
+		{
+			std::vector<std::shared_ptr<container_module::value>> values;
+			values.reserve(columns);
+			for (int column = 0; column < columns; ++column)
+			{
+				values.push_back(build_value(sqlite3_column_name(statement, column),
+											 read_cell(statement, column)));
+			}
+
+			units.push_back(std::make_shared<container_module::container_value>(
+				"row", std::move(values)));
+		}
+		sqlite3_reset(statement);
+
+		if (result != SQLITE_DONE)
+		{
+			set_error(sqlite3_errmsg(reader_));
+			span.set_error("", sqlite3_errmsg(reader_));
+			return nullptr;
+		}
+
+		span.set_attribute("db.rows", static_cast<int64_t>(units.size()));
+		return std::make_unique<container_module::value_container>("query", units);
+	}
+
+	bool sqlite_replica::select(const std::string& query_string, result_buffer& output)
+	{
+		std::lock_guard<std::mutex> lock(reader_mutex_);
+		sqlite3_stmt* statement = prepared(query_string);
+		if (statement == nullptr)
+		{
+			output.reset(0);
+			return false;
+		}
+
+		const int columns = sqlite3_column_count(statement);
+		output.reset(static_cast<size_t>(columns));
+		for (int column = 0; column < columns; ++column)
+		{
+			output.set_column_name(static_cast<size_t>(column), sqlite3_column_name(statement, column));
+		}
+
+		int result = SQLITE_OK;
+		while ((result = sqlite3_step(statement)) == SQLITE_ROW)
+		{
+			for (int column = 0; column < columns; ++column)
+			{
+				const replica_cell cell = read_cell(statement, column);
+				switch (cell.kind)
+				{
+				case replica_cell::kinds::null:
+					output.append_null();
+					break;
+				case replica_cell::kinds::boolean:
+					output.append_boolean(cell.integer != 0, cell.text);
+					break;
+				case replica_cell::kinds::integer:
+				case replica_cell::kinds::big_integer:
+					output.append_integer(cell.integer, cell.text);
+					break;
+				case replica_cell::kinds::real:
+					output.append_real(cell.real, cell.text);
+					break;
+				case replica_cell::kinds::text:
+					output.append_text(cell.text);
+					break;
+				}
+			}
+		}
+		sqlite3_reset(statement);
+
+		if (result != SQLITE_DONE)
+		{
+			set_error(sqlite3_errmsg(reader_));
+			return false;
+		}
+		return true;
+	}
+
+	std::string sqlite_replica::last_error(void) const
+	{
+		std::lock_guard<std::mutex> lock(error_mutex_);
+		return last_error_;
+	}
+
+	bool sqlite_replica::describe(postgres_manager& source, table& target)
+	{
+		std::vector<column> columns;
+		std::vector<std::string> fields;
+		std::vector<bool> nulls;
+		const bool described = source.copy_out(
+			"COPY (SELECT attname, format_type(atttypid, atttypmod) FROM pg_attribute"
+			" WHERE attrelid = " + quote_literal(target.source) + "::regclass"
+			" AND attnum > 0 AND NOT attisdropped ORDER BY attnum) TO STDOUT",
+			[&](std::string_view row) {
+				parse_copy_row(row, fields, nulls);
+				if (fields.size() != 2)
+				{
+					return false;
+				}
+				columns.push_back({ fields[0], declared_type(fields[1]) });
+				return true;
+			});
+
+		auto has = [&](const std::string& name) {
+			for (const auto& entry : columns)
+			{
+				if (entry.name == name)
+				{
+					return true;
+				}
+			}
+			return false;
+		};
+		if (!described || !has(target.key_column)
+			|| (!target.watermark_column.empty() && !has(target.watermark_column)))
+		{
+			set_error("cannot describe " + target.source + ": " + source.last_error_state());
+			return false;
+		}
+
+		target.columns = std::move(columns);
+		return true;
+	}
+
+	bool sqlite_replica::load(postgres_manager& source, table& target, const bool& full)
+	{
+		if (writer_ == nullptr)
+		{
+			set_error("replica is not open");
+			return false;
+		}
+
+		const std::string local = quote_identifier(target.local);
+		std::string select_list;
+		std::string definition;
+		std::string placeholders;
+		for (const auto& entry : target.columns)
+		{
+			const std::string name = quote_identifier(entry.name);
+			select_list += (select_list.empty() ? "" : ", ") + name;
+			definition += name + " " + entry.declared + ", ";
+			placeholders += placeholders.empty() ? "?" : ", ?";
+		}
+
+		if (!execute("BEGIN IMMEDIATE"))
+		{
+			return false;
+		}
+
+		std::vector<std::string> fields;
+		std::vector<bool> nulls;
+		sqlite3_stmt* insert = nullptr;
+		auto fail = [&]() {
+			sqlite3_finalize(insert);
+			execute("ROLLBACK");
+			return false;
+		};
+
+		if (full
+			&& (!execute("DROP TABLE IF EXISTS " + local)
+				|| !execute("CREATE TABLE " + local + " (" + definition + "PRIMARY KEY ("
+							+ quote_identifier(target.key_column) + "))")))
+		{
+			return fail();
+		}
+
+		const std::string insert_statement
+			= "INSERT OR REPLACE INTO " + local + " (" + select_list + ") VALUES (" + placeholders + ")";
+		if (sqlite3_prepare_v2(writer_, insert_statement.c_str(), -1, &insert, nullptr) != SQLITE_OK)
+		{
+			set_error(sqlite3_errmsg(writer_));
+			return fail();
+		}
+
+		std::string filter;
+		if (!full && !target.watermark.empty())
+		{
+			filter = " WHERE " + quote_identifier(target.watermark_column) + " > "
+					 + quote_literal(target.watermark);
+		}
+
+		// The next watermark is taken by the server, compared in the
+		// column's own type, before the rows are copied: rows committed in
+		// between are copied again next time rather than skipped.
+		std::string watermark = full ? std::string() : target.watermark;
+		if (!target.watermark_column.empty())
+		{
+			const bool read = source.copy_out(
+				"COPY (SELECT max(" + quote_identifier(target.watermark_column) + ")::text FROM "
+					+ target.source + filter + ") TO STDOUT",
+				[&](std::string_view row) {
+					parse_copy_row(row, fields, nulls);
+					if (fields.size() == 1 && !nulls[0])
+					{
+						watermark = fields[0];
+					}
+					return true;
+				});
+			if (!read)
+			{
+				set_error("cannot read the watermark of " + target.source + ": "
+						  + source.last_error_state());
+				return fail();
+			}
+		}
+
+		const std::string copy
+			= "COPY (SELECT " + select_list + " FROM " + target.source + filter + ") TO STDOUT";
+
+		bool stored = true;
+		const bool copied = source.copy_out(copy, [&](std::string_view row) {
+			parse_copy_row(row, fields, nulls);
+			if (fields.size() != target.columns.size())
+			{
+				set_error("unexpected column count copying " + target.source);
+				return stored = false;
+			}
+
+			for (size_t index = 0; index < fields.size(); ++index)
+			{
+				const int parameter = static_cast<int>(index) + 1;
+				if (nulls[index])
+				{
+					sqlite3_bind_null(insert, parameter);
+				}
+				else if (target.columns[index].declared == "BOOLEAN")
+				{
+					sqlite3_bind_int64(insert, parameter, fields[index] == "t" ? 1 : 0);
+				}
+				else
+				{
+					sqlite3_bind_text(insert, parameter, fields[index].data(),
+									  static_cast<int>(fields[index].size()), SQLITE_STATIC);
+				}
+			}
+
+			const int result = sqlite3_step(insert);
+			sqlite3_reset(insert);
+			if (result != SQLITE_DONE)
+			{
+				set_error(sqlite3_errmsg(writer_));
+				return stored = false;
+			}
+			return true;
+		});
+		sqlite3_finalize(insert);
+		insert = nullptr;
+
+		if (!copied || !stored)
+		{
+			if (stored)
+			{
+				set_error("cannot copy " + target.source + ": " + source.last_error_state());
+			}
+			return fail();
+		}
+
+		if (!execute("COMMIT"))
+		{
+			return fail();
+		}
+
+		target.watermark = std::move(watermark);
+		return true;
+	}
+
+	bool sqlite_replica::execute(const std::string& statement)
+	{
+		char* message = nullptr;
+		if (sqlite3_exec(writer_, statement.c_str(), nullptr, nullptr, &message) != SQLITE_OK)
+		{
+			set_error(message != nullptr ? message : sqlite3_errmsg(writer_));
+			sqlite3_free(message);
+			return false;
+		}
+		return true;
+	}
+
+	sqlite3_stmt* sqlite_replica::prepared(const std::string& query_string)
+	{
+		if (reader_ == nullptr)
+		{
+			set_error("replica is not open");
+			return nullptr;
+		}
+
+		auto found = statements_.find(query_string);
+		if (found != statements_.end())
+		{
+			return found->second;
+		}
+
+		sqlite3_stmt* statement = nullptr;
+		if (sqlite3_prepare_v2(reader_, query_string.c_str(), -1, &statement, nullptr) != SQLITE_OK)
+		{
+			set_error(sqlite3_errmsg(reader_));
+			sqlite3_finalize(statement);
+			return nullptr;
+		}
+
+		if (statements_.size() >= max_cached_statements)
+		{
+			for (auto& [cached, entry] : statements_)
+			{
+				sqlite3_finalize(entry);
+			}
+			statements_.clear();
+		}
+		statements_.emplace(query_string, statement);
+
+		return statement;
+	}
+
+	void sqlite_replica::set_error(const std::string& message)
+	{
+		std::lock_guard<std::mutex> lock(error_mutex_);
+		last_error_ = message;
+	}
+} // namespace database
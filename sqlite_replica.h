@@ -0,0 +1,204 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "result_buffer.h"
+#include "container/core/container.h"
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace database
+{
+	class postgres_manager;
+
+	/**
+	 * @class sqlite_replica
+	 * @brief A local SQLite copy of selected PostgreSQL tables that serves
+	 *        reads without a network round trip.
+	 *
+	 * Each mirrored table is loaded with @c COPY by @c snapshot and kept
+	 * current by @c refresh, which copies only rows whose watermark column
+	 * (an @c updated_at timestamp or growing id) is past the largest value
+	 * already mirrored and upserts them by key. The largest value is taken
+	 * by the server, so it is compared in the column's own type. @c wait_and_refresh applies
+	 * deltas when a @c NOTIFY arrives on a channel the source connection
+	 * listens to, or after an interval. Deletes, and tables without a
+	 * watermark column, are only picked up by the next @c snapshot.
+	 *
+	 * Tables are mirrored under their unqualified name. @c covers tells
+	 * whether a SELECT reads only mirrored tables. Only statements passed
+	 * to @c serve are routed here by @c database_manager, because SQLite
+	 * can run some PostgreSQL SQL with different results (collation,
+	 * integer division, date functions); SQL that SQLite cannot run
+	 * simply fails and can be sent to the server instead.
+	 *
+	 * Reads use their own SQLite connection in WAL mode, so they are not
+	 * blocked while a snapshot or refresh is written. Call @c mirror for
+	 * every table before snapshotting or reading; @c snapshot and
+	 * @c refresh are meant for one maintenance thread.
+	 */
+	class sqlite_replica
+	{
+	public:
+		sqlite_replica(void);
+		virtual ~sqlite_replica(void);
+
+		sqlite_replica(const sqlite_replica&) = delete;
+		sqlite_replica& operator=(const sqlite_replica&) = delete;
+
+		/**
+		 * @brief Opens or creates the replica file; ":memory:" is not
+		 *        supported because reads use a second connection.
+		 */
+		bool open(const std::string& path);
+
+		void close(void);
+
+		/**
+		 * @brief Registers @p table for mirroring.
+		 *
+		 * @param table            PostgreSQL table, optionally schema
+		 *                         qualified.
+		 * @param key_column       Column that identifies a row.
+		 * @param watermark_column Column compared by @c refresh; empty to
+		 *                         refresh the table by snapshot only.
+		 */
+		bool mirror(const std::string& table,
+					const std::string& key_column,
+					const std::string& watermark_column = "");
+
+		/**
+		 * @brief Reloads every mirrored table from @p source. Each table
+		 *        is replaced in one SQLite transaction, so readers see
+		 *        either the old or the new copy.
+		 */
+		bool snapshot(postgres_manager& source);
+
+		/**
+		 * @brief Applies rows past each table's watermark.
+		 */
+		bool refresh(postgres_manager& source);
+
+		/**
+		 * @brief Waits up to @p interval for a notification on @p source,
+		 *        then calls @c refresh. Use @c postgres_manager::listen
+		 *        first to subscribe to the channel the tables' triggers
+		 *        notify.
+		 */
+		bool wait_and_refresh(postgres_manager& source, const std::chrono::milliseconds& interval);
+
+		/**
+		 * @brief @c true if @p query_string is a plain SELECT whose FROM
+		 *        and JOIN clauses name only mirrored tables.
+		 */
+		bool covers(const std::string& query_string) const;
+
+		/**
+		 * @brief Lets @c database_manager route @p query_string, and every
+		 *        statement that differs from it only in its literals, to
+		 *        this replica, e.g. "SELECT * FROM plans WHERE id = 1" for
+		 *        key lookups by id. Call before the replica is read.
+		 *
+		 * @return @c false if the statement is not @c covered.
+		 */
+		bool serve(const std::string& query_string);
+
+		/**
+		 * @brief @c true if @p query_string matches a statement passed to
+		 *        @c serve.
+		 */
+		bool serves(const std::string& query_string) const;
+
+		/**
+		 * @brief Runs @p query_string on the replica and builds the same
+		 *        container layout as @c postgres_manager::select_query.
+		 */
+		std::unique_ptr<container_module::value_container> select_query(
+			const std::string& query_string);
+
+		/**
+		 * @brief Runs @p query_string on the replica into @p output.
+		 */
+		bool select(const std::string& query_string, result_buffer& output);
+
+		/**
+		 * @brief The SQLite or COPY error of the last failed call.
+		 */
+		std::string last_error(void) const;
+
+	private:
+		struct column
+		{
+			std::string name;
+			std::string declared; ///< SQLite type; also selects the container value type.
+		};
+
+		struct table
+		{
+			std::string source;	   ///< Name as given to @c mirror.
+			std::string local;	   ///< Unqualified name in the replica.
+			std::string key_column;
+			std::string watermark_column;
+			std::vector<column> columns;
+			std::string watermark; ///< Largest mirrored watermark, as text.
+		};
+
+		bool describe(postgres_manager& source, table& target);
+		bool load(postgres_manager& source, table& target, const bool& full);
+		bool execute(const std::string& statement);
+		sqlite3_stmt* prepared(const std::string& query_string);
+		void set_error(const std::string& message);
+
+	private:
+		sqlite3* writer_;
+		sqlite3* reader_;
+		std::vector<table> tables_;
+		std::set<std::string> local_names_;
+		std::set<std::string> served_; ///< Normalized statements routed here.
+
+		mutable std::mutex reader_mutex_; ///< Guards @c reader_ and its statements.
+		std::unordered_map<std::string, sqlite3_stmt*> statements_;
+
+		mutable std::mutex error_mutex_;
+		std::string last_error_;
+	};
+} // namespace database
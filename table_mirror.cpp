@@ -0,0 +1,258 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#include "database/table_mirror.h"
+
+#include "database/postgres_manager.h"
+
+#include <thread>
+#include <charconv>
+
+namespace database
+{
+	namespace
+	{
+		constexpr uint32_t empty_slot = UINT32_MAX;
+
+		uint64_t hash_key(std::string_view key)
+		{
+			uint64_t hash = 14695981039346656037ULL;
+			for (const unsigned char c : key)
+			{
+				hash ^= c;
+				hash *= 1099511628211ULL;
+			}
+			return hash;
+		}
+
+		size_t thread_stripe(void)
+		{
+			static std::atomic<size_t> next{ 0 };
+			thread_local const size_t stripe = next.fetch_add(1, std::memory_order_relaxed);
+			return stripe;
+		}
+	} // namespace
+
+	struct table_mirror::version
+	{
+		struct slot
+		{
+			uint64_t hash = 0;
+			uint32_t row = empty_slot;
+		};
+
+		result_buffer rows;
+		size_t key_column = 0;
+		uint64_t generation = 0;
+		std::vector<slot> index; ///< Power-of-two sized, at most half full.
+
+		void build_index(void)
+		{
+			size_t capacity = 16;
+			while (capacity < rows.rows() * 2)
+			{
+				capacity *= 2;
+			}
+			index.assign(capacity, slot{});
+
+			const size_t mask = capacity - 1;
+			for (size_t row = 0; row < rows.rows(); ++row)
+			{
+				const std::string_view key = rows.text(row, key_column);
+				const uint64_t hash = hash_key(key);
+				for (size_t position = hash & mask;; position = (position + 1) & mask)
+				{
+					slot& entry = index[position];
+					if (entry.row == empty_slot
+						|| (entry.hash == hash && rows.text(entry.row, key_column) == key))
+					{
+						entry.hash = hash;
+						entry.row = static_cast<uint32_t>(row);
+						break;
+					}
+				}
+			}
+		}
+
+		size_t find(std::string_view key) const
+		{
+			if (index.empty())
+			{
+				return view::npos;
+			}
+
+			const uint64_t hash = hash_key(key);
+			const size_t mask = index.size() - 1;
+			for (size_t position = hash & mask;; position = (position + 1) & mask)
+			{
+				const slot& entry = index[position];
+				if (entry.row == empty_slot)
+				{
+					return view::npos;
+				}
+				if (entry.hash == hash && rows.text(entry.row, key_column) == key)
+				{
+					return entry.row;
+				}
+			}
+		}
+	};
+
+	table_mirror::view::view(table_mirror* owner, const version* pinned, const uint32_t& phase)
+		: owner_(owner), version_(pinned), phase_(phase)
+	{
+	}
+
+	table_mirror::view::view(view&& other) noexcept
+		: owner_(other.owner_), version_(other.version_), phase_(other.phase_)
+	{
+		other.owner_ = nullptr;
+	}
+
+	table_mirror::view::~view(void)
+	{
+		if (owner_ != nullptr)
+		{
+			owner_->unpin(phase_);
+		}
+	}
+
+	size_t table_mirror::view::find(std::string_view key) const { return version_->find(key); }
+
+	size_t table_mirror::view::find(const int64_t& key) const
+	{
+		char text[24];
+		const auto [end, error] = std::to_chars(text, text + sizeof(text), key);
+		return version_->find(std::string_view(text, static_cast<size_t>(end - text)));
+	}
+
+	const result_buffer& table_mirror::view::rows(void) const { return version_->rows; }
+
+	uint64_t table_mirror::view::generation(void) const { return version_->generation; }
+
+	table_mirror::table_mirror(const std::string& name,
+							   const std::string& query_string,
+							   const std::string& key_column)
+		: name_(name)
+		, query_string_(query_string)
+		, key_column_(key_column)
+		, generation_(0)
+		, current_(new version())
+		, phase_(0)
+	{
+		for (auto& entry : stripes_)
+		{
+			entry.readers[0].store(0, std::memory_order_relaxed);
+			entry.readers[1].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	table_mirror::~table_mirror(void) { delete current_.load(); }
+
+	table_mirror::view table_mirror::read(void)
+	{
+		// The count is raised before the pointer is loaded, so a refresh
+		// that swaps the pointer afterwards is certain to see this reader.
+		const uint32_t phase = phase_.load(std::memory_order_seq_cst) & 1;
+		stripes_[thread_stripe() % stripe_count].readers[phase].fetch_add(
+			1, std::memory_order_seq_cst);
+		return view(this, current_.load(std::memory_order_seq_cst), phase);
+	}
+
+	void table_mirror::unpin(const uint32_t& phase)
+	{
+		stripes_[thread_stripe() % stripe_count].readers[phase].fetch_sub(
+			1, std::memory_order_release);
+	}
+
+	void table_mirror::wait_for_readers(void)
+	{
+		// Two flips, as in SRCU: a reader may have read the phase just
+		// before the first flip and raise the old count only after it was
+		// drained, so the other count is drained as well.
+		for (int pass = 0; pass < 2; ++pass)
+		{
+			const uint32_t drained = phase_.fetch_add(1, std::memory_order_seq_cst) & 1;
+			for (;;)
+			{
+				int64_t readers = 0;
+				for (const auto& entry : stripes_)
+				{
+					readers += entry.readers[drained].load(std::memory_order_acquire);
+				}
+				if (readers == 0)
+				{
+					break;
+				}
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	bool table_mirror::refresh(postgres_manager& source)
+	{
+		std::lock_guard<std::mutex> lock(refresh_mutex_);
+
+		if (!source.is_prepared(name_) && !source.prepare(name_, query_string_))
+		{
+			return false;
+		}
+
+		auto next = std::make_unique<version>();
+		if (!source.execute_prepared(name_, {}, next->rows))
+		{
+			return false;
+		}
+
+		next->key_column = next->rows.columns();
+		for (size_t column = 0; column < next->rows.columns(); ++column)
+		{
+			if (next->rows.column_name(column) == key_column_)
+			{
+				next->key_column = column;
+			}
+		}
+		if (next->key_column == next->rows.columns() || next->rows.rows() >= empty_slot)
+		{
+			return false;
+		}
+
+		next->build_index();
+		next->generation = ++generation_;
+
+		const version* previous = current_.exchange(next.release(), std::memory_order_seq_cst);
+		wait_for_readers();
+		delete previous;
+
+		return true;
+	}
+} // namespace database
@@ -0,0 +1,161 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+#include "result_buffer.h"
+
+namespace database
+{
+	class postgres_manager;
+
+	/**
+	 * @class table_mirror
+	 * @brief An in-memory copy of a small table with a hash index on its
+	 *        key column, for lookups that take nanoseconds rather than a
+	 *        round trip.
+	 *
+	 * Each @c refresh loads the table into a new version (rows in a flat
+	 * @c result_buffer plus an open-addressing index) and publishes it by
+	 * swapping one atomic pointer, RCU-style. Readers pin the current
+	 * version with @c read(); pinning is two atomic increments on a
+	 * counter stripe private to the thread in the common case, so readers
+	 * never wait on each other or on a refresh. The refresh waits until
+	 * every reader that may still see the old version has unpinned it
+	 * before freeing it, so keep views short-lived.
+	 */
+	class table_mirror
+	{
+		struct version;
+
+	public:
+		/**
+		 * @class view
+		 * @brief A pinned version of the mirror; it stays valid, unchanged
+		 *        by refreshes, until the view is destroyed.
+		 */
+		class view
+		{
+		public:
+			view(view&& other) noexcept;
+			view(const view&) = delete;
+			view& operator=(const view&) = delete;
+			view& operator=(view&&) = delete;
+			~view(void);
+
+			/**
+			 * @brief Returns the row whose key column equals @p key, or
+			 *        @c npos.
+			 */
+			size_t find(std::string_view key) const;
+			size_t find(const int64_t& key) const;
+
+			/**
+			 * @brief All rows; empty before the first refresh.
+			 */
+			const result_buffer& rows(void) const;
+
+			/**
+			 * @brief Counts refreshes published so far; 0 means not loaded.
+			 */
+			uint64_t generation(void) const;
+
+			static constexpr size_t npos = static_cast<size_t>(-1);
+
+		private:
+			friend class table_mirror;
+			view(table_mirror* owner, const version* pinned, const uint32_t& phase);
+
+			table_mirror* owner_;
+			const version* version_;
+			uint32_t phase_;
+		};
+
+		/**
+		 * @param name         Prepared statement name, unique per
+		 *                     connection.
+		 * @param query_string SELECT that returns the whole table.
+		 * @param key_column   Column to index; a repeated key resolves to
+		 *                     the last row returned.
+		 */
+		table_mirror(const std::string& name,
+					 const std::string& query_string,
+					 const std::string& key_column);
+		virtual ~table_mirror(void);
+
+		table_mirror(const table_mirror&) = delete;
+		table_mirror& operator=(const table_mirror&) = delete;
+
+		/**
+		 * @brief Loads the table from @p source and publishes it. Readers
+		 *        keep seeing the previous version until this returns.
+		 *
+		 * @return @c false if the statement failed or lacks the key
+		 *         column; the published version is then unchanged.
+		 */
+		bool refresh(postgres_manager& source);
+
+		/**
+		 * @brief Pins and returns the current version.
+		 */
+		view read(void);
+
+	private:
+		void unpin(const uint32_t& phase);
+		void wait_for_readers(void);
+
+	private:
+		struct alignas(64) stripe
+		{
+			std::atomic<int64_t> readers[2];
+		};
+		static constexpr size_t stripe_count = 16;
+
+		std::string name_;
+		std::string query_string_;
+		std::string key_column_;
+
+		std::mutex refresh_mutex_;
+		uint64_t generation_;
+
+		std::atomic<const version*> current_;
+		std::atomic<uint32_t> phase_;
+		stripe stripes_[stripe_count];
+	};
+} // namespace database
@@ -0,0 +1,214 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+// Heap allocation counting for tests and benchmarks.
+//
+// This header replaces the global operator new and operator delete, so it
+// must be included in exactly one translation unit of each executable.
+// Counts are kept per thread, so allocations made by unrelated threads
+// (connection pools, exporters, the test runner) do not leak into a
+// measurement. Only allocations made through operator new are seen;
+// malloc calls inside C libraries such as libpq are not counted.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// GCC sees through the inlined replacements below and warns that memory
+// from operator new is handed to free(). Both sides are replaced here and
+// do match, so the warning is silenced for this header only.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+namespace allocation_counter {
+
+struct counts {
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+};
+
+inline thread_local counts thread_counts;
+
+inline counts current() {
+    return thread_counts;
+}
+
+// Counts the allocations made on the current thread since construction.
+class scope {
+public:
+    scope() : start_(current()) {}
+
+    uint64_t allocations() const {
+        return thread_counts.allocations - start_.allocations;
+    }
+
+    uint64_t bytes() const {
+        return thread_counts.bytes - start_.bytes;
+    }
+
+    void restart() {
+        start_ = current();
+    }
+
+private:
+    counts start_;
+};
+
+inline void* counted_allocate(std::size_t size) {
+    ++thread_counts.allocations;
+    thread_counts.bytes += size;
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+inline void* counted_allocate_aligned(std::size_t size, std::align_val_t alignment) {
+    ++thread_counts.allocations;
+    thread_counts.bytes += size;
+    const auto align = static_cast<std::size_t>(alignment);
+#ifdef _WIN32
+    return _aligned_malloc(size == 0 ? 1 : size, align);
+#else
+    // aligned_alloc requires the size to be a multiple of the alignment.
+    const std::size_t rounded = ((size == 0 ? 1 : size) + align - 1) / align * align;
+    return std::aligned_alloc(align, rounded);
+#endif
+}
+
+inline void release_aligned(void* pointer) noexcept {
+#ifdef _WIN32
+    _aligned_free(pointer);
+#else
+    std::free(pointer);
+#endif
+}
+
+} // namespace allocation_counter
+
+void* operator new(std::size_t size) {
+    if (void* pointer = allocation_counter::counted_allocate(size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    if (void* pointer = allocation_counter::counted_allocate(size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return allocation_counter::counted_allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return allocation_counter::counted_allocate(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    if (void* pointer = allocation_counter::counted_allocate_aligned(size, alignment)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    if (void* pointer = allocation_counter::counted_allocate_aligned(size, alignment)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocation_counter::counted_allocate_aligned(size, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocation_counter::counted_allocate_aligned(size, alignment);
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept {
+    allocation_counter::release_aligned(pointer);
+}
+
+void operator delete[](void* pointer, std::align_val_t) noexcept {
+    allocation_counter::release_aligned(pointer);
+}
+
+void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept {
+    allocation_counter::release_aligned(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t, std::align_val_t) noexcept {
+    allocation_counter::release_aligned(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t, const std::nothrow_t&) noexcept {
+    allocation_counter::release_aligned(pointer);
+}
+
+void operator delete[](void* pointer, std::align_val_t, const std::nothrow_t&) noexcept {
+    allocation_counter::release_aligned(pointer);
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
@@ -31,16 +31,33 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *****************************************************************************/
 
 #include <benchmark/benchmark.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
 #include <memory>
 #include <random>
 #include <sstream>
 #include <vector>
 #include <thread>
 
+#include "../columnar_result.h"
+#include "../csv_import.h"
 #include "../database_manager.h"
 #include "../postgres_manager.h"
 #include "../database_types.h"
+#include "../job_queue.h"
+#include "../result_buffer.h"
+#include "../table_mirror.h"
+#include "../timeseries_writer.h"
+#include "allocation_counter.h"
+#include "pg_loopback_server.h"
 #include <container.h>
+#include <libpq-fe.h>
+
+#ifdef __linux__
+#include <linux/tcp.h>
+#endif
 
 using namespace database;
 using namespace container_module;
@@ -105,6 +122,15 @@ std::string GenerateRandomString(size_t length) {
     return result;
 }
 
+// Reports the heap allocations made by the benchmark thread per iteration
+static void ReportAllocations(benchmark::State& state,
+                              const allocation_counter::scope& allocations) {
+    state.counters["allocs/op"] = benchmark::Counter(
+        static_cast<double>(allocations.allocations()), benchmark::Counter::kAvgIterations);
+    state.counters["bytes/op"] = benchmark::Counter(
+        static_cast<double>(allocations.bytes()), benchmark::Counter::kAvgIterations);
+}
+
 // Connection benchmarks
 static void BM_DatabaseConnection(benchmark::State& state) {
     for (auto _ : state) {
@@ -134,6 +160,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_InsertSingleRow)(benchmark::Stat
     auto& db = database_manager::handle();
     int counter = 0;
     
+    allocation_counter::scope allocations;
     for (auto _ : state) {
         std::string name = "User" + std::to_string(counter++);
         std::string email = name + "@example.com";
@@ -147,6 +174,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_InsertSingleRow)(benchmark::Stat
         benchmark::DoNotOptimize(rows);
     }
     
+    ReportAllocations(state, allocations);
     state.SetItemsProcessed(state.iterations());
 }
 BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_InsertSingleRow);
@@ -157,6 +185,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_InsertBatch)(benchmark::State& s
     const int batch_size = state.range(0);
     int counter = 0;
     
+    allocation_counter::scope allocations;
     for (auto _ : state) {
         std::stringstream query;
         query << "INSERT INTO benchmark_table (name, age, email, score) VALUES ";
@@ -175,6 +204,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_InsertBatch)(benchmark::State& s
         benchmark::DoNotOptimize(rows);
     }
     
+    ReportAllocations(state, allocations);
     state.SetItemsProcessed(state.iterations() * batch_size);
 }
 BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_InsertBatch)
@@ -196,6 +226,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_UpdateByPrimaryKey)(benchmark::S
     }
     
     int id = 1;
+    allocation_counter::scope allocations;
     for (auto _ : state) {
         auto rows = db.update_query(
             "UPDATE benchmark_table SET age = age + 1 WHERE id = " + 
@@ -206,6 +237,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_UpdateByPrimaryKey)(benchmark::S
         benchmark::DoNotOptimize(rows);
     }
     
+    ReportAllocations(state, allocations);
     state.SetItemsProcessed(state.iterations());
 }
 BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_UpdateByPrimaryKey);
@@ -224,6 +256,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_DeleteByPrimaryKey)(benchmark::S
     }
     
     int id = 1;
+    allocation_counter::scope allocations;
     for (auto _ : state) {
         auto rows = db.delete_query(
             "DELETE FROM benchmark_table WHERE id = " + std::to_string(id++)
@@ -232,10 +265,157 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_DeleteByPrimaryKey)(benchmark::S
         benchmark::DoNotOptimize(rows);
     }
     
+    ReportAllocations(state, allocations);
     state.SetItemsProcessed(state.iterations());
 }
 BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_DeleteByPrimaryKey);
 
+// Set-based counterparts: state.range(0) rows per call, keys and values
+// sent as binary arrays; compare items/s with the single-row loops above
+BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_BulkUpdateByPrimaryKey)(benchmark::State& state) {
+    auto& db = database_manager::handle();
+    db.create_query(
+        "INSERT INTO benchmark_table (name, age) "
+        "SELECT 'BulkUser' || n, 20 + n % 60 FROM generate_series(1, 10000) n");
+
+    postgres_manager connection;
+    if (!connection.connect("host=localhost port=5432 dbname=postgres user=postgres")) {
+        state.SkipWithError("Could not connect");
+        return;
+    }
+
+    const std::vector<std::string> columns = { "age" };
+    std::vector<bulk_update_row> rows(static_cast<size_t>(state.range(0)));
+    int id = 1;
+    int age = 20;
+    for (auto _ : state) {
+        for (auto& row : rows) {
+            row.key = std::to_string(id);
+            row.values = { std::to_string(age) };
+            id = id % 10000 + 1;
+        }
+        ++age;
+
+        uint64_t updated = 0;
+        benchmark::DoNotOptimize(
+            connection.bulk_update("benchmark_table", "id", columns, rows, updated));
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_BulkUpdateByPrimaryKey)->Arg(100)->Arg(1000);
+
+BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_BulkDeleteByPrimaryKey)(benchmark::State& state) {
+    postgres_manager connection;
+    if (!connection.connect("host=localhost port=5432 dbname=postgres user=postgres")) {
+        state.SkipWithError("Could not connect");
+        return;
+    }
+
+    std::vector<std::string> keys(static_cast<size_t>(state.range(0)));
+    int64_t id = 1;
+    for (auto _ : state) {
+        state.PauseTiming();
+        connection.create_query(
+            "INSERT INTO benchmark_table (id, name) SELECT n, 'DeleteUser' || n "
+            "FROM generate_series(" + std::to_string(id) + ", "
+            + std::to_string(id + state.range(0) - 1) + ") n");
+        for (auto& key : keys) {
+            key = std::to_string(id++);
+        }
+        state.ResumeTiming();
+
+        uint64_t deleted = 0;
+        benchmark::DoNotOptimize(connection.bulk_delete("benchmark_table", "id", keys, deleted));
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_BulkDeleteByPrimaryKey)->Arg(100)->Arg(1000);
+
+// Metrics ingestion: one insert_query per point, against points buffered
+// per daily partition and sent with binary COPY
+static const char* const timeseries_table
+    = "CREATE TABLE benchmark_metrics (time TIMESTAMPTZ, series TEXT, value FLOAT8) "
+      "PARTITION BY RANGE (time)";
+
+BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_TimeseriesInsertPerPoint)(benchmark::State& state) {
+    auto& db = database_manager::handle();
+    db.create_query("DROP TABLE IF EXISTS benchmark_metrics");
+    db.create_query(timeseries_table);
+    db.create_query("CREATE TABLE benchmark_metrics_default PARTITION OF benchmark_metrics DEFAULT");
+
+    int counter = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.insert_query(
+            "INSERT INTO benchmark_metrics VALUES (now(), 'cpu.load', "
+            + std::to_string(counter++ % 100) + ")"));
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    db.create_query("DROP TABLE benchmark_metrics");
+}
+BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_TimeseriesInsertPerPoint);
+
+BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_TimeseriesWriterAppend)(benchmark::State& state) {
+    auto& db = database_manager::handle();
+    db.create_query("DROP TABLE IF EXISTS benchmark_metrics");
+    db.create_query(timeseries_table);
+
+    timeseries_writer_options options;
+    options.table = "benchmark_metrics";
+    options.flush_points = static_cast<size_t>(state.range(0));
+    timeseries_writer writer(options);
+    if (!writer.start("host=localhost port=5432 dbname=postgres user=postgres")) {
+        state.SkipWithError("Could not connect");
+        return;
+    }
+
+    int counter = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+            writer.append(std::chrono::system_clock::now(), "cpu.load", counter++ % 100));
+    }
+    // Points still buffered count towards the time.
+    writer.flush();
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["copies"] = static_cast<double>(writer.stats().copies);
+    writer.stop();
+    db.create_query("DROP TABLE benchmark_metrics");
+}
+BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_TimeseriesWriterAppend)->Arg(10000)->Arg(50000);
+
+// Job throughput: state.range(0) jobs enqueued, leased with SKIP LOCKED
+// and acked per iteration, three statements in all
+BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_JobQueueBatch)(benchmark::State& state) {
+    postgres_manager connection;
+    if (!connection.connect("host=localhost port=5432 dbname=postgres user=postgres")) {
+        state.SkipWithError("Could not connect");
+        return;
+    }
+    connection.create_query("DROP TABLE IF EXISTS benchmark_jobs");
+
+    job_queue_options options;
+    options.table = "benchmark_jobs";
+    job_queue queue("benchmark_jobs", options);
+    queue.install(connection);
+
+    const std::vector<std::string> payloads(static_cast<size_t>(state.range(0)), "{\"task\": \"noop\"}");
+    std::vector<job> jobs;
+    for (auto _ : state) {
+        uint64_t count = 0;
+        queue.enqueue(connection, payloads, count);
+        queue.dequeue(connection, payloads.size(), jobs);
+        queue.complete(connection, jobs, count);
+        benchmark::DoNotOptimize(count);
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    connection.create_query("DROP TABLE benchmark_jobs");
+}
+BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_JobQueueBatch)->Arg(1)->Arg(100)->Arg(5000);
+
 // Select benchmarks
 BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_SelectByPrimaryKey)(benchmark::State& state) {
     auto& db = database_manager::handle();
@@ -252,6 +432,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_SelectByPrimaryKey)(benchmark::S
     }
     
     int id = 1;
+    allocation_counter::scope allocations;
     for (auto _ : state) {
         auto result = db.select_query(
             "SELECT * FROM benchmark_table WHERE id = " + std::to_string(id++)
@@ -261,10 +442,52 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_SelectByPrimaryKey)(benchmark::S
         benchmark::DoNotOptimize(result);
     }
     
+    ReportAllocations(state, allocations);
     state.SetItemsProcessed(state.iterations());
 }
 BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_SelectByPrimaryKey);
 
+// Prepared select decoded into a reused buffer; allocs/op should be 0
+BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_PreparedSelectIntoBuffer)(benchmark::State& state) {
+    auto& db = database_manager::handle();
+
+    for (int i = 0; i < 1000; ++i) {
+        db.insert_query(
+            "INSERT INTO benchmark_table (name, age, email, score) VALUES "
+            "('PreparedUser" + std::to_string(i) + "', " +
+            std::to_string(20 + (i % 60)) + ", 'prepared" +
+            std::to_string(i) + "@test.com', " +
+            std::to_string(70.0 + (i % 30)) + ")"
+        );
+    }
+
+    postgres_manager connection;
+    if (!connection.connect("host=localhost port=5432 dbname=postgres user=postgres") ||
+        !connection.prepare("bm_select_by_id", "SELECT * FROM benchmark_table WHERE id = $1")) {
+        state.SkipWithError("Could not prepare statement");
+        return;
+    }
+
+    const std::string name = "bm_select_by_id";
+    result_buffer result;
+    char id_text[16];
+    const char* parameters[] = { id_text };
+    int id = 1;
+
+    allocation_counter::scope allocations;
+    for (auto _ : state) {
+        std::snprintf(id_text, sizeof(id_text), "%d", id++);
+        if (id > 1000) id = 1;
+
+        benchmark::DoNotOptimize(connection.execute_prepared(name, parameters, result));
+        benchmark::DoNotOptimize(result.text(0, 1));
+    }
+
+    ReportAllocations(state, allocations);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_PreparedSelectIntoBuffer);
+
 // Range select benchmark
 BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_SelectRange)(benchmark::State& state) {
     auto& db = database_manager::handle();
@@ -281,6 +504,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_SelectRange)(benchmark::State& s
         );
     }
     
+    allocation_counter::scope allocations;
     for (auto _ : state) {
         auto result = db.select_query(
             "SELECT * FROM benchmark_table WHERE age BETWEEN 25 AND " +
@@ -290,6 +514,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_SelectRange)(benchmark::State& s
         benchmark::DoNotOptimize(result);
     }
     
+    ReportAllocations(state, allocations);
     state.SetItemsProcessed(state.iterations());
 }
 BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_SelectRange)
@@ -312,6 +537,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_ComplexQuery)(benchmark::State&
         );
     }
     
+    allocation_counter::scope allocations;
     for (auto _ : state) {
         auto result = db.select_query(
             "SELECT name, age, AVG(score) as avg_score, COUNT(*) as count "
@@ -326,6 +552,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_ComplexQuery)(benchmark::State&
         benchmark::DoNotOptimize(result);
     }
     
+    ReportAllocations(state, allocations);
     state.SetItemsProcessed(state.iterations());
 }
 BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_ComplexQuery);
@@ -347,6 +574,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_ResultParsing)(benchmark::State&
         );
     }
     
+    allocation_counter::scope allocations;
     for (auto _ : state) {
         auto result = db.select_query(
             "SELECT * FROM benchmark_table LIMIT " + std::to_string(result_size)
@@ -376,6 +604,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_ResultParsing)(benchmark::State&
         }
     }
     
+    ReportAllocations(state, allocations);
     state.SetItemsProcessed(state.iterations() * result_size);
 }
 BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_ResultParsing)
@@ -388,6 +617,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_Transaction)(benchmark::State& s
     const int ops_per_transaction = state.range(0);
     int counter = 0;
     
+    allocation_counter::scope allocations;
     for (auto _ : state) {
         db.create_query("BEGIN");
         
@@ -402,6 +632,7 @@ BENCHMARK_DEFINE_F(DatabaseBenchmarkFixture, BM_Transaction)(benchmark::State& s
         db.create_query("COMMIT");
     }
     
+    ReportAllocations(state, allocations);
     state.SetItemsProcessed(state.iterations() * ops_per_transaction);
 }
 BENCHMARK_REGISTER_F(DatabaseBenchmarkFixture, BM_Transaction)
@@ -455,6 +686,523 @@ BENCHMARK(BM_ConcurrentQueries)
     ->RangeMultiplier(2)
     ->Range(1, 8);
 
+// Protocol mode matrix
+//
+// Compares simple vs. extended protocol, text vs. binary results and
+// unprepared vs. prepared statements at pipeline depths from 1 to 256, for
+// several result shapes. Each iteration sends `depth` queries back to back
+// (one multi-statement string for the simple protocol, libpq pipeline mode
+// otherwise) and waits for all results. Runs against the local server when
+// it is available, otherwise against an in-process loopback stand-in that
+// speaks the wire protocol and returns synthetic rows.
+enum ProtocolMode { kSimpleProtocol = 0, kExtendedProtocol = 1, kPreparedProtocol = 2 };
+
+struct ProtocolTarget {
+    std::string connection_string;
+    const char* label = "none";
+#ifndef _WIN32
+    std::unique_ptr<pg_loopback_server> loopback;
+#endif
+};
+
+static ProtocolTarget& GetProtocolTarget() {
+    static ProtocolTarget target = []() {
+        ProtocolTarget result;
+        if (g_postgresql_available) {
+            result.connection_string = "host=localhost port=5432 dbname=postgres user=postgres";
+            result.label = "postgres";
+            return result;
+        }
+#ifndef _WIN32
+        result.loopback = std::make_unique<pg_loopback_server>();
+        if (result.loopback->start()) {
+            result.connection_string = result.loopback->connection_string();
+            result.label = "loopback";
+        }
+#endif
+        return result;
+    }();
+    return target;
+}
+
+static double ThreadCpuSeconds() {
+#ifdef _WIN32
+    return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#else
+    timespec now{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) / 1e9;
+#endif
+}
+
+// Bytes sent and received on the connection's socket so far
+static std::pair<uint64_t, uint64_t> WireBytes(PGconn* connection) {
+    auto& target = GetProtocolTarget();
+#ifndef _WIN32
+    if (target.loopback) {
+        return { target.loopback->bytes_received(), target.loopback->bytes_sent() };
+    }
+#endif
+#ifdef __linux__
+    tcp_info info{};
+    socklen_t length = sizeof(info);
+    if (getsockopt(PQsocket(connection), IPPROTO_TCP, TCP_INFO, &info, &length) == 0) {
+        return { info.tcpi_bytes_acked, info.tcpi_bytes_received };
+    }
+#endif
+    (void)connection;
+    return { 0, 0 };
+}
+
+static void BM_ProtocolMatrix(benchmark::State& state) {
+    const auto mode = static_cast<ProtocolMode>(state.range(0));
+    const int binary = static_cast<int>(state.range(1));
+    const int depth = static_cast<int>(state.range(2));
+    const int64_t rows = state.range(3);
+    const int64_t width = state.range(4);
+
+    auto& target = GetProtocolTarget();
+    if (target.connection_string.empty()) {
+        state.SkipWithError("Neither PostgreSQL nor the loopback stand-in is available");
+        return;
+    }
+#ifndef _WIN32
+    if (target.loopback) {
+        target.loopback->set_result_shape(static_cast<uint32_t>(rows), static_cast<uint32_t>(width));
+    }
+#endif
+
+    PGconn* connection = PQconnectdb(target.connection_string.c_str());
+    if (PQstatus(connection) != CONNECTION_OK) {
+        state.SkipWithError("Could not connect");
+        PQfinish(connection);
+        return;
+    }
+
+    const char* statement =
+        "SELECT i AS id, repeat('x', $2::int) AS payload FROM generate_series(1, $1::int) AS i";
+    const std::string rows_text = std::to_string(rows);
+    const std::string width_text = std::to_string(width);
+    const char* parameters[] = { rows_text.c_str(), width_text.c_str() };
+
+    std::string batch;
+    for (int i = 0; i < depth; ++i) {
+        batch += "SELECT i AS id, repeat('x', " + width_text +
+                 ") AS payload FROM generate_series(1, " + rows_text + ") AS i;";
+    }
+
+    if (mode == kPreparedProtocol) {
+        PGresult* prepared = PQprepare(connection, "bm_protocol", statement, 2, nullptr);
+        const bool ok = PQresultStatus(prepared) == PGRES_COMMAND_OK;
+        PQclear(prepared);
+        if (!ok) {
+            state.SkipWithError("Could not prepare statement");
+            PQfinish(connection);
+            return;
+        }
+    }
+    if (mode != kSimpleProtocol) {
+        PQenterPipelineMode(connection);
+    }
+
+    const auto bytes_before = WireBytes(connection);
+    const double cpu_before = ThreadCpuSeconds();
+    bool failed = false;
+
+    for (auto _ : state) {
+        int completed = 0;
+        PGresult* result = nullptr;
+
+        if (mode == kSimpleProtocol) {
+            PQsendQuery(connection, batch.c_str());
+            while ((result = PQgetResult(connection)) != nullptr) {
+                completed += PQresultStatus(result) == PGRES_TUPLES_OK ? 1 : 0;
+                PQclear(result);
+            }
+        } else {
+            for (int i = 0; i < depth; ++i) {
+                if (mode == kPreparedProtocol) {
+                    PQsendQueryPrepared(connection, "bm_protocol", 2, parameters, nullptr, nullptr, binary);
+                } else {
+                    PQsendQueryParams(connection, statement, 2, nullptr, parameters, nullptr, nullptr, binary);
+                }
+            }
+            PQpipelineSync(connection);
+
+            for (int i = 0; i < depth; ++i) {
+                while ((result = PQgetResult(connection)) != nullptr) {
+                    completed += PQresultStatus(result) == PGRES_TUPLES_OK ? 1 : 0;
+                    PQclear(result);
+                }
+            }
+            // The PGRES_PIPELINE_SYNC result
+            PQclear(PQgetResult(connection));
+        }
+
+        if (completed != depth) {
+            failed = true;
+            break;
+        }
+    }
+
+    const double cpu_seconds = ThreadCpuSeconds() - cpu_before;
+    const auto bytes_after = WireBytes(connection);
+    const std::string error = failed ? PQerrorMessage(connection) : "";
+
+    if (mode != kSimpleProtocol) {
+        PQexitPipelineMode(connection);
+    }
+    PQfinish(connection);
+
+    if (failed) {
+        state.SkipWithError(error.empty() ? "Query failed" : error.c_str());
+        return;
+    }
+
+    const double queries = static_cast<double>(state.iterations()) * depth;
+    state.SetItemsProcessed(static_cast<int64_t>(queries));
+    state.SetBytesProcessed(static_cast<int64_t>(bytes_after.second - bytes_before.second));
+    state.counters["cpu_us/query"] = cpu_seconds * 1e6 / queries;
+    state.counters["sent_bytes/query"] =
+        static_cast<double>(bytes_after.first - bytes_before.first) / queries;
+    state.counters["recv_bytes/query"] =
+        static_cast<double>(bytes_after.second - bytes_before.second) / queries;
+
+    static const char* mode_names[] = { "simple", "extended", "prepared" };
+    state.SetLabel(std::string(target.label) + " " + mode_names[mode] + (binary ? " binary" : " text"));
+}
+
+static void ProtocolMatrixArguments(benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgNames({ "mode", "binary", "depth", "rows", "width" });
+
+    const std::pair<int64_t, int64_t> shapes[] = {
+        { 1, 16 }, { 1, 1024 }, { 100, 16 }, { 100, 1024 }, { 1000, 64 }
+    };
+    for (int mode = kSimpleProtocol; mode <= kPreparedProtocol; ++mode) {
+        for (int binary = 0; binary <= 1; ++binary) {
+            // The simple protocol always returns text.
+            if (mode == kSimpleProtocol && binary == 1) {
+                continue;
+            }
+            for (int depth = 1; depth <= 256; depth *= 4) {
+                for (const auto& [rows, width] : shapes) {
+                    benchmark->Args({ mode, binary, depth, rows, width });
+                }
+            }
+        }
+    }
+}
+BENCHMARK(BM_ProtocolMatrix)->Apply(ProtocolMatrixArguments);
+
+// Recovery from backend faults. Each iteration is one fault cycle against a
+// fresh loopback stand-in: a prepared statement is executed every
+// millisecond, the fault is injected after 100 ms and cleared 200 ms later,
+// and requests continue for another 500 ms. Reports how long after the
+// fault cleared the first request succeeded, how many cycles recovered at
+// all, the share of successful requests and the slowest single request.
+// Faults: all sockets dropped (the server stays up), the server stopped and
+// restarted on the same port (connects are refused meanwhile), and
+// responses stalled. Auto-reconnect off matches a caller that never
+// reconnects by hand.
+enum FaultScenario { kDropSockets = 0, kRestartServer = 1, kStallResponses = 2 };
+
+static void BM_Resilience(benchmark::State& state) {
+#ifdef _WIN32
+    state.SkipWithError("Needs the POSIX loopback stand-in");
+#else
+    using clock = std::chrono::steady_clock;
+    const auto scenario = static_cast<FaultScenario>(state.range(0));
+    const bool auto_reconnect = state.range(1) != 0;
+    const auto response_timeout = std::chrono::milliseconds(state.range(2));
+
+    const auto healthy_before = std::chrono::milliseconds(100);
+    const auto outage = std::chrono::milliseconds(200);
+    const auto recovery_window = std::chrono::milliseconds(500);
+    const auto request_interval = std::chrono::milliseconds(1);
+
+    pg_loopback_server server;
+    if (!server.start()) {
+        state.SkipWithError("Could not start the loopback stand-in");
+        return;
+    }
+    server.set_result_shape(1, 16);
+    const uint16_t port = server.port();
+    const std::string connection_string = server.connection_string();
+
+    uint64_t attempts = 0;
+    uint64_t successes = 0;
+    int64_t recovered_cycles = 0;
+    double recovery_ms = 0.0;
+    double worst_ms = 0.0;
+
+    for (auto _ : state) {
+        postgres_manager connection;
+        connection.set_auto_reconnect(auto_reconnect);
+        connection.set_response_timeout(response_timeout);
+        if (!connection.connect(connection_string) || !connection.prepare("bm_resilience", "SELECT 1")) {
+            state.SkipWithError("Could not connect");
+            return;
+        }
+
+        const auto start = clock::now();
+        const auto fault_at = start + healthy_before;
+        const auto restore_at = fault_at + outage;
+        const auto end = restore_at + recovery_window;
+        // Dropped sockets can be reopened right away.
+        const auto cleared_at = scenario == kDropSockets ? fault_at : restore_at;
+
+        std::thread injector([&]() {
+            std::this_thread::sleep_until(fault_at);
+            switch (scenario) {
+            case kDropSockets:
+                server.drop_connections();
+                break;
+            case kRestartServer:
+                server.stop();
+                break;
+            case kStallResponses:
+                server.set_stalled(true);
+                break;
+            }
+
+            std::this_thread::sleep_until(restore_at);
+            if (scenario == kRestartServer) {
+                server.start(port);
+            } else if (scenario == kStallResponses) {
+                server.set_stalled(false);
+            }
+        });
+
+        result_buffer output;
+        const std::span<const char* const> no_parameters;
+        bool recovered = false;
+        auto next = start;
+        for (;;) {
+            std::this_thread::sleep_until(next);
+            const auto issued = clock::now();
+            if (issued >= end) {
+                break;
+            }
+
+            const bool ok = connection.execute_prepared("bm_resilience", no_parameters, output);
+            const auto finished = clock::now();
+
+            ++attempts;
+            successes += ok ? 1 : 0;
+            worst_ms = std::max(
+                worst_ms, std::chrono::duration<double, std::milli>(finished - issued).count());
+            if (ok && !recovered && finished >= cleared_at && issued >= fault_at) {
+                recovered = true;
+                recovery_ms +=
+                    std::chrono::duration<double, std::milli>(finished - cleared_at).count();
+            }
+
+            // Keep the schedule, but do not burst to catch up after a
+            // request that blocked.
+            next = std::max(next + request_interval, finished);
+        }
+
+        injector.join();
+        recovered_cycles += recovered ? 1 : 0;
+    }
+
+    state.counters["recovery_ms"] =
+        recovered_cycles == 0 ? -1.0 : recovery_ms / static_cast<double>(recovered_cycles);
+    state.counters["recovered"] =
+        static_cast<double>(recovered_cycles) / static_cast<double>(state.iterations());
+    state.counters["success_rate"] =
+        attempts == 0 ? 0.0 : static_cast<double>(successes) / static_cast<double>(attempts);
+    state.counters["worst_ms"] = worst_ms;
+
+    static const char* fault_names[] = { "drop sockets", "restart", "stall" };
+    state.SetLabel(std::string(fault_names[scenario]) +
+                   (auto_reconnect ? ", auto-reconnect" : ", no reconnect"));
+#endif
+}
+
+static void ResilienceArguments(benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgNames({ "fault", "reconnect", "timeout_ms" });
+    for (int fault = kDropSockets; fault <= kStallResponses; ++fault) {
+        for (int reconnect = 0; reconnect <= 1; ++reconnect) {
+            benchmark->Args({ fault, reconnect, 0 });
+            // Only a stall is affected by waiting less for a response.
+            if (fault == kStallResponses) {
+                benchmark->Args({ fault, reconnect, 50 });
+            }
+        }
+    }
+}
+BENCHMARK(BM_Resilience)
+    ->Apply(ResilienceArguments)
+    ->Iterations(3)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Key lookups in a 10,000-row table_mirror from several threads, with a
+// refresh publishing a new version every 10 ms in the background, compared
+// with a prepared select round trip to the loopback stand-in. Lookups pin
+// the current version, probe the index and read one cell.
+static void BM_TableMirrorLookup(benchmark::State& state) {
+#ifdef _WIN32
+    state.SkipWithError("Needs the POSIX loopback stand-in");
+#else
+    static pg_loopback_server server;
+    static database::postgres_manager source;
+    static std::unique_ptr<database::table_mirror> mirror;
+    static std::atomic<bool> refreshing{ false };
+    static std::thread refresher;
+
+    if (state.thread_index() == 0) {
+        if (!server.start() || !source.connect(server.connection_string())) {
+            state.SkipWithError("Could not start the loopback stand-in");
+        }
+        server.set_result_shape(10000, 16);
+        mirror = std::make_unique<database::table_mirror>("mirror_select", "SELECT id, payload FROM dimension", "id");
+        mirror->refresh(source);
+        refreshing = true;
+        refresher = std::thread([] {
+            while (refreshing) {
+                mirror->refresh(source);
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        });
+    }
+
+    std::mt19937 random(static_cast<uint32_t>(state.thread_index()));
+    std::uniform_int_distribution<int64_t> keys(1, 10000);
+    size_t found = 0;
+    for (auto _ : state) {
+        auto view = mirror->read();
+        const size_t row = view.find(keys(random));
+        if (row != database::table_mirror::view::npos) {
+            found += view.rows().text(row, 1).size();
+        }
+        benchmark::DoNotOptimize(found);
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0) {
+        refreshing = false;
+        refresher.join();
+        mirror.reset();
+        source.disconnect();
+        server.stop();
+    }
+#endif
+}
+BENCHMARK(BM_TableMirrorLookup)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_PreparedSelectLookup(benchmark::State& state) {
+#ifdef _WIN32
+    state.SkipWithError("Needs the POSIX loopback stand-in");
+#else
+    pg_loopback_server server;
+    database::postgres_manager connection;
+    if (!server.start() || !connection.connect(server.connection_string())) {
+        state.SkipWithError("Could not start the loopback stand-in");
+        return;
+    }
+    server.set_result_shape(1, 16);
+    connection.prepare("lookup_select", "SELECT id, payload FROM dimension WHERE id = $1");
+
+    database::result_buffer result;
+    const char* parameters[] = { "42" };
+    for (auto _ : state) {
+        connection.execute_prepared("lookup_select", parameters, result);
+        benchmark::DoNotOptimize(result.rows());
+    }
+    state.SetItemsProcessed(state.iterations());
+#endif
+}
+BENCHMARK(BM_PreparedSelectLookup)->UseRealTime();
+
+// A large read decoded into a reused result_buffer from a prepared
+// statement's PGresult (mode 0) or streamed through binary COPY into a
+// columnar_result (mode 1). Against the local server when available,
+// otherwise the loopback stand-in.
+static void BM_LargeSelect(benchmark::State& state) {
+    const int64_t mode = state.range(0);
+    const int64_t rows = state.range(1);
+
+    auto& target = GetProtocolTarget();
+    if (target.connection_string.empty()) {
+        state.SkipWithError("Neither PostgreSQL nor the loopback stand-in is available");
+        return;
+    }
+#ifndef _WIN32
+    if (target.loopback) {
+        target.loopback->set_result_shape(static_cast<uint32_t>(rows), 16);
+    }
+#endif
+
+    database::postgres_manager connection;
+    if (!connection.connect(target.connection_string)) {
+        state.SkipWithError("Could not connect");
+        return;
+    }
+
+    const std::string rows_text = std::to_string(rows);
+    const std::string statement
+        = "SELECT i AS id, repeat('x', 16) AS payload FROM generate_series(1, " + rows_text + ") AS i";
+    connection.prepare("large_select",
+                       "SELECT i AS id, repeat('x', 16) AS payload FROM generate_series(1, $1::int) AS i");
+    const char* parameters[] = { rows_text.c_str() };
+
+    database::result_buffer buffer;
+    database::columnar_result columns;
+    for (auto _ : state) {
+        const bool ok = mode == 0 ? connection.execute_prepared("large_select", parameters, buffer)
+                                  : connection.select_columnar(statement, columns);
+        if (!ok) {
+            state.SkipWithError("Query failed");
+            break;
+        }
+        benchmark::DoNotOptimize(mode == 0 ? buffer.rows() : columns.rows());
+    }
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetLabel(std::string(mode == 0 ? "pgresult" : "binary_copy") + "/" + target.label);
+}
+BENCHMARK(BM_LargeSelect)
+    ->ArgsProduct({ { 0, 1 }, { 100000 } })
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Row and field scanning over 16 MiB of CSV with short and quoted fields,
+// and the quote-parity pass that cuts it into chunks for parallel COPY.
+static std::string make_csv(size_t bytes) {
+    std::string data;
+    for (int row = 0; data.size() < bytes; ++row) {
+        data += std::to_string(row) + ",customer " + std::to_string(row % 977)
+                + ",\"Street 1, \"\"Apt\"\" 2\",2024-01-01 10:00:00,19.99\n";
+    }
+    return data;
+}
+
+static void BM_CsvScanRows(benchmark::State& state) {
+    static const std::string data = make_csv(16 * 1024 * 1024);
+    for (auto _ : state) {
+        database::csv_scanner scanner(data, ',', '"');
+        size_t fields = 0;
+        size_t rows = 0;
+        while (scanner.next_row(fields)) {
+            ++rows;
+        }
+        benchmark::DoNotOptimize(rows);
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(data.size()));
+}
+BENCHMARK(BM_CsvScanRows)->Unit(benchmark::kMillisecond);
+
+static void BM_CsvSplitChunks(benchmark::State& state) {
+    static const std::string data = make_csv(16 * 1024 * 1024);
+    for (auto _ : state) {
+        auto chunks = database::split_csv_rows(data, 1024 * 1024, '"');
+        benchmark::DoNotOptimize(chunks.data());
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(data.size()));
+}
+BENCHMARK(BM_CsvSplitChunks)->Unit(benchmark::kMillisecond);
+
 // Main function with PostgreSQL check
 int main(int argc, char** argv) {
     // Check if PostgreSQL is available
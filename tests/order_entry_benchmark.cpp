@@ -0,0 +1,622 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+// Order-entry transactional benchmark.
+//
+// A simplified TPC-C: terminals run new-order, payment and order-status
+// transactions against a configurable number of warehouses. Every terminal
+// has a home warehouse, so fewer warehouses means more terminals contending
+// for the same district and warehouse rows. Transactions that fail with a
+// serialization failure or deadlock are retried, and the report shows how
+// often that happened alongside the transaction rate. This is not a
+// compliant TPC-C implementation: there is no keying or think time, the
+// delivery and stock-level transactions are left out, and the schema keeps
+// only the columns the three transactions touch.
+//
+// Example:
+//   database_order_entry --load --warehouses 4
+//   database_order_entry --warehouses 4 --terminals 32 --duration 60
+//                        --isolation repeatable-read
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../postgres_manager.h"
+#include "../latency_histogram.h"
+
+using namespace database;
+
+namespace {
+
+constexpr int districts_per_warehouse = 10;
+
+enum class transaction_type { new_order = 0, payment = 1, order_status = 2 };
+constexpr size_t transaction_type_count = 3;
+const char* transaction_names[transaction_type_count] = { "NEW-ORDER", "PAYMENT", "ORDER-STATUS" };
+
+enum class outcome { committed, rolled_back, retryable, failed };
+
+struct benchmark_options {
+    std::string connection = "host=localhost port=5432 dbname=postgres user=postgres";
+    int warehouses = 1;
+    int customers_per_district = 300;
+    int items = 10000;
+    size_t terminals = 10;
+    double duration_seconds = 60.0;
+    double mix[transaction_type_count] = { 0.45, 0.43, 0.12 };
+    std::string isolation = "READ COMMITTED";
+    int max_retries = 5;
+    bool load = false;
+};
+
+struct transaction_counters {
+    std::atomic<uint64_t> attempts{ 0 };
+    std::atomic<uint64_t> committed{ 0 };
+    std::atomic<uint64_t> rolled_back{ 0 };
+    std::atomic<uint64_t> aborts{ 0 };
+    std::atomic<uint64_t> retried{ 0 };
+    std::atomic<uint64_t> failed{ 0 };
+    latency_histogram latency;
+};
+
+struct shared_state {
+    transaction_counters counters[transaction_type_count];
+    std::atomic<bool> stop{ false };
+};
+
+// Non-uniform random from TPC-C clause 2.1.6, which concentrates accesses
+// on a subset of customers and items.
+int nurand(std::mt19937& random, const int& a, const int& x, const int& y, const int& c) {
+    const int r1 = std::uniform_int_distribution<int>(0, a)(random);
+    const int r2 = std::uniform_int_distribution<int>(x, y)(random);
+    return (((r1 | r2) + c) % (y - x + 1)) + x;
+}
+
+int uniform(std::mt19937& random, const int& low, const int& high) {
+    return std::uniform_int_distribution<int>(low, high)(random);
+}
+
+std::string money(const double& amount) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.2f", amount);
+    return buffer;
+}
+
+bool is_retryable(const std::string& sqlstate) {
+    // serialization_failure and deadlock_detected
+    return sqlstate == "40001" || sqlstate == "40P01";
+}
+
+class terminal {
+public:
+    terminal(const benchmark_options& options, const int& home_warehouse, const unsigned& seed)
+        : options_(options), home_warehouse_(home_warehouse), random_(seed) {
+        customer_constant_ = uniform(random_, 0, 1023);
+        item_constant_ = uniform(random_, 0, 8191);
+    }
+
+    bool connect() {
+        return connection_.connect(options_.connection);
+    }
+
+    void disconnect() {
+        connection_.disconnect();
+    }
+
+    transaction_type choose() {
+        double point = std::uniform_real_distribution<double>(0.0, 1.0)(random_);
+        for (size_t index = 0; index < transaction_type_count; ++index) {
+            if (point < options_.mix[index]) {
+                return static_cast<transaction_type>(index);
+            }
+            point -= options_.mix[index];
+        }
+        return transaction_type::new_order;
+    }
+
+    // Runs one transaction with the given inputs; the caller retries with
+    // the same inputs on a retryable outcome.
+    outcome run(const transaction_type& type, const unsigned& input_seed) {
+        std::mt19937 inputs(input_seed);
+        if (!begin()) {
+            return finish_failed();
+        }
+
+        outcome result = outcome::failed;
+        switch (type) {
+        case transaction_type::new_order:
+            result = new_order(inputs);
+            break;
+        case transaction_type::payment:
+            result = payment(inputs);
+            break;
+        case transaction_type::order_status:
+            result = order_status(inputs);
+            break;
+        }
+
+        if (result == outcome::committed && !connection_.create_query("COMMIT")) {
+            return finish_failed();
+        }
+        return result;
+    }
+
+    unsigned next_seed() {
+        return static_cast<unsigned>(random_());
+    }
+
+private:
+    bool begin() {
+        if (!connection_.is_connected() && !connect()) {
+            return false;
+        }
+        return connection_.create_query("BEGIN ISOLATION LEVEL " + options_.isolation);
+    }
+
+    outcome finish_failed() {
+        const bool retryable = is_retryable(connection_.last_error_state());
+        if (connection_.is_connected()) {
+            connection_.create_query("ROLLBACK");
+        }
+        return retryable ? outcome::retryable : outcome::failed;
+    }
+
+    int customer_id(std::mt19937& inputs) {
+        return nurand(inputs, 1023, 1, options_.customers_per_district, customer_constant_);
+    }
+
+    outcome new_order(std::mt19937& inputs) {
+        const int w = home_warehouse_;
+        const int d = uniform(inputs, 1, districts_per_warehouse);
+        const int c = customer_id(inputs);
+        const int line_count = uniform(inputs, 5, 15);
+        // 1% of new-orders name an unused item and must roll back.
+        const bool invalid_item = uniform(inputs, 1, 100) == 1;
+
+        const std::string district
+            = " WHERE d_w_id = " + std::to_string(w) + " AND d_id = " + std::to_string(d);
+
+        if (!connection_.select_query(
+                "SELECT c_discount, c_last, w_tax FROM oe_customer, oe_warehouse"
+                " WHERE w_id = " + std::to_string(w) + " AND c_w_id = w_id AND c_d_id = "
+                + std::to_string(d) + " AND c_id = " + std::to_string(c))
+            || connection_.update_query("UPDATE oe_district SET d_next_o_id = d_next_o_id + 1"
+                                        + district) != 1) {
+            return finish_failed();
+        }
+
+        bool all_local = true;
+        std::vector<int> supply_warehouses(line_count, w);
+        for (auto& supply : supply_warehouses) {
+            if (options_.warehouses > 1 && uniform(inputs, 1, 100) == 1) {
+                do {
+                    supply = uniform(inputs, 1, options_.warehouses);
+                } while (supply == w);
+                all_local = false;
+            }
+        }
+
+        if (connection_.insert_query(
+                "INSERT INTO oe_orders SELECT d_w_id, d_id, d_next_o_id - 1, "
+                + std::to_string(c) + ", now(), " + std::to_string(line_count) + ", "
+                + (all_local ? "1" : "0") + " FROM oe_district" + district)
+            != 1) {
+            return finish_failed();
+        }
+
+        for (int number = 1; number <= line_count; ++number) {
+            const int item = (invalid_item && number == line_count)
+                                 ? options_.items + 1
+                                 : nurand(inputs, 8191, 1, options_.items, item_constant_);
+            const int supply = supply_warehouses[number - 1];
+            const int quantity = uniform(inputs, 1, 10);
+            const std::string q = std::to_string(quantity);
+
+            if (connection_.update_query(
+                    "UPDATE oe_stock SET s_quantity = CASE WHEN s_quantity >= " + q
+                    + " + 10 THEN s_quantity - " + q + " ELSE s_quantity - " + q
+                    + " + 91 END, s_ytd = s_ytd + " + q
+                    + ", s_order_cnt = s_order_cnt + 1, s_remote_cnt = s_remote_cnt + "
+                    + (supply == w ? "0" : "1") + " WHERE s_w_id = " + std::to_string(supply)
+                    + " AND s_i_id = " + std::to_string(item))
+                != 1) {
+                if (!connection_.last_error_state().empty() || !connection_.is_connected()) {
+                    return finish_failed();
+                }
+                // Unknown item: the expected business rollback.
+                connection_.create_query("ROLLBACK");
+                return outcome::rolled_back;
+            }
+
+            if (connection_.insert_query(
+                    "INSERT INTO oe_order_line SELECT d_w_id, d_id, d_next_o_id - 1, "
+                    + std::to_string(number) + ", i_id, " + std::to_string(supply) + ", " + q
+                    + ", " + q + " * i_price FROM oe_district, oe_item" + district
+                    + " AND i_id = " + std::to_string(item))
+                != 1) {
+                return finish_failed();
+            }
+        }
+
+        return outcome::committed;
+    }
+
+    outcome payment(std::mt19937& inputs) {
+        const int w = home_warehouse_;
+        const int d = uniform(inputs, 1, districts_per_warehouse);
+        const std::string amount = money(uniform(inputs, 100, 500000) / 100.0);
+
+        // 15% of payments are for a customer of another warehouse.
+        int customer_w = w;
+        int customer_d = d;
+        if (options_.warehouses > 1 && uniform(inputs, 1, 100) <= 15) {
+            do {
+                customer_w = uniform(inputs, 1, options_.warehouses);
+            } while (customer_w == w);
+            customer_d = uniform(inputs, 1, districts_per_warehouse);
+        }
+        const int c = customer_id(inputs);
+
+        if (connection_.update_query("UPDATE oe_warehouse SET w_ytd = w_ytd + " + amount
+                                     + " WHERE w_id = " + std::to_string(w))
+                != 1
+            || connection_.update_query("UPDATE oe_district SET d_ytd = d_ytd + " + amount
+                                        + " WHERE d_w_id = " + std::to_string(w)
+                                        + " AND d_id = " + std::to_string(d))
+                   != 1
+            || connection_.update_query(
+                   "UPDATE oe_customer SET c_balance = c_balance - " + amount
+                   + ", c_ytd_payment = c_ytd_payment + " + amount
+                   + ", c_payment_cnt = c_payment_cnt + 1 WHERE c_w_id = "
+                   + std::to_string(customer_w) + " AND c_d_id = " + std::to_string(customer_d)
+                   + " AND c_id = " + std::to_string(c))
+                   != 1
+            || connection_.insert_query(
+                   "INSERT INTO oe_history VALUES (" + std::to_string(c) + ", "
+                   + std::to_string(customer_d) + ", " + std::to_string(customer_w) + ", "
+                   + std::to_string(d) + ", " + std::to_string(w) + ", now(), " + amount + ")")
+                   != 1) {
+            return finish_failed();
+        }
+
+        return outcome::committed;
+    }
+
+    outcome order_status(std::mt19937& inputs) {
+        const int w = home_warehouse_;
+        const int d = uniform(inputs, 1, districts_per_warehouse);
+        const int c = customer_id(inputs);
+        const std::string customer = std::to_string(w) + " AND c_d_id = " + std::to_string(d)
+                                     + " AND c_id = " + std::to_string(c);
+        const std::string last_order
+            = "(SELECT max(o_id) FROM oe_orders WHERE o_w_id = " + std::to_string(w)
+              + " AND o_d_id = " + std::to_string(d) + " AND o_c_id = " + std::to_string(c) + ")";
+
+        if (!connection_.select_query(
+                "SELECT c_balance, c_last FROM oe_customer WHERE c_w_id = " + customer)
+            || !connection_.select_query(
+                "SELECT o_id, o_entry_d, o_ol_cnt FROM oe_orders WHERE o_w_id = "
+                + std::to_string(w) + " AND o_d_id = " + std::to_string(d) + " AND o_id = "
+                + last_order)
+            || !connection_.select_query(
+                "SELECT ol_i_id, ol_supply_w_id, ol_quantity, ol_amount FROM oe_order_line"
+                " WHERE ol_w_id = " + std::to_string(w) + " AND ol_d_id = " + std::to_string(d)
+                + " AND ol_o_id = " + last_order)) {
+            return finish_failed();
+        }
+
+        return outcome::committed;
+    }
+
+    const benchmark_options& options_;
+    int home_warehouse_;
+    std::mt19937 random_;
+    int customer_constant_ = 0;
+    int item_constant_ = 0;
+    postgres_manager connection_;
+};
+
+void terminal_loop(const benchmark_options& options, shared_state& state, const size_t& index) {
+    terminal session(options, static_cast<int>(index % options.warehouses) + 1,
+                     std::random_device{}() + static_cast<unsigned>(index));
+    if (!session.connect()) {
+        std::cerr << "terminal " << index << ": could not connect\n";
+        return;
+    }
+
+    while (!state.stop.load(std::memory_order_relaxed)) {
+        const transaction_type type = session.choose();
+        const unsigned input_seed = session.next_seed();
+        auto& counters = state.counters[static_cast<size_t>(type)];
+
+        const auto start = std::chrono::steady_clock::now();
+        outcome result = session.run(type, input_seed);
+        int attempts = 1;
+        while (result == outcome::retryable && attempts <= options.max_retries
+               && !state.stop.load(std::memory_order_relaxed)) {
+            counters.aborts.fetch_add(1, std::memory_order_relaxed);
+            result = session.run(type, input_seed);
+            ++attempts;
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        counters.attempts.fetch_add(static_cast<uint64_t>(attempts), std::memory_order_relaxed);
+        if (attempts > 1) {
+            counters.retried.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        switch (result) {
+        case outcome::committed:
+            counters.committed.fetch_add(1, std::memory_order_relaxed);
+            counters.latency.record(static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+            break;
+        case outcome::rolled_back:
+            counters.rolled_back.fetch_add(1, std::memory_order_relaxed);
+            break;
+        case outcome::retryable:
+            counters.aborts.fetch_add(1, std::memory_order_relaxed);
+            counters.failed.fetch_add(1, std::memory_order_relaxed);
+            break;
+        case outcome::failed:
+            counters.failed.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+    }
+
+    session.disconnect();
+}
+
+bool create_and_load(const benchmark_options& options) {
+    postgres_manager connection;
+    if (!connection.connect(options.connection)) {
+        std::cerr << "load: could not connect\n";
+        return false;
+    }
+
+    const std::string warehouses = std::to_string(options.warehouses);
+    const std::string customers = std::to_string(options.customers_per_district);
+    const std::string items = std::to_string(options.items);
+
+    const std::vector<std::string> statements = {
+        "DROP TABLE IF EXISTS oe_history, oe_order_line, oe_orders, oe_stock, oe_item,"
+        " oe_customer, oe_district, oe_warehouse",
+        "CREATE TABLE oe_warehouse (w_id INT PRIMARY KEY, w_name TEXT, w_tax NUMERIC(4, 4),"
+        " w_ytd NUMERIC(14, 2))",
+        "CREATE TABLE oe_district (d_w_id INT, d_id INT, d_tax NUMERIC(4, 4),"
+        " d_ytd NUMERIC(14, 2), d_next_o_id INT, PRIMARY KEY (d_w_id, d_id))",
+        "CREATE TABLE oe_customer (c_w_id INT, c_d_id INT, c_id INT, c_last TEXT,"
+        " c_discount NUMERIC(4, 4), c_balance NUMERIC(14, 2), c_ytd_payment NUMERIC(14, 2),"
+        " c_payment_cnt INT, PRIMARY KEY (c_w_id, c_d_id, c_id))",
+        "CREATE TABLE oe_item (i_id INT PRIMARY KEY, i_name TEXT, i_price NUMERIC(5, 2))",
+        "CREATE TABLE oe_stock (s_w_id INT, s_i_id INT, s_quantity INT, s_ytd INT,"
+        " s_order_cnt INT, s_remote_cnt INT, PRIMARY KEY (s_w_id, s_i_id))",
+        "CREATE TABLE oe_orders (o_w_id INT, o_d_id INT, o_id INT, o_c_id INT,"
+        " o_entry_d TIMESTAMP, o_ol_cnt INT, o_all_local INT,"
+        " PRIMARY KEY (o_w_id, o_d_id, o_id))",
+        "CREATE INDEX oe_orders_customer ON oe_orders (o_w_id, o_d_id, o_c_id, o_id)",
+        "CREATE TABLE oe_order_line (ol_w_id INT, ol_d_id INT, ol_o_id INT, ol_number INT,"
+        " ol_i_id INT, ol_supply_w_id INT, ol_quantity INT, ol_amount NUMERIC(8, 2),"
+        " PRIMARY KEY (ol_w_id, ol_d_id, ol_o_id, ol_number))",
+        "CREATE TABLE oe_history (h_c_id INT, h_c_d_id INT, h_c_w_id INT, h_d_id INT,"
+        " h_w_id INT, h_date TIMESTAMP, h_amount NUMERIC(8, 2))",
+        "INSERT INTO oe_item SELECT i, 'item-' || i, (1 + random() * 99)::NUMERIC(5, 2)"
+        " FROM generate_series(1, " + items + ") i",
+        "INSERT INTO oe_warehouse SELECT w, 'warehouse-' || w, (random() * 0.2)::NUMERIC(4, 4),"
+        " 300000 FROM generate_series(1, " + warehouses + ") w",
+        "INSERT INTO oe_district SELECT w, d, (random() * 0.2)::NUMERIC(4, 4), 30000, 1"
+        " FROM generate_series(1, " + warehouses + ") w, generate_series(1, "
+        + std::to_string(districts_per_warehouse) + ") d",
+        "INSERT INTO oe_customer SELECT w, d, c, 'customer-' || (c % 1000),"
+        " (random() * 0.5)::NUMERIC(4, 4), -10, 10, 1 FROM generate_series(1, " + warehouses
+        + ") w, generate_series(1, " + std::to_string(districts_per_warehouse)
+        + ") d, generate_series(1, " + customers + ") c",
+        "INSERT INTO oe_stock SELECT w, i, 10 + (random() * 90)::INT, 0, 0, 0"
+        " FROM generate_series(1, " + warehouses + ") w, generate_series(1, " + items + ") i",
+        "ANALYZE",
+    };
+
+    for (const auto& statement : statements) {
+        if (!connection.create_query(statement)) {
+            std::cerr << "load: failed: " << statement.substr(0, 60) << "...\n";
+            return false;
+        }
+    }
+
+    std::cout << "Loaded " << options.warehouses << " warehouse(s)\n";
+    return true;
+}
+
+void print_report(const benchmark_options& options, const shared_state& state,
+                  const double& elapsed) {
+    const double minutes = elapsed / 60.0;
+    uint64_t total_committed = 0;
+    uint64_t total_aborts = 0;
+    uint64_t total_attempts = 0;
+
+    std::printf("\n%-13s %10s %10s %9s %9s %9s %9s %9s %9s\n", "transaction", "committed",
+                "tpm", "rollback", "aborts", "retried", "failed", "p50 ms", "p99 ms");
+    for (size_t index = 0; index < transaction_type_count; ++index) {
+        const auto& counters = state.counters[index];
+        const uint64_t committed = counters.committed.load();
+        const uint64_t aborts = counters.aborts.load();
+        total_committed += committed;
+        total_aborts += aborts;
+        total_attempts += counters.attempts.load();
+
+        std::printf("%-13s %10llu %10.0f %9llu %9llu %9llu %9llu %9.2f %9.2f\n",
+                    transaction_names[index], static_cast<unsigned long long>(committed),
+                    static_cast<double>(committed) / minutes,
+                    static_cast<unsigned long long>(counters.rolled_back.load()),
+                    static_cast<unsigned long long>(aborts),
+                    static_cast<unsigned long long>(counters.retried.load()),
+                    static_cast<unsigned long long>(counters.failed.load()),
+                    counters.latency.value_at_quantile(0.50) / 1e6,
+                    counters.latency.value_at_quantile(0.99) / 1e6);
+    }
+
+    const double new_orders
+        = static_cast<double>(state.counters[0].committed.load()) / minutes;
+    std::printf("\n%d warehouse(s), %zu terminal(s), %s, %.1f s\n", options.warehouses,
+                options.terminals, options.isolation.c_str(), elapsed);
+    std::printf("tpmC (new-order/min): %.0f\n", new_orders);
+    std::printf("tpm (all committed):  %.0f\n", static_cast<double>(total_committed) / minutes);
+    std::printf("abort rate:           %.2f%% of %llu attempts\n",
+                total_attempts == 0
+                    ? 0.0
+                    : 100.0 * static_cast<double>(total_aborts) / static_cast<double>(total_attempts),
+                static_cast<unsigned long long>(total_attempts));
+}
+
+bool parse_mix(const std::string& text, benchmark_options& options) {
+    double values[transaction_type_count] = { 0, 0, 0 };
+    std::istringstream stream(text);
+    std::string part;
+    size_t index = 0;
+    while (std::getline(stream, part, '/') && index < transaction_type_count) {
+        values[index++] = std::atof(part.c_str());
+    }
+
+    const double total = values[0] + values[1] + values[2];
+    if (index != transaction_type_count || total <= 0.0) {
+        return false;
+    }
+    for (size_t type = 0; type < transaction_type_count; ++type) {
+        options.mix[type] = values[type] / total;
+    }
+    return true;
+}
+
+void print_usage() {
+    std::cout
+        << "Usage: database_order_entry [options]\n"
+           "  --connection <conninfo>   libpq connection string\n"
+           "  --load                    (re)create and populate the oe_* tables, then exit\n"
+           "  --warehouses <n>          number of warehouses (default 1)\n"
+           "  --customers <n>           customers per district (default 300)\n"
+           "  --items <n>               catalog size (default 10000)\n"
+           "  --terminals <n>           concurrent terminals (default 10)\n"
+           "  --duration <seconds>      run time (default 60)\n"
+           "  --mix <n/p/s>             new-order/payment/order-status (default 45/43/12)\n"
+           "  --isolation <level>       read-committed | repeatable-read | serializable\n"
+           "  --max-retries <n>         retries after serialization failure or deadlock (default 5)\n";
+}
+
+bool parse_arguments(int argc, char** argv, benchmark_options& options) {
+    for (int index = 1; index < argc; ++index) {
+        const std::string argument = argv[index];
+        auto value = [&]() -> std::string {
+            return (index + 1 < argc) ? std::string(argv[++index]) : std::string();
+        };
+
+        if (argument == "--connection") {
+            options.connection = value();
+        } else if (argument == "--load") {
+            options.load = true;
+        } else if (argument == "--warehouses") {
+            options.warehouses = std::max(1, std::atoi(value().c_str()));
+        } else if (argument == "--customers") {
+            options.customers_per_district = std::max(1, std::atoi(value().c_str()));
+        } else if (argument == "--items") {
+            options.items = std::max(1, std::atoi(value().c_str()));
+        } else if (argument == "--terminals") {
+            options.terminals = static_cast<size_t>(std::max(1, std::atoi(value().c_str())));
+        } else if (argument == "--duration") {
+            options.duration_seconds = std::atof(value().c_str());
+        } else if (argument == "--mix") {
+            if (!parse_mix(value(), options)) {
+                std::cerr << "--mix expects three proportions such as 45/43/12\n";
+                return false;
+            }
+        } else if (argument == "--isolation") {
+            const std::string level = value();
+            if (level == "read-committed") {
+                options.isolation = "READ COMMITTED";
+            } else if (level == "repeatable-read") {
+                options.isolation = "REPEATABLE READ";
+            } else if (level == "serializable") {
+                options.isolation = "SERIALIZABLE";
+            } else {
+                std::cerr << "unknown isolation level: " << level << "\n";
+                return false;
+            }
+        } else if (argument == "--max-retries") {
+            options.max_retries = std::max(0, std::atoi(value().c_str()));
+        } else {
+            print_usage();
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    benchmark_options options;
+    if (!parse_arguments(argc, argv, options)) {
+        return 1;
+    }
+
+    if (options.load) {
+        return create_and_load(options) ? 0 : 1;
+    }
+
+    shared_state state;
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> terminals;
+    for (size_t index = 0; index < options.terminals; ++index) {
+        terminals.emplace_back(terminal_loop, std::cref(options), std::ref(state), index);
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.duration_seconds));
+    state.stop.store(true);
+    for (auto& thread : terminals) {
+        thread.join();
+    }
+
+    const double elapsed
+        = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    print_report(options, state, elapsed);
+
+    return 0;
+}
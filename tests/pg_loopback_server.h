@@ -0,0 +1,754 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+// A minimal PostgreSQL wire-protocol (v3) server on the loopback interface.
+//
+// It stands in for a real server in benchmarks and tests that exercise the
+// client side of the protocol: it accepts any user without authentication,
+// answers every simple query, Parse/Bind/Describe/Execute/Sync sequence and
+// pipeline with a synthetic result of `rows` rows of (id int4, payload
+// text), in text or binary as the client asks, and counts the bytes it
+// exchanges. Query text is mostly ignored, so the result shape is set with
+// set_result_shape(); simple queries do track BEGIN, COMMIT, ROLLBACK and
+// savepoints, report the rows of an INSERT ... VALUES, accept COPY ... FROM
+// STDIN, answer a binary COPY ... TO STDOUT with the result rows, deliver a
+// NOTIFY to the session that sent it, and fail statements or COPY data that
+// contain a text passed to set_rejected_values(); the last simple query is
+// kept for inspection. Named prepared statements are tracked per
+// connection: a Parse of a name in use, or a Bind or Describe of an unknown
+// one, fails and the messages up to the next Sync are skipped. For
+// resilience tests it can drop every open connection, stall its responses,
+// or be stopped and started again on the same port, during which connects
+// are refused. POSIX only.
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+class pg_loopback_server {
+public:
+    pg_loopback_server() = default;
+
+    ~pg_loopback_server() {
+        stop();
+    }
+
+    pg_loopback_server(const pg_loopback_server&) = delete;
+    pg_loopback_server& operator=(const pg_loopback_server&) = delete;
+
+    // Listens on 127.0.0.1:port; 0 picks a free port.
+    bool start(uint16_t port = 0) {
+        listener_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listener_ < 0) {
+            return false;
+        }
+
+        int reuse = 1;
+        ::setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        socklen_t length = sizeof(address);
+        if (::bind(listener_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || ::listen(listener_, 64) != 0
+            || ::getsockname(listener_, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+            ::close(listener_);
+            listener_ = -1;
+            return false;
+        }
+
+        port_ = ntohs(address.sin_port);
+        running_ = true;
+        acceptor_ = std::thread([this]() { accept_loop(); });
+        return true;
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) {
+            return;
+        }
+
+        ::shutdown(listener_, SHUT_RDWR);
+        ::close(listener_);
+        listener_ = -1;
+        if (acceptor_.joinable()) {
+            acceptor_.join();
+        }
+
+        std::vector<std::thread> sessions;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const int& socket : sockets_) {
+                ::shutdown(socket, SHUT_RDWR);
+            }
+            sessions.swap(sessions_);
+        }
+        for (auto& session : sessions) {
+            session.join();
+        }
+    }
+
+    uint16_t port() const {
+        return port_;
+    }
+
+    // A libpq connection string for this server.
+    std::string connection_string() const {
+        return "host=127.0.0.1 port=" + std::to_string(port_)
+               + " dbname=loopback user=loopback sslmode=disable gssencmode=disable";
+    }
+
+    // Sets the rows returned for every statement from now on.
+    void set_result_shape(const uint32_t& rows, const uint32_t& payload_width) {
+        auto shape = std::make_shared<result_shape>();
+        shape->rows = rows;
+        shape->text = build_rows(rows, payload_width, false);
+        shape->binary = build_rows(rows, payload_width, true);
+        std::lock_guard<std::mutex> lock(mutex_);
+        shape_ = std::move(shape);
+    }
+
+    // Simple-query statements and COPY data containing any of these texts
+    // fail with `state`, by default a unique violation, from now on.
+    void set_rejected_values(std::vector<std::string> values, std::string state = "23505") {
+        auto rejected = std::make_shared<const rejection>(rejection{ std::move(values), std::move(state) });
+        std::lock_guard<std::mutex> lock(mutex_);
+        rejected_ = std::move(rejected);
+    }
+
+    // Closes every open client connection; the server keeps accepting.
+    void drop_connections() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const int& socket : sockets_) {
+            ::shutdown(socket, SHUT_RDWR);
+        }
+    }
+
+    // While stalled, requests are read but no response is sent; the
+    // responses held back are sent once the stall ends.
+    void set_stalled(const bool& stalled) {
+        stalled_.store(stalled);
+    }
+
+    // Connections accepted so far.
+    uint64_t connections() const {
+        return connections_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t bytes_received() const {
+        return bytes_received_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t bytes_sent() const {
+        return bytes_sent_.load(std::memory_order_relaxed);
+    }
+
+    // Frontend messages of one type received so far, e.g. 'Q' for simple
+    // queries or 'P' for Parse.
+    uint64_t messages(const char& type) const {
+        return messages_[static_cast<unsigned char>(type)].load(std::memory_order_relaxed);
+    }
+
+    // Text of the last simple query received.
+    std::string last_query() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return last_query_;
+    }
+
+private:
+    struct result_shape {
+        uint32_t rows = 0;
+        std::string text;   // DataRow messages, text format
+        std::string binary; // DataRow messages, binary format
+    };
+
+    struct rejection {
+        std::vector<std::string> values;
+        std::string state = "23505";
+    };
+
+    static void put_int32(std::string& output, const uint32_t& value) {
+        const uint32_t network = htonl(value);
+        output.append(reinterpret_cast<const char*>(&network), 4);
+    }
+
+    static void put_int16(std::string& output, const uint16_t& value) {
+        const uint16_t network = htons(value);
+        output.append(reinterpret_cast<const char*>(&network), 2);
+    }
+
+    static uint32_t get_int32(const char* input) {
+        uint32_t network;
+        std::memcpy(&network, input, 4);
+        return ntohl(network);
+    }
+
+    static uint16_t get_int16(const char* input) {
+        uint16_t network;
+        std::memcpy(&network, input, 2);
+        return ntohs(network);
+    }
+
+    static void put_message(std::string& output, const char& type, const std::string& body) {
+        output.push_back(type);
+        put_int32(output, static_cast<uint32_t>(body.size() + 4));
+        output.append(body);
+    }
+
+    static std::string build_rows(const uint32_t& rows, const uint32_t& width, const bool& binary) {
+        const std::string payload(width, 'x');
+        std::string output;
+        for (uint32_t row = 1; row <= rows; ++row) {
+            std::string body;
+            put_int16(body, 2);
+            if (binary) {
+                put_int32(body, 4);
+                put_int32(body, row);
+            } else {
+                const std::string id = std::to_string(row);
+                put_int32(body, static_cast<uint32_t>(id.size()));
+                body.append(id);
+            }
+            put_int32(body, width);
+            body.append(payload);
+            put_message(output, 'D', body);
+        }
+        return output;
+    }
+
+    static std::string row_description(const bool& binary) {
+        std::string body;
+        put_int16(body, 2);
+        const struct {
+            const char* name;
+            uint32_t type;
+            uint16_t size;
+        } columns[] = { { "id", 23, 4 }, { "payload", 25, 0xFFFF } };
+        for (const auto& column : columns) {
+            body.append(column.name, std::strlen(column.name) + 1);
+            put_int32(body, 0); // table oid
+            put_int16(body, 0); // column number
+            put_int32(body, column.type);
+            put_int16(body, column.size);
+            put_int32(body, 0xFFFFFFFF); // type modifier
+            put_int16(body, binary ? 1 : 0);
+        }
+        std::string output;
+        put_message(output, 'T', body);
+        return output;
+    }
+
+    static void put_error(std::string& output, const char* state, const char* message) {
+        std::string body;
+        body.push_back('S');
+        body.append("ERROR").push_back('\0');
+        body.push_back('V');
+        body.append("ERROR").push_back('\0');
+        body.push_back('C');
+        body.append(state).push_back('\0');
+        body.push_back('M');
+        body.append(message).push_back('\0');
+        body.push_back('\0');
+        put_message(output, 'E', body);
+    }
+
+    static bool starts_with(const std::string& statement, const char* prefix) {
+        return statement.compare(0, std::strlen(prefix), prefix) == 0;
+    }
+
+    // Tuples after VALUES, counted as parentheses at nesting depth zero.
+    static size_t values_rows(const std::string& statement) {
+        const size_t values = statement.find("VALUES");
+        if (values == std::string::npos) {
+            return 0;
+        }
+        size_t rows = 0;
+        int depth = 0;
+        bool quoted = false;
+        for (size_t index = values; index < statement.size(); ++index) {
+            const char c = statement[index];
+            if (c == '\'') {
+                quoted = !quoted;
+            } else if (!quoted && c == '(') {
+                rows += depth == 0 ? 1 : 0;
+                ++depth;
+            } else if (!quoted && c == ')') {
+                --depth;
+            }
+        }
+        return rows;
+    }
+
+    // The binary DataRow bodies are binary COPY tuples already. They are
+    // sent in CopyData messages of an odd size, cut anywhere, so clients
+    // must reassemble rows; a real server sends one row per message.
+    static void append_binary_copy(std::string& output, const result_shape& shape) {
+        std::string body(1, '\1');
+        put_int16(body, 2);
+        put_int16(body, 1);
+        put_int16(body, 1);
+        put_message(output, 'H', body);
+
+        std::string stream("PGCOPY\n\377\r\n\0", 11);
+        put_int32(stream, 0);
+        put_int32(stream, 0);
+        for (size_t offset = 0; offset < shape.binary.size();) {
+            const uint32_t length = get_int32(shape.binary.data() + offset + 1);
+            stream.append(shape.binary, offset + 5, length - 4);
+            offset += 1 + length;
+        }
+        put_int16(stream, 0xFFFF);
+
+        constexpr size_t piece = 777;
+        for (size_t offset = 0; offset < stream.size(); offset += piece) {
+            put_message(output, 'd', stream.substr(offset, piece));
+        }
+        put_message(output, 'c', "");
+        put_message(output, 'C', "COPY " + std::to_string(shape.rows) + '\0');
+    }
+
+    // Answers one statement of a simple query and moves the transaction
+    // status ('I', 'T' or 'E'); returns false if it failed or started a
+    // COPY, which ends the query string like on a real server.
+    bool answer_statement(std::string& output, const std::string& statement, char& status,
+                          bool& copying, const result_shape& shape,
+                          const rejection& rejected) {
+        const bool rollback = starts_with(statement, "ROLLBACK");
+        if (status == 'E' && !rollback && !starts_with(statement, "COMMIT")) {
+            put_error(output, "25P02", "current transaction is aborted");
+            return false;
+        }
+        for (const std::string& value : rejected.values) {
+            if (statement.find(value) != std::string::npos) {
+                put_error(output, rejected.state.c_str(), ("rejected value " + value).c_str());
+                status = status == 'I' ? 'I' : 'E';
+                return false;
+            }
+        }
+
+        if (starts_with(statement, "COPY") && statement.find("FROM STDIN") != std::string::npos) {
+            // Text format, no columns described.
+            std::string body(1, '\0');
+            put_int16(body, 0);
+            put_message(output, 'G', body);
+            copying = true;
+            return false;
+        }
+        if (starts_with(statement, "COPY (") && statement.find("FORMAT binary") != std::string::npos) {
+            append_binary_copy(output, shape);
+            return true;
+        }
+        if (starts_with(statement, "BEGIN")) {
+            status = 'T';
+            put_message(output, 'C', std::string("BEGIN") + '\0');
+        } else if (starts_with(statement, "COMMIT")) {
+            put_message(output, 'C', std::string(status == 'E' ? "ROLLBACK" : "COMMIT") + '\0');
+            status = 'I';
+        } else if (starts_with(statement, "ROLLBACK TO")) {
+            status = 'T';
+            put_message(output, 'C', std::string("ROLLBACK") + '\0');
+        } else if (rollback) {
+            status = 'I';
+            put_message(output, 'C', std::string("ROLLBACK") + '\0');
+        } else if (starts_with(statement, "SAVEPOINT") || starts_with(statement, "RELEASE")) {
+            put_message(output, 'C', statement.substr(0, statement.find(' ')) + '\0');
+        } else if (starts_with(statement, "INSERT")) {
+            put_message(output, 'C', "INSERT 0 " + std::to_string(values_rows(statement)) + '\0');
+        } else if (starts_with(statement, "LISTEN")) {
+            put_message(output, 'C', std::string("LISTEN") + '\0');
+        } else if (starts_with(statement, "NOTIFY ")) {
+            // Delivered to the sending session itself: NOTIFY channel, 'payload'.
+            const size_t comma = std::min(statement.find(','), statement.size());
+            const size_t open = statement.find('\'', comma);
+            const size_t close = open == std::string::npos ? open : statement.find('\'', open + 1);
+            std::string body;
+            put_int32(body, 1);
+            body += statement.substr(7, comma - 7) + '\0';
+            body += (close == std::string::npos ? "" : statement.substr(open + 1, close - open - 1)) + '\0';
+            put_message(output, 'C', std::string("NOTIFY") + '\0');
+            put_message(output, 'A', body);
+        } else {
+            output.append(row_description(false));
+            append_result(output, shape, false);
+        }
+        return true;
+    }
+
+    std::shared_ptr<const result_shape> shape() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!shape_) {
+            shape_ = std::make_shared<result_shape>();
+        }
+        return shape_;
+    }
+
+    std::shared_ptr<const rejection> rejected() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!rejected_) {
+            rejected_ = std::make_shared<const rejection>();
+        }
+        return rejected_;
+    }
+
+    void accept_loop() {
+        while (running_) {
+            const int socket = ::accept(listener_, nullptr, nullptr);
+            if (socket < 0) {
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!running_) {
+                ::close(socket);
+                break;
+            }
+            connections_.fetch_add(1, std::memory_order_relaxed);
+            sockets_.push_back(socket);
+            sessions_.emplace_back([this, socket]() { serve(socket); });
+        }
+    }
+
+    bool read_exact(const int& socket, char* output, size_t size) {
+        while (size > 0) {
+            const ssize_t received = ::recv(socket, output, size, 0);
+            if (received <= 0) {
+                return false;
+            }
+            bytes_received_.fetch_add(static_cast<uint64_t>(received), std::memory_order_relaxed);
+            output += received;
+            size -= static_cast<size_t>(received);
+        }
+        return true;
+    }
+
+    bool write_all(const int& socket, const std::string& data) {
+        size_t offset = 0;
+        while (offset < data.size()) {
+            const ssize_t sent = ::send(socket, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return false;
+            }
+            offset += static_cast<size_t>(sent);
+        }
+        bytes_sent_.fetch_add(data.size(), std::memory_order_relaxed);
+        return true;
+    }
+
+    bool startup(const int& socket) {
+        for (;;) {
+            char header[8];
+            if (!read_exact(socket, header, sizeof(header))) {
+                return false;
+            }
+            const uint32_t length = get_int32(header);
+            const uint32_t code = get_int32(header + 4);
+            if (length < 8 || length > 10000) {
+                return false;
+            }
+            std::string rest(length - 8, '\0');
+            if (!rest.empty() && !read_exact(socket, rest.data(), rest.size())) {
+                return false;
+            }
+
+            // SSLRequest and GSSENCRequest: decline and wait for the real
+            // startup packet.
+            if (code == 80877103 || code == 80877104) {
+                if (!write_all(socket, "N")) {
+                    return false;
+                }
+                continue;
+            }
+            break;
+        }
+
+        std::string output;
+        std::string authentication_ok;
+        put_int32(authentication_ok, 0);
+        put_message(output, 'R', authentication_ok);
+
+        const char* parameters[][2] = { { "server_version", "15.0" },
+                                        { "server_encoding", "UTF8" },
+                                        { "client_encoding", "UTF8" },
+                                        { "DateStyle", "ISO, MDY" },
+                                        { "integer_datetimes", "on" },
+                                        { "standard_conforming_strings", "on" } };
+        for (const auto& parameter : parameters) {
+            std::string body;
+            body.append(parameter[0], std::strlen(parameter[0]) + 1);
+            body.append(parameter[1], std::strlen(parameter[1]) + 1);
+            put_message(output, 'S', body);
+        }
+
+        std::string key;
+        put_int32(key, 1);
+        put_int32(key, 1);
+        put_message(output, 'K', key);
+        put_message(output, 'Z', "I");
+        return write_all(socket, output);
+    }
+
+    static void append_result(std::string& output, const result_shape& shape, const bool& binary) {
+        output.append(binary ? shape.binary : shape.text);
+        put_message(output, 'C', "SELECT " + std::to_string(shape.rows) + '\0');
+    }
+
+    void serve(const int& socket) {
+        if (startup(socket)) {
+            bool binary_results = false;
+            char status = 'I';
+            bool copying = false;
+            bool copy_rejected = false;
+            uint64_t copy_rows = 0;
+            char copy_tail = '\0';
+            std::set<std::string> statements;
+            bool skipping = false; // After an extended-protocol error, until Sync.
+            std::string body;
+            std::string output;
+            for (;;) {
+                char header[5];
+                if (!read_exact(socket, header, sizeof(header))) {
+                    break;
+                }
+                const char type = header[0];
+                messages_[static_cast<unsigned char>(type)].fetch_add(1, std::memory_order_relaxed);
+                const uint32_t length = get_int32(header + 1);
+                if (length < 4) {
+                    break;
+                }
+                body.resize(length - 4);
+                if (!body.empty() && !read_exact(socket, body.data(), body.size())) {
+                    break;
+                }
+
+                const auto current = shape();
+                if (skipping && std::string("PBDECH").find(type) != std::string::npos) {
+                    continue;
+                }
+                switch (type) {
+                case 'Q': {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        last_query_.assign(body.c_str());
+                    }
+                    // One result per non-empty statement, up to the first
+                    // that fails.
+                    const auto rejected_values = rejected();
+                    size_t statements = 0;
+                    size_t start = 0;
+                    while (start < body.size()) {
+                        size_t end = body.find(';', start);
+                        if (end == std::string::npos) {
+                            end = body.size();
+                        }
+                        const size_t first = body.find_first_not_of(std::string(" \n\0", 3), start);
+                        size_t last = end;
+                        while (last > start && (body[last - 1] == '\0' || body[last - 1] == ' ')) {
+                            --last;
+                        }
+                        if (first != std::string::npos && first < last) {
+                            ++statements;
+                            if (!answer_statement(output, body.substr(first, last - first), status,
+                                                  copying, *current, *rejected_values)) {
+                                break;
+                            }
+                        }
+                        start = end + 1;
+                    }
+                    if (statements == 0) {
+                        put_message(output, 'I', "");
+                    }
+                    if (!copying) {
+                        put_message(output, 'Z', std::string(1, status));
+                    }
+                    break;
+                }
+                case 'd':
+                    // COPY data; rows are counted by newline, quotes aside.
+                    for (const char& c : body) {
+                        copy_rows += c == '\n' ? 1 : 0;
+                    }
+                    copy_tail = body.empty() ? copy_tail : body.back();
+                    for (const std::string& value : rejected()->values) {
+                        copy_rejected = copy_rejected || body.find(value) != std::string::npos;
+                    }
+                    break;
+                case 'c':
+                case 'f':
+                    if (type == 'f' || copy_rejected) {
+                        put_error(output, type == 'f' ? "57014" : rejected()->state.c_str(), "COPY rejected");
+                        status = status == 'I' ? 'I' : 'E';
+                    } else {
+                        copy_rows += copy_tail != '\n' && copy_tail != '\0' ? 1 : 0;
+                        put_message(output, 'C', "COPY " + std::to_string(copy_rows) + '\0');
+                    }
+                    put_message(output, 'Z', std::string(1, status));
+                    copying = false;
+                    copy_rejected = false;
+                    copy_rows = 0;
+                    copy_tail = '\0';
+                    break;
+                case 'P':
+                    if (body[0] != '\0' && !statements.insert(body.c_str()).second) {
+                        put_error(output, "42P05", "prepared statement already exists");
+                        status = status == 'I' ? 'I' : 'E';
+                        skipping = true;
+                        break;
+                    }
+                    put_message(output, '1', "");
+                    break;
+                case 'B': {
+                    // portal\0 statement\0 int16 nformats, formats, int16
+                    // nparams, params, int16 nresult formats, formats
+                    size_t offset = body.find('\0') + 1;
+                    const std::string statement = body.c_str() + offset;
+                    if (!statement.empty() && statements.count(statement) == 0) {
+                        put_error(output, "26000", "prepared statement does not exist");
+                        status = status == 'I' ? 'I' : 'E';
+                        skipping = true;
+                        break;
+                    }
+                    offset = body.find('\0', offset) + 1;
+                    const uint16_t formats = get_int16(body.data() + offset);
+                    offset += 2 + 2 * static_cast<size_t>(formats);
+                    const uint16_t parameters = get_int16(body.data() + offset);
+                    offset += 2;
+                    for (uint16_t index = 0; index < parameters; ++index) {
+                        const uint32_t size = get_int32(body.data() + offset);
+                        offset += 4 + (size == 0xFFFFFFFF ? 0 : size);
+                    }
+                    const uint16_t result_formats = get_int16(body.data() + offset);
+                    binary_results = result_formats > 0 && get_int16(body.data() + offset + 2) == 1;
+                    put_message(output, '2', "");
+                    break;
+                }
+                case 'D':
+                    if (body.size() > 2 && body[0] == 'S' && statements.count(body.c_str() + 1) == 0) {
+                        put_error(output, "26000", "prepared statement does not exist");
+                        status = status == 'I' ? 'I' : 'E';
+                        skipping = true;
+                    } else if (!body.empty() && body[0] == 'S') {
+                        std::string parameters;
+                        put_int16(parameters, 0);
+                        put_message(output, 't', parameters);
+                        output.append(row_description(false));
+                    } else {
+                        output.append(row_description(binary_results));
+                    }
+                    break;
+                case 'E':
+                    append_result(output, *current, binary_results);
+                    break;
+                case 'S':
+                    skipping = false;
+                    put_message(output, 'Z', std::string(1, status));
+                    break;
+                case 'C':
+                    if (!body.empty() && body[0] == 'S') {
+                        statements.erase(body.c_str() + 1);
+                    }
+                    put_message(output, '3', "");
+                    break;
+                case 'H':
+                    break;
+                case 'X':
+                    break;
+                default:
+                    break;
+                }
+
+                if (type == 'X') {
+                    break;
+                }
+
+                // Like the real server, hold responses until Sync, Flush or
+                // the end of a simple query, so a pipeline is answered in
+                // as few writes as possible.
+                const bool flush = type == 'S' || type == 'H' || type == 'Q' || type == 'c' || type == 'f'
+                                   || output.size() >= 65536;
+                while (flush && stalled_.load() && running_.load()) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                if (flush && !output.empty()) {
+                    if (!write_all(socket, output)) {
+                        break;
+                    }
+                    output.clear();
+                }
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = sockets_.begin(); it != sockets_.end(); ++it) {
+            if (*it == socket) {
+                sockets_.erase(it);
+                break;
+            }
+        }
+        ::close(socket);
+    }
+
+    int listener_ = -1;
+    uint16_t port_ = 0;
+    std::atomic<bool> running_{ false };
+    std::atomic<bool> stalled_{ false };
+    std::thread acceptor_;
+    mutable std::mutex mutex_;
+    std::vector<int> sockets_;
+    std::vector<std::thread> sessions_;
+    std::shared_ptr<result_shape> shape_;
+    std::shared_ptr<const rejection> rejected_;
+    std::string last_query_;
+    std::atomic<uint64_t> connections_{ 0 };
+    std::atomic<uint64_t> bytes_received_{ 0 };
+    std::atomic<uint64_t> bytes_sent_{ 0 };
+    std::atomic<uint64_t> messages_[256] = {};
+};
+
+#endif // _WIN32
@@ -0,0 +1,590 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+// Long-running soak test.
+//
+// Runs a mixed insert/select/update/delete workload for hours through a
+// connection pool and through a thread-owned prepared statement, with a
+// small share of statements that fail on the server and periodic
+// reconnects, so error and connection paths are exercised as often as the
+// happy path. Every sample interval it records resident memory, open file
+// descriptors, client and server connection counts and the latency
+// percentiles of that interval. At the end it fits a trend to the samples
+// taken after warm-up and flags steady memory or descriptor growth and
+// latency drift, which short benchmarks cannot see.
+//
+// Example:
+//   database_soak --duration 14400 --threads 16 --pool-size 8
+//                 --sample-interval 60 --output soak.csv
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "../connection_pool.h"
+#include "../latency_histogram.h"
+#include "../postgres_manager.h"
+#include "../result_buffer.h"
+
+using namespace database;
+
+namespace {
+
+struct soak_options {
+    std::string connection = "host=localhost port=5432 dbname=postgres user=postgres";
+    double duration_seconds = 3600.0;
+    double sample_interval_seconds = 60.0;
+    double warmup_seconds = 300.0;
+    size_t threads = 8;
+    size_t pool_size = 8;
+    uint64_t rows = 100000;
+    double error_rate = 0.01;
+    uint64_t reconnect_every = 10000;
+    double drift_threshold = 1.5;
+    double growth_threshold_mb_per_hour = 16.0;
+    std::string output;
+};
+
+struct sample {
+    double elapsed_seconds = 0.0;
+    uint64_t rss_bytes = 0;
+    int64_t open_descriptors = -1;
+    size_t pool_size = 0;
+    size_t pool_idle = 0;
+    int64_t server_connections = -1;
+    uint64_t operations = 0;
+    uint64_t failures = 0;
+    double p50_ms = 0.0;
+    double p99_ms = 0.0;
+    double p999_ms = 0.0;
+    double max_ms = 0.0;
+};
+
+struct shared_state {
+    std::atomic<bool> stop{ false };
+    std::atomic<uint64_t> operations{ 0 };
+    std::atomic<uint64_t> failures{ 0 };
+    std::atomic<uint64_t> injected_errors{ 0 };
+    std::atomic<uint64_t> reconnects{ 0 };
+    latency_histogram interval;
+};
+
+volatile std::sig_atomic_t interrupted = 0;
+
+void on_interrupt(int) {
+    interrupted = 1;
+}
+
+uint64_t resident_bytes() {
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size = 0;
+    uint64_t resident = 0;
+    if (statm >> size >> resident) {
+        return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    }
+#endif
+    return 0;
+}
+
+int64_t open_descriptors() {
+#ifdef __linux__
+    std::error_code error;
+    int64_t count = 0;
+    for (std::filesystem::directory_iterator entry("/proc/self/fd", error), end;
+         !error && entry != end; entry.increment(error)) {
+        ++count;
+    }
+    // The iterator holds one descriptor of its own while counting.
+    return error ? -1 : count - 1;
+#else
+    return -1;
+#endif
+}
+
+std::string random_payload(std::mt19937_64& random) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    std::uniform_int_distribution<size_t> pick(0, sizeof(alphabet) - 2);
+    std::uniform_int_distribution<size_t> length(16, 256);
+
+    std::string payload(length(random), ' ');
+    for (auto& c : payload) {
+        c = alphabet[pick(random)];
+    }
+    return payload;
+}
+
+bool prepare_table(const soak_options& options) {
+    postgres_manager connection;
+    if (!connection.connect(options.connection)) {
+        std::cerr << "setup: could not connect\n";
+        return false;
+    }
+
+    connection.create_query("DROP TABLE IF EXISTS soak_items");
+    if (!connection.create_query("CREATE TABLE soak_items (id BIGINT PRIMARY KEY, "
+                                 "payload TEXT NOT NULL, revision INT NOT NULL DEFAULT 0)")) {
+        std::cerr << "setup: could not create soak_items\n";
+        return false;
+    }
+    if (connection.insert_query("INSERT INTO soak_items SELECT g, md5(g::text), 0 "
+                                "FROM generate_series(0, "
+                                + std::to_string(options.rows - 1) + ") g")
+        != options.rows) {
+        std::cerr << "setup: could not populate soak_items\n";
+        return false;
+    }
+    connection.create_query("ANALYZE soak_items");
+    return true;
+}
+
+bool open_prepared(postgres_manager& connection, const soak_options& options) {
+    return connection.connect(options.connection)
+           && connection.prepare("soak_by_id",
+                                 "SELECT id, payload, revision FROM soak_items WHERE id = $1");
+}
+
+// One operation through a pooled connection. Failed statements leave the
+// connection open, so injected errors exercise the server error path
+// without churning connections.
+bool run_pooled(connection_pool& pool, std::mt19937_64& random, const soak_options& options,
+                shared_state& state) {
+    auto connection = pool.acquire();
+    if (!connection.valid()) {
+        return false;
+    }
+
+    const std::string id
+        = std::to_string(std::uniform_int_distribution<uint64_t>(0, options.rows - 1)(random));
+
+    if (std::uniform_real_distribution<double>(0.0, 1.0)(random) < options.error_rate) {
+        state.injected_errors.fetch_add(1, std::memory_order_relaxed);
+        connection->update_query("UPDATE soak_items SET revision = 'not a number' WHERE id = "
+                                 + id);
+        return true;
+    }
+
+    const int choice = std::uniform_int_distribution<int>(0, 99)(random);
+    if (choice < 35) {
+        return connection->select_query("SELECT id, payload, revision FROM soak_items WHERE id >= "
+                                        + id + " ORDER BY id LIMIT 20")
+               != nullptr;
+    }
+    if (choice < 70) {
+        // The row may have been deleted, so zero rows is not a failure.
+        connection->update_query("UPDATE soak_items SET payload = '" + random_payload(random)
+                                 + "', revision = revision + 1 WHERE id = " + id);
+        return connection->is_connected();
+    }
+    if (choice < 90) {
+        return connection->insert_query("INSERT INTO soak_items (id, payload) VALUES (" + id
+                                        + ", '" + random_payload(random)
+                                        + "') ON CONFLICT (id) DO UPDATE SET payload = "
+                                          "EXCLUDED.payload, revision = soak_items.revision + 1")
+               == 1;
+    }
+    connection->delete_query("DELETE FROM soak_items WHERE id = " + id);
+    return connection->is_connected();
+}
+
+void worker(const soak_options& options, shared_state& state, connection_pool& pool,
+            const size_t& thread_index) {
+    std::mt19937_64 random(std::random_device{}() ^ (thread_index * 0x9E3779B97F4A7C15ULL));
+
+    // A thread-owned connection for the prepared path, closed and reopened
+    // every reconnect_every operations.
+    postgres_manager prepared;
+    bool prepared_ready = open_prepared(prepared, options);
+    result_buffer rows;
+    char key[24];
+    const char* parameters[] = { key };
+    uint64_t since_reconnect = 0;
+
+    while (!state.stop.load(std::memory_order_relaxed)) {
+        const auto issued = std::chrono::steady_clock::now();
+
+        bool succeeded = false;
+        if (prepared_ready && std::uniform_int_distribution<int>(0, 3)(random) == 0) {
+            std::snprintf(key, sizeof(key), "%llu",
+                          static_cast<unsigned long long>(std::uniform_int_distribution<uint64_t>(
+                              0, options.rows - 1)(random)));
+            succeeded = prepared.execute_prepared("soak_by_id", parameters, rows);
+        } else {
+            succeeded = run_pooled(pool, random, options, state);
+        }
+
+        const auto finished = std::chrono::steady_clock::now();
+        state.interval.record(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(finished - issued).count()));
+        state.operations.fetch_add(1, std::memory_order_relaxed);
+        if (!succeeded) {
+            state.failures.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if (!prepared_ready || !prepared.is_connected()
+            || (options.reconnect_every != 0 && ++since_reconnect >= options.reconnect_every)) {
+            prepared.disconnect();
+            prepared_ready = open_prepared(prepared, options);
+            since_reconnect = 0;
+            state.reconnects.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    prepared.disconnect();
+}
+
+int64_t server_connections(postgres_manager& monitor, const soak_options& options,
+                           result_buffer& rows) {
+    static const char* const no_parameters[] = { nullptr };
+    if (!monitor.is_connected()) {
+        monitor.disconnect();
+        if (!monitor.connect(options.connection)
+            || !monitor.prepare("soak_backends", "SELECT count(*) FROM pg_stat_activity "
+                                                 "WHERE datname = current_database()")) {
+            return -1;
+        }
+    }
+    if (!monitor.execute_prepared("soak_backends", std::span<const char* const>(no_parameters, 0),
+                                  rows)
+        || rows.rows() != 1) {
+        return -1;
+    }
+    return rows.integer(0, 0);
+}
+
+struct trend {
+    double slope = 0.0; // units per second
+    double r_squared = 0.0;
+};
+
+// Least-squares line through (x, y). A high r-squared separates steady
+// growth from noise such as allocator high-water marks.
+trend fit(const std::vector<double>& x, const std::vector<double>& y) {
+    trend result;
+    const auto n = static_cast<double>(x.size());
+    if (x.size() < 3) {
+        return result;
+    }
+
+    double mean_x = 0.0;
+    double mean_y = 0.0;
+    for (size_t index = 0; index < x.size(); ++index) {
+        mean_x += x[index];
+        mean_y += y[index];
+    }
+    mean_x /= n;
+    mean_y /= n;
+
+    double sxy = 0.0;
+    double sxx = 0.0;
+    double syy = 0.0;
+    for (size_t index = 0; index < x.size(); ++index) {
+        sxy += (x[index] - mean_x) * (y[index] - mean_y);
+        sxx += (x[index] - mean_x) * (x[index] - mean_x);
+        syy += (y[index] - mean_y) * (y[index] - mean_y);
+    }
+    if (sxx == 0.0) {
+        return result;
+    }
+
+    result.slope = sxy / sxx;
+    result.r_squared = syy == 0.0 ? 0.0 : (sxy * sxy) / (sxx * syy);
+    return result;
+}
+
+double median(std::vector<double> values) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+void write_sample(std::ofstream& output, const sample& value) {
+    if (!output.is_open()) {
+        return;
+    }
+    output << value.elapsed_seconds << ',' << value.rss_bytes << ',' << value.open_descriptors
+           << ',' << value.pool_size << ',' << value.pool_idle << ',' << value.server_connections
+           << ',' << value.operations << ',' << value.failures << ',' << value.p50_ms << ','
+           << value.p99_ms << ',' << value.p999_ms << ',' << value.max_ms << '\n';
+    output.flush();
+}
+
+// Returns the number of flagged problems.
+int analyze(const soak_options& options, const std::vector<sample>& samples) {
+    std::vector<double> elapsed;
+    std::vector<double> rss;
+    std::vector<double> descriptors;
+    std::vector<double> p99;
+    for (const auto& value : samples) {
+        if (value.elapsed_seconds < options.warmup_seconds) {
+            continue;
+        }
+        elapsed.push_back(value.elapsed_seconds);
+        rss.push_back(static_cast<double>(value.rss_bytes));
+        descriptors.push_back(static_cast<double>(value.open_descriptors));
+        p99.push_back(value.p99_ms);
+    }
+
+    std::printf("\nAnalysis over %zu samples after %.0f s warm-up:\n", elapsed.size(),
+                options.warmup_seconds);
+    if (elapsed.size() < 6) {
+        std::printf("  not enough samples to judge trends; run longer or sample more often\n");
+        return 0;
+    }
+
+    int flagged = 0;
+
+    const trend memory = fit(elapsed, rss);
+    const double memory_mb_per_hour = memory.slope * 3600.0 / (1024.0 * 1024.0);
+    const bool memory_growth = memory.r_squared >= 0.5
+                               && memory_mb_per_hour > options.growth_threshold_mb_per_hour;
+    std::printf("  memory:      %+.2f MB/h (r^2 %.2f)%s\n", memory_mb_per_hour, memory.r_squared,
+                memory_growth ? "  <-- steady growth" : "");
+    flagged += memory_growth ? 1 : 0;
+
+    if (descriptors.front() >= 0.0) {
+        const trend files = fit(elapsed, descriptors);
+        const double rise = files.slope * (elapsed.back() - elapsed.front());
+        const bool descriptor_growth = files.r_squared >= 0.5 && rise > 8.0;
+        std::printf("  descriptors: %+.1f over the run (r^2 %.2f)%s\n", rise, files.r_squared,
+                    descriptor_growth ? "  <-- steady growth" : "");
+        flagged += descriptor_growth ? 1 : 0;
+    }
+
+    // Compare typical interval p99 at the start and the end; medians keep
+    // a single slow interval (checkpoint, autovacuum) from deciding it.
+    const size_t third = p99.size() / 3;
+    const double early = median(std::vector<double>(p99.begin(), p99.begin() + third));
+    const double late = median(std::vector<double>(p99.end() - third, p99.end()));
+    const bool drift = early > 0.0 && late > early * options.drift_threshold;
+    std::printf("  p99 latency: %.3f ms early, %.3f ms late (x%.2f)%s\n", early, late,
+                early > 0.0 ? late / early : 0.0, drift ? "  <-- drift" : "");
+    flagged += drift ? 1 : 0;
+
+    return flagged;
+}
+
+void print_usage() {
+    std::cout
+        << "Usage: database_soak [options]\n"
+           "  --connection <conninfo>     libpq connection string\n"
+           "  --duration <seconds>        run time (default 3600)\n"
+           "  --sample-interval <seconds> time between samples (default 60)\n"
+           "  --warmup <seconds>          samples ignored by the trend analysis (default 300)\n"
+           "  --threads <n>               worker threads (default 8)\n"
+           "  --pool-size <n>             pooled connections (default 8)\n"
+           "  --rows <n>                  rows in soak_items (default 100000)\n"
+           "  --error-rate <fraction>     share of statements that fail (default 0.01)\n"
+           "  --reconnect-every <n>       reopen the prepared connection every n operations\n"
+           "  --drift-threshold <ratio>   flag late p99 above early p99 times this (default 1.5)\n"
+           "  --growth-threshold <MB/h>   flag steady RSS growth above this (default 16)\n"
+           "  --output <file>             also write every sample as CSV\n";
+}
+
+bool parse_arguments(int argc, char** argv, soak_options& options) {
+    for (int index = 1; index < argc; ++index) {
+        const std::string argument = argv[index];
+        auto value = [&]() -> std::string {
+            return (index + 1 < argc) ? std::string(argv[++index]) : std::string();
+        };
+
+        if (argument == "--connection") {
+            options.connection = value();
+        } else if (argument == "--duration") {
+            options.duration_seconds = std::atof(value().c_str());
+        } else if (argument == "--sample-interval") {
+            options.sample_interval_seconds = std::max(0.1, std::atof(value().c_str()));
+        } else if (argument == "--warmup") {
+            options.warmup_seconds = std::atof(value().c_str());
+        } else if (argument == "--threads") {
+            options.threads = std::max<size_t>(1, std::strtoull(value().c_str(), nullptr, 10));
+        } else if (argument == "--pool-size") {
+            options.pool_size = std::max<size_t>(1, std::strtoull(value().c_str(), nullptr, 10));
+        } else if (argument == "--rows") {
+            options.rows = std::max<uint64_t>(1, std::strtoull(value().c_str(), nullptr, 10));
+        } else if (argument == "--error-rate") {
+            options.error_rate = std::atof(value().c_str());
+        } else if (argument == "--reconnect-every") {
+            options.reconnect_every = std::strtoull(value().c_str(), nullptr, 10);
+        } else if (argument == "--drift-threshold") {
+            options.drift_threshold = std::atof(value().c_str());
+        } else if (argument == "--growth-threshold") {
+            options.growth_threshold_mb_per_hour = std::atof(value().c_str());
+        } else if (argument == "--output") {
+            options.output = value();
+        } else {
+            print_usage();
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    soak_options options;
+    if (!parse_arguments(argc, argv, options)) {
+        return 1;
+    }
+    if (!prepare_table(options)) {
+        return 1;
+    }
+
+    std::ofstream output;
+    if (!options.output.empty()) {
+        output.open(options.output);
+        if (!output.is_open()) {
+            std::cerr << "could not open " << options.output << "\n";
+            return 1;
+        }
+        output << "elapsed_s,rss_bytes,open_fds,pool_size,pool_idle,server_connections,"
+                  "operations,failures,p50_ms,p99_ms,p999_ms,max_ms\n";
+    }
+
+    std::signal(SIGINT, on_interrupt);
+    std::signal(SIGTERM, on_interrupt);
+
+    std::printf("Soaking for %.0f s: %zu threads, pool of %zu, sample every %.0f s\n",
+                options.duration_seconds, options.threads, options.pool_size,
+                options.sample_interval_seconds);
+    std::printf("%9s %10s %5s %9s %7s %10s %8s %9s %9s %9s\n", "elapsed", "rss_mb", "fds",
+                "pool", "server", "ops", "failed", "p50_ms", "p99_ms", "max_ms");
+
+    connection_pool pool(options.connection, options.pool_size, "soak");
+    shared_state state;
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t index = 0; index < options.threads; ++index) {
+        workers.emplace_back(worker, std::cref(options), std::ref(state), std::ref(pool), index);
+    }
+
+    postgres_manager monitor;
+    result_buffer monitor_rows;
+    std::vector<sample> samples;
+    uint64_t previous_operations = 0;
+    uint64_t previous_failures = 0;
+    const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(options.sample_interval_seconds));
+    const auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                      std::chrono::duration<double>(options.duration_seconds));
+
+    auto next_sample = start + interval;
+    while (interrupted == 0 && next_sample <= deadline) {
+        // Sleep in short steps so an interrupt is noticed promptly.
+        while (interrupted == 0 && std::chrono::steady_clock::now() < next_sample) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        if (interrupted != 0) {
+            break;
+        }
+        next_sample += interval;
+
+        // Samples recorded between the merge and the reset are lost; at
+        // thousands of operations per interval that does not move the
+        // percentiles.
+        latency_histogram window;
+        window.merge(state.interval);
+        state.interval.reset();
+
+        sample value;
+        value.elapsed_seconds
+            = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        value.rss_bytes = resident_bytes();
+        value.open_descriptors = open_descriptors();
+        value.pool_size = pool.size();
+        value.pool_idle = pool.idle();
+        value.server_connections = server_connections(monitor, options, monitor_rows);
+
+        const uint64_t operations = state.operations.load();
+        const uint64_t failures = state.failures.load();
+        value.operations = operations - previous_operations;
+        value.failures = failures - previous_failures;
+        previous_operations = operations;
+        previous_failures = failures;
+
+        value.p50_ms = window.value_at_quantile(0.50) / 1e6;
+        value.p99_ms = window.value_at_quantile(0.99) / 1e6;
+        value.p999_ms = window.value_at_quantile(0.999) / 1e6;
+        value.max_ms = window.max() / 1e6;
+
+        std::printf("%8.0fs %10.1f %5lld %4zu/%-4zu %7lld %10llu %8llu %9.3f %9.3f %9.3f\n",
+                    value.elapsed_seconds, value.rss_bytes / (1024.0 * 1024.0),
+                    static_cast<long long>(value.open_descriptors), value.pool_size - value.pool_idle,
+                    value.pool_size, static_cast<long long>(value.server_connections),
+                    static_cast<unsigned long long>(value.operations),
+                    static_cast<unsigned long long>(value.failures), value.p50_ms, value.p99_ms,
+                    value.max_ms);
+        std::fflush(stdout);
+
+        write_sample(output, value);
+        samples.push_back(value);
+    }
+
+    state.stop.store(true);
+    for (auto& thread : workers) {
+        thread.join();
+    }
+    monitor.disconnect();
+
+    std::printf("\n%llu operations, %llu failed, %llu injected errors, %llu reconnects\n",
+                static_cast<unsigned long long>(state.operations.load()),
+                static_cast<unsigned long long>(state.failures.load()),
+                static_cast<unsigned long long>(state.injected_errors.load()),
+                static_cast<unsigned long long>(state.reconnects.load()));
+
+    const int flagged = analyze(options, samples);
+    if (flagged != 0) {
+        std::printf("\n%d problem(s) flagged\n", flagged);
+        return 2;
+    }
+    std::printf("\nNo growth or drift detected\n");
+    return 0;
+}
@@ -31,15 +31,51 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *****************************************************************************/
 
 #include <gtest/gtest.h>
+#include <algorithm>
 #include <memory>
 #include <thread>
 #include <chrono>
 #include <vector>
 #include <string>
+#include <cstdio>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <sys/wait.h>
+#endif
 
 #include "../database_manager.h"
 #include "../postgres_manager.h"
+#include "../prometheus_exposition.h"
+#include "../query_capture.h"
+#include "../incremental_query.h"
+#include "../result_buffer.h"
+#include "../shared_result_cache.h"
+#ifdef USE_SQLITE
+#include "../sqlite_replica.h"
+#endif
 #include "../database_types.h"
+#include "../columnar_result.h"
+#include "../connection_pool.h"
+#include "../csv_import.h"
+#include "../database_metrics.h"
+#include "../id_allocator.h"
+#include "../job_queue.h"
+#include "../latency_histogram.h"
+#include "../partition_router.h"
+#include "../query_timing.h"
+#include "../query_tracer.h"
+#include "../session_state.h"
+#include "../sql_fingerprint.h"
+#include "../table_mirror.h"
+#include "../timeseries_writer.h"
+#include "allocation_counter.h"
+#include "pg_loopback_server.h"
 #include <container.h>
 
 using namespace database;
@@ -96,6 +132,2191 @@ TEST(DatabaseTypesTest, EnumValues) {
     EXPECT_EQ(static_cast<int>(database_types::postgres), 1);
 }
 
+// Statement Fingerprint Tests
+TEST(StatementFingerprintTest, LiteralsAndLayoutAreIgnored) {
+    EXPECT_EQ(normalize_statement("SELECT * FROM t WHERE id = 42"),
+              "select * from t where id = ?");
+    EXPECT_EQ(normalize_statement("select  *\n FROM T where ID=7 -- trailing"),
+              "select * from t where id = ?");
+    EXPECT_EQ(statement_fingerprint("SELECT name FROM users WHERE name = 'O''Brien'"),
+              statement_fingerprint("select name from users where name = 'Smith'"));
+    EXPECT_NE(statement_fingerprint("SELECT name FROM users"),
+              statement_fingerprint("SELECT email FROM users"));
+}
+
+TEST(StatementFingerprintTest, QuotedFormsAndParameters) {
+    EXPECT_EQ(normalize_statement("INSERT INTO t (a, b) VALUES (E'x\\'y', $1)"),
+              "insert into t (a, b) values (?, $1)");
+    EXPECT_EQ(normalize_statement("SELECT $$body$$, \"Mixed\".col /* c */ FROM x"),
+              "select ?, \"Mixed\".col from x");
+    EXPECT_EQ(fingerprint_to_string(0x1234), "0000000000001234");
+}
+
+TEST(StatementFingerprintTest, ParameterizeKeepsLiteralTypes) {
+    std::string statement;
+    std::vector<std::string> parameters;
+    ASSERT_TRUE(parameterize_statement(
+        "SELECT * FROM t WHERE id = 42 AND big = 3000000000 AND name = 'O''Brien' AND x > 1.5", statement,
+        parameters));
+    EXPECT_EQ(statement, "select * from t where id = $1::int4 and big = $2::int8 and name = $3 and x > $4::numeric");
+    EXPECT_EQ(parameters, (std::vector<std::string>{ "42", "3000000000", "O'Brien", "1.5" }));
+
+    // Typed literals and ORDER BY positions stay inline.
+    ASSERT_TRUE(parameterize_statement("select a from t where d > DATE '2024-01-01' order by 1 limit 10",
+                                       statement, parameters));
+    EXPECT_EQ(statement, "select a from t where d > date '2024-01-01' order by 1 limit $1::int4");
+
+    // Every position in the list stays inline until the clause ends.
+    ASSERT_TRUE(parameterize_statement("SELECT a, b FROM t WHERE c = 7 ORDER BY 1, 2", statement, parameters));
+    EXPECT_EQ(statement, "select a, b from t where c = $1::int4 order by 1, 2");
+    ASSERT_TRUE(parameterize_statement("SELECT a, b FROM t ORDER BY a DESC, 2 LIMIT 3", statement, parameters));
+    EXPECT_EQ(statement, "select a, b from t order by a desc, 2 limit $1::int4");
+    ASSERT_TRUE(parameterize_statement(
+        "SELECT a, b, count(*) FROM t GROUP BY 1, 2 HAVING count(*) > 4 ORDER BY 3", statement, parameters));
+    EXPECT_EQ(statement, "select a, b, count (*) from t group by 1, 2 having count (*) > $1::int4 order by 3");
+    EXPECT_EQ(parameters, (std::vector<std::string>{ "4" }));
+    ASSERT_TRUE(parameterize_statement("SELECT DISTINCT ON (1, 2) a, b FROM t WHERE c IN (5, 6) ORDER BY 1, 2",
+                                       statement, parameters));
+    EXPECT_EQ(statement,
+              "select distinct on (1, 2) a, b from t where c in ($1::int4, $2::int4) order by 1, 2");
+
+    EXPECT_FALSE(parameterize_statement("SELECT 1; SELECT 2", statement, parameters));
+    EXPECT_FALSE(parameterize_statement("SELECT * FROM t WHERE id = $1", statement, parameters));
+    EXPECT_FALSE(parameterize_statement("CREATE TABLE t (x INT DEFAULT 5)", statement, parameters));
+    EXPECT_FALSE(parameterize_statement("SELECT now()", statement, parameters));
+}
+
+// Query Tracer Tests
+class QueryTracerTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        query_tracer::handle().set_sample_ratio(1.0);
+        query_tracer::handle().set_exporter(std::make_shared<callback_exporter>(
+            [this](const trace_span& span) { spans_.push_back(span); }));
+    }
+
+    void TearDown() override {
+        query_tracer::handle().set_exporter(nullptr);
+        query_tracer::handle().set_sample_ratio(1.0);
+    }
+
+    std::vector<trace_span> spans_;
+};
+
+TEST_F(QueryTracerTest, ChildSpansShareTrace) {
+    {
+        scoped_span query(span_kind::query);
+        query.set_statement("SELECT * FROM t WHERE id = 1");
+        {
+            scoped_span execute(span_kind::execute);
+            execute.set_attribute("db.bytes_sent", int64_t{ 28 });
+        }
+    }
+
+    ASSERT_EQ(spans_.size(), 2);
+    const auto& execute = spans_[0];
+    const auto& query = spans_[1];
+    EXPECT_EQ(execute.kind, span_kind::execute);
+    EXPECT_EQ(query.kind, span_kind::query);
+    EXPECT_EQ(execute.trace_id, query.trace_id);
+    EXPECT_EQ(execute.parent_span_id, query.span_id);
+    EXPECT_LE(query.start_time_unix_nano, execute.start_time_unix_nano);
+
+    bool has_fingerprint = false;
+    for (const auto& attribute : query.attributes) {
+        has_fingerprint = has_fingerprint || attribute.key == "db.statement.fingerprint";
+    }
+    EXPECT_TRUE(has_fingerprint);
+}
+
+TEST_F(QueryTracerTest, UnsampledSpansAreNotExported) {
+    query_tracer::handle().set_sample_ratio(0.0);
+    {
+        scoped_span query(span_kind::query);
+        EXPECT_FALSE(query.recording());
+        scoped_span fetch(span_kind::fetch);
+        EXPECT_FALSE(fetch.recording());
+    }
+
+    EXPECT_TRUE(spans_.empty());
+    EXPECT_EQ(query_tracer::current_frame(), nullptr);
+}
+
+TEST_F(QueryTracerTest, RemoteParentFromTraceparent) {
+    scoped_trace_context context(
+        "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01");
+    ASSERT_TRUE(context.valid());
+    {
+        scoped_span query(span_kind::query);
+        query.set_error("42P01", "relation does not exist");
+    }
+
+    ASSERT_EQ(spans_.size(), 1);
+    EXPECT_EQ(trace_id_to_string(spans_[0].trace_id.data(), 16),
+              "4bf92f3577b34da6a3ce929d0e0e4736");
+    EXPECT_EQ(trace_id_to_string(spans_[0].parent_span_id.data(), 8),
+              "00f067aa0ba902b7");
+    EXPECT_TRUE(spans_[0].error);
+
+    EXPECT_FALSE(scoped_trace_context("not-a-traceparent").valid());
+}
+
+// Latency Histogram Tests
+TEST(LatencyHistogramTest, QuantilesWithinBucketPrecision) {
+    latency_histogram histogram;
+    for (uint64_t value = 1; value <= 1000; ++value) {
+        histogram.record(value * 1000);
+    }
+
+    EXPECT_EQ(histogram.count(), 1000);
+    EXPECT_EQ(histogram.max(), 1000000);
+    EXPECT_NEAR(static_cast<double>(histogram.value_at_quantile(0.5)), 500000.0, 500000.0 * 0.125);
+    EXPECT_NEAR(static_cast<double>(histogram.value_at_quantile(0.99)), 990000.0, 990000.0 * 0.125);
+    EXPECT_EQ(histogram.value_at_quantile(1.0), 1000000);
+    EXPECT_GE(histogram.count_at_or_below(500000), 490);
+
+    histogram.reset();
+    EXPECT_EQ(histogram.count(), 0);
+    EXPECT_EQ(histogram.value_at_quantile(0.5), 0);
+}
+
+TEST(LatencyHistogramTest, BucketBoundsCoverEveryValue) {
+    for (uint64_t value = 0; value < 1000000; value += 37) {
+        const size_t index = latency_histogram::bucket_index(value);
+        EXPECT_LE(value, latency_histogram::bucket_upper_bound(index));
+        if (index > 0) {
+            EXPECT_GT(value, latency_histogram::bucket_upper_bound(index - 1));
+        }
+    }
+}
+
+TEST(LatencyHistogramTest, CorrectedRecordingBackfillsMissedSamples) {
+    latency_histogram histogram;
+    histogram.record_corrected(10000, 1000);
+
+    // 10us observed with a 1us pacing interval stands for ten requests:
+    // 10us, 9us, ... 1us.
+    EXPECT_EQ(histogram.count(), 10);
+    EXPECT_EQ(histogram.max(), 10000);
+    EXPECT_EQ(histogram.sum(), 55000);
+
+    histogram.reset();
+    histogram.record_corrected(500, 1000);
+    EXPECT_EQ(histogram.count(), 1);
+}
+
+// Query Timing Tests
+TEST(QueryTimingTest, LapsArePhasesAndPoolWaitIsCarried) {
+    auto& timing = query_timing::handle();
+    timing.reset();
+    timing.set_sample_interval(1);
+
+    scoped_query_timing::add_pending_pool_wait(std::chrono::microseconds(250));
+    {
+        scoped_query_timing query("SELECT 1");
+        ASSERT_EQ(scoped_query_timing::current(), &query);
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        query.lap(query_phase::server_first_byte);
+        query.lap(query_phase::decode);
+        query.set_rows(1);
+    }
+    EXPECT_EQ(scoped_query_timing::current(), nullptr);
+
+    auto records = timing.sampled_records();
+    ASSERT_EQ(records.size(), 1);
+    const auto& record = records[0];
+    EXPECT_EQ(record.fingerprint, statement_fingerprint("select 1"));
+    EXPECT_EQ(record.phase_ns[static_cast<size_t>(query_phase::pool_wait)], 250000);
+    EXPECT_GE(record.phase_ns[static_cast<size_t>(query_phase::server_first_byte)], 2000000);
+    EXPECT_GE(record.total_ns, 2250000);
+    EXPECT_EQ(record.rows, 1);
+    EXPECT_EQ(timing.phase_histogram(query_phase::server_first_byte).count(), 1);
+    EXPECT_EQ(timing.total_histogram().count(), 1);
+
+    timing.set_sample_interval(100);
+    timing.reset();
+}
+
+// Connection Pool Tests
+TEST(ConnectionPoolTest, FailedConnectReturnsInvalidLease) {
+    connection_pool pool("host=nonexistent_host port=5432 dbname=test connect_timeout=1", 2);
+
+    auto lease = pool.acquire(std::chrono::milliseconds(100));
+    EXPECT_FALSE(lease.valid());
+    EXPECT_EQ(pool.size(), 0);
+    EXPECT_EQ(pool.idle(), 0);
+    EXPECT_EQ(pool.waiting(), 0);
+}
+
+TEST_F(DatabaseTest, ConnectionPoolReusesConnections) {
+    if (!IsPostgreSQLAvailable()) {
+        GTEST_SKIP() << "PostgreSQL not available";
+    }
+
+    connection_pool pool("host=localhost port=5432 dbname=postgres user=postgres", 1);
+    {
+        auto first = pool.acquire();
+        ASSERT_TRUE(first.valid());
+        EXPECT_TRUE(first->create_query("SELECT 1"));
+
+        // The only connection is leased, so a second acquire times out.
+        auto second = pool.acquire(std::chrono::milliseconds(50));
+        EXPECT_FALSE(second.valid());
+    }
+
+    EXPECT_EQ(pool.size(), 1);
+    EXPECT_EQ(pool.idle(), 1);
+    EXPECT_TRUE(pool.acquire().valid());
+}
+
+// Prometheus Exposition Tests
+TEST(PrometheusExpositionTest, RendersCountersPoolsAndHistograms) {
+    auto& metrics = database_metrics::handle();
+    metrics.reset();
+    metrics.record_error("23505");
+    metrics.record_error("23503");
+    metrics.record_error("");
+    metrics.add_bytes_sent(128);
+    metrics.record_prepared_lookup(true);
+    metrics.record_prepared_lookup(true);
+    metrics.record_prepared_lookup(false);
+
+    connection_pool pool("host=nonexistent_host connect_timeout=1", 4, "orders");
+    const std::string text = render_prometheus_metrics();
+
+    EXPECT_NE(text.find("# TYPE database_pool_size gauge"), std::string::npos);
+    EXPECT_NE(text.find("database_pool_max_size{pool=\"orders\"} 4"), std::string::npos);
+    EXPECT_NE(text.find("database_query_errors_total{sqlstate_class=\"23\"} 2"), std::string::npos);
+    EXPECT_NE(text.find("database_query_errors_total{sqlstate_class=\"08\"} 1"), std::string::npos);
+    EXPECT_NE(text.find("database_bytes_sent_total 128"), std::string::npos);
+    EXPECT_NE(text.find("database_prepared_cache_hit_ratio 0.666666667"), std::string::npos);
+    EXPECT_NE(text.find("database_query_duration_seconds_bucket{le=\"+Inf\"}"), std::string::npos);
+    EXPECT_NE(text.find("database_query_phase_duration_seconds_count{phase=\"pool_wait\"}"),
+              std::string::npos);
+
+    metrics.reset();
+}
+
+#ifndef _WIN32
+TEST(PrometheusExpositionTest, ListenerServesMetricsOnLoopback) {
+    metrics_http_listener listener;
+    ASSERT_TRUE(listener.start(0));
+    ASSERT_NE(listener.port(), 0);
+
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_GE(client, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(listener.port());
+
+    // A client that never sends its request is dropped after the timeout
+    // instead of blocking every later scrape.
+    int silent = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_GE(silent, 0);
+    ASSERT_EQ(connect(silent, reinterpret_cast<sockaddr*>(&address), sizeof(address)), 0);
+
+    ASSERT_EQ(connect(client, reinterpret_cast<sockaddr*>(&address), sizeof(address)), 0);
+
+    const std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    ASSERT_EQ(send(client, request.data(), request.size(), 0),
+              static_cast<ssize_t>(request.size()));
+
+    std::string response;
+    char buffer[4096];
+    ssize_t count = 0;
+    while ((count = recv(client, buffer, sizeof(buffer), 0)) > 0) {
+        response.append(buffer, static_cast<size_t>(count));
+    }
+    close(client);
+    char byte = 0;
+    EXPECT_EQ(recv(silent, &byte, 1, 0), 0);
+    close(silent);
+    listener.stop();
+
+    EXPECT_EQ(response.rfind("HTTP/1.1 200 OK", 0), 0);
+    EXPECT_NE(response.find("database_queries_total"), std::string::npos);
+}
+#endif
+
+// Query Capture Tests
+TEST(QueryCaptureTest, RecordsRoundTrip) {
+    const std::string path
+        = (std::filesystem::temp_directory_path() / "database_unit_capture.dbcap").string();
+
+    query_capture_writer writer;
+    ASSERT_TRUE(writer.open(path));
+    EXPECT_FALSE(writer.open(path));
+
+    const uint32_t first = writer.next_session();
+    const uint32_t second = writer.next_session();
+    EXPECT_NE(first, second);
+
+    capture_record record;
+    record.session = first;
+    record.start_offset_us = 1500;
+    record.duration_us = 420;
+    record.kind = capture_statement_kind::select_query;
+    record.statement = "SELECT * FROM users WHERE id = 1";
+    writer.record(record);
+
+    // Written out of start order, as concurrent sessions finish.
+    record.session = second;
+    record.start_offset_us = 900;
+    record.kind = capture_statement_kind::update_query;
+    record.succeeded = false;
+    record.rows = 3;
+    record.statement = "UPDATE users SET name = 'x'";
+    record.parameters = { std::string("a"), std::nullopt, std::string() };
+    writer.record(record);
+
+    record.session = first;
+    record.start_offset_us = 2000;
+    record.kind = capture_statement_kind::select_query;
+    record.succeeded = true;
+    record.rows = 0;
+    record.statement = "SELECT * FROM users WHERE id = 1";
+    record.parameters.clear();
+    writer.record(record);
+
+    EXPECT_EQ(writer.records_written(), 3);
+    writer.close();
+    EXPECT_FALSE(writer.is_open());
+
+    query_capture_reader reader;
+    ASSERT_TRUE(reader.open(path));
+    EXPECT_GT(reader.capture_start_unix_us(), 0);
+
+    std::vector<capture_record> records;
+    while (reader.next(record)) {
+        records.push_back(record);
+    }
+    EXPECT_FALSE(reader.failed());
+    std::remove(path.c_str());
+
+    ASSERT_EQ(records.size(), 3);
+    EXPECT_EQ(records[0].session, first);
+    EXPECT_EQ(records[0].start_offset_us, 1500);
+    EXPECT_EQ(records[0].duration_us, 420);
+    EXPECT_EQ(records[0].kind, capture_statement_kind::select_query);
+    EXPECT_TRUE(records[0].succeeded);
+
+    EXPECT_EQ(records[1].session, second);
+    EXPECT_EQ(records[1].start_offset_us, 900);
+    EXPECT_EQ(records[1].kind, capture_statement_kind::update_query);
+    EXPECT_FALSE(records[1].succeeded);
+    EXPECT_EQ(records[1].rows, 3);
+    ASSERT_EQ(records[1].parameters.size(), 3);
+    EXPECT_EQ(records[1].parameters[0], std::optional<std::string>("a"));
+    EXPECT_FALSE(records[1].parameters[1].has_value());
+    EXPECT_EQ(records[1].parameters[2], std::optional<std::string>(""));
+
+    EXPECT_EQ(records[2].start_offset_us, 2000);
+    EXPECT_EQ(records[2].statement, records[0].statement);
+}
+
+// Allocation Tests
+TEST(AllocationCounterTest, CountsAllocationsOnThisThread) {
+    allocation_counter::scope allocations;
+    auto value = std::make_unique<int64_t>(42);
+    const uint64_t counted = allocations.allocations();
+    const uint64_t bytes = allocations.bytes();
+
+    EXPECT_EQ(counted, 1);
+    EXPECT_EQ(bytes, sizeof(int64_t));
+
+    allocations.restart();
+    std::thread([]() { std::vector<int> other(1000); }).join();
+    // Only the thread object itself may allocate here, not the vector.
+    EXPECT_LT(allocations.bytes(), 1000 * sizeof(int));
+}
+
+TEST(ResultBufferTest, ReuseDoesNotAllocate) {
+    result_buffer buffer;
+    auto fill = [&buffer]() {
+        buffer.reset(4);
+        buffer.set_column_name(0, "id");
+        buffer.set_column_name(1, "name");
+        buffer.set_column_name(2, "score");
+        buffer.set_column_name(3, "active");
+        for (int64_t row = 0; row < 100; ++row) {
+            buffer.append_integer(row, "12345");
+            if (row % 10 == 0) {
+                buffer.append_null();
+            } else {
+                buffer.append_text("some name that is longer than sso");
+            }
+            buffer.append_real(0.5, "0.5");
+            buffer.append_boolean(true, "t");
+        }
+        buffer.set_affected_rows(0);
+    };
+
+    fill();
+    allocation_counter::scope allocations;
+    fill();
+    const uint64_t counted = allocations.allocations();
+
+    EXPECT_EQ(counted, 0);
+    ASSERT_EQ(buffer.rows(), 100);
+    ASSERT_EQ(buffer.columns(), 4);
+    EXPECT_EQ(buffer.column_name(1), "name");
+    EXPECT_EQ(buffer.integer(7, 0), 7);
+    EXPECT_EQ(buffer.text(7, 0), "12345");
+    EXPECT_TRUE(buffer.is_null(10, 1));
+    EXPECT_EQ(buffer.text(10, 1), "");
+    EXPECT_EQ(buffer.text(11, 1), "some name that is longer than sso");
+    EXPECT_DOUBLE_EQ(buffer.real(3, 2), 0.5);
+    EXPECT_TRUE(buffer.boolean(3, 3));
+    EXPECT_EQ(buffer.kind(3, 2), result_buffer::cell_kind::real);
+    EXPECT_EQ(buffer.integer(3, 2), 0);
+    EXPECT_TRUE(buffer.is_null(100, 0));
+}
+
+TEST_F(DatabaseTest, PreparedExecuteIsAllocationFreeInSteadyState) {
+    if (!IsPostgreSQLAvailable()) {
+        GTEST_SKIP() << "PostgreSQL not available";
+    }
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect("host=localhost port=5432 dbname=postgres user=postgres"));
+    ASSERT_TRUE(connection.create_query(
+        "CREATE TEMPORARY TABLE allocation_test (id INTEGER PRIMARY KEY, name TEXT, score DOUBLE PRECISION)"));
+    ASSERT_TRUE(connection.prepare("allocation_insert",
+                                   "INSERT INTO allocation_test VALUES ($1, $2, $3)"));
+    ASSERT_TRUE(connection.prepare("allocation_select",
+                                   "SELECT id, name, score FROM allocation_test WHERE id <= $1 ORDER BY id"));
+
+    const std::string insert = "allocation_insert";
+    const std::string select = "allocation_select";
+    result_buffer result;
+    char id[16];
+    char score[16];
+    const char* insert_parameters[] = { id, "steady state row", score };
+    const char* select_parameters[] = { "10" };
+
+    auto run = [&](const int& first, const int& count) {
+        bool succeeded = true;
+        for (int index = first; index < first + count; ++index) {
+            std::snprintf(id, sizeof(id), "%d", index);
+            std::snprintf(score, sizeof(score), "%d.5", index);
+            succeeded = connection.execute_prepared(insert, insert_parameters, result) && succeeded;
+            succeeded = connection.execute_prepared(select, select_parameters, result) && succeeded;
+        }
+        return succeeded;
+    };
+
+    // Warm up: grows the buffer and any sampled-timing storage.
+    ASSERT_TRUE(run(1, 200));
+
+    allocation_counter::scope allocations;
+    const bool succeeded = run(201, 200);
+    const uint64_t counted = allocations.allocations();
+
+    EXPECT_TRUE(succeeded);
+    EXPECT_EQ(counted, 0);
+    ASSERT_EQ(result.rows(), 10);
+    EXPECT_EQ(result.integer(9, 0), 10);
+    EXPECT_EQ(result.text(9, 1), "steady state row");
+    EXPECT_DOUBLE_EQ(result.real(9, 2), 10.5);
+}
+
+TEST_F(DatabaseTest, FailedStatementKeepsConnection) {
+    if (!IsPostgreSQLAvailable()) {
+        GTEST_SKIP() << "PostgreSQL not available";
+    }
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect("host=localhost port=5432 dbname=postgres user=postgres"));
+    EXPECT_FALSE(connection.create_query("SELECT * FROM reconnect_test_missing_table"));
+    EXPECT_EQ(connection.last_error_state(), "42P01");
+    EXPECT_TRUE(connection.is_connected());
+    EXPECT_TRUE(connection.create_query("SELECT 1"));
+}
+
+TEST_F(DatabaseTest, IncrementalQueryMergesRowsPastWatermark) {
+    if (!IsPostgreSQLAvailable()) {
+        GTEST_SKIP() << "PostgreSQL not available";
+    }
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect("host=localhost port=5432 dbname=postgres user=postgres"));
+    ASSERT_TRUE(connection.create_query(
+        "CREATE TEMPORARY TABLE watermark_test (id INTEGER PRIMARY KEY, status TEXT, version BIGINT)"));
+    ASSERT_TRUE(connection.create_query(
+        "INSERT INTO watermark_test SELECT n, 'new', n FROM generate_series(1, 100) n"));
+
+    incremental_query query("watermark_select",
+                            "SELECT id, status, version FROM watermark_test WHERE version > $1",
+                            "id", "version", "0");
+    ASSERT_TRUE(query.refresh(connection));
+    EXPECT_TRUE(query.last_refresh_was_full());
+    EXPECT_EQ(query.rows().rows(), 100);
+    EXPECT_EQ(query.watermark(), "100");
+
+    ASSERT_TRUE(query.refresh(connection));
+    EXPECT_FALSE(query.last_refresh_was_full());
+    EXPECT_EQ(query.fetched_rows(), 0);
+
+    // One update and two inserts come back as three rows.
+    ASSERT_TRUE(connection.create_query("UPDATE watermark_test SET status = 'paid', version = 101 WHERE id = 7"));
+    ASSERT_TRUE(connection.create_query("INSERT INTO watermark_test VALUES (101, 'new', 102), (102, 'new', 103)"));
+    ASSERT_TRUE(query.refresh(connection));
+    EXPECT_EQ(query.fetched_rows(), 3);
+    EXPECT_EQ(query.watermark(), "103");
+
+    const result_buffer& rows = query.rows();
+    ASSERT_EQ(rows.rows(), 102);
+    int paid = 0;
+    for (size_t row = 0; row < rows.rows(); ++row) {
+        if (rows.integer(row, 0) == 7) {
+            EXPECT_EQ(rows.text(row, 1), "paid");
+            ++paid;
+        }
+    }
+    EXPECT_EQ(paid, 1);
+
+    // A full reload picks up the delete the watermark cannot see.
+    ASSERT_TRUE(connection.create_query("DELETE FROM watermark_test WHERE id = 1"));
+    query.invalidate();
+    ASSERT_TRUE(query.refresh(connection));
+    EXPECT_TRUE(query.last_refresh_was_full());
+    EXPECT_EQ(query.rows().rows(), 101);
+}
+
+TEST_F(DatabaseTest, IncrementalQueryOrdersWatermarkInColumnType) {
+    if (!IsPostgreSQLAvailable()) {
+        GTEST_SKIP() << "PostgreSQL not available";
+    }
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect("host=localhost port=5432 dbname=postgres user=postgres"));
+    ASSERT_TRUE(connection.create_query(
+        "CREATE TEMPORARY TABLE numeric_watermark_test (id INTEGER PRIMARY KEY, version NUMERIC)"));
+    ASSERT_TRUE(connection.create_query("INSERT INTO numeric_watermark_test VALUES (1, 9.5), (2, 10.0)"));
+
+    // As text "9.5" sorts after "10.0"; the server compares numbers.
+    incremental_query query("numeric_watermark_select",
+                            "SELECT id, version FROM numeric_watermark_test WHERE version > $1;",
+                            "id", "version", "0");
+    ASSERT_TRUE(query.refresh(connection));
+    EXPECT_EQ(query.watermark(), "10.0");
+    EXPECT_EQ(query.rows().columns(), 2);
+
+    ASSERT_TRUE(connection.create_query("INSERT INTO numeric_watermark_test VALUES (3, 9.9)"));
+    ASSERT_TRUE(query.refresh(connection));
+    EXPECT_EQ(query.fetched_rows(), 0);
+    ASSERT_TRUE(connection.create_query("INSERT INTO numeric_watermark_test VALUES (4, 10.5)"));
+    ASSERT_TRUE(query.refresh(connection));
+    EXPECT_EQ(query.fetched_rows(), 1);
+    EXPECT_EQ(query.watermark(), "10.5");
+    EXPECT_EQ(query.rows().rows(), 3);
+}
+
+#ifdef USE_SQLITE
+TEST_F(DatabaseTest, BulkUpdateAndDeleteByKeyArrays) {
+    if (!IsPostgreSQLAvailable()) {
+        GTEST_SKIP() << "PostgreSQL not available";
+    }
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect("host=localhost port=5432 dbname=postgres user=postgres"));
+    ASSERT_TRUE(connection.create_query(
+        "CREATE TEMPORARY TABLE bulk_change_test (id INTEGER PRIMARY KEY, name VARCHAR(32), "
+        "score NUMERIC(6, 2), seen TIMESTAMPTZ)"));
+    ASSERT_TRUE(connection.create_query(
+        "INSERT INTO bulk_change_test SELECT n, 'row ' || n, n, NULL FROM generate_series(1, 2500) n"));
+
+    // Chunks of 1000: three statements, with quotes, NULLs and a key that
+    // does not exist.
+    std::vector<bulk_update_row> rows;
+    for (int id = 1; id <= 2500; id += 2) {
+        rows.push_back({ std::to_string(id),
+                         { "it's " + std::to_string(id), std::nullopt, "2024-05-01 00:00:00+00" } });
+    }
+    rows.push_back({ "9999", { "missing", "1", std::nullopt } });
+    uint64_t updated = 0;
+    ASSERT_TRUE(connection.bulk_update("bulk_change_test", "id", { "name", "score", "seen" }, rows,
+                                       updated, 1000));
+    EXPECT_EQ(updated, 1250);
+
+    result_buffer check;
+    ASSERT_TRUE(connection.prepare("bulk_change_check",
+                                   "SELECT name, score IS NULL, seen IS NOT NULL FROM bulk_change_test WHERE id = $1"));
+    const char* const odd[] = { "7" };
+    ASSERT_TRUE(connection.execute_prepared("bulk_change_check", odd, check));
+    EXPECT_EQ(check.text(0, 0), "it's 7");
+    EXPECT_TRUE(check.boolean(0, 1));
+    EXPECT_TRUE(check.boolean(0, 2));
+    const char* const even[] = { "8" };
+    ASSERT_TRUE(connection.execute_prepared("bulk_change_check", even, check));
+    EXPECT_EQ(check.text(0, 0), "row 8");
+
+    std::vector<std::string> keys;
+    for (int id = 1; id <= 2500; id += 3) {
+        keys.push_back(std::to_string(id));
+    }
+    uint64_t deleted = 0;
+    ASSERT_TRUE(connection.bulk_delete("bulk_change_test", "id", keys, deleted, 500));
+    EXPECT_EQ(deleted, keys.size());
+
+    // A key that is not an integer fails before anything is sent.
+    keys = { "12", "twelve" };
+    EXPECT_FALSE(connection.bulk_delete("bulk_change_test", "id", keys, deleted));
+    const std::vector<bulk_update_row> one = { { "1", { "x" } } };
+    EXPECT_FALSE(connection.bulk_update("bulk_change_test", "id", { "missing_column" }, one, updated));
+}
+
+TEST_F(DatabaseTest, IdAllocatorReservesHiLoBlocks) {
+    if (!IsPostgreSQLAvailable()) {
+        GTEST_SKIP() << "PostgreSQL not available";
+    }
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect("host=localhost port=5432 dbname=postgres user=postgres"));
+    connection.create_query("DROP SEQUENCE IF EXISTS hilo_test_seq, plain_test_seq");
+    ASSERT_TRUE(connection.create_query("CREATE SEQUENCE hilo_test_seq INCREMENT BY 100"));
+    ASSERT_TRUE(connection.create_query("CREATE SEQUENCE plain_test_seq"));
+
+    // One nextval covers 100 ids; a plain nextval afterwards is past them.
+    id_allocator hilo("hilo_test", "hilo_test_seq", 100);
+    std::vector<int64_t> ids;
+    ASSERT_TRUE(hilo.take(connection, 150, ids));
+    EXPECT_EQ(hilo.reservations(), 2);
+    EXPECT_EQ(ids.front(), 1);
+    EXPECT_EQ(ids.back(), 150);
+    ASSERT_TRUE(connection.create_query("SELECT nextval('hilo_test_seq')"));
+
+    // A sequence that increments by one is called once per id, in one
+    // statement.
+    id_allocator plain("plain_test", "plain_test_seq", 50);
+    int64_t id = 0;
+    ASSERT_TRUE(plain.next(connection, id));
+    EXPECT_EQ(id, 1);
+    ids.clear();
+    ASSERT_TRUE(plain.take(connection, 49, ids));
+    EXPECT_EQ(ids.back(), 50);
+    EXPECT_EQ(plain.reservations(), 1);
+
+    connection.create_query("DROP SEQUENCE hilo_test_seq, plain_test_seq");
+}
+
+TEST_F(DatabaseTest, TimeseriesWriterFillsDailyPartitions) {
+    if (!IsPostgreSQLAvailable()) {
+        GTEST_SKIP() << "PostgreSQL not available";
+    }
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect("host=localhost port=5432 dbname=postgres user=postgres"));
+    connection.create_query("DROP TABLE IF EXISTS ts_test");
+    ASSERT_TRUE(connection.create_query(
+        "CREATE TABLE ts_test (time TIMESTAMPTZ, series TEXT, value FLOAT8) PARTITION BY RANGE (time)"));
+
+    timeseries_writer_options options;
+    options.table = "ts_test";
+    options.partitions_ahead = 1;
+    options.flush_points = 400;
+    timeseries_writer writer(options);
+    ASSERT_TRUE(writer.start("host=localhost port=5432 dbname=postgres user=postgres"));
+
+    const auto now = std::chrono::system_clock::now();
+    const auto old = now - std::chrono::hours(72);
+    for (int index = 0; index < 1000; ++index) {
+        ASSERT_TRUE(writer.append(now, "cpu.load", index * 0.5));
+    }
+    ASSERT_TRUE(writer.append(old, "cpu.load", -1.25));
+    writer.stop();
+
+    const auto stats = writer.stats();
+    EXPECT_EQ(stats.points_written, 1001);
+    EXPECT_EQ(stats.points_failed, 0);
+    EXPECT_EQ(stats.rerouted, 0);
+    EXPECT_EQ(stats.partitions_created, 3);
+
+    result_buffer check;
+    ASSERT_TRUE(connection.prepare("ts_test_check",
+                                   "SELECT tableoid::regclass::text, count(*), sum(value) FROM ts_test "
+                                   "GROUP BY 1 ORDER BY 1"));
+    ASSERT_TRUE(connection.execute_prepared("ts_test_check", {}, check));
+    ASSERT_EQ(check.rows(), 2);
+    const auto lower = [](const std::chrono::system_clock::time_point& time) {
+        const int64_t day = 86400LL * 1000000;
+        const int64_t microseconds
+            = std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+        return microseconds / day * day;
+    };
+    EXPECT_EQ(check.text(0, 0), writer.partition_name(lower(old)));
+    EXPECT_EQ(check.integer(0, 1), 1);
+    EXPECT_DOUBLE_EQ(check.real(0, 2), -1.25);
+    EXPECT_EQ(check.text(1, 0), writer.partition_name(lower(now)));
+    EXPECT_EQ(check.integer(1, 1), 1000);
+    EXPECT_DOUBLE_EQ(check.real(1, 2), 249750.0);
+
+    connection.create_query("DROP TABLE ts_test");
+}
+
+TEST_F(DatabaseTest, JobQueueLeasesSkipLockedAndWakesOnNotify) {
+    if (!IsPostgreSQLAvailable()) {
+        GTEST_SKIP() << "PostgreSQL not available";
+    }
+
+    const std::string connect_string = "host=localhost port=5432 dbname=postgres user=postgres";
+    postgres_manager producer;
+    ASSERT_TRUE(producer.connect(connect_string));
+    producer.create_query("DROP TABLE IF EXISTS job_test");
+
+    job_queue_options options;
+    options.table = "job_test";
+    options.visibility_timeout = std::chrono::milliseconds(300);
+    options.copy_rows = 5;
+    job_queue queue("job_test", options);
+    ASSERT_TRUE(queue.install(producer));
+    ASSERT_TRUE(queue.install(producer));
+
+    uint64_t enqueued = 0;
+    const std::vector<std::string> few = { "a", "it's \"quoted\"", "tab\there" };
+    ASSERT_TRUE(queue.enqueue(producer, few, enqueued));
+    EXPECT_EQ(enqueued, 3);
+    std::vector<std::string> many(7, "copied\nline");
+    ASSERT_TRUE(queue.enqueue(producer, many, enqueued));
+    EXPECT_EQ(enqueued, 7);
+
+    // Two consumers split the ready jobs without blocking each other.
+    postgres_manager consumer;
+    ASSERT_TRUE(consumer.connect(connect_string));
+    std::vector<job> first;
+    std::vector<job> second;
+    ASSERT_TRUE(queue.dequeue(producer, 6, first));
+    ASSERT_TRUE(queue.dequeue(consumer, 6, second));
+    ASSERT_EQ(first.size(), 6);
+    ASSERT_EQ(second.size(), 4);
+    EXPECT_EQ(first[1].payload, "it's \"quoted\"");
+    EXPECT_EQ(first[2].payload, "tab\there");
+    EXPECT_EQ(second[3].payload, "copied\nline");
+    EXPECT_EQ(first[0].attempts, 1);
+
+    uint64_t acked = 0;
+    ASSERT_TRUE(queue.complete(producer, first, acked));
+    EXPECT_EQ(acked, 6);
+
+    // Unacked jobs come back after their lease; acks for the old lease
+    // no longer count.
+    std::this_thread::sleep_for(std::chrono::milliseconds(400));
+    std::vector<job> again;
+    ASSERT_TRUE(queue.dequeue(consumer, 10, again));
+    ASSERT_EQ(again.size(), 4);
+    EXPECT_EQ(again[0].attempts, 2);
+    ASSERT_TRUE(queue.complete(consumer, second, acked));
+    EXPECT_EQ(acked, 0);
+    ASSERT_TRUE(queue.defer(consumer, again, std::chrono::milliseconds(0), acked));
+    EXPECT_EQ(acked, 4);
+    ASSERT_TRUE(queue.dequeue(consumer, 10, again));
+    ASSERT_TRUE(queue.complete(consumer, again, acked));
+    EXPECT_EQ(acked, 4);
+
+    // A waiting consumer wakes on the enqueue, well before its timeout.
+    std::vector<job> woken;
+    const auto started = std::chrono::steady_clock::now();
+    std::thread waiter([&]() { EXPECT_TRUE(queue.wait_dequeue(consumer, 10, std::chrono::seconds(10), woken)); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_TRUE(queue.enqueue(producer, few, enqueued));
+    waiter.join();
+    EXPECT_EQ(woken.size(), 3);
+    EXPECT_LT(std::chrono::steady_clock::now() - started, std::chrono::seconds(2));
+
+    producer.create_query("DROP TABLE job_test");
+}
+
+TEST_F(DatabaseTest, PartitionRouterFollowsDetachedPartition) {
+    if (!IsPostgreSQLAvailable()) {
+        GTEST_SKIP() << "PostgreSQL not available";
+    }
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect("host=localhost port=5432 dbname=postgres user=postgres"));
+    connection.create_query("DROP TABLE IF EXISTS router_test, router_test_1, router_test_2");
+    ASSERT_TRUE(connection.create_query(
+        "CREATE TABLE router_test (id BIGINT, note TEXT) PARTITION BY RANGE (id)"));
+    ASSERT_TRUE(connection.create_query(
+        "CREATE TABLE router_test_1 PARTITION OF router_test FOR VALUES FROM (0) TO (100)"));
+    ASSERT_TRUE(connection.create_query(
+        "CREATE TABLE router_test_2 PARTITION OF router_test FOR VALUES FROM (100) TO (200)"));
+
+    partition_router router("router_test", "router_test");
+    ASSERT_TRUE(router.load(connection));
+    EXPECT_EQ(router.partitions(), 2);
+    EXPECT_EQ(router.route("150"), "router_test_2");
+    EXPECT_TRUE(router.refresh_if_changed(connection));
+
+    // Rows bound for a partition that was dropped go through the parent.
+    ASSERT_TRUE(connection.create_query("DROP TABLE router_test_2"));
+    ASSERT_TRUE(connection.create_query(
+        "CREATE TABLE router_test_default PARTITION OF router_test DEFAULT"));
+    const std::vector<std::string> keys = { "5", "150" };
+    const std::vector<std::string> tuples = { "(5, 'a')", "(150, 'b')" };
+    auto result = router.insert(connection, "id, note", keys, tuples);
+    EXPECT_TRUE(result.completed);
+    EXPECT_EQ(result.rows, 2);
+    EXPECT_EQ(result.rerouted, 1);
+
+    ASSERT_TRUE(router.refresh_if_changed(connection));
+    EXPECT_EQ(router.route("150"), "router_test_default");
+
+    // Detaching is seen by the version check alone.
+    ASSERT_TRUE(connection.create_query("ALTER TABLE router_test DETACH PARTITION router_test_1"));
+    ASSERT_TRUE(router.refresh_if_changed(connection));
+    EXPECT_EQ(router.route("5"), "router_test_default");
+    connection.create_query("DROP TABLE router_test, router_test_1");
+}
+
+TEST_F(DatabaseTest, SqliteReplicaMirrorsAndRefreshesOnNotify) {
+    if (!IsPostgreSQLAvailable()) {
+        GTEST_SKIP() << "PostgreSQL not available";
+    }
+
+    const std::string connect_string = "host=localhost port=5432 dbname=postgres user=postgres";
+    postgres_manager writer;
+    postgres_manager follower;
+    ASSERT_TRUE(writer.connect(connect_string));
+    ASSERT_TRUE(follower.connect(connect_string));
+    ASSERT_TRUE(writer.create_query("DROP TABLE IF EXISTS replica_plans"));
+    ASSERT_TRUE(writer.create_query(
+        "CREATE TABLE replica_plans (code TEXT PRIMARY KEY, seats INTEGER, active BOOLEAN, version BIGINT)"));
+    ASSERT_TRUE(writer.create_query(
+        "INSERT INTO replica_plans VALUES ('free', 1, true, 1), ('team', 10, true, 2)"));
+
+    const std::string path = (std::filesystem::temp_directory_path() / "replica_test.db").string();
+    std::filesystem::remove(path);
+    sqlite_replica replica;
+    ASSERT_TRUE(replica.open(path));
+    ASSERT_TRUE(replica.mirror("replica_plans", "code", "version"));
+    ASSERT_TRUE(replica.snapshot(follower)) << replica.last_error();
+
+    result_buffer rows;
+    ASSERT_TRUE(replica.select("SELECT code, seats, active FROM replica_plans ORDER BY code", rows));
+    ASSERT_EQ(rows.rows(), 2);
+    EXPECT_EQ(rows.integer(1, 1), 10);
+    EXPECT_TRUE(rows.boolean(1, 2));
+
+    ASSERT_TRUE(follower.listen("replica_plans"));
+    ASSERT_TRUE(writer.create_query("UPDATE replica_plans SET seats = 25, version = 3 WHERE code = 'team'"));
+    ASSERT_TRUE(writer.create_query("NOTIFY replica_plans"));
+    ASSERT_TRUE(replica.wait_and_refresh(follower, std::chrono::seconds(5))) << replica.last_error();
+
+    ASSERT_TRUE(replica.select("SELECT seats FROM replica_plans WHERE code = 'team'", rows));
+    ASSERT_EQ(rows.rows(), 1);
+    EXPECT_EQ(rows.integer(0, 0), 25);
+
+    EXPECT_TRUE(replica.covers("SELECT * FROM replica_plans WHERE code = 'free'"));
+    EXPECT_FALSE(replica.covers("SELECT * FROM replica_plans FOR UPDATE"));
+    EXPECT_FALSE(replica.covers("SELECT * FROM test_table"));
+
+    // Only registered statements are routed, whatever their literals.
+    EXPECT_FALSE(replica.serves("SELECT * FROM replica_plans WHERE code = 'free'"));
+    EXPECT_FALSE(replica.serve("SELECT * FROM test_table WHERE id = 1"));
+    ASSERT_TRUE(replica.serve("SELECT * FROM replica_plans WHERE code = 'free'"));
+    EXPECT_TRUE(replica.serves("select * from replica_plans where code = 'team'"));
+    EXPECT_FALSE(replica.serves("SELECT * FROM replica_plans WHERE seats = 1"));
+
+    // The watermark is compared as a number: 10 is past 9 although "10" < "9".
+    ASSERT_TRUE(writer.create_query("UPDATE replica_plans SET seats = 9, version = 9 WHERE code = 'free'"));
+    ASSERT_TRUE(replica.refresh(follower)) << replica.last_error();
+    ASSERT_TRUE(writer.create_query("UPDATE replica_plans SET seats = 40, version = 10 WHERE code = 'team'"));
+    ASSERT_TRUE(replica.refresh(follower)) << replica.last_error();
+    ASSERT_TRUE(replica.select("SELECT seats FROM replica_plans WHERE code = 'team'", rows));
+    ASSERT_EQ(rows.rows(), 1);
+    EXPECT_EQ(rows.integer(0, 0), 40);
+
+    writer.create_query("DROP TABLE replica_plans");
+    replica.close();
+    std::filesystem::remove(path);
+}
+#endif
+
+#ifndef _WIN32
+TEST(PostgresManagerTest, ReconnectsAfterLostConnection) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    server.set_result_shape(1, 8);
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect(server.connection_string()));
+    ASSERT_TRUE(connection.prepare("reconnect_select", "SELECT 1"));
+
+    const uint64_t reconnects = database_metrics::handle().reconnects();
+    result_buffer result;
+    const std::span<const char* const> no_parameters;
+    ASSERT_TRUE(connection.execute_prepared("reconnect_select", no_parameters, result));
+
+    // The call that sees the lost connection fails; the next one
+    // reconnects and finds the prepared statement again.
+    server.drop_connections();
+    EXPECT_FALSE(connection.execute_prepared("reconnect_select", no_parameters, result));
+    EXPECT_TRUE(connection.execute_prepared("reconnect_select", no_parameters, result));
+    EXPECT_EQ(result.rows(), 1);
+    EXPECT_EQ(database_metrics::handle().reconnects(), reconnects + 1);
+
+    // With auto-reconnect off, the connection stays lost.
+    connection.set_auto_reconnect(false);
+    server.drop_connections();
+    EXPECT_FALSE(connection.execute_prepared("reconnect_select", no_parameters, result));
+    EXPECT_FALSE(connection.execute_prepared("reconnect_select", no_parameters, result));
+    EXPECT_FALSE(connection.is_connected());
+}
+
+TEST(PostgresManagerTest, NoReconnectInsideTransactionBlock) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    server.set_result_shape(1, 8);
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect(server.connection_string()));
+    ASSERT_TRUE(connection.create_query("BEGIN"));
+    ASSERT_TRUE(connection.create_query("UPDATE accounts SET balance = balance - 10 WHERE id = 1"));
+
+    // The rest of the transaction must not autocommit on a new session,
+    // and COMMIT must not pretend to succeed.
+    server.drop_connections();
+    EXPECT_FALSE(connection.create_query("UPDATE accounts SET balance = balance + 10 WHERE id = 2"));
+    EXPECT_FALSE(connection.create_query("UPDATE accounts SET balance = balance + 10 WHERE id = 2"));
+    EXPECT_EQ(connection.last_error_state(), "08003");
+    EXPECT_FALSE(connection.create_query("COMMIT"));
+    EXPECT_EQ(connection.last_error_state(), "08003");
+    EXPECT_FALSE(connection.create_query("ROLLBACK TO SAVEPOINT before_credit"));
+
+    // ROLLBACK acknowledges the loss and reconnects.
+    EXPECT_TRUE(connection.create_query("ROLLBACK"));
+    EXPECT_TRUE(connection.create_query("SELECT 1"));
+
+    // Outside a transaction block the next call reconnects as before.
+    server.drop_connections();
+    EXPECT_FALSE(connection.create_query("SELECT 1"));
+    EXPECT_TRUE(connection.create_query("SELECT 1"));
+}
+
+TEST(PostgresManagerTest, SessionIdentityReadsSearchPathOnce) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    server.set_result_shape(1, 8);
+
+    postgres_manager connection;
+    EXPECT_EQ(connection.session_identity(), "");
+    ASSERT_TRUE(connection.connect(server.connection_string()));
+
+    const std::string identity = connection.session_identity();
+    EXPECT_FALSE(identity.empty());
+    EXPECT_EQ(server.last_query(), "SELECT current_setting('search_path')");
+    EXPECT_EQ(connection.session_identity(), identity);
+    EXPECT_TRUE(connection.create_query("SELECT 1"));
+    EXPECT_EQ(connection.session_identity(), identity);
+    EXPECT_EQ(server.messages('Q'), 2);
+
+    // A statement that may change the search_path makes it read again.
+    EXPECT_TRUE(connection.create_query("SET search_path TO reporting, public"));
+    EXPECT_EQ(connection.session_identity(), identity);
+    EXPECT_EQ(server.messages('Q'), 4);
+}
+
+TEST(PostgresManagerTest, NotificationsForOtherWaitersAreKept) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect(server.connection_string()));
+    ASSERT_TRUE(connection.listen("jobs"));
+    ASSERT_TRUE(connection.listen("cache"));
+    ASSERT_TRUE(connection.create_query("NOTIFY cache, 'plans'"));
+    ASSERT_TRUE(connection.create_query("NOTIFY jobs, 'default'"));
+    ASSERT_TRUE(connection.create_query("NOTIFY cache, 'countries'"));
+
+    const auto jobs = [](std::string_view channel, std::string_view) { return channel == "jobs"; };
+    std::string channel;
+    std::string payload;
+    ASSERT_TRUE(connection.wait_notification(std::chrono::milliseconds(0), jobs, channel, payload));
+    EXPECT_EQ(payload, "default");
+    EXPECT_FALSE(connection.wait_notification(std::chrono::milliseconds(0), jobs, channel, payload));
+
+    // The others are still there, in order.
+    ASSERT_TRUE(connection.wait_notification(std::chrono::milliseconds(0), channel, payload));
+    EXPECT_EQ(channel, "cache");
+    EXPECT_EQ(payload, "plans");
+    ASSERT_TRUE(connection.wait_notification(std::chrono::milliseconds(0), channel, payload));
+    EXPECT_EQ(payload, "countries");
+    EXPECT_FALSE(connection.wait_notification(std::chrono::milliseconds(0), channel, payload));
+}
+
+TEST(PostgresManagerTest, AutoParameterizeSharesOnePreparedStatement) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    server.set_result_shape(1, 8);
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect(server.connection_string()));
+    connection.set_auto_parameterize(true);
+
+    auto& metrics = database_metrics::handle();
+    const uint64_t hits = metrics.prepared_hits();
+    const uint64_t misses = metrics.prepared_misses();
+    for (int id = 1; id <= 5; ++id) {
+        EXPECT_NE(connection.select_query("SELECT * FROM t WHERE id = " + std::to_string(id)), nullptr);
+    }
+    EXPECT_EQ(server.messages('P'), 1);
+    EXPECT_EQ(server.messages('B'), 5);
+    EXPECT_EQ(server.messages('Q'), 0);
+    EXPECT_EQ(metrics.prepared_hits() - hits, 4);
+    EXPECT_EQ(metrics.prepared_misses() - misses, 1);
+
+    // Nothing to parameterize, or turned off: sent as text.
+    EXPECT_TRUE(connection.create_query("SELECT now()"));
+    connection.set_auto_parameterize(false);
+    EXPECT_NE(connection.select_query("SELECT * FROM t WHERE id = 6"), nullptr);
+    EXPECT_EQ(server.messages('Q'), 2);
+}
+
+TEST(SessionStateTest, SendsOnlyChangedSettings) {
+    session_state session;
+    EXPECT_TRUE(session.at_baseline());
+    ASSERT_TRUE(session.set("Work_Mem", "64MB"));
+    ASSERT_TRUE(session.set("search_path", "app, public"));
+    EXPECT_FALSE(session.set("work_mem; DROP TABLE t", "1"));
+    ASSERT_TRUE(session.pending());
+    EXPECT_EQ(session.statement(),
+              "SELECT set_config('search_path', 'app, public', false), "
+              "set_config('work_mem', '64MB', false)");
+    session.applied(true, false);
+    EXPECT_FALSE(session.pending());
+    EXPECT_FALSE(session.at_baseline());
+    EXPECT_EQ(*session.value("work_mem"), "64MB");
+
+    // Values already in place send nothing.
+    EXPECT_TRUE(session.set("work_mem", "64MB"));
+    EXPECT_FALSE(session.pending());
+    EXPECT_EQ(session.skipped(), 1);
+
+    // A failed statement rolled its settings back; they are sent again.
+    ASSERT_TRUE(session.set("work_mem", "1GB"));
+    EXPECT_TRUE(session.set("application_name", "it's C:\\app"));
+    const std::string retried = session.statement();
+    EXPECT_NE(retried.find("E'it''s C:\\\\app'"), std::string::npos);
+    session.applied(false, false);
+    EXPECT_TRUE(session.pending());
+    EXPECT_EQ(session.statement(), retried);
+    EXPECT_EQ(*session.value("work_mem"), "1GB");
+    EXPECT_EQ(*session.value("application_name"), "it's C:\\app");
+    session.applied(true, false);
+    EXPECT_FALSE(session.pending());
+    EXPECT_EQ(session.sent(), 4);
+
+    // Settings made inside a transaction block are forgotten once it ends.
+    ASSERT_TRUE(session.set("statement_timeout", "5s"));
+    session.applied(true, true);
+    session.begin(true);
+    EXPECT_TRUE(session.set("statement_timeout", "5s"));
+    EXPECT_FALSE(session.pending());
+    session.begin(false);
+    EXPECT_TRUE(session.set("statement_timeout", "5s"));
+    EXPECT_TRUE(session.pending());
+    EXPECT_EQ(session.sent(), 5);
+
+    session.reconnected();
+    EXPECT_EQ(session.statement(),
+              "SELECT set_config('application_name', E'it''s C:\\\\app', false), "
+              "set_config('search_path', 'app, public', false), "
+              "set_config('statement_timeout', '5s', false), set_config('work_mem', '1GB', false)");
+
+    EXPECT_TRUE(session_state::changes_settings("  set work_mem = '1GB'"));
+    EXPECT_TRUE(session_state::changes_settings("DISCARD ALL"));
+    EXPECT_FALSE(session_state::changes_settings("SELECT 1"));
+    EXPECT_FALSE(session_state::changes_settings("SETTLE"));
+    EXPECT_TRUE(session_state::can_carry("\n with t as (select 1) select * from t"));
+    EXPECT_FALSE(session_state::can_carry("VACUUM t"));
+    EXPECT_FALSE(session_state::can_carry("BEGIN"));
+}
+
+TEST(PostgresManagerTest, SessionSettingsRideAlongWithStatements) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    server.set_result_shape(1, 4);
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect(server.connection_string()));
+
+    ASSERT_TRUE(connection.set_session("statement_timeout", "5s"));
+    ASSERT_TRUE(connection.create_query("SELECT 1"));
+    EXPECT_EQ(server.messages('Q'), 1);
+    EXPECT_EQ(server.last_query(), "SELECT set_config('statement_timeout', '5s', false);\nSELECT 1");
+
+    // The same setting again costs nothing.
+    ASSERT_TRUE(connection.set_session("statement_timeout", "5s"));
+    ASSERT_TRUE(connection.create_query("SELECT 2"));
+    EXPECT_EQ(server.messages('Q'), 2);
+    EXPECT_EQ(server.last_query(), "SELECT 2");
+
+    // Statements that must not run in a transaction block, and prepared
+    // statements, get the settings in a message of their own.
+    ASSERT_TRUE(connection.set_session("work_mem", "64MB"));
+    ASSERT_TRUE(connection.create_query("VACUUM t"));
+    EXPECT_EQ(server.messages('Q'), 4);
+    ASSERT_TRUE(connection.prepare("session_select", "SELECT id FROM t WHERE id = $1"));
+    ASSERT_TRUE(connection.set_session("work_mem", "128MB"));
+    result_buffer rows;
+    const char* const parameters[] = { "1" };
+    ASSERT_TRUE(connection.execute_prepared("session_select", parameters, rows));
+    EXPECT_EQ(server.messages('Q'), 5);
+    EXPECT_EQ(server.last_query(), "SELECT set_config('work_mem', '128MB', false)");
+    ASSERT_TRUE(connection.execute_prepared("session_select", parameters, rows));
+    EXPECT_EQ(server.messages('Q'), 5);
+
+    // A plain SET leaves the session unknown until it is reset.
+    ASSERT_TRUE(connection.create_query("SET work_mem = '1GB'"));
+    EXPECT_FALSE(connection.session().at_baseline());
+    ASSERT_TRUE(connection.reset_session());
+    EXPECT_EQ(server.last_query(), "RESET ALL");
+    EXPECT_TRUE(connection.session().at_baseline());
+    const uint64_t before = server.messages('Q');
+    ASSERT_TRUE(connection.reset_session());
+    EXPECT_EQ(server.messages('Q'), before);
+
+    // A new session gets the settings again.
+    ASSERT_TRUE(connection.set_session("search_path", "app"));
+    ASSERT_TRUE(connection.create_query("SELECT 3"));
+    server.drop_connections();
+    EXPECT_FALSE(connection.create_query("SELECT 4"));
+    ASSERT_TRUE(connection.create_query("SELECT 5"));
+    EXPECT_EQ(server.last_query(), "SELECT set_config('search_path', 'app', false);\nSELECT 5");
+}
+
+TEST(PostgresManagerTest, BulkWriteIsolatesRejectedRowsByBisection) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    server.set_rejected_values({ "(17)", "(62)" });
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect(server.connection_string()));
+
+    std::vector<std::string> rows;
+    for (int id = 0; id < 100; ++id) {
+        rows.push_back("(" + std::to_string(id) + ")");
+    }
+    const auto outcome = connection.bulk_write("INSERT INTO t (id) VALUES ", rows);
+    EXPECT_TRUE(outcome.completed);
+    EXPECT_EQ(outcome.rows_written, 98);
+    ASSERT_EQ(outcome.failed_rows.size(), 2);
+    EXPECT_EQ(outcome.failed_rows[0].row, 17);
+    EXPECT_EQ(outcome.failed_rows[1].row, 62);
+    EXPECT_EQ(outcome.failed_rows[0].state, "23505");
+    EXPECT_LT(outcome.round_trips, 30);
+    EXPECT_EQ(outcome.round_trips, server.messages('Q'));
+    EXPECT_TRUE(connection.is_idle());
+
+    // Inside a caller's transaction nothing is committed.
+    ASSERT_TRUE(connection.create_query("BEGIN"));
+    const auto nested = connection.bulk_write("INSERT INTO t (id) VALUES ", rows);
+    EXPECT_TRUE(nested.completed);
+    EXPECT_EQ(nested.rows_written, 98);
+    EXPECT_FALSE(connection.is_idle());
+    EXPECT_TRUE(connection.create_query("COMMIT"));
+
+    // A clean batch takes one statement and the commit.
+    server.set_rejected_values({});
+    const auto clean = connection.bulk_write("INSERT INTO t (id) VALUES ", rows);
+    EXPECT_EQ(clean.rows_written, 100);
+    EXPECT_EQ(clean.round_trips, 2);
+}
+
+TEST(PostgresManagerTest, BulkWriteAbandonsBatchOnNonDataError) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    // An undefined column fails every subset of the rows alike.
+    server.set_rejected_values({ "(17)" }, "42703");
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect(server.connection_string()));
+
+    std::vector<std::string> rows;
+    for (int id = 0; id < 100; ++id) {
+        rows.push_back("(" + std::to_string(id) + ")");
+    }
+    const auto outcome = connection.bulk_write("INSERT INTO t (id) VALUES ", rows);
+    EXPECT_FALSE(outcome.completed);
+    EXPECT_EQ(outcome.rows_written, 0);
+    EXPECT_TRUE(outcome.failed_rows.empty());
+    EXPECT_EQ(outcome.round_trips, 1);
+    EXPECT_EQ(connection.last_error_state(), "42703");
+    EXPECT_TRUE(connection.is_idle());
+
+    // A trigger's RAISE EXCEPTION is blamed on its row.
+    server.set_rejected_values({ "(17)" }, "P0001");
+    const auto raised = connection.bulk_write("INSERT INTO t (id) VALUES ", rows);
+    EXPECT_TRUE(raised.completed);
+    EXPECT_EQ(raised.rows_written, 99);
+    ASSERT_EQ(raised.failed_rows.size(), 1);
+    EXPECT_EQ(raised.failed_rows[0].state, "P0001");
+}
+
+TEST(CsvImportTest, ScannerCountsFieldsOutsideQuotes) {
+    const std::string data = "1,plain,x\n"
+                             "2,\"has , comma and\nnewline\",y\n"
+                             "3,\"doubled \"\" quote, spanning more than one sixteen-byte block\",z\n"
+                             "4,,last row without newline";
+    csv_scanner scanner(data, ',', '"');
+    std::vector<size_t> fields;
+    size_t count = 0;
+    while (scanner.next_row(count)) {
+        fields.push_back(count);
+    }
+    EXPECT_EQ(fields, (std::vector<size_t>{ 3, 3, 3, 3 }));
+    EXPECT_EQ(scanner.offset(), data.size());
+    EXPECT_FALSE(scanner.in_quotes());
+
+    csv_scanner unterminated("1,\"open\n2,3\n", ',', '"');
+    while (unterminated.next_row(count)) {
+    }
+    EXPECT_TRUE(unterminated.in_quotes());
+
+    // Without quoting, quotes are data.
+    csv_scanner tabs("a\t\"b\tc\n", '\t', '\0');
+    ASSERT_TRUE(tabs.next_row(count));
+    EXPECT_EQ(count, 3);
+}
+
+TEST(CsvImportTest, SplitsOnlyOnRowBoundaries) {
+    std::string data;
+    for (int row = 0; row < 200; ++row) {
+        data += std::to_string(row) + ",\"line one\nline \"\"two\"\"\"," + std::string(row % 37, 'x') + "\n";
+    }
+
+    for (const size_t chunk_bytes : { 1, 7, 64, 1000, 100000 }) {
+        const auto chunks = split_csv_rows(data, chunk_bytes, '"');
+        std::string joined;
+        size_t rows = 0;
+        for (const auto& chunk : chunks) {
+            ASSERT_FALSE(chunk.empty());
+            EXPECT_EQ(chunk.back(), '\n');
+            csv_scanner scanner(chunk, ',', '"');
+            size_t fields = 0;
+            while (scanner.next_row(fields)) {
+                EXPECT_EQ(fields, 3);
+                ++rows;
+            }
+            EXPECT_FALSE(scanner.in_quotes());
+            joined.append(chunk);
+        }
+        EXPECT_EQ(joined, data);
+        EXPECT_EQ(rows, 200);
+    }
+}
+
+TEST(CsvImportTest, LoadsChunksInParallelOverCopy) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+
+    std::string data = "id,name\n";
+    for (int row = 0; row < 1000; ++row) {
+        data += std::to_string(row) + ",name " + std::to_string(row) + "\n";
+    }
+
+    csv_import_options options;
+    options.table = "people";
+    options.columns = "id, name";
+    options.header = true;
+    options.connections = 4;
+    options.chunk_bytes = 1024;
+    const csv_importer importer(options);
+    EXPECT_EQ(importer.copy_statement(),
+              "COPY people (id, name) FROM STDIN WITH (FORMAT csv, DELIMITER ',', QUOTE '\"')");
+
+    auto result = importer.load(server.connection_string(), data);
+    EXPECT_TRUE(result.completed);
+    EXPECT_EQ(result.rows, 1000);
+    EXPECT_EQ(result.bytes, data.size() - 8);
+    EXPECT_GT(result.chunks, 4);
+    EXPECT_EQ(server.messages('Q'), result.chunks);
+
+    // A row with a missing field is caught before its chunk is sent, and
+    // a chunk the server rejects is reported; the rest still load.
+    std::string damaged = data;
+    const size_t short_row = damaged.find("\n500,") + 1;
+    damaged.erase(damaged.find(',', short_row), 1);
+    server.set_rejected_values({ "name 900\n" });
+    result = importer.load(server.connection_string(), damaged);
+    EXPECT_FALSE(result.completed);
+    ASSERT_EQ(result.failed_chunks.size(), 2);
+    EXPECT_LE(result.failed_chunks[0].offset, short_row);
+    EXPECT_NE(result.failed_chunks[0].message.find("row at byte " + std::to_string(short_row)),
+              std::string::npos);
+    EXPECT_NE(result.failed_chunks[1].message.find("23505"), std::string::npos);
+    size_t lost = 0;
+    for (const auto& failed : result.failed_chunks) {
+        const std::string_view chunk(damaged.data() + failed.offset, failed.bytes);
+        lost += static_cast<size_t>(std::count(chunk.begin(), chunk.end(), '\n'));
+    }
+    EXPECT_EQ(result.rows, 1000 - lost);
+}
+
+TEST(IdAllocatorTest, ThreadsShareOneReservedBlock) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    // The loopback answers the reservation with ids 1..4000, one per row.
+    server.set_result_shape(4000, 1);
+
+    id_allocator allocator("order_ids", "orders_id_seq", 4000);
+    std::vector<std::vector<int64_t>> taken(8);
+    std::vector<std::thread> threads;
+    for (size_t thread = 0; thread < taken.size(); ++thread) {
+        threads.emplace_back([&, thread]() {
+            postgres_manager connection;
+            ASSERT_TRUE(connection.connect(server.connection_string()));
+            for (int index = 0; index < 250; ++index) {
+                int64_t id = 0;
+                ASSERT_TRUE(allocator.next(connection, id));
+                taken[thread].push_back(id);
+            }
+            ASSERT_TRUE(allocator.take(connection, 250, taken[thread]));
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::vector<int64_t> all;
+    for (const auto& ids : taken) {
+        all.insert(all.end(), ids.begin(), ids.end());
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(all.size(), 4000);
+    EXPECT_EQ(all.front(), 1);
+    EXPECT_EQ(all.back(), 4000);
+    EXPECT_EQ(std::adjacent_find(all.begin(), all.end()), all.end());
+    EXPECT_EQ(allocator.reservations(), 1);
+    EXPECT_EQ(server.messages('P'), 1);
+}
+
+TEST(TimeseriesWriterTest, BuffersPerPartitionAndFlushesBySizeAndAge) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+
+    timeseries_writer_options options;
+    options.table = "metrics";
+    options.partitions_ahead = 1;
+    options.flush_points = 1000;
+    options.flush_age = std::chrono::seconds(30);
+    timeseries_writer writer(options);
+    ASSERT_TRUE(writer.start(server.connection_string()));
+    // Today's partition and tomorrow's.
+    EXPECT_EQ(server.messages('Q'), 2);
+    EXPECT_EQ(writer.partition_name(0), "metrics_p19700101");
+
+    const auto now = std::chrono::system_clock::now();
+    std::vector<timeseries_point> points;
+    for (int index = 0; index < 2500; ++index) {
+        points.push_back({ now, "cpu", static_cast<double>(index) });
+    }
+    points.push_back({ now - std::chrono::hours(72), "cpu", 0.0 });
+    ASSERT_TRUE(writer.append(points));
+
+    // The full partition goes out on its own; the old point waits for
+    // its age limit or an explicit flush, which first creates its
+    // partition.
+    for (int wait = 0; wait < 500 && writer.stats().points_written < 2500; ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(writer.stats().points_written, 2500);
+    EXPECT_NE(server.last_query().find("COPY metrics_p"), std::string::npos);
+    EXPECT_NE(server.last_query().find("(time, series, value) FROM STDIN (FORMAT binary)"), std::string::npos);
+
+    writer.flush();
+    auto stats = writer.stats();
+    EXPECT_EQ(stats.points_written, 2501);
+    EXPECT_EQ(stats.copies, 2);
+    EXPECT_EQ(stats.partitions_created, 3);
+    EXPECT_EQ(stats.buffered_bytes, 0);
+    EXPECT_EQ(server.messages('Q'), 5);
+    writer.stop();
+    EXPECT_FALSE(writer.append(now, "cpu", 1.0));
+
+    // With a short age limit a single point is sent without a flush.
+    options.flush_age = std::chrono::milliseconds(20);
+    timeseries_writer aged(options);
+    ASSERT_TRUE(aged.start(server.connection_string()));
+    ASSERT_TRUE(aged.append(now, "cpu", 1.0));
+    for (int wait = 0; wait < 500 && aged.stats().points_written == 0; ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(aged.stats().points_written, 1);
+}
+
+TEST(TimeseriesWriterTest, CapsBufferedBytesWhileServerStalls) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+
+    timeseries_writer_options options;
+    options.table = "metrics";
+    options.flush_points = 10;
+    options.max_buffered_bytes = 4096;
+    timeseries_writer writer(options);
+    ASSERT_TRUE(writer.start(server.connection_string()));
+
+    server.set_stalled(true);
+    const auto now = std::chrono::system_clock::now();
+    uint64_t accepted = 0;
+    for (int index = 0; index < 10000; ++index) {
+        if (writer.try_append(now, "disk.io", 1.0)) {
+            ++accepted;
+        }
+    }
+    auto stats = writer.stats();
+    EXPECT_LT(accepted, 200);
+    EXPECT_EQ(stats.points_rejected, 10000 - accepted);
+    EXPECT_GE(stats.buffered_bytes, options.max_buffered_bytes);
+
+    // A blocking append waits until the stalled batch is through.
+    std::thread release([&server]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        server.set_stalled(false);
+    });
+    EXPECT_TRUE(writer.append(now, "disk.io", 1.0));
+    release.join();
+    writer.flush();
+
+    stats = writer.stats();
+    EXPECT_EQ(stats.points_written, accepted + 1);
+    EXPECT_EQ(stats.waits, 1);
+    EXPECT_EQ(stats.buffered_bytes, 0);
+}
+
+TEST(TimeseriesWriterTest, KeepsFailedBatchesForRetry) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+
+    timeseries_writer_options options;
+    options.table = "metrics";
+    options.flush_age = std::chrono::milliseconds(20);
+    timeseries_writer writer(options);
+    ASSERT_TRUE(writer.start(server.connection_string()));
+
+    // Both the partition and the parent refuse the batch; it stays
+    // buffered instead of being dropped.
+    server.set_rejected_values({ "COPY metrics" });
+    const auto now = std::chrono::system_clock::now();
+    ASSERT_TRUE(writer.append(now, "cpu", 1.0));
+    writer.flush();
+    auto stats = writer.stats();
+    EXPECT_EQ(stats.points_written, 0);
+    EXPECT_EQ(stats.points_failed, 0);
+    EXPECT_GE(stats.retried, 1);
+    EXPECT_EQ(stats.rerouted, stats.retried);
+    EXPECT_GT(stats.buffered_bytes, 0);
+
+    // Points appended meanwhile join the kept batch in one COPY.
+    ASSERT_TRUE(writer.append(now, "cpu", 2.0));
+    server.set_rejected_values({});
+    for (int wait = 0; wait < 500 && writer.stats().points_written < 2; ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    stats = writer.stats();
+    EXPECT_EQ(stats.points_written, 2);
+    EXPECT_EQ(stats.points_failed, 0);
+    EXPECT_EQ(stats.buffered_bytes, 0);
+
+    // Only stop gives up on a batch that keeps failing.
+    server.set_rejected_values({ "COPY metrics" });
+    ASSERT_TRUE(writer.append(now, "cpu", 3.0));
+    writer.stop();
+    stats = writer.stats();
+    EXPECT_EQ(stats.points_written, 2);
+    EXPECT_EQ(stats.points_failed, 1);
+    EXPECT_EQ(stats.buffered_bytes, 0);
+}
+
+TEST(JobQueueTest, EachCallIsOnePreparedStatement) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    server.set_result_shape(1, 4);
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect(server.connection_string()));
+    job_queue_options options;
+    options.table = "jobs";
+    options.copy_rows = 100;
+    options.recheck_interval = std::chrono::milliseconds(30);
+    job_queue queue("jobs", options);
+
+    // A small batch and its notification are one statement.
+    uint64_t enqueued = 0;
+    std::vector<std::string> payloads(50, "{\"task\": \"resize\"}");
+    ASSERT_TRUE(queue.enqueue(connection, payloads, enqueued));
+    EXPECT_EQ(server.messages('P'), 1);
+    EXPECT_EQ(server.messages('E'), 1);
+    ASSERT_TRUE(queue.enqueue(connection, payloads, enqueued));
+    EXPECT_EQ(server.messages('P'), 1);
+
+    // A large one goes through COPY, escaped one row per line.
+    payloads.assign(500, "line\nbreak\ttab");
+    ASSERT_TRUE(queue.enqueue(connection, payloads, enqueued));
+    EXPECT_EQ(enqueued, 500);
+    EXPECT_EQ(server.last_query(), "COPY jobs (queue, payload) FROM STDIN");
+
+    server.set_result_shape(20, 4);
+    std::vector<job> jobs;
+    ASSERT_TRUE(queue.dequeue(connection, 20, jobs));
+    ASSERT_EQ(jobs.size(), 20);
+    EXPECT_TRUE(std::is_sorted(jobs.begin(), jobs.end(),
+                               [](const job& left, const job& right) { return left.id < right.id; }));
+    const uint64_t executed = server.messages('E');
+    uint64_t completed = 0;
+    ASSERT_TRUE(queue.complete(connection, jobs, completed));
+    EXPECT_EQ(server.messages('E'), executed + 1);
+
+    // An empty queue is rechecked only every recheck_interval, and LISTEN
+    // is sent once per connection.
+    server.set_result_shape(0, 4);
+    const uint64_t queries = server.messages('Q');
+    const auto started = std::chrono::steady_clock::now();
+    EXPECT_FALSE(queue.wait_dequeue(connection, 10, std::chrono::milliseconds(100), jobs));
+    EXPECT_FALSE(queue.wait_dequeue(connection, 10, std::chrono::milliseconds(100), jobs));
+    EXPECT_GE(std::chrono::steady_clock::now() - started, std::chrono::milliseconds(200));
+    EXPECT_TRUE(jobs.empty());
+    EXPECT_EQ(server.messages('Q'), queries + 1);
+    EXPECT_LE(server.messages('E') - executed - 1, 10);
+}
+
+TEST(PartitionRouterTest, RoutesRangeAndListBounds) {
+    partition_router events("events_router", "events");
+    ASSERT_TRUE(events.set_bounds("r", "timestamptz",
+                                  { { "events_old", "FOR VALUES FROM (MINVALUE) TO ('2024-01-01 00:00:00+00')" },
+                                    { "events_2024_01", "FOR VALUES FROM ('2024-01-01 00:00:00+00') TO ('2024-02-01 00:00:00+00')" },
+                                    { "events_2024_02", "FOR VALUES FROM ('2024-02-01 00:00:00+00') TO ('2024-03-01 00:00:00+00')" },
+                                    { "events_other", "DEFAULT" } }));
+    EXPECT_EQ(events.partitions(), 4);
+    EXPECT_EQ(events.route("2023-06-30 12:00:00+00"), "events_old");
+    EXPECT_EQ(events.route("2024-01-01 00:00:00+00"), "events_2024_01");
+    EXPECT_EQ(events.route("2024-01-31T23:59:59.999999Z"), "events_2024_01");
+    EXPECT_EQ(events.route("2024-02-01 01:00:00+02"), "events_2024_01");
+    EXPECT_EQ(events.route("2024-02-01"), "events_2024_02");
+    EXPECT_EQ(events.route("2024-07-01 00:00:00+00"), "events_other");
+    EXPECT_EQ(events.route("not a time"), "events");
+
+    partition_router orders("orders_router", "orders");
+    ASSERT_TRUE(orders.set_bounds("r", "int8",
+                                  { { "orders_2", "FOR VALUES FROM (1000) TO (2000)" },
+                                    { "orders_1", "FOR VALUES FROM (0) TO (1000)" } }));
+    EXPECT_EQ(orders.route("0"), "orders_1");
+    EXPECT_EQ(orders.route("1999"), "orders_2");
+    EXPECT_EQ(orders.route("2000"), "orders");
+
+    partition_router regions("regions_router", "accounts");
+    ASSERT_TRUE(regions.set_bounds("l", "text",
+                                   { { "accounts_eu", "FOR VALUES IN ('de', 'fr', 'it''s')" },
+                                     { "accounts_us", "FOR VALUES IN ('us', NULL)" } }));
+    EXPECT_EQ(regions.route("fr"), "accounts_eu");
+    EXPECT_EQ(regions.route("it's"), "accounts_eu");
+    EXPECT_EQ(regions.route("us"), "accounts_us");
+    EXPECT_EQ(regions.route("jp"), "accounts");
+
+    const std::vector<std::string> keys = { "us", "de", "jp", "us", "fr" };
+    const auto batches = regions.group(keys);
+    ASSERT_EQ(batches.size(), 3);
+    EXPECT_EQ(batches[0].partition, "accounts_us");
+    EXPECT_EQ(batches[0].rows, (std::vector<size_t>{ 0, 3 }));
+    EXPECT_EQ(batches[1].rows, (std::vector<size_t>{ 1, 4 }));
+    EXPECT_EQ(batches[2].partition, "accounts");
+
+    // Hash partitions are left to the server.
+    partition_router hashed("hashed_router", "sessions");
+    ASSERT_TRUE(hashed.set_bounds("h", "int8",
+                                  { { "sessions_0", "FOR VALUES WITH (modulus 2, remainder 0)" },
+                                    { "sessions_1", "FOR VALUES WITH (modulus 2, remainder 1)" } }));
+    EXPECT_EQ(hashed.partitions(), 0);
+    EXPECT_EQ(hashed.route("42"), "sessions");
+
+    EXPECT_FALSE(orders.set_bounds("r", "int8", { { "orders_1", "FOR VALUES FROM (0, 0) TO (1, 1)" } }));
+    EXPECT_EQ(orders.route("0"), "orders");
+}
+
+TEST(PartitionRouterTest, WritesEachPartitionSeparately) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+
+    partition_router router("orders_router", "orders");
+    ASSERT_TRUE(router.set_bounds("r", "int4",
+                                  { { "orders_1", "FOR VALUES FROM (0) TO (100)" },
+                                    { "orders_2", "FOR VALUES FROM (100) TO (200)" },
+                                    { "orders_3", "FOR VALUES FROM (200) TO (300)" } }));
+
+    std::vector<std::string> keys;
+    std::vector<std::string> lines;
+    std::vector<std::string> tuples;
+    for (int id = 0; id < 300; ++id) {
+        const int key = (id * 7) % 300;
+        keys.push_back(std::to_string(key));
+        lines.push_back(std::to_string(key) + ",item " + std::to_string(id));
+        tuples.push_back("(" + std::to_string(key) + ")");
+    }
+
+    auto result = router.copy(server.connection_string(), "id, item", keys, lines, 3);
+    EXPECT_TRUE(result.completed);
+    EXPECT_EQ(result.rows, 300);
+    EXPECT_EQ(result.partitions, 3);
+    EXPECT_EQ(server.messages('Q'), 3);
+
+    // A rejected row fails only its partition's batch.
+    server.set_rejected_values({ "item 150\n" });
+    result = router.copy(server.connection_string(), "id, item", keys, lines, 3);
+    EXPECT_FALSE(result.completed);
+    ASSERT_EQ(result.failed_partitions.size(), 1);
+    EXPECT_EQ(result.failed_partitions[0].partition, "orders_2");
+    EXPECT_EQ(result.failed_partitions[0].state, "23505");
+    EXPECT_EQ(result.rows, 200);
+
+    // Inserts take one statement per clean partition; a bad row is
+    // isolated within its partition.
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect(server.connection_string()));
+    server.set_rejected_values({ "(21)" });
+    const size_t before = server.messages('Q');
+    result = router.insert(connection, "id", keys, tuples);
+    EXPECT_FALSE(result.completed);
+    EXPECT_TRUE(result.failed_partitions.empty());
+    ASSERT_EQ(result.failed_rows.size(), 1);
+    EXPECT_EQ(keys[result.failed_rows[0].row], "21");
+    EXPECT_EQ(result.rows, 299);
+    EXPECT_LT(server.messages('Q') - before, 30);
+}
+
+TEST(PostgresManagerTest, SelectColumnarDecodesBinaryCopy) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    server.set_result_shape(5000, 12);
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect(server.connection_string()));
+
+    columnar_result result;
+    ASSERT_TRUE(connection.select_columnar("SELECT id, payload FROM t;", result));
+    ASSERT_EQ(result.rows(), 5000);
+    ASSERT_EQ(result.columns(), 2);
+    EXPECT_EQ(result.column_name(0), "id");
+    EXPECT_EQ(result.kind(0), columnar_result::column_kind::integer);
+    EXPECT_EQ(result.kind(1), columnar_result::column_kind::text);
+    const auto ids = result.integers(0);
+    ASSERT_EQ(ids.size(), 5000);
+    for (size_t row = 0; row < ids.size(); ++row) {
+        ASSERT_EQ(ids[row], static_cast<int64_t>(row + 1));
+    }
+    EXPECT_EQ(result.text(4999, 1), "xxxxxxxxxxxx");
+    EXPECT_TRUE(result.reals(0).empty());
+    EXPECT_EQ(server.messages('Q'), 1);
+
+    // In batches only one batch is held at a time.
+    size_t batches = 0;
+    int64_t sum = 0;
+    ASSERT_TRUE(connection.select_columnar("SELECT id, payload FROM t", result, 1024,
+                                           [&](const columnar_result& batch) {
+                                               ++batches;
+                                               for (const int64_t id : batch.integers(0)) {
+                                                   sum += id;
+                                               }
+                                               return batch.rows() <= 1024;
+                                           }));
+    EXPECT_EQ(batches, 5);
+    EXPECT_EQ(sum, 5000 * 5001 / 2);
+    EXPECT_EQ(result.rows(), 0);
+
+    // A rejected batch stops the read; the connection stays usable.
+    EXPECT_FALSE(connection.select_columnar("SELECT id, payload FROM t", result, 1024,
+                                            [](const columnar_result&) { return false; }));
+    EXPECT_TRUE(connection.select_columnar("SELECT id, payload FROM t", result));
+    EXPECT_EQ(result.rows(), 5000);
+}
+
+TEST(PostgresManagerTest, ResponseTimeoutBoundsStalledServer) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    server.set_result_shape(1, 8);
+
+    postgres_manager connection;
+    ASSERT_TRUE(connection.connect(server.connection_string()));
+    connection.set_response_timeout(std::chrono::milliseconds(50));
+
+    server.set_stalled(true);
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(connection.select_query("SELECT 1"), nullptr);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+    EXPECT_FALSE(connection.is_connected());
+
+    server.set_stalled(false);
+    EXPECT_NE(connection.select_query("SELECT 1"), nullptr);
+}
+#endif
+
+#ifdef __linux__
+// The proxy is a single-file tool; its main() is left out here.
+#define DATABASE_PROXY_NO_MAIN
+#include "../tools/proxy.cpp"
+
+// Runs database_proxy in-process in front of a pg_loopback_server.
+class proxy_under_test {
+public:
+    ~proxy_under_test() {
+        stop();
+    }
+
+    bool start(const std::string& connection, const size_t& pool_size, const size_t& max_statements = 1000) {
+        proxy_options options;
+        options.connection = connection;
+        options.port = 0;
+        options.pool_size = pool_size;
+        options.max_statements = max_statements;
+        options.stats_interval_seconds = 0.0;
+        stop_requested = 0;
+        proxy_ = std::make_unique<proxy>(options);
+        if (!proxy_->start()) {
+            return false;
+        }
+        runner_ = std::thread([this]() { proxy_->run(); });
+        return true;
+    }
+
+    void stop() {
+        if (!runner_.joinable()) {
+            return;
+        }
+        stop_requested = 1;
+        // A connect wakes the event loop, which then sees the request.
+        const int socket = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port());
+        ::connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+        runner_.join();
+        ::close(socket);
+        proxy_.reset();
+    }
+
+    uint16_t port() const {
+        return proxy_->port();
+    }
+
+private:
+    std::unique_ptr<proxy> proxy_;
+    std::thread runner_;
+};
+
+// A frontend that writes protocol messages itself, so a test decides how
+// they are split across writes.
+class raw_client {
+public:
+    ~raw_client() {
+        close();
+    }
+
+    bool connect(const uint16_t& port) {
+        socket_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        timeval timeout{ 5, 0 };
+        ::setsockopt(socket_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        if (::connect(socket_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            return false;
+        }
+
+        std::string packet;
+        put_int32(packet, protocol_version_3);
+        packet.append("user\0loopback\0database\0loopback\0\0", 33);
+        std::string startup;
+        put_int32(startup, static_cast<uint32_t>(packet.size() + 4));
+        send(startup + packet);
+        return read_until_ready().back() == 'Z';
+    }
+
+    void send(const std::string& bytes) {
+        ::send(socket_, bytes.data(), bytes.size(), MSG_NOSIGNAL);
+    }
+
+    // Types of the messages received up to the `count`-th ReadyForQuery.
+    std::string read_until_ready(const size_t& count = 1) {
+        std::string types;
+        for (size_t ready = 0; ready < count;) {
+            char header[5];
+            if (!read_exact(header, sizeof(header))) {
+                break;
+            }
+            std::string body(get_int32(header + 1) - 4, '\0');
+            if (!read_exact(body.data(), body.size())) {
+                break;
+            }
+            types += header[0];
+            if (header[0] == 'Z') {
+                status_ = body.empty() ? '?' : body[0];
+                ++ready;
+            }
+        }
+        return types;
+    }
+
+    // Whether anything arrives within `milliseconds`.
+    bool receives_within(const int& milliseconds) {
+        pollfd descriptor{ socket_, POLLIN, 0 };
+        return ::poll(&descriptor, 1, milliseconds) > 0;
+    }
+
+    char status() const {
+        return status_;
+    }
+
+    void close() {
+        if (socket_ >= 0) {
+            ::close(socket_);
+            socket_ = -1;
+        }
+    }
+
+    static std::string query(const std::string& text) {
+        std::string output;
+        put_message(output, 'Q', std::string_view(text.c_str(), text.size() + 1));
+        return output;
+    }
+
+    static std::string parse(const std::string& name, const std::string& text) {
+        std::string body = name + '\0' + text + '\0';
+        body.append("\0\0", 2); // no parameter types
+        std::string output;
+        put_message(output, 'P', body);
+        return output;
+    }
+
+    static std::string bind(const std::string& statement) {
+        std::string body = std::string(1, '\0') + statement + '\0';
+        body.append("\0\0\0\0\0\0", 6); // no formats, parameters or result formats
+        std::string output;
+        put_message(output, 'B', body);
+        return output;
+    }
+
+    static std::string execute() {
+        std::string output;
+        put_message(output, 'E', std::string_view("\0\0\0\0\0", 5));
+        return output;
+    }
+
+    static std::string close_statement(const std::string& name) {
+        std::string output;
+        put_message(output, 'C', "S" + name + '\0');
+        return output;
+    }
+
+    static std::string sync() {
+        std::string output;
+        put_message(output, 'S', "");
+        return output;
+    }
+
+private:
+    bool read_exact(char* output, size_t size) {
+        while (size > 0) {
+            const ssize_t received = ::recv(socket_, output, size, 0);
+            if (received <= 0) {
+                return false;
+            }
+            output += received;
+            size -= static_cast<size_t>(received);
+        }
+        return true;
+    }
+
+    int socket_ = -1;
+    char status_ = '?';
+};
+
+TEST(ProxyTest, MultiplexesClientsBetweenTransactions) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    proxy_under_test proxy;
+    ASSERT_TRUE(proxy.start(server.connection_string(), 1));
+
+    raw_client first;
+    raw_client second;
+    ASSERT_TRUE(first.connect(proxy.port()));
+    ASSERT_TRUE(second.connect(proxy.port()));
+
+    first.send(raw_client::query("SELECT 1"));
+    EXPECT_EQ(first.read_until_ready(), "TCZ");
+    second.send(raw_client::query("SELECT 1"));
+    EXPECT_EQ(second.read_until_ready(), "TCZ");
+
+    // An open transaction keeps the server; the other client waits.
+    first.send(raw_client::query("BEGIN"));
+    first.read_until_ready();
+    EXPECT_EQ(first.status(), 'T');
+    second.send(raw_client::query("SELECT 1"));
+    EXPECT_FALSE(second.receives_within(100));
+    first.send(raw_client::query("COMMIT"));
+    first.read_until_ready();
+    EXPECT_EQ(first.status(), 'I');
+    EXPECT_EQ(second.read_until_ready(), "TCZ");
+
+    EXPECT_EQ(server.connections(), 1);
+}
+
+TEST(ProxyTest, ReparsesNamedStatementOnAnotherServer) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    proxy_under_test proxy;
+    ASSERT_TRUE(proxy.start(server.connection_string(), 2));
+    for (int wait = 0; wait < 500 && server.connections() < 2; ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_EQ(server.connections(), 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    raw_client first;
+    raw_client second;
+    ASSERT_TRUE(first.connect(proxy.port()));
+    ASSERT_TRUE(second.connect(proxy.port()));
+
+    first.send(raw_client::parse("by_id", "SELECT 1") + raw_client::sync());
+    EXPECT_EQ(first.read_until_ready(), "1Z");
+
+    // The server that prepared it is busy, so the Bind runs on the other
+    // one, which gets the Parse first; its ParseComplete is not forwarded.
+    second.send(raw_client::query("BEGIN"));
+    second.read_until_ready();
+    first.send(raw_client::bind("by_id") + raw_client::execute() + raw_client::sync());
+    EXPECT_EQ(first.read_until_ready(), "2CZ");
+    EXPECT_EQ(server.messages('P'), 2);
+    second.send(raw_client::query("COMMIT"));
+    second.read_until_ready();
+}
+
+TEST(ProxyTest, PipelinedBatchKeepsServerUntilItsSync) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    proxy_under_test proxy;
+    ASSERT_TRUE(proxy.start(server.connection_string(), 1));
+
+    raw_client pipelined;
+    raw_client other;
+    ASSERT_TRUE(pipelined.connect(proxy.port()));
+    ASSERT_TRUE(other.connect(proxy.port()));
+
+    // The second batch arrives with the first but its Sync comes later:
+    // the first ReadyForQuery must not hand the server to another client.
+    const std::string batch = raw_client::parse("", "SELECT 1") + raw_client::bind("") + raw_client::execute();
+    pipelined.send(batch + raw_client::sync() + batch);
+    EXPECT_EQ(pipelined.read_until_ready(), "12CZ");
+    other.send(raw_client::query("SELECT 1"));
+    EXPECT_FALSE(other.receives_within(100));
+    pipelined.send(raw_client::sync());
+    EXPECT_EQ(pipelined.read_until_ready(), "12CZ");
+    EXPECT_EQ(other.read_until_ready(), "TCZ");
+
+    // The same for a message cut in two after a Sync.
+    const std::string next = batch + raw_client::sync();
+    pipelined.send(next + next.substr(0, 3));
+    EXPECT_EQ(pipelined.read_until_ready(), "12CZ");
+    other.send(raw_client::query("SELECT 1"));
+    EXPECT_FALSE(other.receives_within(100));
+    pipelined.send(next.substr(3));
+    EXPECT_EQ(pipelined.read_until_ready(), "12CZ");
+    EXPECT_EQ(other.read_until_ready(), "TCZ");
+}
+
+TEST(ProxyTest, ClientLeavingMidTransactionDiscardsServer) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    proxy_under_test proxy;
+    ASSERT_TRUE(proxy.start(server.connection_string(), 1));
+
+    raw_client leaving;
+    ASSERT_TRUE(leaving.connect(proxy.port()));
+    leaving.send(raw_client::query("BEGIN"));
+    leaving.read_until_ready();
+    EXPECT_EQ(leaving.status(), 'T');
+    leaving.close();
+
+    // The next client runs on a new server connection outside any
+    // transaction, not in the one left open.
+    raw_client next;
+    ASSERT_TRUE(next.connect(proxy.port()));
+    next.send(raw_client::query("SELECT 1"));
+    EXPECT_EQ(next.read_until_ready(), "TCZ");
+    EXPECT_EQ(next.status(), 'I');
+    EXPECT_EQ(server.connections(), 2);
+}
+
+TEST(ProxyTest, ClosesUnusedStatementsPastCap) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    proxy_under_test proxy;
+    ASSERT_TRUE(proxy.start(server.connection_string(), 1, 2));
+
+    raw_client client;
+    ASSERT_TRUE(client.connect(proxy.port()));
+    client.send(raw_client::parse("a", "SELECT 1") + raw_client::parse("b", "SELECT 2")
+                + raw_client::parse("c", "SELECT 3") + raw_client::sync());
+    EXPECT_EQ(client.read_until_ready(), "111Z");
+
+    // Statements in use stay; once closed by the client they are closed
+    // on the server when the cap is passed again.
+    client.send(raw_client::close_statement("a") + raw_client::close_statement("b") + raw_client::sync());
+    EXPECT_EQ(client.read_until_ready(), "33Z");
+    EXPECT_EQ(server.messages('C'), 2);
+    client.send(raw_client::parse("d", "SELECT 4") + raw_client::sync());
+    EXPECT_EQ(client.read_until_ready(), "1Z");
+    for (int wait = 0; wait < 500 && server.messages('C') < 4; ++wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(server.messages('C'), 4);
+
+    // Their CloseComplete is not forwarded, and the same text can be
+    // prepared again.
+    client.send(raw_client::parse("a", "SELECT 1") + raw_client::bind("c") + raw_client::execute()
+                + raw_client::sync());
+    EXPECT_EQ(client.read_until_ready(), "12CZ");
+}
+#endif // __linux__
+
+TEST(SharedResultCacheTest, EntriesAreSharedBetweenMappings) {
+    const std::string name = "/database_test_cache_" + std::to_string(getpid());
+    shared_result_cache::remove(name);
+
+    shared_result_cache writer;
+    shared_result_cache reader;
+    ASSERT_TRUE(writer.open(name, 64 * 1024, 512));
+    ASSERT_TRUE(reader.open(name, 64 * 1024, 512));
+    EXPECT_FALSE(reader.open(name, 32 * 1024, 512));
+    ASSERT_TRUE(reader.open(name, 64 * 1024, 512));
+
+    std::string value;
+    EXPECT_FALSE(reader.get("SELECT 1", value));
+    EXPECT_TRUE(writer.put("SELECT 1", "one", std::chrono::seconds(10)));
+    ASSERT_TRUE(reader.get("SELECT 1", value));
+    EXPECT_EQ(value, "one");
+
+    EXPECT_TRUE(writer.put("SELECT 1", "uno", std::chrono::seconds(10)));
+    ASSERT_TRUE(reader.get("SELECT 1", value));
+    EXPECT_EQ(value, "uno");
+
+    EXPECT_TRUE(writer.put("SELECT 2", "two", std::chrono::milliseconds(1)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    EXPECT_FALSE(reader.get("SELECT 2", value));
+
+    reader.invalidate("SELECT 1");
+    EXPECT_FALSE(writer.get("SELECT 1", value));
+
+    EXPECT_FALSE(writer.put("big", std::string(writer.max_entry_bytes(), 'x'), std::chrono::seconds(10)));
+    EXPECT_EQ(reader.stats().rejected, 1u);
+
+    // A forked process sees the same segment.
+    writer.put("SELECT 3", "three", std::chrono::seconds(10));
+    const pid_t child = fork();
+    if (child == 0) {
+        shared_result_cache other;
+        std::string seen;
+        const bool ok = other.open(name, 64 * 1024, 512) && other.get("SELECT 3", seen) && seen == "three"
+                        && other.put("SELECT 4", "four", std::chrono::seconds(10));
+        _exit(ok ? 0 : 1);
+    }
+    int status = 0;
+    ASSERT_EQ(waitpid(child, &status, 0), child);
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    ASSERT_TRUE(writer.get("SELECT 4", value));
+    EXPECT_EQ(value, "four");
+
+    EXPECT_TRUE(shared_result_cache::remove(name));
+}
+
+TEST(SharedResultCacheTest, EvictsLeastRecentlyUsedWithinSize) {
+    const std::string name = "/database_test_evict_" + std::to_string(getpid());
+    shared_result_cache::remove(name);
+
+    // 16 slots: two sets of eight.
+    shared_result_cache cache;
+    ASSERT_TRUE(cache.open(name, 16 * 256, 256));
+
+    std::string value;
+    for (int i = 0; i < 200; ++i) {
+        const std::string key = "key" + std::to_string(i);
+        EXPECT_TRUE(cache.put(key, "value", std::chrono::seconds(10)));
+        // Keep key0 hot so it survives.
+        EXPECT_TRUE(cache.get("key0", value));
+    }
+
+    int live = 0;
+    for (int i = 0; i < 200; ++i) {
+        live += cache.get("key" + std::to_string(i), value) ? 1 : 0;
+    }
+    EXPECT_LE(live, 16);
+    EXPECT_TRUE(cache.get("key0", value));
+    EXPECT_TRUE(cache.get("key199", value));
+    EXPECT_GE(cache.stats().evictions, 200u - 16u);
+
+    cache.clear();
+    EXPECT_FALSE(cache.get("key199", value));
+    EXPECT_TRUE(shared_result_cache::remove(name));
+}
+
+TEST(TableMirrorTest, ReadersKeepTheirVersionAcrossRefreshes) {
+    pg_loopback_server server;
+    ASSERT_TRUE(server.start());
+    server.set_result_shape(100, 4);
+
+    postgres_manager source;
+    ASSERT_TRUE(source.connect(server.connection_string()));
+    table_mirror mirror("mirror_select", "SELECT id, payload FROM dimension", "id");
+
+    EXPECT_EQ(mirror.read().generation(), 0);
+    EXPECT_EQ(mirror.read().find(1), table_mirror::view::npos);
+
+    ASSERT_TRUE(mirror.refresh(source));
+    {
+        auto view = mirror.read();
+        EXPECT_EQ(view.generation(), 1);
+        ASSERT_EQ(view.rows().rows(), 100);
+        const size_t row = view.find(42);
+        ASSERT_NE(row, table_mirror::view::npos);
+        EXPECT_EQ(view.rows().integer(row, 0), 42);
+        EXPECT_EQ(view.rows().text(row, 1), "xxxx");
+        EXPECT_EQ(view.find("100"), view.find(100));
+        EXPECT_EQ(view.find(101), table_mirror::view::npos);
+    }
+
+    // Readers pin whichever version is current and must always see a
+    // complete one while refreshes alternate between two table sizes.
+    std::atomic<bool> running{ true };
+    std::atomic<int> torn{ 0 };
+    std::vector<std::thread> readers;
+    for (int thread = 0; thread < 4; ++thread) {
+        readers.emplace_back([&] {
+            while (running) {
+                auto view = mirror.read();
+                const size_t rows = view.rows().rows();
+                if ((rows != 100 && rows != 200) || view.find(static_cast<int64_t>(rows)) == table_mirror::view::npos
+                    || view.find(static_cast<int64_t>(rows + 1)) != table_mirror::view::npos) {
+                    ++torn;
+                }
+            }
+        });
+    }
+    for (int refresh = 0; refresh < 50; ++refresh) {
+        server.set_result_shape(refresh % 2 == 0 ? 200 : 100, 4);
+        ASSERT_TRUE(mirror.refresh(source));
+    }
+    running = false;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    EXPECT_EQ(torn, 0);
+    EXPECT_EQ(mirror.read().generation(), 51);
+
+    table_mirror missing_key("mirror_missing", "SELECT id, payload FROM dimension", "code");
+    EXPECT_FALSE(missing_key.refresh(source));
+}
+
 // Database Manager Singleton Tests
 TEST(DatabaseManagerTest, SingletonInstance) {
     auto& instance1 = database_manager::handle();
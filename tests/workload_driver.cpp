@@ -0,0 +1,584 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+// YCSB-style workload driver.
+//
+// Runs a configurable read/update/insert/scan mix against a single table
+// with zipfian, uniform or latest key popularity, either closed-loop (each
+// thread issues its next operation as soon as the previous one finishes) or
+// open-loop (operations arrive at a fixed rate regardless of how fast the
+// server answers). Latency is measured from the intended start time of
+// each operation, so queueing behind a slow operation is counted instead of
+// being hidden (coordinated omission).
+//
+// Example:
+//   database_workload --load --records 100000
+//   database_workload --records 100000 --mix 95/5/0/0 --distribution zipfian
+//                     --threads 16 --target-rate 20000 --duration 60 --slo-ms 5
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../postgres_manager.h"
+#include "../latency_histogram.h"
+
+using namespace database;
+
+namespace {
+
+enum class operation_type { read = 0, update = 1, insert = 2, scan = 3 };
+constexpr size_t operation_type_count = 4;
+const char* operation_names[operation_type_count] = { "READ", "UPDATE", "INSERT", "SCAN" };
+
+enum class key_distribution { zipfian, uniform, latest };
+
+struct workload_options {
+    std::string connection = "host=localhost port=5432 dbname=postgres user=postgres";
+    std::string table = "usertable";
+    uint64_t records = 10000;
+    uint64_t operations = 0;
+    double duration_seconds = 30.0;
+    size_t threads = 4;
+    double proportions[operation_type_count] = { 0.95, 0.05, 0.0, 0.0 };
+    key_distribution distribution = key_distribution::zipfian;
+    double zipfian_constant = 0.99;
+    uint64_t max_scan_length = 100;
+    size_t field_count = 10;
+    size_t field_length = 100;
+    double target_rate = 0.0;
+    bool open_loop = false;
+    bool load = false;
+    double slo_ms = 0.0;
+};
+
+uint64_t fnv_hash(uint64_t value) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int index = 0; index < 8; ++index) {
+        hash ^= value & 0xFF;
+        hash *= 1099511628211ULL;
+        value >>= 8;
+    }
+    return hash;
+}
+
+// Keys are hashed so that inserts and popular keys are spread over the
+// index instead of being clustered at one end, as in YCSB.
+std::string build_key(const uint64_t& index) {
+    return "user" + std::to_string(fnv_hash(index));
+}
+
+// Zipfian generator from Gray et al., "Quickly Generating Billion-Record
+// Synthetic Databases", the same algorithm YCSB uses.
+class zipfian_generator {
+public:
+    zipfian_generator(const uint64_t& items, const double& theta)
+        : items_(items), theta_(theta) {
+        zeta_n_ = zeta(items_, theta_);
+        const double zeta_2 = zeta(2, theta_);
+        alpha_ = 1.0 / (1.0 - theta_);
+        eta_ = (1.0 - std::pow(2.0 / static_cast<double>(items_), 1.0 - theta_))
+               / (1.0 - zeta_2 / zeta_n_);
+    }
+
+    uint64_t next(std::mt19937_64& random) const {
+        const double u = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+        const double uz = u * zeta_n_;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + std::pow(0.5, theta_)) {
+            return 1;
+        }
+        const auto value = static_cast<uint64_t>(
+            static_cast<double>(items_) * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+        return value >= items_ ? items_ - 1 : value;
+    }
+
+private:
+    static double zeta(const uint64_t& count, const double& theta) {
+        double sum = 0.0;
+        for (uint64_t index = 1; index <= count; ++index) {
+            sum += 1.0 / std::pow(static_cast<double>(index), theta);
+        }
+        return sum;
+    }
+
+    uint64_t items_;
+    double theta_;
+    double zeta_n_ = 0.0;
+    double alpha_ = 0.0;
+    double eta_ = 0.0;
+};
+
+class key_chooser {
+public:
+    key_chooser(const workload_options& options, std::atomic<uint64_t>& inserted)
+        : options_(options), inserted_(inserted),
+          zipfian_(options.records == 0 ? 1 : options.records, options.zipfian_constant) {}
+
+    uint64_t next(std::mt19937_64& random) const {
+        const uint64_t available = inserted_.load(std::memory_order_relaxed);
+        if (available == 0) {
+            return 0;
+        }
+
+        switch (options_.distribution) {
+        case key_distribution::uniform:
+            return std::uniform_int_distribution<uint64_t>(0, available - 1)(random);
+        case key_distribution::latest: {
+            // Most recently inserted keys are the most popular.
+            const uint64_t offset = zipfian_.next(random) % available;
+            return available - 1 - offset;
+        }
+        case key_distribution::zipfian:
+            break;
+        }
+
+        // Scramble the zipfian rank so popular keys are not adjacent.
+        return fnv_hash(zipfian_.next(random)) % available;
+    }
+
+private:
+    const workload_options& options_;
+    std::atomic<uint64_t>& inserted_;
+    zipfian_generator zipfian_;
+};
+
+std::string random_value(std::mt19937_64& random, const size_t& length) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    std::uniform_int_distribution<size_t> pick(0, sizeof(alphabet) - 2);
+
+    std::string value(length, ' ');
+    for (auto& c : value) {
+        c = alphabet[pick(random)];
+    }
+    return value;
+}
+
+std::string insert_statement(const workload_options& options, std::mt19937_64& random,
+                             const uint64_t& first, const uint64_t& count) {
+    std::ostringstream query;
+    query << "INSERT INTO " << options.table << " VALUES ";
+    for (uint64_t index = first; index < first + count; ++index) {
+        if (index != first) {
+            query << ", ";
+        }
+        query << "('" << build_key(index) << "'";
+        for (size_t field = 0; field < options.field_count; ++field) {
+            query << ", '" << random_value(random, options.field_length) << "'";
+        }
+        query << ")";
+    }
+    return query.str();
+}
+
+bool create_and_load(const workload_options& options) {
+    postgres_manager connection;
+    if (!connection.connect(options.connection)) {
+        std::cerr << "load: could not connect\n";
+        return false;
+    }
+
+    std::ostringstream schema;
+    schema << "CREATE TABLE " << options.table << " (ycsb_key VARCHAR(64) PRIMARY KEY";
+    for (size_t field = 0; field < options.field_count; ++field) {
+        schema << ", field" << field << " TEXT";
+    }
+    schema << ")";
+
+    connection.create_query("DROP TABLE IF EXISTS " + options.table);
+    if (!connection.create_query(schema.str())) {
+        std::cerr << "load: could not create " << options.table << "\n";
+        return false;
+    }
+
+    std::mt19937_64 random(42);
+    const uint64_t batch = 500;
+    for (uint64_t first = 0; first < options.records; first += batch) {
+        const uint64_t count = std::min(batch, options.records - first);
+        if (connection.insert_query(insert_statement(options, random, first, count)) != count) {
+            std::cerr << "load: insert failed at record " << first << "\n";
+            return false;
+        }
+    }
+
+    connection.create_query("ANALYZE " + options.table);
+    std::cout << "Loaded " << options.records << " records into " << options.table << "\n";
+    return true;
+}
+
+struct shared_state {
+    std::atomic<uint64_t> inserted{ 0 };
+    std::atomic<uint64_t> next_insert{ 0 };
+    std::atomic<uint64_t> issued{ 0 };
+    std::atomic<uint64_t> completed{ 0 };
+    std::atomic<uint64_t> failures{ 0 };
+    std::atomic<bool> stop{ false };
+    latency_histogram latency[operation_type_count];
+    latency_histogram service_time[operation_type_count];
+};
+
+bool run_operation(postgres_manager& connection, const workload_options& options,
+                   const operation_type& type, const key_chooser& keys, shared_state& state,
+                   std::mt19937_64& random) {
+    switch (type) {
+    case operation_type::read: {
+        auto result = connection.select_query("SELECT * FROM " + options.table
+                                              + " WHERE ycsb_key = '"
+                                              + build_key(keys.next(random)) + "'");
+        return result != nullptr;
+    }
+    case operation_type::update: {
+        const size_t field = std::uniform_int_distribution<size_t>(
+            0, options.field_count - 1)(random);
+        return connection.update_query("UPDATE " + options.table + " SET field"
+                                       + std::to_string(field) + " = '"
+                                       + random_value(random, options.field_length)
+                                       + "' WHERE ycsb_key = '"
+                                       + build_key(keys.next(random)) + "'")
+               == 1;
+    }
+    case operation_type::insert: {
+        const uint64_t index = state.next_insert.fetch_add(1);
+        const bool inserted
+            = connection.insert_query(insert_statement(options, random, index, 1)) == 1;
+        if (inserted) {
+            // Raise the key count to cover this key. An earlier insert
+            // that is still running or failed leaves a gap that "latest"
+            // may pick; waiting for it instead would stall this worker,
+            // or spin forever if it failed.
+            uint64_t current = state.inserted.load();
+            while (current < index + 1
+                   && !state.inserted.compare_exchange_weak(current, index + 1)) {
+            }
+        }
+        return inserted;
+    }
+    case operation_type::scan: {
+        const uint64_t length = std::uniform_int_distribution<uint64_t>(
+            1, options.max_scan_length)(random);
+        auto result = connection.select_query(
+            "SELECT * FROM " + options.table + " WHERE ycsb_key >= '"
+            + build_key(keys.next(random)) + "' ORDER BY ycsb_key LIMIT "
+            + std::to_string(length));
+        return result != nullptr;
+    }
+    }
+    return false;
+}
+
+operation_type choose_operation(const workload_options& options, std::mt19937_64& random) {
+    double point = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+    for (size_t index = 0; index < operation_type_count; ++index) {
+        if (point < options.proportions[index]) {
+            return static_cast<operation_type>(index);
+        }
+        point -= options.proportions[index];
+    }
+    return operation_type::read;
+}
+
+void worker(const workload_options& options, shared_state& state, const key_chooser& keys,
+            const std::chrono::steady_clock::time_point& start, const size_t& thread_index) {
+    postgres_manager connection;
+    if (!connection.connect(options.connection)) {
+        std::cerr << "worker " << thread_index << ": could not connect\n";
+        state.failures.fetch_add(1);
+        return;
+    }
+
+    std::mt19937_64 random(std::random_device{}() ^ (thread_index * 0x9E3779B97F4A7C15ULL));
+    const auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                      std::chrono::duration<double>(options.duration_seconds));
+
+    // Closed-loop pacing: each thread aims for rate / threads operations per
+    // second and back-fills the samples it missed while stalled.
+    const double per_thread_rate = options.target_rate / static_cast<double>(options.threads);
+    const uint64_t pacing_interval_ns
+        = (!options.open_loop && per_thread_rate > 0.0)
+              ? static_cast<uint64_t>(1e9 / per_thread_rate)
+              : 0;
+    const uint64_t arrival_interval_ns
+        = options.open_loop ? static_cast<uint64_t>(1e9 / options.target_rate) : 0;
+    auto next_paced = start;
+
+    while (!state.stop.load(std::memory_order_relaxed)) {
+        const uint64_t sequence = state.issued.fetch_add(1);
+        if (options.operations != 0 && sequence >= options.operations) {
+            break;
+        }
+
+        // The time the operation should have started. In open-loop mode
+        // this is its slot on the global arrival schedule, so time spent
+        // waiting for a busy worker counts as latency.
+        std::chrono::steady_clock::time_point intended;
+        if (options.open_loop) {
+            intended = start + std::chrono::nanoseconds(sequence * arrival_interval_ns);
+        } else if (pacing_interval_ns != 0) {
+            intended = next_paced;
+            next_paced += std::chrono::nanoseconds(pacing_interval_ns);
+        } else {
+            intended = std::chrono::steady_clock::now();
+        }
+
+        if (intended >= deadline && options.operations == 0) {
+            break;
+        }
+        std::this_thread::sleep_until(intended);
+
+        const operation_type type = choose_operation(options, random);
+        const auto issued = std::chrono::steady_clock::now();
+        const bool succeeded = run_operation(connection, options, type, keys, state, random);
+        const auto finished = std::chrono::steady_clock::now();
+        state.completed.fetch_add(1, std::memory_order_relaxed);
+
+        if (!succeeded) {
+            state.failures.fetch_add(1, std::memory_order_relaxed);
+            if (!connection.is_connected()) {
+                connection.connect(options.connection);
+            }
+        }
+
+        const auto index = static_cast<size_t>(type);
+        const auto latency = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(finished - intended).count());
+        const auto service = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(finished - issued).count());
+
+        if (pacing_interval_ns != 0) {
+            state.latency[index].record_corrected(service, pacing_interval_ns);
+        } else {
+            state.latency[index].record(latency);
+        }
+        state.service_time[index].record(service);
+
+        if (options.operations == 0 && finished >= deadline) {
+            break;
+        }
+    }
+
+    connection.disconnect();
+}
+
+void print_histogram(const char* label, const latency_histogram& histogram) {
+    if (histogram.count() == 0) {
+        return;
+    }
+    std::printf("  %-8s count=%-10llu p50=%8.3f p90=%8.3f p99=%8.3f p99.9=%8.3f max=%8.3f ms\n",
+                label, static_cast<unsigned long long>(histogram.count()),
+                histogram.value_at_quantile(0.50) / 1e6, histogram.value_at_quantile(0.90) / 1e6,
+                histogram.value_at_quantile(0.99) / 1e6, histogram.value_at_quantile(0.999) / 1e6,
+                histogram.max() / 1e6);
+}
+
+bool parse_mix(const std::string& text, workload_options& options) {
+    double values[operation_type_count] = { 0, 0, 0, 0 };
+    std::istringstream stream(text);
+    std::string part;
+    size_t index = 0;
+    while (std::getline(stream, part, '/') && index < operation_type_count) {
+        values[index++] = std::atof(part.c_str());
+    }
+
+    const double total = values[0] + values[1] + values[2] + values[3];
+    if (index != operation_type_count || total <= 0.0) {
+        return false;
+    }
+    for (size_t op = 0; op < operation_type_count; ++op) {
+        options.proportions[op] = values[op] / total;
+    }
+    return true;
+}
+
+void print_usage() {
+    std::cout
+        << "Usage: database_workload [options]\n"
+           "  --connection <conninfo>   libpq connection string\n"
+           "  --table <name>            table name (default usertable)\n"
+           "  --load                    (re)create and populate the table, then exit\n"
+           "  --records <n>             number of preloaded records (default 10000)\n"
+           "  --mix <r/u/i/s>           read/update/insert/scan proportions (default 95/5/0/0)\n"
+           "  --distribution <d>        zipfian | uniform | latest (default zipfian)\n"
+           "  --zipfian-constant <t>    zipfian skew (default 0.99)\n"
+           "  --max-scan-length <n>     longest scan (default 100)\n"
+           "  --fields <n>              value columns per record (default 10)\n"
+           "  --field-length <n>        bytes per value column (default 100)\n"
+           "  --threads <n>             worker connections (default 4)\n"
+           "  --duration <seconds>      run time (default 30)\n"
+           "  --operations <n>          stop after n operations instead\n"
+           "  --target-rate <ops/s>     pace operations; 0 runs unthrottled\n"
+           "  --open-loop               issue at --target-rate on a fixed schedule\n"
+           "  --slo-ms <ms>             report whether p99 stays under this latency\n";
+}
+
+bool parse_arguments(int argc, char** argv, workload_options& options) {
+    for (int index = 1; index < argc; ++index) {
+        const std::string argument = argv[index];
+        auto value = [&]() -> std::string {
+            return (index + 1 < argc) ? std::string(argv[++index]) : std::string();
+        };
+
+        if (argument == "--connection") {
+            options.connection = value();
+        } else if (argument == "--table") {
+            options.table = value();
+        } else if (argument == "--load") {
+            options.load = true;
+        } else if (argument == "--records") {
+            options.records = std::strtoull(value().c_str(), nullptr, 10);
+        } else if (argument == "--mix") {
+            if (!parse_mix(value(), options)) {
+                std::cerr << "--mix expects four proportions such as 50/50/0/0\n";
+                return false;
+            }
+        } else if (argument == "--distribution") {
+            const std::string name = value();
+            if (name == "zipfian") {
+                options.distribution = key_distribution::zipfian;
+            } else if (name == "uniform") {
+                options.distribution = key_distribution::uniform;
+            } else if (name == "latest") {
+                options.distribution = key_distribution::latest;
+            } else {
+                std::cerr << "unknown distribution: " << name << "\n";
+                return false;
+            }
+        } else if (argument == "--zipfian-constant") {
+            options.zipfian_constant = std::atof(value().c_str());
+        } else if (argument == "--max-scan-length") {
+            options.max_scan_length = std::max<uint64_t>(1, std::strtoull(value().c_str(), nullptr, 10));
+        } else if (argument == "--fields") {
+            options.field_count = std::max<size_t>(1, std::strtoull(value().c_str(), nullptr, 10));
+        } else if (argument == "--field-length") {
+            options.field_length = std::strtoull(value().c_str(), nullptr, 10);
+        } else if (argument == "--threads") {
+            options.threads = std::max<size_t>(1, std::strtoull(value().c_str(), nullptr, 10));
+        } else if (argument == "--duration") {
+            options.duration_seconds = std::atof(value().c_str());
+        } else if (argument == "--operations") {
+            options.operations = std::strtoull(value().c_str(), nullptr, 10);
+        } else if (argument == "--target-rate") {
+            options.target_rate = std::atof(value().c_str());
+        } else if (argument == "--open-loop") {
+            options.open_loop = true;
+        } else if (argument == "--slo-ms") {
+            options.slo_ms = std::atof(value().c_str());
+        } else {
+            print_usage();
+            return false;
+        }
+    }
+
+    if (options.open_loop && options.target_rate <= 0.0) {
+        std::cerr << "--open-loop requires --target-rate\n";
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    workload_options options;
+    if (!parse_arguments(argc, argv, options)) {
+        return 1;
+    }
+
+    if (options.load) {
+        return create_and_load(options) ? 0 : 1;
+    }
+
+    shared_state state;
+    state.inserted.store(options.records);
+    state.next_insert.store(options.records);
+    key_chooser keys(options, state.inserted);
+
+    std::printf("Running %s workload: %zu threads, mix %.2f/%.2f/%.2f/%.2f, target %.0f ops/s\n",
+                options.open_loop ? "open-loop" : "closed-loop", options.threads,
+                options.proportions[0], options.proportions[1], options.proportions[2],
+                options.proportions[3], options.target_rate);
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t index = 0; index < options.threads; ++index) {
+        workers.emplace_back(worker, std::cref(options), std::ref(state), std::cref(keys), start,
+                             index);
+    }
+    for (auto& thread : workers) {
+        thread.join();
+    }
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    latency_histogram overall;
+    for (const auto& histogram : state.latency) {
+        overall.merge(histogram);
+    }
+
+    // The latency histograms include samples back-filled for operations a
+    // stalled closed-loop worker never sent, so throughput counts only the
+    // operations that ran.
+    const uint64_t completed = state.completed.load();
+    std::printf("\nThroughput: %.1f ops/s (%llu operations in %.2f s, %llu failed)\n",
+                static_cast<double>(completed) / elapsed, static_cast<unsigned long long>(completed),
+                elapsed, static_cast<unsigned long long>(state.failures.load()));
+
+    std::printf("\nLatency from intended start (coordinated-omission corrected):\n");
+    for (size_t index = 0; index < operation_type_count; ++index) {
+        print_histogram(operation_names[index], state.latency[index]);
+    }
+    print_histogram("ALL", overall);
+
+    std::printf("\nService time (from actual send):\n");
+    for (size_t index = 0; index < operation_type_count; ++index) {
+        print_histogram(operation_names[index], state.service_time[index]);
+    }
+
+    if (options.slo_ms > 0.0) {
+        const double p99_ms = overall.value_at_quantile(0.99) / 1e6;
+        std::printf("\nSLO p99 < %.3f ms: %s (p99 = %.3f ms)\n", options.slo_ms,
+                    p99_ms < options.slo_ms ? "MET" : "MISSED", p99_ms);
+        return p99_ms < options.slo_ms ? 0 : 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,473 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+
+#include "database/timeseries_writer.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <vector>
+
+namespace database
+{
+	namespace
+	{
+		constexpr int64_t microseconds_per_day = 86400LL * 1000000;
+
+		// 2000-01-01, where PostgreSQL timestamps count from.
+		constexpr int64_t postgres_epoch = 946684800LL * 1000000;
+
+		constexpr char copy_signature[] = "PGCOPY\n\377\r\n";
+
+		// Signature, flags and header extension length.
+		constexpr size_t copy_header_size = sizeof(copy_signature) + 8;
+
+		void put_big_endian(std::string& output, const uint64_t& value, const size_t& bytes)
+		{
+			for (size_t index = bytes; index-- > 0;)
+			{
+				output.push_back(static_cast<char>((value >> (index * 8)) & 0xff));
+			}
+		}
+
+		int64_t floor_divide(const int64_t& value, const int64_t& divisor)
+		{
+			const int64_t quotient = value / divisor;
+			return (value % divisor != 0 && value < 0) ? quotient - 1 : quotient;
+		}
+
+		int64_t unix_microseconds(const std::chrono::system_clock::time_point& time)
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+		}
+
+		void civil_from_days(int64_t days, int64_t& year, int64_t& month, int64_t& day)
+		{
+			days += 719468;
+			const int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+			const int64_t day_of_era = days - era * 146097;
+			const int64_t year_of_era
+				= (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+			const int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+			const int64_t shifted_month = (5 * day_of_year + 2) / 153;
+			day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+			month = shifted_month < 10 ? shifted_month + 3 : shifted_month - 9;
+			year = year_of_era + era * 400 + (month <= 2 ? 1 : 0);
+		}
+
+		struct utc_time
+		{
+			long long year;
+			int month;
+			int day;
+			int hour;
+			int minute;
+		};
+
+		utc_time to_utc(const int64_t& microseconds)
+		{
+			const int64_t days = floor_divide(microseconds, microseconds_per_day);
+			const int64_t minutes = (microseconds - days * microseconds_per_day) / 60000000;
+			int64_t year = 0;
+			int64_t month = 0;
+			int64_t day = 0;
+			civil_from_days(days, year, month, day);
+
+			return { static_cast<long long>(year), static_cast<int>(month), static_cast<int>(day),
+					 static_cast<int>(minutes / 60), static_cast<int>(minutes % 60) };
+		}
+
+		std::string timestamp_literal(const int64_t& microseconds)
+		{
+			const utc_time time = to_utc(microseconds);
+			char text[40];
+			std::snprintf(text, sizeof(text), "'%04lld-%02d-%02d %02d:%02d:00+00'", time.year, time.month,
+						  time.day, time.hour, time.minute);
+			return text;
+		}
+	} // namespace
+
+	timeseries_writer::timeseries_writer(const timeseries_writer_options& options)
+		: options_(options)
+		, interval_(std::max<int64_t>(60, options.partition_interval.count()) / 60 * 60000000)
+		, columns_(options.time_column + ", " + options.series_column + ", " + options.value_column)
+		, buffered_bytes_(0)
+		, running_(false)
+		, flush_requested_(0)
+		, flush_completed_(0)
+		, created_through_(INT64_MIN)
+	{
+		options_.flush_points = std::max<size_t>(1, options_.flush_points);
+	}
+
+	timeseries_writer::~timeseries_writer(void) { stop(); }
+
+	bool timeseries_writer::start(const std::string& connect_string)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (running_ || thread_.joinable())
+			{
+				return false;
+			}
+		}
+
+		if (!connection_.connect(connect_string))
+		{
+			return false;
+		}
+		create_ahead();
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		running_ = true;
+		thread_ = std::thread(&timeseries_writer::run, this);
+
+		return true;
+	}
+
+	void timeseries_writer::stop(void)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			running_ = false;
+		}
+		wake_.notify_all();
+		space_.notify_all();
+
+		if (thread_.joinable())
+		{
+			thread_.join();
+			connection_.disconnect();
+		}
+	}
+
+	bool timeseries_writer::append(const std::chrono::system_clock::time_point& time,
+								   std::string_view series,
+								   const double& value)
+	{
+		const timeseries_point point{ time, series, value };
+		return append(std::span<const timeseries_point>(&point, 1));
+	}
+
+	bool timeseries_writer::append(std::span<const timeseries_point> points)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (running_ && !has_space())
+		{
+			++stats_.waits;
+			space_.wait(lock, [this]() { return !running_ || has_space(); });
+		}
+		if (!running_)
+		{
+			return false;
+		}
+
+		for (const timeseries_point& point : points)
+		{
+			encode(point.time, point.series, point.value);
+		}
+
+		return true;
+	}
+
+	bool timeseries_writer::try_append(const std::chrono::system_clock::time_point& time,
+									   std::string_view series,
+									   const double& value)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!running_)
+		{
+			return false;
+		}
+		if (!has_space())
+		{
+			++stats_.points_rejected;
+			return false;
+		}
+
+		encode(time, series, value);
+
+		return true;
+	}
+
+	void timeseries_writer::flush(void)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (!running_)
+		{
+			return;
+		}
+
+		const uint64_t target = ++flush_requested_;
+		wake_.notify_one();
+		flushed_.wait(lock, [this, target]() { return flush_completed_ >= target; });
+	}
+
+	timeseries_writer_stats timeseries_writer::stats(void) const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		timeseries_writer_stats result = stats_;
+		result.buffered_bytes = buffered_bytes_;
+		return result;
+	}
+
+	std::string timeseries_writer::partition_name(const int64_t& lower) const
+	{
+		const utc_time time = to_utc(lower);
+		char suffix[40];
+		if (interval_ % microseconds_per_day == 0)
+		{
+			std::snprintf(suffix, sizeof(suffix), "_p%04lld%02d%02d", time.year, time.month, time.day);
+		}
+		else
+		{
+			std::snprintf(suffix, sizeof(suffix), "_p%04lld%02d%02d_%02d%02d", time.year, time.month, time.day,
+						  time.hour, time.minute);
+		}
+
+		return options_.table + suffix;
+	}
+
+	bool timeseries_writer::has_space(void) const { return buffered_bytes_ < options_.max_buffered_bytes; }
+
+	void timeseries_writer::encode(const std::chrono::system_clock::time_point& time,
+								   std::string_view series,
+								   const double& value)
+	{
+		const int64_t microseconds = unix_microseconds(time);
+		buffer& target = buffers_[floor_divide(microseconds, interval_) * interval_];
+		const size_t before = target.data.size();
+		if (target.points == 0)
+		{
+			target.first = std::chrono::steady_clock::now();
+			target.data.append(copy_signature, sizeof(copy_signature));
+			put_big_endian(target.data, 0, 4); // flags
+			put_big_endian(target.data, 0, 4); // header extension length
+		}
+
+		put_big_endian(target.data, 3, 2);
+		put_big_endian(target.data, 8, 4);
+		put_big_endian(target.data, static_cast<uint64_t>(microseconds - postgres_epoch), 8);
+		put_big_endian(target.data, series.size(), 4);
+		target.data.append(series);
+		put_big_endian(target.data, 8, 4);
+		put_big_endian(target.data, std::bit_cast<uint64_t>(value), 8);
+
+		buffered_bytes_ += target.data.size() - before;
+		if (++target.points == options_.flush_points)
+		{
+			wake_.notify_one();
+		}
+	}
+
+	void timeseries_writer::run(void)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		for (;;)
+		{
+			const uint64_t requested = flush_requested_;
+			const bool everything = !running_ || requested != flush_completed_;
+			const auto now = std::chrono::steady_clock::now();
+			auto deadline = now + options_.flush_age;
+
+			std::vector<std::pair<int64_t, buffer>> due;
+			for (auto it = buffers_.begin(); it != buffers_.end();)
+			{
+				if (everything
+					|| (now >= it->second.retry
+						&& (it->second.points >= options_.flush_points
+							|| now - it->second.first >= options_.flush_age)))
+				{
+					due.emplace_back(it->first, std::move(it->second));
+					it = buffers_.erase(it);
+					continue;
+				}
+				deadline = std::min(deadline, std::max(it->second.first + options_.flush_age, it->second.retry));
+				++it;
+			}
+
+			if (due.empty())
+			{
+				if (everything)
+				{
+					flush_completed_ = requested;
+					flushed_.notify_all();
+					if (!running_)
+					{
+						break;
+					}
+					continue;
+				}
+
+				const int64_t upcoming
+					= floor_divide(unix_microseconds(std::chrono::system_clock::now()), interval_) * interval_
+					  + static_cast<int64_t>(options_.partitions_ahead) * interval_;
+				if (upcoming > created_through_)
+				{
+					lock.unlock();
+					create_ahead();
+					lock.lock();
+					continue;
+				}
+
+				wake_.wait_until(lock, deadline);
+				continue;
+			}
+
+			// Bytes stay counted until they are sent, so the cap also
+			// covers batches in flight.
+			size_t sent = 0;
+			for (const auto& [lower, batch] : due)
+			{
+				sent += batch.data.size();
+			}
+
+			lock.unlock();
+			std::vector<bool> written;
+			for (auto& [lower, batch] : due)
+			{
+				written.push_back(write(lower, batch));
+			}
+			lock.lock();
+
+			for (size_t index = 0; index < due.size(); ++index)
+			{
+				if (!written[index])
+				{
+					requeue(due[index].first, due[index].second, sent);
+				}
+			}
+			buffered_bytes_ -= sent;
+			space_.notify_all();
+			if (everything)
+			{
+				flush_completed_ = requested;
+				flushed_.notify_all();
+			}
+		}
+	}
+
+	void timeseries_writer::requeue(const int64_t& lower, buffer& batch, size_t& sent)
+	{
+		if (!running_)
+		{
+			stats_.points_failed += batch.points;
+			return;
+		}
+
+		// The failed batch keeps its bytes counted and goes ahead of
+		// points appended since, which lose their own COPY header.
+		++stats_.retried;
+		sent -= batch.data.size();
+		batch.retry = std::chrono::steady_clock::now() + options_.flush_age;
+		auto newer = buffers_.find(lower);
+		if (newer != buffers_.end())
+		{
+			batch.data.append(newer->second.data, copy_header_size);
+			batch.points += newer->second.points;
+			buffered_bytes_ -= copy_header_size;
+		}
+		buffers_[lower] = std::move(batch);
+	}
+
+	bool timeseries_writer::write(const int64_t& lower, buffer& batch)
+	{
+		const std::string table = target(lower);
+		put_big_endian(batch.data, 0xffff, 2); // file trailer
+
+		uint64_t rows = 0;
+		bool written = connection_.copy_in("COPY " + table + " (" + columns_ + ") FROM STDIN (FORMAT binary)",
+										   batch.data, rows);
+		const bool rerouted = !written && table != options_.table;
+		if (rerouted)
+		{
+			// The partition may have been dropped or detached; it is
+			// created again on its next batch.
+			targets_.erase(lower);
+			written = connection_.copy_in("COPY " + options_.table + " (" + columns_
+											  + ") FROM STDIN (FORMAT binary)",
+										  batch.data, rows);
+		}
+
+		if (!written)
+		{
+			batch.data.resize(batch.data.size() - 2);
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		stats_.copies += rerouted ? 2 : 1;
+		stats_.rerouted += rerouted ? 1 : 0;
+		stats_.points_written += written ? batch.points : 0;
+		return written;
+	}
+
+	const std::string& timeseries_writer::target(const int64_t& lower)
+	{
+		auto found = targets_.find(lower);
+		if (found != targets_.end())
+		{
+			return found->second;
+		}
+
+		const std::string name = partition_name(lower);
+		if (connection_.create_query("CREATE TABLE IF NOT EXISTS " + name + " PARTITION OF " + options_.table
+									 + " FOR VALUES FROM (" + timestamp_literal(lower) + ") TO ("
+									 + timestamp_literal(lower + interval_) + ")"))
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			++stats_.partitions_created;
+			return targets_.emplace(lower, name).first->second;
+		}
+
+		if (connection_.last_error_state().empty())
+		{
+			// No answer from the server: try again on the next batch.
+			return options_.table;
+		}
+
+		// The server refused the range, e.g. because it overlaps a
+		// partition made by hand; the parent routes these points.
+		return targets_.emplace(lower, options_.table).first->second;
+	}
+
+	void timeseries_writer::create_ahead(void)
+	{
+		const int64_t current
+			= floor_divide(unix_microseconds(std::chrono::system_clock::now()), interval_) * interval_;
+		for (size_t index = 0; index <= options_.partitions_ahead; ++index)
+		{
+			target(current + static_cast<int64_t>(index) * interval_);
+		}
+		created_through_ = current + static_cast<int64_t>(options_.partitions_ahead) * interval_;
+	}
+} // namespace database
@@ -0,0 +1,236 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include "postgres_manager.h"
+
+namespace database
+{
+	/**
+	 * @brief Target table and limits of a @c timeseries_writer.
+	 */
+	struct timeseries_writer_options
+	{
+		std::string table; ///< Parent table, range-partitioned on @c time_column.
+		std::string time_column = "time"; ///< timestamptz
+		std::string series_column = "series"; ///< text
+		std::string value_column = "value"; ///< float8
+		std::chrono::seconds partition_interval = std::chrono::hours(24);
+		size_t partitions_ahead = 2; ///< Partitions kept created past the current one.
+		size_t flush_points = 50000; ///< A partition's points are sent at this many...
+		std::chrono::milliseconds flush_age{ 1000 }; ///< ...or when the oldest is this old.
+		size_t max_buffered_bytes = 64 * 1024 * 1024; ///< @c append waits above this.
+	};
+
+	/**
+	 * @brief One point for @c timeseries_writer::append.
+	 */
+	struct timeseries_point
+	{
+		std::chrono::system_clock::time_point time;
+		std::string_view series;
+		double value;
+	};
+
+	/**
+	 * @brief Counters of a @c timeseries_writer.
+	 */
+	struct timeseries_writer_stats
+	{
+		uint64_t points_written = 0;
+		uint64_t points_failed = 0; ///< Dropped on @c stop after failing.
+		uint64_t points_rejected = 0; ///< Refused by @c try_append over the memory cap.
+		uint64_t copies = 0; ///< COPY statements sent.
+		uint64_t rerouted = 0; ///< Batches sent through the parent table.
+		uint64_t retried = 0; ///< Failed batches kept for another attempt.
+		uint64_t partitions_created = 0;
+		uint64_t waits = 0; ///< Times @c append waited for buffer space.
+		size_t buffered_bytes = 0; ///< Buffered and in-flight data.
+	};
+
+	/**
+	 * @class timeseries_writer
+	 * @brief Buffers time-series points per time partition and writes
+	 *        them with binary @c COPY.
+	 *
+	 * The parent table is expected to be range-partitioned on its time
+	 * column with one partition per @c partition_interval, counted from
+	 * the Unix epoch in UTC; with the default of a day that is
+	 * @code
+	 * CREATE TABLE metrics (time timestamptz, series text, value float8)
+	 *     PARTITION BY RANGE (time);
+	 * @endcode
+	 * and partitions named like @c metrics_p20261017. The writer creates
+	 * the partition of the current interval and @c partitions_ahead more
+	 * on start and whenever the interval rolls over, so new points rarely
+	 * wait for DDL. A partition for older points is created on their
+	 * first flush; if it cannot be created, for example because the
+	 * range overlaps a partition made by hand, its points go through the
+	 * parent.
+	 *
+	 * Each append encodes the point straight into the binary COPY buffer
+	 * of its partition. A background thread with its own connection sends
+	 * a buffer as one @c COPY into the child table once it holds
+	 * @c flush_points points or its oldest point is @c flush_age old, so
+	 * the server neither parses text nor routes tuples. A batch the
+	 * partition rejects is sent once more through the parent. If that
+	 * fails too, the batch is put back in front of its partition's
+	 * newer points, still counted against the memory cap, and retried
+	 * no sooner than @c flush_age later or on the next @c flush. Only
+	 * batches still failing on @c stop are dropped and counted in
+	 * @c points_failed.
+	 *
+	 * Memory is capped: @c append waits while @c max_buffered_bytes are
+	 * buffered or being sent, and @c try_append refuses the point
+	 * instead. The cap is checked once per call, so a large batch may go
+	 * past it by its own size.
+	 *
+	 * All members are thread-safe.
+	 */
+	class timeseries_writer
+	{
+	public:
+		explicit timeseries_writer(const timeseries_writer_options& options);
+		virtual ~timeseries_writer(void);
+
+		timeseries_writer(const timeseries_writer&) = delete;
+		timeseries_writer& operator=(const timeseries_writer&) = delete;
+
+		/**
+		 * @brief Connects, creates the upcoming partitions and starts the
+		 *        flush thread.
+		 *
+		 * @return @c false if already started or the connection failed.
+		 */
+		bool start(const std::string& connect_string);
+
+		/**
+		 * @brief Sends every buffered point and stops the flush thread.
+		 */
+		void stop(void);
+
+		/**
+		 * @brief Buffers one point, waiting while the buffers are full.
+		 *
+		 * @return @c false if the writer is not running.
+		 */
+		bool append(const std::chrono::system_clock::time_point& time,
+					std::string_view series,
+					const double& value);
+
+		/**
+		 * @brief Buffers @p points under one lock, waiting while the
+		 *        buffers are full.
+		 */
+		bool append(std::span<const timeseries_point> points);
+
+		/**
+		 * @brief Buffers one point unless the buffers are full.
+		 *
+		 * @return @c false if the point was refused.
+		 */
+		bool try_append(const std::chrono::system_clock::time_point& time,
+						std::string_view series,
+						const double& value);
+
+		/**
+		 * @brief Sends every point appended so far and waits until they
+		 *        were written or put back for a retry.
+		 */
+		void flush(void);
+
+		timeseries_writer_stats stats(void) const;
+
+		/**
+		 * @brief Name of the partition that holds the interval starting
+		 *        at @p lower microseconds after the Unix epoch: the table
+		 *        name, "_p" and the UTC date, plus "_HHMM" for intervals
+		 *        that are not whole days.
+		 */
+		std::string partition_name(const int64_t& lower) const;
+
+	private:
+		struct buffer
+		{
+			std::string data; ///< Binary COPY header and tuples.
+			size_t points = 0;
+			std::chrono::steady_clock::time_point first;
+			std::chrono::steady_clock::time_point retry; ///< Not sent before, after a failure.
+		};
+
+		bool has_space(void) const;
+		void encode(const std::chrono::system_clock::time_point& time,
+					std::string_view series,
+					const double& value);
+		void run(void);
+		bool write(const int64_t& lower, buffer& batch);
+		void requeue(const int64_t& lower, buffer& batch, size_t& sent);
+		const std::string& target(const int64_t& lower);
+		void create_ahead(void);
+
+	private:
+		timeseries_writer_options options_;
+		int64_t interval_; ///< Partition width in microseconds.
+		std::string columns_;
+
+		mutable std::mutex mutex_;
+		std::condition_variable wake_; ///< Signals the flush thread.
+		std::condition_variable space_; ///< Signals waiting appends.
+		std::condition_variable flushed_; ///< Signals @c flush callers.
+		std::map<int64_t, buffer> buffers_; ///< By partition lower bound.
+		size_t buffered_bytes_;
+		bool running_;
+		uint64_t flush_requested_;
+		uint64_t flush_completed_;
+		timeseries_writer_stats stats_;
+
+		std::thread thread_;
+		// Used by the flush thread only.
+		postgres_manager connection_;
+		std::unordered_map<int64_t, std::string> targets_; ///< Lower bound to table.
+		int64_t created_through_;
+	};
+} // namespace database
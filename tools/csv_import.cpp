@@ -0,0 +1,160 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+// Loads a CSV or TSV file into a table with parallel COPY streams.
+//
+// The file is memory-mapped and cut into chunks on row boundaries; each
+// connection sends whole chunks with COPY ... FROM STDIN until none are
+// left. Rows are checked for a consistent field count before they are
+// sent. Each chunk commits on its own, so failed chunks are listed with
+// their byte ranges for a retry.
+//
+// Example:
+//   database_csv_import --connection "host=db dbname=app" --table events --header --jobs 8 events.csv
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "database/csv_import.h"
+
+using namespace database;
+
+namespace {
+
+struct import_options {
+    std::string path;
+    std::string connection = "host=localhost port=5432 dbname=postgres user=postgres";
+    csv_import_options load;
+};
+
+void print_usage() {
+    std::cout << "Usage: database_csv_import --table <name> [options] <file>\n"
+                 "  --connection <conninfo>   target server\n"
+                 "  --table <name>            table to load into\n"
+                 "  --columns <list>          column list, e.g. \"id, name\" (default all)\n"
+                 "  --delimiter <char|tab>    field delimiter (default ,)\n"
+                 "  --quote <char|none>       quote character (default \"); none sends\n"
+                 "                            PostgreSQL text format\n"
+                 "  --header                  skip the first row\n"
+                 "  --jobs <n>                parallel connections (default 4)\n"
+                 "  --chunk-mb <n>            input per COPY statement (default 16)\n";
+}
+
+bool parse_character(const std::string& value, char& output) {
+    if (value == "tab" || value == "\\t") {
+        output = '\t';
+    } else if (value == "none") {
+        output = '\0';
+    } else if (value.size() == 1) {
+        output = value[0];
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parse_arguments(int argc, char** argv, import_options& options) {
+    for (int index = 1; index < argc; ++index) {
+        const std::string argument = argv[index];
+        auto value = [&]() -> std::string {
+            return (index + 1 < argc) ? std::string(argv[++index]) : std::string();
+        };
+
+        bool valid = true;
+        if (argument == "--connection") {
+            options.connection = value();
+        } else if (argument == "--table") {
+            options.load.table = value();
+        } else if (argument == "--columns") {
+            options.load.columns = value();
+        } else if (argument == "--delimiter") {
+            valid = parse_character(value(), options.load.delimiter) && options.load.delimiter != '\0';
+        } else if (argument == "--quote") {
+            valid = parse_character(value(), options.load.quote);
+        } else if (argument == "--header") {
+            options.load.header = true;
+        } else if (argument == "--jobs") {
+            options.load.connections = std::max<size_t>(1, std::strtoull(value().c_str(), nullptr, 10));
+        } else if (argument == "--chunk-mb") {
+            options.load.chunk_bytes
+                = std::max<size_t>(1, std::strtoull(value().c_str(), nullptr, 10)) * 1024 * 1024;
+        } else if (argument.rfind("--", 0) != 0 && options.path.empty()) {
+            options.path = argument;
+        } else {
+            valid = false;
+        }
+
+        if (!valid) {
+            print_usage();
+            return false;
+        }
+    }
+
+    if (options.path.empty() || options.load.table.empty()) {
+        print_usage();
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    import_options options;
+    if (!parse_arguments(argc, argv, options)) {
+        return 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const csv_importer importer(options.load);
+    const csv_import_result result = importer.load_file(options.connection, options.path);
+    const double elapsed
+        = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (const auto& failed : result.failed_chunks) {
+        std::cerr << "bytes " << failed.offset << "-" << failed.offset + failed.bytes
+                  << " not loaded: " << failed.message << "\n";
+    }
+
+    const double megabytes = static_cast<double>(result.bytes) / (1024.0 * 1024.0);
+    std::printf("Loaded %llu rows (%.1f MiB) in %zu of %zu chunks in %.2f s, %.1f MiB/s\n",
+                static_cast<unsigned long long>(result.rows), megabytes,
+                result.chunks - std::min(result.chunks, result.failed_chunks.size()), result.chunks,
+                elapsed,
+                elapsed > 0.0 ? megabytes / elapsed : 0.0);
+
+    return result.completed ? 0 : 1;
+}
@@ -0,0 +1,1244 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+// Transaction-pooling proxy.
+//
+// Accepts any number of PostgreSQL client connections and runs each client
+// transaction on one of a small, fixed set of server connections, the way
+// pgbouncer's transaction mode does. A server connection is lent to a
+// client from its first message until the server reports it idle outside a
+// transaction with every message the client sent answered, then goes to
+// the next waiting client.
+//
+// Server connections are opened with libpq, so every authentication option
+// of a connection string works; after the handshake the proxy relays
+// protocol messages on their sockets itself, which it can only do on a
+// plain socket, so sslmode and gssencmode are forced to disable (run the
+// proxy next to the server or inside a trusted network). Clients are not
+// authenticated (listen on loopback or a trusted network only), and their
+// startup parameters are ignored: every client talks to the backend named
+// by --connection.
+//
+// Named prepared statements are tracked: a client's Parse is recorded and
+// sent under a shared server-side name, and Bind or Describe on a server
+// that has not seen it yet is preceded by that Parse, so extended-protocol
+// clients keep working whichever server runs their next transaction.
+// Shared statements are counted per client name; past --max-statements,
+// those no client uses any more are closed on every server.
+// Session state set outside a transaction (SET, advisory locks, SQL-level
+// PREPARE, LISTEN) is not carried between server connections.
+//
+// Example:
+//   database_proxy --connection "host=db dbname=app user=app" --port 6432 --pool-size 20
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <libpq-fe.h>
+
+#include "database/postgres_manager.h"
+
+using namespace database;
+
+namespace {
+
+struct proxy_options {
+    std::string connection = "host=localhost port=5432 dbname=postgres user=postgres";
+    std::string listen_address = "127.0.0.1";
+    uint16_t port = 6432;
+    size_t pool_size = 10;
+    size_t max_clients = 10000;
+    size_t max_statements = 1000;
+    double stats_interval_seconds = 60.0;
+};
+
+void print_usage() {
+    std::cout
+        << "Usage: database_proxy [options]\n"
+           "  --connection <conninfo>   libpq connection string of the backend\n"
+           "  --listen <address>        address to accept clients on (default 127.0.0.1)\n"
+           "  --port <port>             port to accept clients on; 0 picks a free one (default 6432)\n"
+           "  --pool-size <n>           server connections (default 10)\n"
+           "  --max-clients <n>         client connections accepted (default 10000)\n"
+           "  --max-statements <n>      shared prepared statements kept before unused ones\n"
+           "                            are closed on the servers (default 1000)\n"
+           "  --stats-interval <s>      seconds between statistics lines; 0 disables (default 60)\n";
+}
+
+[[maybe_unused]] bool parse_arguments(int argc, char** argv, proxy_options& options) {
+    for (int index = 1; index < argc; ++index) {
+        const std::string argument = argv[index];
+        auto value = [&]() -> std::string {
+            return (index + 1 < argc) ? std::string(argv[++index]) : std::string();
+        };
+
+        if (argument == "--connection") {
+            options.connection = value();
+        } else if (argument == "--listen") {
+            options.listen_address = value();
+        } else if (argument == "--port") {
+            options.port = static_cast<uint16_t>(std::strtoul(value().c_str(), nullptr, 10));
+        } else if (argument == "--pool-size") {
+            options.pool_size = std::max<size_t>(1, std::strtoull(value().c_str(), nullptr, 10));
+        } else if (argument == "--max-clients") {
+            options.max_clients = std::max<size_t>(1, std::strtoull(value().c_str(), nullptr, 10));
+        } else if (argument == "--max-statements") {
+            options.max_statements = std::strtoull(value().c_str(), nullptr, 10);
+        } else if (argument == "--stats-interval") {
+            options.stats_interval_seconds = std::atof(value().c_str());
+        } else {
+            print_usage();
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef __linux__
+
+volatile std::sig_atomic_t stop_requested = 0;
+
+[[maybe_unused]] void on_signal(int) {
+    stop_requested = 1;
+}
+
+// Protocol constants and message helpers.
+constexpr uint32_t protocol_version_3 = 196608;
+constexpr uint32_t cancel_request_code = 80877102;
+constexpr uint32_t ssl_request_code = 80877103;
+constexpr uint32_t gssenc_request_code = 80877104;
+
+// Stop reading from a peer while this much is queued for the other side.
+constexpr size_t backpressure_bytes = 4 * 1024 * 1024;
+
+uint32_t get_int32(const char* input) {
+    uint32_t network;
+    std::memcpy(&network, input, 4);
+    return ntohl(network);
+}
+
+void put_int32(std::string& output, const uint32_t& value) {
+    const uint32_t network = htonl(value);
+    output.append(reinterpret_cast<const char*>(&network), 4);
+}
+
+void put_message(std::string& output, const char& type, std::string_view body) {
+    output.push_back(type);
+    put_int32(output, static_cast<uint32_t>(body.size() + 4));
+    output.append(body);
+}
+
+void put_error(std::string& output, const char* sqlstate, const std::string& text) {
+    std::string body;
+    body += 'S';
+    body.append("ERROR", 6);
+    body += 'V';
+    body.append("ERROR", 6);
+    body += 'C';
+    body.append(sqlstate, std::strlen(sqlstate) + 1);
+    body += 'M';
+    body.append(text.c_str(), text.size() + 1);
+    body += '\0';
+    put_message(output, 'E', body);
+}
+
+// Splits a null-terminated string off the front of `body`.
+std::string_view take_cstring(std::string_view& body) {
+    const size_t end = body.find('\0');
+    if (end == std::string_view::npos) {
+        const std::string_view all = body;
+        body = {};
+        return all;
+    }
+    const std::string_view value = body.substr(0, end);
+    body.remove_prefix(end + 1);
+    return value;
+}
+
+// Opens a server connection. The proxy reads and writes the socket
+// directly once connected, so TLS and GSSAPI encryption must stay off
+// whatever the connection string asks for; later keywords override those
+// expanded from the connection string.
+pg_connection_handle connect_backend(const std::string& connection) {
+    const char* keywords[] = { "dbname", "sslmode", "gssencmode", nullptr };
+    const char* values[] = { connection.c_str(), "disable", "disable", nullptr };
+    return pg_connection_handle(PQconnectdbParams(keywords, values, 1));
+}
+
+bool set_nonblocking(const int& socket) {
+    const int flags = ::fcntl(socket, F_GETFL, 0);
+    return flags >= 0 && ::fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+struct client_session;
+
+struct endpoint {
+    enum class kind { listener, wake, client, server };
+
+    explicit endpoint(const kind& type) : type(type) {}
+    virtual ~endpoint() = default;
+
+    kind type;
+    int socket = -1;
+    uint32_t events = 0;
+    bool closed = false;
+    std::string input;
+    std::string output;
+};
+
+// A Parse or Close sent to the server whose completion message is still
+// due. Injected ones were added by the proxy, so their completion is not
+// forwarded. `segment` is the number of Syncs sent before it: everything
+// still pending once that Sync is answered was skipped after an error.
+struct pending_completion {
+    uint64_t segment = 0;
+    bool injected = false;
+    std::string statement;
+};
+
+// A statement prepared under a shared server-side name. `body` is the
+// Parse message after the name: query text and parameter types.
+struct shared_statement {
+    std::string body;
+    size_t users = 0; // client statement names mapped to it
+};
+
+struct server_connection : endpoint {
+    server_connection() : endpoint(kind::server) {}
+
+    pg_connection_handle handle;
+    client_session* client = nullptr;
+    std::unordered_set<std::string> prepared;
+    std::vector<std::string> stale; // Evicted statements to close once the server is free.
+    std::deque<pending_completion> parses;
+    std::deque<pending_completion> closes;
+    uint64_t syncs_sent = 0;
+    uint64_t syncs_answered = 0;
+    uint64_t unsynced = 0; // Extended-protocol messages sent since the last Sync, Query or FunctionCall.
+    char transaction_status = 'I';
+};
+
+struct client_session : endpoint {
+    client_session() : endpoint(kind::client) {}
+
+    uint32_t id = 0;
+    uint32_t secret = 0;
+    bool started = false;
+    bool waiting = false;
+    server_connection* server = nullptr;
+    std::unordered_map<std::string, std::string> statements; // client name -> server name
+};
+
+class proxy {
+public:
+    explicit proxy(const proxy_options& options) : options_(options) {}
+
+    ~proxy() {
+        stop_connector();
+        for (auto& [socket, client] : clients_) {
+            ::close(socket);
+        }
+        for (auto& server : servers_) {
+            // PQfinish closes the socket and sends Terminate.
+            server->handle.reset();
+        }
+        if (listener_.socket >= 0) {
+            ::close(listener_.socket);
+        }
+        if (wake_.socket >= 0) {
+            ::close(wake_.socket);
+            ::close(wake_write_);
+        }
+        if (epoll_ >= 0) {
+            ::close(epoll_);
+        }
+    }
+
+    bool start() {
+        // The first connection is opened up front, so a wrong connection
+        // string fails at startup, and supplies the parameters reported
+        // to clients.
+        pg_connection_handle first(connect_backend(options_.connection));
+        if (PQstatus(first.get()) != CONNECTION_OK) {
+            std::cerr << "could not connect to the backend: " << PQerrorMessage(first.get());
+            return false;
+        }
+        const char* names[] = { "server_version", "server_encoding", "client_encoding",
+                                "DateStyle", "IntervalStyle", "TimeZone", "integer_datetimes",
+                                "standard_conforming_strings", "is_superuser",
+                                "session_authorization" };
+        for (const char* name : names) {
+            const char* value = PQparameterStatus(first.get(), name);
+            if (value != nullptr) {
+                std::string body;
+                body.append(name, std::strlen(name) + 1);
+                body.append(value, std::strlen(value) + 1);
+                put_message(startup_reply_, 'S', body);
+            }
+        }
+
+        epoll_ = ::epoll_create1(0);
+        int pipe_ends[2];
+        if (epoll_ < 0 || ::pipe(pipe_ends) != 0) {
+            std::cerr << "could not create the event loop\n";
+            return false;
+        }
+        wake_.socket = pipe_ends[0];
+        wake_write_ = pipe_ends[1];
+        set_nonblocking(wake_.socket);
+        set_nonblocking(wake_write_);
+        watch(wake_, EPOLLIN);
+
+        if (!listen()) {
+            return false;
+        }
+
+        adopt(std::move(first));
+        missing_ = options_.pool_size - 1;
+        connector_ = std::thread([this]() { connector_loop(); });
+        return true;
+    }
+
+    // The port clients connect to; --port 0 picks a free one.
+    uint16_t port() const {
+        return port_;
+    }
+
+    void run() {
+        std::vector<epoll_event> events(256);
+        auto next_stats = std::chrono::steady_clock::now() + stats_interval();
+
+        while (stop_requested == 0) {
+            const int ready = ::epoll_wait(epoll_, events.data(), static_cast<int>(events.size()), 1000);
+            for (int index = 0; index < ready; ++index) {
+                auto* target = static_cast<endpoint*>(events[static_cast<size_t>(index)].data.ptr);
+                if (target->closed) {
+                    continue;
+                }
+                const uint32_t flags = events[static_cast<size_t>(index)].events;
+                switch (target->type) {
+                case endpoint::kind::listener:
+                    accept_clients();
+                    break;
+                case endpoint::kind::wake:
+                    take_opened_servers();
+                    break;
+                case endpoint::kind::client:
+                    on_client_event(static_cast<client_session*>(target), flags);
+                    break;
+                case endpoint::kind::server:
+                    on_server_event(static_cast<server_connection*>(target), flags);
+                    break;
+                }
+            }
+            // Freed only now, as later events in the batch may point at
+            // them.
+            graveyard_clients_.clear();
+            graveyard_servers_.clear();
+
+            if (options_.stats_interval_seconds > 0.0 && std::chrono::steady_clock::now() >= next_stats) {
+                print_stats();
+                next_stats += stats_interval();
+            }
+        }
+    }
+
+private:
+    std::chrono::steady_clock::duration stats_interval() const {
+        return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(std::max(1.0, options_.stats_interval_seconds)));
+    }
+
+    bool listen() {
+        listener_.socket = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listener_.socket < 0) {
+            return false;
+        }
+        int reuse = 1;
+        ::setsockopt(listener_.socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(options_.port);
+        socklen_t length = sizeof(address);
+        if (::inet_pton(AF_INET, options_.listen_address.c_str(), &address.sin_addr) != 1
+            || ::bind(listener_.socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || ::listen(listener_.socket, 1024) != 0
+            || ::getsockname(listener_.socket, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+            std::cerr << "could not listen on " << options_.listen_address << ":" << options_.port
+                      << ": " << std::strerror(errno) << "\n";
+            return false;
+        }
+        port_ = ntohs(address.sin_port);
+        set_nonblocking(listener_.socket);
+        watch(listener_, EPOLLIN);
+        std::printf("Listening on %s:%u with %zu server connections\n",
+                    options_.listen_address.c_str(), port_, options_.pool_size);
+        std::fflush(stdout);
+        return true;
+    }
+
+    void watch(endpoint& target, const uint32_t& events) {
+        epoll_event event{};
+        event.events = events;
+        event.data.ptr = &target;
+        ::epoll_ctl(epoll_, EPOLL_CTL_ADD, target.socket, &event);
+        target.events = events;
+    }
+
+    void update_interest(endpoint& target, const bool& readable) {
+        if (target.closed) {
+            return;
+        }
+        const uint32_t events = (readable ? EPOLLIN : 0u) | (target.output.empty() ? 0u : EPOLLOUT);
+        if (events != target.events) {
+            epoll_event event{};
+            event.events = events;
+            event.data.ptr = &target;
+            ::epoll_ctl(epoll_, EPOLL_CTL_MOD, target.socket, &event);
+            target.events = events;
+        }
+    }
+
+    void refresh(client_session* client) {
+        if (client == nullptr || client->closed) {
+            return;
+        }
+        const bool server_full = client->server != nullptr && client->server->output.size() >= backpressure_bytes;
+        update_interest(*client, !server_full && client->input.size() < backpressure_bytes);
+        if (client->server != nullptr) {
+            refresh(client->server);
+        }
+    }
+
+    void refresh(server_connection* server) {
+        if (server == nullptr || server->closed) {
+            return;
+        }
+        const bool client_full = server->client != nullptr && server->client->output.size() >= backpressure_bytes;
+        update_interest(*server, !client_full);
+    }
+
+    // Returns false if the peer is gone.
+    static bool read_available(endpoint& source) {
+        char buffer[65536];
+        for (;;) {
+            const ssize_t received = ::recv(source.socket, buffer, sizeof(buffer), 0);
+            if (received > 0) {
+                source.input.append(buffer, static_cast<size_t>(received));
+                if (source.input.size() >= backpressure_bytes) {
+                    return true;
+                }
+                continue;
+            }
+            if (received == 0) {
+                return false;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+    }
+
+    static bool flush(endpoint& target) {
+        while (!target.output.empty()) {
+            const ssize_t sent = ::send(target.socket, target.output.data(), target.output.size(), MSG_NOSIGNAL);
+            if (sent > 0) {
+                target.output.erase(0, static_cast<size_t>(sent));
+                continue;
+            }
+            return sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        }
+        return true;
+    }
+
+    // ---- server connections
+
+    void connector_loop() {
+        std::unique_lock<std::mutex> lock(connector_mutex_);
+        while (!connector_stop_) {
+            connector_wake_.wait(lock, [this]() { return connector_stop_ || missing_ > 0; });
+            if (connector_stop_) {
+                break;
+            }
+
+            lock.unlock();
+            pg_connection_handle connection(connect_backend(options_.connection));
+            const bool connected = PQstatus(connection.get()) == CONNECTION_OK;
+            if (!connected) {
+                std::cerr << "server connection failed: " << PQerrorMessage(connection.get());
+            }
+            lock.lock();
+
+            if (connected) {
+                --missing_;
+                opened_.push_back(std::move(connection));
+                const char signal = 1;
+                [[maybe_unused]] const ssize_t written = ::write(wake_write_, &signal, 1);
+            } else {
+                // Back off while the backend is down.
+                connector_wake_.wait_for(lock, std::chrono::seconds(1), [this]() { return connector_stop_; });
+            }
+        }
+    }
+
+    void stop_connector() {
+        {
+            std::lock_guard<std::mutex> lock(connector_mutex_);
+            connector_stop_ = true;
+        }
+        connector_wake_.notify_all();
+        if (connector_.joinable()) {
+            connector_.join();
+        }
+    }
+
+    void request_server() {
+        {
+            std::lock_guard<std::mutex> lock(connector_mutex_);
+            ++missing_;
+        }
+        connector_wake_.notify_all();
+    }
+
+    void take_opened_servers() {
+        char drain[64];
+        while (::read(wake_.socket, drain, sizeof(drain)) > 0) {
+        }
+
+        std::vector<pg_connection_handle> opened;
+        {
+            std::lock_guard<std::mutex> lock(connector_mutex_);
+            opened.swap(opened_);
+        }
+        for (auto& connection : opened) {
+            adopt(std::move(connection));
+        }
+    }
+
+    void adopt(pg_connection_handle connection) {
+        auto server = std::make_unique<server_connection>();
+        server->socket = PQsocket(connection.get());
+        server->handle = std::move(connection);
+        set_nonblocking(server->socket);
+        int no_delay = 1;
+        ::setsockopt(server->socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        watch(*server, EPOLLIN);
+
+        server_connection* raw = server.get();
+        servers_.push_back(std::move(server));
+        release(raw);
+    }
+
+    // Ends the transaction a server ran for its client.
+    void detach(server_connection* server) {
+        if (server->client != nullptr) {
+            server->client->server = nullptr;
+            server->client = nullptr;
+            ++transactions_;
+        }
+    }
+
+    // Hands an idle server to the next waiting client, or parks it.
+    void release(server_connection* server) {
+        detach(server);
+        server->parses.clear();
+        server->closes.clear();
+        server->syncs_sent = 0;
+        server->syncs_answered = 0;
+        server->unsynced = 0;
+        close_stale(server);
+
+        while (!waiting_.empty()) {
+            client_session* client = waiting_.front();
+            waiting_.pop_front();
+            if (client->closed || !client->waiting) {
+                continue;
+            }
+            client->waiting = false;
+            assign(client, server);
+            process_client(client);
+            refresh(client);
+            return;
+        }
+        idle_.push_back(server);
+        refresh(server);
+    }
+
+    void assign(client_session* client, server_connection* server) {
+        client->server = server;
+        server->client = client;
+    }
+
+    bool acquire(client_session* client) {
+        if (idle_.empty()) {
+            return false;
+        }
+        assign(client, idle_.back());
+        idle_.pop_back();
+        return true;
+    }
+
+    void close_server(server_connection* server) {
+        if (server->closed) {
+            return;
+        }
+        server->closed = true;
+        ::epoll_ctl(epoll_, EPOLL_CTL_DEL, server->socket, nullptr);
+        idle_.erase(std::remove(idle_.begin(), idle_.end(), server), idle_.end());
+
+        client_session* client = server->client;
+        if (client != nullptr) {
+            client->server = nullptr;
+            server->client = nullptr;
+            put_error(client->output, "08006", "server connection lost");
+            flush(*client);
+            close_client(client);
+        }
+
+        auto found = std::find_if(servers_.begin(), servers_.end(),
+                                  [server](const auto& entry) { return entry.get() == server; });
+        if (found != servers_.end()) {
+            graveyard_servers_.push_back(std::move(*found));
+            servers_.erase(found);
+        }
+        request_server();
+    }
+
+    // Adds a Parse for `name` ahead of the message being forwarded if this
+    // server has not prepared it.
+    void ensure_prepared(server_connection* server, const std::string& name) {
+        if (server->prepared.count(name) != 0) {
+            return;
+        }
+        const auto statement = statements_.find(name);
+        if (statement == statements_.end()) {
+            return;
+        }
+        std::string message;
+        message.append(name.c_str(), name.size() + 1);
+        message.append(statement->second.body);
+        put_message(server->output, 'P', message);
+        server->parses.push_back({ server->syncs_sent, true, name });
+        server->prepared.insert(name);
+    }
+
+    // Shared server-side name for a Parse body (query text and parameter
+    // types), so clients preparing the same statement reuse it.
+    const std::string& server_statement(const std::string_view& body) {
+        const std::string key(body);
+        auto found = statement_names_.find(key);
+        if (found == statement_names_.end()) {
+            std::string name = "proxy_" + std::to_string(++last_statement_);
+            statements_.emplace(name, shared_statement{ key, 0 });
+            unused_statements_.insert(name);
+            found = statement_names_.emplace(key, std::move(name)).first;
+        }
+        return found->second;
+    }
+
+    // Points a client's statement name at a shared statement.
+    void use_statement(client_session* client, const std::string& name, const std::string& shared) {
+        auto [entry, added] = client->statements.try_emplace(name, shared);
+        if (!added) {
+            if (entry->second == shared) {
+                return;
+            }
+            unuse_statement(entry->second);
+            entry->second = shared;
+        }
+        if (statements_[shared].users++ == 0) {
+            unused_statements_.erase(shared);
+        }
+    }
+
+    void unuse_statement(const std::string& shared) {
+        auto found = statements_.find(shared);
+        if (found != statements_.end() && --found->second.users == 0) {
+            unused_statements_.insert(shared);
+        }
+    }
+
+    // Past --max-statements, forgets statements no client refers to and
+    // closes them on every server: on idle ones now, on busy ones when
+    // their transaction ends.
+    void evict_statements() {
+        while (statements_.size() > options_.max_statements && !unused_statements_.empty()) {
+            const std::string name = *unused_statements_.begin();
+            unused_statements_.erase(unused_statements_.begin());
+            for (auto& server : servers_) {
+                if (server->prepared.erase(name) == 0) {
+                    continue;
+                }
+                server->stale.push_back(name);
+                if (server->client == nullptr) {
+                    close_stale(server.get());
+                    refresh(server.get());
+                }
+            }
+            const auto statement = statements_.find(name);
+            statement_names_.erase(statement->second.body);
+            statements_.erase(statement);
+            ++evicted_statements_;
+        }
+    }
+
+    // Sends a Close for each evicted statement; their CloseComplete is
+    // not forwarded.
+    void close_stale(server_connection* server) {
+        for (const std::string& name : server->stale) {
+            std::string body = "S";
+            body.append(name.c_str(), name.size() + 1);
+            put_message(server->output, 'C', body);
+            server->closes.push_back({ server->syncs_sent, true, "" });
+        }
+        server->stale.clear();
+    }
+
+    void forward_client_message(client_session* client, const char& type, std::string_view body) {
+        server_connection* server = client->server;
+        if (type == 'S' || type == 'Q' || type == 'F') {
+            server->unsynced = 0;
+        } else if (std::string_view("PBDECH").find(type) != std::string_view::npos) {
+            ++server->unsynced;
+        }
+
+        switch (type) {
+        case 'P': {
+            std::string_view rest = body;
+            const std::string name(take_cstring(rest));
+            if (name.empty()) {
+                server->parses.push_back({ server->syncs_sent, false, "" });
+                put_message(server->output, type, body);
+                return;
+            }
+
+            const std::string shared = server_statement(rest);
+            use_statement(client, name, shared);
+            if (server->prepared.count(shared) != 0) {
+                // Already prepared here: close it first so the Parse the
+                // client waits for succeeds.
+                std::string close_body = "S";
+                close_body.append(shared.c_str(), shared.size() + 1);
+                put_message(server->output, 'C', close_body);
+                server->closes.push_back({ server->syncs_sent, true, "" });
+            }
+            std::string message;
+            message.append(shared.c_str(), shared.size() + 1);
+            message.append(rest);
+            put_message(server->output, 'P', message);
+            server->parses.push_back({ server->syncs_sent, false, shared });
+            server->prepared.insert(shared);
+            evict_statements();
+            return;
+        }
+        case 'B': {
+            std::string_view rest = body;
+            const std::string_view portal = take_cstring(rest);
+            const std::string statement(take_cstring(rest));
+            const auto mapped = client->statements.find(statement);
+            if (statement.empty() || mapped == client->statements.end()) {
+                put_message(server->output, type, body);
+                return;
+            }
+            ensure_prepared(server, mapped->second);
+            std::string message;
+            message.append(portal.data(), portal.size());
+            message += '\0';
+            message.append(mapped->second.c_str(), mapped->second.size() + 1);
+            message.append(rest);
+            put_message(server->output, type, message);
+            return;
+        }
+        case 'D':
+        case 'C': {
+            std::string_view rest = body.substr(std::min<size_t>(1, body.size()));
+            const std::string name(take_cstring(rest));
+            const bool statement = !body.empty() && body[0] == 'S' && !name.empty();
+            if (type == 'C') {
+                server->closes.push_back({ server->syncs_sent, false, "" });
+            }
+            const auto mapped = statement ? client->statements.find(name) : client->statements.end();
+            if (mapped == client->statements.end()) {
+                put_message(server->output, type, body);
+                return;
+            }
+
+            std::string message = "S";
+            if (type == 'D') {
+                ensure_prepared(server, mapped->second);
+                message.append(mapped->second.c_str(), mapped->second.size() + 1);
+            } else {
+                // Other clients may share the server statement, so only
+                // the client's name is dropped; closing a name that does
+                // not exist still answers CloseComplete. The statement
+                // itself is closed once no client uses it and the cap is
+                // reached.
+                unuse_statement(mapped->second);
+                client->statements.erase(mapped);
+                message.append("proxy_closed", sizeof("proxy_closed"));
+            }
+            put_message(server->output, type, message);
+            return;
+        }
+        case 'S':
+        case 'Q':
+        case 'F':
+            // Each is answered with ReadyForQuery.
+            ++server->syncs_sent;
+            put_message(server->output, type, body);
+            return;
+        default:
+            put_message(server->output, type, body);
+            return;
+        }
+    }
+
+    // ---- clients
+
+    void accept_clients() {
+        for (;;) {
+            const int socket = ::accept(listener_.socket, nullptr, nullptr);
+            if (socket < 0) {
+                return;
+            }
+            if (clients_.size() >= options_.max_clients) {
+                ::close(socket);
+                ++rejected_clients_;
+                continue;
+            }
+            set_nonblocking(socket);
+            int no_delay = 1;
+            ::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+            auto client = std::make_unique<client_session>();
+            client->socket = socket;
+            client->id = ++last_client_id_;
+            client->secret = static_cast<uint32_t>(random_());
+            watch(*client, EPOLLIN);
+            clients_.emplace(socket, std::move(client));
+        }
+    }
+
+    void close_client(client_session* client) {
+        if (client->closed) {
+            return;
+        }
+        client->closed = true;
+        ::epoll_ctl(epoll_, EPOLL_CTL_DEL, client->socket, nullptr);
+        ::close(client->socket);
+        for (const auto& [name, shared] : client->statements) {
+            unuse_statement(shared);
+        }
+        client->statements.clear();
+
+        server_connection* server = client->server;
+        if (server != nullptr) {
+            // Mid-transaction or with results outstanding: the server's
+            // state is unknown, so it is replaced rather than reused.
+            client->server = nullptr;
+            server->client = nullptr;
+            close_server(server);
+        }
+
+        auto found = clients_.find(client->socket);
+        if (found != clients_.end()) {
+            graveyard_clients_.push_back(std::move(found->second));
+            clients_.erase(found);
+        }
+    }
+
+    void on_client_event(client_session* client, const uint32_t& flags) {
+        if ((flags & EPOLLOUT) != 0 && !flush(*client)) {
+            close_client(client);
+            return;
+        }
+        if ((flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0) {
+            const bool open = read_available(*client);
+            process_client(client);
+            if (!open) {
+                close_client(client);
+                return;
+            }
+        }
+        if (!client->closed) {
+            refresh(client);
+        }
+    }
+
+    bool handle_startup(client_session* client) {
+        if (client->input.size() < 8) {
+            return false;
+        }
+        const uint32_t length = get_int32(client->input.data());
+        if (length < 8 || length > 10000) {
+            close_client(client);
+            return false;
+        }
+        if (client->input.size() < length) {
+            return false;
+        }
+        const uint32_t code = get_int32(client->input.data() + 4);
+        const std::string packet = client->input.substr(8, length - 8);
+        client->input.erase(0, length);
+
+        if (code == ssl_request_code || code == gssenc_request_code) {
+            client->output.push_back('N');
+            flush(*client);
+            return true;
+        }
+        if (code == cancel_request_code && packet.size() >= 8) {
+            cancel(get_int32(packet.data()), get_int32(packet.data() + 4));
+            close_client(client);
+            return false;
+        }
+        if (code != protocol_version_3) {
+            put_error(client->output, "08P01", "unsupported frontend protocol");
+            flush(*client);
+            close_client(client);
+            return false;
+        }
+
+        std::string authentication_ok;
+        put_int32(authentication_ok, 0);
+        put_message(client->output, 'R', authentication_ok);
+        client->output.append(startup_reply_);
+        std::string key;
+        put_int32(key, client->id);
+        put_int32(key, client->secret);
+        put_message(client->output, 'K', key);
+        put_message(client->output, 'Z', "I");
+        client->started = true;
+        flush(*client);
+        return true;
+    }
+
+    void cancel(const uint32_t& id, const uint32_t& secret) {
+        for (auto& [socket, client] : clients_) {
+            if (client->id != id) {
+                continue;
+            }
+            if (client->secret != secret || client->server == nullptr) {
+                return;
+            }
+            PGcancel* request = PQgetCancel(client->server->handle.get());
+            if (request != nullptr) {
+                // PQcancel opens its own connection; keep it off the loop.
+                std::thread([request]() {
+                    char error[256];
+                    PQcancel(request, error, sizeof(error));
+                    PQfreeCancel(request);
+                }).detach();
+            }
+            return;
+        }
+    }
+
+    // Forwards every complete message the client has sent, borrowing a
+    // server first if the client has none; stops while it waits for one.
+    void process_client(client_session* client) {
+        while (!client->closed) {
+            if (!client->started) {
+                if (!handle_startup(client)) {
+                    return;
+                }
+                continue;
+            }
+
+            if (client->input.size() < 5) {
+                break;
+            }
+            const char type = client->input[0];
+            const uint32_t length = get_int32(client->input.data() + 1);
+            if (length < 4) {
+                close_client(client);
+                return;
+            }
+            if (client->input.size() < length + 1) {
+                break;
+            }
+            if (type == 'X') {
+                close_client(client);
+                return;
+            }
+
+            if (client->server == nullptr && !acquire(client)) {
+                if (!client->waiting) {
+                    client->waiting = true;
+                    waiting_.push_back(client);
+                }
+                break;
+            }
+
+            forward_client_message(client, type,
+                                   std::string_view(client->input).substr(5, length - 4));
+            client->input.erase(0, length + 1);
+            if (client->server->output.size() >= backpressure_bytes) {
+                break;
+            }
+        }
+
+        if (!client->closed && client->server != nullptr && !flush(*client->server)) {
+            close_server(client->server);
+        }
+    }
+
+    // ---- server responses
+
+    void on_server_event(server_connection* server, const uint32_t& flags) {
+        if ((flags & EPOLLOUT) != 0 && !flush(*server)) {
+            close_server(server);
+            return;
+        }
+        if ((flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0) {
+            const bool open = read_available(*server);
+            process_server(server);
+            if (!open && !server->closed) {
+                close_server(server);
+                return;
+            }
+        }
+        if (server->closed) {
+            return;
+        }
+        client_session* client = server->client;
+        refresh(server);
+        if (client != nullptr) {
+            // The client may be waiting on server-side backpressure.
+            process_client(client);
+            refresh(client);
+        }
+    }
+
+    // Drops pending completions of the segment just answered; those still
+    // pending were skipped because of an error, so their Parse failed.
+    void finish_segment(server_connection* server) {
+        for (auto* queue : { &server->parses, &server->closes }) {
+            while (!queue->empty() && queue->front().segment < server->syncs_answered) {
+                if (!queue->front().statement.empty()) {
+                    server->prepared.erase(queue->front().statement);
+                }
+                queue->pop_front();
+            }
+        }
+    }
+
+    void process_server(server_connection* server) {
+        size_t offset = 0;
+        client_session* client = server->client;
+        bool released = false;
+
+        while (server->input.size() - offset >= 5) {
+            const char type = server->input[offset];
+            const uint32_t length = get_int32(server->input.data() + offset + 1);
+            if (length < 4) {
+                close_server(server);
+                return;
+            }
+            if (server->input.size() - offset < length + 1) {
+                break;
+            }
+            const std::string_view message(server->input.data() + offset, length + 1);
+            offset += length + 1;
+
+            bool forward = true;
+            if (type == '1' && !server->parses.empty()) {
+                forward = !server->parses.front().injected;
+                server->parses.pop_front();
+            } else if (type == '3' && !server->closes.empty()) {
+                forward = !server->closes.front().injected;
+                server->closes.pop_front();
+            } else if (type == 'Z') {
+                ++server->syncs_answered;
+                server->transaction_status = length >= 5 ? message[5] : 'I';
+                finish_segment(server);
+            }
+
+            if (forward && client != nullptr) {
+                client->output.append(message);
+            }
+
+            if (type == 'Z' && server->syncs_answered == server->syncs_sent
+                && server->transaction_status == 'I' && server->unsynced == 0
+                && (client == nullptr || client->input.empty())) {
+                // End of the transaction. A pipelined client whose next
+                // batch was sent before its Sync keeps the server until
+                // that Sync is answered, and one with part of a message
+                // buffered keeps it until the message is complete.
+                // Anything after this belongs to no client; there should
+                // be nothing.
+                released = true;
+                break;
+            }
+        }
+        server->input.erase(0, offset);
+
+        if (client != nullptr && !flush(*client)) {
+            close_client(client);
+            return;
+        }
+        if (released) {
+            if (client != nullptr) {
+                refresh(client);
+            }
+            if (!drain_unowned(server)) {
+                // The server is out of step; the next client must not see
+                // what it sends.
+                detach(server);
+                close_server(server);
+                return;
+            }
+            release(server);
+        }
+    }
+
+    // Drops what a server sent after its transaction ended: notifications,
+    // notices and parameter changes belong to no client. Returns false if
+    // anything else, or part of a message, is left.
+    bool drain_unowned(server_connection* server) {
+        size_t offset = 0;
+        while (server->input.size() - offset >= 5) {
+            const char type = server->input[offset];
+            const uint32_t length = get_int32(server->input.data() + offset + 1);
+            if ((type != 'A' && type != 'N' && type != 'S') || length < 4
+                || server->input.size() - offset < length + 1) {
+                break;
+            }
+            offset += length + 1;
+        }
+        server->input.erase(0, offset);
+        return server->input.empty();
+    }
+
+    void print_stats() {
+        std::printf("clients=%zu waiting=%zu servers=%zu idle=%zu transactions=%llu rejected=%llu "
+                    "statements=%zu evicted=%llu\n",
+                    clients_.size(),
+                    static_cast<size_t>(std::count_if(waiting_.begin(), waiting_.end(),
+                                                      [](const client_session* client) {
+                                                          return !client->closed && client->waiting;
+                                                      })),
+                    servers_.size(), idle_.size(), static_cast<unsigned long long>(transactions_),
+                    static_cast<unsigned long long>(rejected_clients_), statements_.size(),
+                    static_cast<unsigned long long>(evicted_statements_));
+        std::fflush(stdout);
+    }
+
+    proxy_options options_;
+    uint16_t port_ = 0;
+    int epoll_ = -1;
+    endpoint listener_{ endpoint::kind::listener };
+    endpoint wake_{ endpoint::kind::wake };
+    int wake_write_ = -1;
+    std::string startup_reply_;
+
+    std::unordered_map<int, std::unique_ptr<client_session>> clients_;
+    std::vector<std::unique_ptr<server_connection>> servers_;
+    std::vector<server_connection*> idle_;
+    std::deque<client_session*> waiting_;
+    std::vector<std::unique_ptr<client_session>> graveyard_clients_;
+    std::vector<std::unique_ptr<server_connection>> graveyard_servers_;
+
+    std::unordered_map<std::string, std::string> statement_names_; // Parse body -> name
+    std::unordered_map<std::string, shared_statement> statements_; // name -> statement
+    std::unordered_set<std::string> unused_statements_;            // names no client refers to
+    uint64_t last_statement_ = 0;
+    uint64_t evicted_statements_ = 0;
+
+    std::mutex connector_mutex_;
+    std::condition_variable connector_wake_;
+    std::thread connector_;
+    std::vector<pg_connection_handle> opened_;
+    size_t missing_ = 0;
+    bool connector_stop_ = false;
+
+    uint32_t last_client_id_ = 0;
+    uint64_t transactions_ = 0;
+    uint64_t rejected_clients_ = 0;
+    std::mt19937 random_{ std::random_device{}() };
+};
+
+#endif // __linux__
+
+} // namespace
+
+// Unit tests include this file to drive the proxy in-process.
+#ifndef DATABASE_PROXY_NO_MAIN
+int main(int argc, char** argv) {
+    proxy_options options;
+    if (!parse_arguments(argc, argv, options)) {
+        return 1;
+    }
+
+#ifdef __linux__
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    proxy server(options);
+    if (!server.start()) {
+        return 1;
+    }
+    server.run();
+    return 0;
+#else
+    std::cerr << "database_proxy needs Linux (epoll)\n";
+    return 1;
+#endif
+}
+#endif // DATABASE_PROXY_NO_MAIN
@@ -0,0 +1,378 @@
+/*****************************************************************************
+BSD 3-Clause License
+
+Copyright (c) 2021, 🍀☀🌕🌥 🌊
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*****************************************************************************/
+
+// Replays a capture log written by database_manager::start_capture().
+//
+// Each captured session gets its own connection and thread, and its
+// statements are reissued in their original order. Statements are started
+// at their captured offset divided by --speed (so --speed 2 compresses the
+// timeline twice), or back to back with --speed 0. A session connects when
+// its first statement is due and disconnects after its last, and at most
+// --max-sessions run at once; a session that has to wait for a slot shows
+// up as lateness. The report compares captured and replayed latency overall
+// and per statement fingerprint.
+//
+// Example:
+//   database_replay --capture prod.dbcap --connection "host=staging dbname=app" --speed 1
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "database/latency_histogram.h"
+#include "database/postgres_manager.h"
+#include "database/query_capture.h"
+#include "database/sql_fingerprint.h"
+
+using namespace database;
+
+namespace {
+
+struct replay_options {
+    std::string capture_path;
+    std::string connection = "host=localhost port=5432 dbname=postgres user=postgres";
+    double speed = 1.0;
+    size_t top = 10;
+    size_t max_sessions = 64; ///< Sessions connected at once; 0 = no limit.
+};
+
+// Counts the sessions running at once against --max-sessions.
+class session_slots {
+public:
+    explicit session_slots(const size_t& limit) : limit_(limit) {}
+
+    void acquire() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        available_.wait(lock, [this]() { return limit_ == 0 || active_ < limit_; });
+        ++active_;
+    }
+
+    void release() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --active_;
+        }
+        available_.notify_one();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable available_;
+    size_t limit_;
+    size_t active_ = 0;
+};
+
+struct fingerprint_stats {
+    std::string normalized;
+    uint64_t count = 0;
+    uint64_t captured_us = 0;
+    uint64_t replayed_us = 0;
+    uint64_t outcome_changes = 0;
+};
+
+struct replay_report {
+    std::mutex mutex;
+    latency_histogram captured;
+    latency_histogram replayed;
+    latency_histogram lateness;
+    std::unordered_map<uint64_t, fingerprint_stats> fingerprints;
+    uint64_t outcome_changes = 0;
+    uint64_t row_changes = 0;
+    uint64_t connect_failures = 0;
+};
+
+bool execute(postgres_manager& connection, const capture_record& record, uint64_t& rows) {
+    rows = 0;
+    switch (record.kind) {
+    case capture_statement_kind::create_query:
+        return connection.create_query(record.statement);
+    case capture_statement_kind::insert_query:
+        rows = connection.insert_query(record.statement);
+        return true;
+    case capture_statement_kind::update_query:
+        rows = connection.update_query(record.statement);
+        return true;
+    case capture_statement_kind::delete_query:
+        rows = connection.delete_query(record.statement);
+        return true;
+    case capture_statement_kind::select_query:
+        return connection.select_query(record.statement) != nullptr;
+    }
+    return false;
+}
+
+std::chrono::steady_clock::time_point scheduled_at(const replay_options& options,
+                                                   const capture_record& record,
+                                                   const std::chrono::steady_clock::time_point& start) {
+    if (options.speed <= 0.0) {
+        return std::chrono::steady_clock::now();
+    }
+    return start + std::chrono::microseconds(static_cast<int64_t>(
+                       static_cast<double>(record.start_offset_us) / options.speed));
+}
+
+void replay_session(const replay_options& options, const std::vector<capture_record>& records,
+                    const std::chrono::steady_clock::time_point& start, replay_report& report,
+                    session_slots& slots) {
+    postgres_manager connection;
+    bool first = true;
+    for (const auto& record : records) {
+        const auto scheduled = scheduled_at(options, record, start);
+        std::this_thread::sleep_until(scheduled);
+
+        if (first) {
+            first = false;
+            if (!connection.connect(options.connection)) {
+                {
+                    std::lock_guard<std::mutex> lock(report.mutex);
+                    ++report.connect_failures;
+                }
+                slots.release();
+                return;
+            }
+        } else if (!connection.is_connected()) {
+            // A statement that failed may have dropped the connection;
+            // keep the rest of the session going on a new one.
+            connection.connect(options.connection);
+        }
+
+        const auto issued = std::chrono::steady_clock::now();
+        uint64_t rows = 0;
+        const bool succeeded = execute(connection, record, rows);
+        const auto finished = std::chrono::steady_clock::now();
+
+        const auto replayed_us = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(finished - issued).count());
+        const auto late_us = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(issued - scheduled).count());
+
+        report.captured.record(record.duration_us * 1000);
+        report.replayed.record(replayed_us * 1000);
+        report.lateness.record(late_us * 1000);
+
+        const uint64_t fingerprint = statement_fingerprint(record.statement);
+        std::lock_guard<std::mutex> lock(report.mutex);
+        auto& stats = report.fingerprints[fingerprint];
+        if (stats.count == 0) {
+            stats.normalized = normalize_statement(record.statement);
+        }
+        ++stats.count;
+        stats.captured_us += record.duration_us;
+        stats.replayed_us += replayed_us;
+        if (succeeded != record.succeeded) {
+            ++stats.outcome_changes;
+            ++report.outcome_changes;
+        } else if (rows != record.rows) {
+            ++report.row_changes;
+        }
+    }
+
+    connection.disconnect();
+    slots.release();
+}
+
+void print_percentiles(const char* label, const latency_histogram& histogram) {
+    std::printf("  %-9s p50=%9.3f p90=%9.3f p99=%9.3f p99.9=%9.3f max=%9.3f ms\n", label,
+                histogram.value_at_quantile(0.50) / 1e6, histogram.value_at_quantile(0.90) / 1e6,
+                histogram.value_at_quantile(0.99) / 1e6, histogram.value_at_quantile(0.999) / 1e6,
+                histogram.max() / 1e6);
+}
+
+void print_report(const replay_options& options, replay_report& report, const double& elapsed,
+                  const size_t& sessions) {
+    char speed[32] = "max";
+    if (options.speed > 0.0) {
+        std::snprintf(speed, sizeof(speed), "%gx", options.speed);
+    }
+    std::printf("\nReplayed %llu statements from %zu sessions in %.2f s (speed %s)\n",
+                static_cast<unsigned long long>(report.replayed.count()), sessions, elapsed,
+                speed);
+    if (report.connect_failures != 0) {
+        std::printf("  %llu sessions could not connect and were skipped\n",
+                    static_cast<unsigned long long>(report.connect_failures));
+    }
+    std::printf("  outcome changed (success <-> failure): %llu, affected rows changed: %llu\n",
+                static_cast<unsigned long long>(report.outcome_changes),
+                static_cast<unsigned long long>(report.row_changes));
+
+    std::printf("\nLatency:\n");
+    print_percentiles("captured", report.captured);
+    print_percentiles("replayed", report.replayed);
+    if (options.speed > 0.0) {
+        print_percentiles("late by", report.lateness);
+    }
+
+    std::vector<const fingerprint_stats*> ranked;
+    ranked.reserve(report.fingerprints.size());
+    for (const auto& [fingerprint, stats] : report.fingerprints) {
+        ranked.push_back(&stats);
+    }
+
+    // Largest total time lost (or gained) first.
+    auto delta = [](const fingerprint_stats* stats) {
+        return static_cast<int64_t>(stats->replayed_us) - static_cast<int64_t>(stats->captured_us);
+    };
+    std::sort(ranked.begin(), ranked.end(), [&](const auto* left, const auto* right) {
+        return std::llabs(delta(left)) > std::llabs(delta(right));
+    });
+
+    std::printf("\n%8s %12s %12s %9s %8s  statement\n", "count", "captured ms", "replayed ms",
+                "change", "outcome");
+    for (size_t index = 0; index < ranked.size() && index < options.top; ++index) {
+        const auto* stats = ranked[index];
+        const double captured_mean = static_cast<double>(stats->captured_us) / stats->count / 1e3;
+        const double replayed_mean = static_cast<double>(stats->replayed_us) / stats->count / 1e3;
+        const double change
+            = captured_mean > 0.0 ? 100.0 * (replayed_mean - captured_mean) / captured_mean : 0.0;
+
+        std::printf("%8llu %12.3f %12.3f %+8.1f%% %8llu  %.80s\n",
+                    static_cast<unsigned long long>(stats->count), captured_mean, replayed_mean,
+                    change, static_cast<unsigned long long>(stats->outcome_changes),
+                    stats->normalized.c_str());
+    }
+}
+
+void print_usage() {
+    std::cout << "Usage: database_replay --capture <file> [options]\n"
+                 "  --connection <conninfo>   target server\n"
+                 "  --speed <factor>          1 = original timing, 2 = twice as fast,\n"
+                 "                            0 = as fast as possible (default 1)\n"
+                 "  --top <n>                 statements to list in the comparison (default 10)\n"
+                 "  --max-sessions <n>        sessions connected at once, 0 = no limit (default 64)\n";
+}
+
+bool parse_arguments(int argc, char** argv, replay_options& options) {
+    for (int index = 1; index < argc; ++index) {
+        const std::string argument = argv[index];
+        auto value = [&]() -> std::string {
+            return (index + 1 < argc) ? std::string(argv[++index]) : std::string();
+        };
+
+        if (argument == "--capture") {
+            options.capture_path = value();
+        } else if (argument == "--connection") {
+            options.connection = value();
+        } else if (argument == "--speed") {
+            options.speed = std::max(0.0, std::atof(value().c_str()));
+        } else if (argument == "--top") {
+            options.top = std::strtoull(value().c_str(), nullptr, 10);
+        } else if (argument == "--max-sessions") {
+            options.max_sessions = std::strtoull(value().c_str(), nullptr, 10);
+        } else {
+            print_usage();
+            return false;
+        }
+    }
+
+    if (options.capture_path.empty()) {
+        print_usage();
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    replay_options options;
+    if (!parse_arguments(argc, argv, options)) {
+        return 1;
+    }
+
+    query_capture_reader reader;
+    if (!reader.open(options.capture_path)) {
+        std::cerr << "cannot read capture " << options.capture_path << "\n";
+        return 1;
+    }
+
+    std::map<uint32_t, std::vector<capture_record>> sessions;
+    capture_record record;
+    uint64_t total = 0;
+    while (reader.next(record)) {
+        sessions[record.session].push_back(record);
+        ++total;
+    }
+    if (reader.failed()) {
+        std::cerr << "capture is truncated or corrupt; replaying the " << total
+                  << " statements read before the error\n";
+    }
+
+    // Records are written as statements finish; restore start order.
+    for (auto& [session, records] : sessions) {
+        std::stable_sort(records.begin(), records.end(), [](const auto& left, const auto& right) {
+            return left.start_offset_us < right.start_offset_us;
+        });
+    }
+
+    // Sessions start in the order of their first statement, each when
+    // that statement is due and a slot is free, so connections are only
+    // held for the span the session covered in the capture.
+    std::vector<const std::vector<capture_record>*> order;
+    order.reserve(sessions.size());
+    for (const auto& [session, records] : sessions) {
+        order.push_back(&records);
+    }
+    std::stable_sort(order.begin(), order.end(), [](const auto* left, const auto* right) {
+        return left->front().start_offset_us < right->front().start_offset_us;
+    });
+
+    replay_report report;
+    session_slots slots(options.max_sessions);
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    threads.reserve(sessions.size());
+    for (const auto* records : order) {
+        std::this_thread::sleep_until(scheduled_at(options, records->front(), start));
+        slots.acquire();
+        threads.emplace_back(replay_session, std::cref(options), std::cref(*records), start,
+                             std::ref(report), std::ref(slots));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    const double elapsed
+        = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    print_report(options, report, elapsed, sessions.size());
+
+    return report.connect_failures == sessions.size() && !sessions.empty() ? 1 : 0;
+}